@@ -0,0 +1,616 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* ftag-bench -- generate a synthetic database and time ftag against it
+ *
+ * Tag popularity follows a Zipf distribution, so a few tags are on most
+ * files and most tags are on a few. Every benchmark runs the ftag binary
+ * as a user would and prints one JSON object per line on stdout.
+ */
+
+/***--- Includes ---***/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sqlite3.h>
+
+/***--- Constants and globals ---***/
+
+#define PROGRAM_NAME "ftag-bench"
+#define DB_FILENAME ".ftag.sqlite3"
+#define SNAPSHOT_FILENAME ".ftag.snapshot"
+#define IMPORT_FILENAME "import.sqlite3"
+
+#define SUCCESS 0
+#define ERROR 1
+
+#define MAX_ARGS 16
+
+struct config {
+	const char *ftag;
+	int files;
+	int tags;
+	int tags_per_file;
+	double zipf;
+	int runs;
+	int batch;
+	unsigned long seed;
+};
+
+static char dbdir[] = "/tmp/ftag-bench-XXXXXX";
+
+/***--- Util ---***/
+
+/* Print the usage to out, stdout when asked for and stderr on a mistake */
+static void usage(FILE *out)
+{
+	static const char *str = "Usage: " PROGRAM_NAME " [OPTIONS]\n"
+	"\n"
+	"Options:\n"
+	"  -b, --ftag PATH       ftag binary to benchmark (default ./ftag)\n"
+	"  -n, --files N         number of files in the database (default 10000)\n"
+	"  -t, --tags N          number of distinct tags (default 1000)\n"
+	"  -k, --tags-per-file N average number of tags on a file (default 4)\n"
+	"  -s, --zipf S          Zipf exponent of tag popularity (default 1.0)\n"
+	"  -r, --runs N          timed runs of each benchmark (default 5)\n"
+	"  -B, --batch N         files tagged by the batch benchmark (default 1000)\n"
+	"  -S, --seed N          random seed (default 1)\n"
+	"  -c, --check           only generate and check the database\n"
+	"  -h, --help            show this help and exit\n";
+
+	fputs(str, out);
+}
+
+// xorshift64*, reproducible across platforms unlike rand()
+static unsigned long long rng_state;
+
+static unsigned long long rng_next(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static double rng_uniform(void)
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/***--- Dataset ---***/
+
+/* Cumulative Zipf distribution over tag ranks, cdf[i] = P(rank <= i + 1) */
+static double *zipf_cdf(int n, double s)
+{
+	double *cdf = malloc(sizeof(*cdf) * n);
+	double sum = 0;
+
+	if (cdf == NULL)
+		return NULL;
+
+	for (int i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+
+	for (int i = 0; i < n; i++)
+		cdf[i] /= sum;
+
+	return cdf;
+}
+
+static int zipf_sample(const double *cdf, int n)
+{
+	double u = rng_uniform();
+	int lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Fill the database ftag created in dbdir directly through SQLite. Going
+ * through the schema's own triggers keeps derived data such as the tag
+ * counts consistent.
+ */
+static int generate(const struct config *cfg)
+{
+	sqlite3 *db = NULL;
+	sqlite3_stmt *tag_prep = NULL, *file_prep = NULL, *xref_prep = NULL;
+	double *cdf = NULL;
+	time_t now = time(NULL);
+	char path[64];
+	int status = ERROR;
+
+	if (chdir(dbdir) != 0 ||
+		sqlite3_open_v2(DB_FILENAME, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+		goto out;
+
+	cdf = zipf_cdf(cfg->tags, cfg->zipf);
+	if (cdf == NULL)
+		goto out;
+
+	sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL);
+
+	if (sqlite3_prepare_v2(db, "INSERT INTO tag (id, name) VALUES (?, ?);",
+						   -1, &tag_prep, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT INTO file (id, relative_path) VALUES (?, ?);",
+						   -1, &file_prep, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO file_tag (file_id, tag_id, "
+						   "tagged_at) VALUES (?, ?, ?);", -1, &xref_prep,
+						   NULL) != SQLITE_OK)
+		goto out;
+
+	for (int i = 0; i < cfg->tags; i++) {
+		sprintf(path, "tag%06d", i);
+		sqlite3_bind_int(tag_prep, 1, i + 1);
+		sqlite3_bind_text(tag_prep, 2, path, -1, SQLITE_TRANSIENT);
+		if (sqlite3_step(tag_prep) != SQLITE_DONE)
+			goto out;
+		sqlite3_reset(tag_prep);
+	}
+
+	// Files were tagged a second apart, the last one just now
+	for (int i = 0; i < cfg->files; i++) {
+		int ntags = 1 + (int) (rng_next() % (2 * cfg->tags_per_file - 1));
+
+		sprintf(path, "dir%04d/file%08d", i % 1000, i);
+		sqlite3_bind_int(file_prep, 1, i + 1);
+		sqlite3_bind_text(file_prep, 2, path, -1, SQLITE_TRANSIENT);
+		if (sqlite3_step(file_prep) != SQLITE_DONE)
+			goto out;
+		sqlite3_reset(file_prep);
+
+		for (int j = 0; j < ntags; j++) {
+			sqlite3_bind_int(xref_prep, 1, i + 1);
+			sqlite3_bind_int(xref_prep, 2, zipf_sample(cdf, cfg->tags) + 1);
+			sqlite3_bind_int64(xref_prep, 3, (sqlite3_int64) now - cfg->files + i);
+			if (sqlite3_step(xref_prep) != SQLITE_DONE)
+				goto out;
+			sqlite3_reset(xref_prep);
+		}
+	}
+
+	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)
+		status = SUCCESS;
+
+	out:
+	sqlite3_finalize(tag_prep);
+	sqlite3_finalize(file_prep);
+	sqlite3_finalize(xref_prep);
+	sqlite3_close(db);
+	free(cdf);
+
+	return status;
+}
+
+static long long count(sqlite3 *db, const char *sql)
+{
+	sqlite3_stmt *prep = NULL;
+	long long n = -1;
+
+	if (sqlite3_prepare_v2(db, sql, -1, &prep, NULL) == SQLITE_OK &&
+		sqlite3_step(prep) == SQLITE_ROW)
+		n = sqlite3_column_int64(prep, 0);
+	sqlite3_finalize(prep);
+
+	return n;
+}
+
+/* Check that the generated database has the size asked for, each file
+ * with 1 to 2k - 1 tags and the tag counts adding up, and print it as a
+ * JSON line
+ */
+static int check(const struct config *cfg)
+{
+	sqlite3 *db = NULL;
+	long long files, tags, pairs, counted;
+	int status = ERROR;
+
+	if (sqlite3_open_v2(DB_FILENAME, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+		goto out;
+
+	files = count(db, "SELECT COUNT(*) FROM file;");
+	tags = count(db, "SELECT COUNT(*) FROM tag;");
+	pairs = count(db, "SELECT COUNT(*) FROM file_tag;");
+	counted = count(db, "SELECT SUM(file_count) FROM tag;");
+
+	printf("{\"dataset\":\"generated\",\"files\":%lld,\"tags\":%lld,"
+		   "\"associations\":%lld}\n", files, tags, pairs);
+	fflush(stdout);
+
+	if (files != cfg->files || tags != cfg->tags || pairs < files ||
+		pairs > files * (2 * cfg->tags_per_file - 1) || counted != pairs ||
+		count(db, "SELECT COUNT(*) FROM file WHERE NOT EXISTS (SELECT 1 "
+			  "FROM file_tag WHERE file_id = file.id);") != 0)
+		fprintf(stderr, PROGRAM_NAME ": expected %d files and %d tags\n",
+				cfg->files, cfg->tags);
+	else
+		status = SUCCESS;
+
+	out:
+	sqlite3_close(db);
+
+	return status;
+}
+
+/* List of new files for the batch tagging benchmark */
+static int write_batch_list(const struct config *cfg, const char *fn)
+{
+	FILE *fp = fopen(fn, "w");
+
+	if (fp == NULL)
+		return ERROR;
+
+	for (int i = 0; i < cfg->batch; i++)
+		fprintf(fp, "batch%04d/file%08d\n", i % 100, i);
+
+	return fclose(fp) == 0 ? SUCCESS : ERROR;
+}
+
+/***--- Running ---***/
+
+/* Run argv in dbdir with output discarded, return wall seconds or -1 */
+static double run(char **argv)
+{
+	double start = now();
+	int status;
+	pid_t pid = fork();
+
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		dup2(null, STDOUT_FILENO);
+		if (chdir(dbdir) == 0)
+			execv(argv[0], argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+		WEXITSTATUS(status) != 0)
+		return -1;
+
+	return now() - start;
+}
+
+/* Print the times of cfg->runs runs as a JSON line, sorting them */
+static void report(const struct config *cfg, const char *name, double *times)
+{
+	qsort(times, cfg->runs, sizeof(*times), double_cmp);
+
+	printf("{\"bench\":\"%s\",\"files\":%d,\"tags\":%d,\"tags_per_file\":%d,"
+		   "\"zipf\":%g,\"runs\":%d,\"min_ms\":%.3f,\"median_ms\":%.3f,"
+		   "\"max_ms\":%.3f}\n", name, cfg->files, cfg->tags,
+		   cfg->tags_per_file, cfg->zipf, cfg->runs, times[0] * 1e3,
+		   times[cfg->runs / 2] * 1e3, times[cfg->runs - 1] * 1e3);
+	fflush(stdout);
+}
+
+/* Time ftag ARGS... cfg->runs times and print the result as a JSON line.
+ * If fresh isn't NULL that file in dbdir is removed before every run.
+ */
+static int bench_fresh(const struct config *cfg, const char *name,
+					   const char *fresh, va_list ap)
+{
+	char *argv[MAX_ARGS];
+	char path[sizeof(dbdir) + 64];
+	double *times = NULL;
+	int argc = 0;
+
+	argv[argc++] = (char *) cfg->ftag;
+	while (argc < MAX_ARGS - 1 && (argv[argc] = va_arg(ap, char *)) != NULL)
+		argc++;
+	argv[argc] = NULL;
+
+	times = malloc(sizeof(*times) * cfg->runs);
+	if (times == NULL)
+		return ERROR;
+
+	for (int i = 0; i < cfg->runs; i++) {
+		if (fresh != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", dbdir, fresh);
+			unlink(path);
+		}
+
+		times[i] = run(argv);
+
+		if (times[i] < 0) {
+			fprintf(stderr, PROGRAM_NAME ": benchmark '%s' failed\n", name);
+			free(times);
+			return ERROR;
+		}
+	}
+
+	report(cfg, name, times);
+	free(times);
+
+	return SUCCESS;
+}
+
+static int bench(const struct config *cfg, const char *name, ...)
+{
+	va_list ap;
+	int status;
+
+	va_start(ap, name);
+	status = bench_fresh(cfg, name, NULL, ap);
+	va_end(ap);
+
+	return status;
+}
+
+/* Time importing file into an empty database */
+static int bench_import(const struct config *cfg, const char *name, ...)
+{
+	va_list ap;
+	int status;
+
+	va_start(ap, name);
+	status = bench_fresh(cfg, name, IMPORT_FILENAME, ap);
+	va_end(ap);
+
+	return status;
+}
+
+static void cleanup(void)
+{
+	char path[sizeof(dbdir) + 64];
+	char cache[sizeof(dbdir) + 32];
+	struct dirent *ent = NULL;
+	DIR *dp = NULL;
+
+	sprintf(cache, "%s/%s.cache", dbdir, DB_FILENAME);
+	if ((dp = opendir(cache)) != NULL) {
+		while ((ent = readdir(dp)) != NULL) {
+			if (*ent->d_name == '.')
+				continue;
+			sprintf(path, "%s/%.16s", cache, ent->d_name);
+			unlink(path);
+		}
+		closedir(dp);
+		rmdir(cache);
+	}
+
+	sprintf(path, "%s/%s", dbdir, DB_FILENAME);
+	unlink(path);
+	sprintf(path, "%s/%s", dbdir, SNAPSHOT_FILENAME);
+	unlink(path);
+	sprintf(path, "%s/%s", dbdir, IMPORT_FILENAME);
+	unlink(path);
+	sprintf(path, "%s/export.jsonl", dbdir);
+	unlink(path);
+	sprintf(path, "%s/export.nul", dbdir);
+	unlink(path);
+	sprintf(path, "%s/changes.tsv", dbdir);
+	unlink(path);
+	sprintf(path, "%s/batch.txt", dbdir);
+	unlink(path);
+	rmdir(dbdir);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = { "./ftag", 10000, 1000, 4, 1.0, 5, 1000, 1 };
+	char *ftag = NULL;
+	char rare[16];
+	int status = SUCCESS;
+	int only_check = 0;
+	int chr = 0;
+
+	static struct option longopts[] = {
+		{"ftag", required_argument, 0, 'b'},
+		{"files", required_argument, 0, 'n'},
+		{"tags", required_argument, 0, 't'},
+		{"tags-per-file", required_argument, 0, 'k'},
+		{"zipf", required_argument, 0, 's'},
+		{"runs", required_argument, 0, 'r'},
+		{"batch", required_argument, 0, 'B'},
+		{"seed", required_argument, 0, 'S'},
+		{"check", no_argument, 0, 'c'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	while ((chr = getopt_long(argc, argv, "b:n:t:k:s:r:B:S:ch", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'b': cfg.ftag = optarg; break;
+			case 'n': cfg.files = atoi(optarg); break;
+			case 't': cfg.tags = atoi(optarg); break;
+			case 'k': cfg.tags_per_file = atoi(optarg); break;
+			case 's': cfg.zipf = atof(optarg); break;
+			case 'r': cfg.runs = atoi(optarg); break;
+			case 'B': cfg.batch = atoi(optarg); break;
+			case 'S': cfg.seed = strtoul(optarg, NULL, 10); break;
+			case 'c': only_check = 1; break;
+			case 'h':
+				usage(stdout);
+				return SUCCESS;
+			default:
+				usage(stderr);
+				return ERROR;
+		}
+	}
+
+	if (cfg.files < 1 || cfg.tags < 2 || cfg.tags_per_file < 1 ||
+		cfg.runs < 1 || cfg.batch < 1) {
+		usage(stderr);
+		return ERROR;
+	}
+
+	rng_state = cfg.seed ? cfg.seed : 1;
+
+	// Benchmarks run in the database directory
+	ftag = realpath(cfg.ftag, NULL);
+	if (ftag == NULL || mkdtemp(dbdir) == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": failed to set up '%s'\n", cfg.ftag);
+		return ERROR;
+	}
+	cfg.ftag = ftag;
+	atexit(cleanup);
+
+	// Let ftag create the schema, then fill it in directly
+	if (run((char *[]) { ftag, "list", NULL }) < 0 || generate(&cfg) != SUCCESS ||
+		check(&cfg) != SUCCESS || write_batch_list(&cfg, "batch.txt") != SUCCESS) {
+		fprintf(stderr, PROGRAM_NAME ": failed to generate database\n");
+		free(ftag);
+		return ERROR;
+	}
+
+	if (only_check) {
+		free(ftag);
+		return SUCCESS;
+	}
+
+	sprintf(rare, "tag%06d", cfg.tags - 1);
+
+	status |= bench(&cfg, "startup", "list", "no-such-file", NULL);
+	status |= bench(&cfg, "tag_file", "file", "dir0000/file00000000",
+					"tag000000", "tag000001", NULL);
+	status |= bench(&cfg, "tag_batch", "file", "--files-from=batch.txt",
+					"tag000002", NULL);
+	status |= bench(&cfg, "filter_any_popular", "filter", "tag000000",
+					"tag000001", NULL);
+	status |= bench(&cfg, "filter_any_rare", "filter", rare, NULL);
+	// Every run but the first is served from the cache
+	status |= bench(&cfg, "filter_any_popular_cached", "filter", "--cache",
+					"tag000000", "tag000001", NULL);
+	status |= bench(&cfg, "filter_all_popular", "filter", "-A", "tag000000",
+					"tag000001", NULL);
+	status |= bench(&cfg, "filter_all_mixed", "filter", "-A", "tag000000",
+					rare, NULL);
+	// Ten tags by range of the name index, then a glob over every name
+	status |= bench(&cfg, "filter_prefix", "filter", "tag00000*", NULL);
+	status |= bench(&cfg, "filter_glob", "filter", "tag*0", NULL);
+	status |= bench(&cfg, "filter_everything", "filter", NULL);
+	// A page costs the same at the start of the result and far into it
+	status |= bench(&cfg, "filter_page_first", "filter", "--limit", "100",
+					"tag000000", NULL);
+	status |= bench(&cfg, "filter_page_deep", "filter", "--limit", "100",
+					"--after", "dir0900", "tag000000", NULL);
+	status |= bench(&cfg, "filter_page_rare", "filter", "--limit", "100", rare,
+					NULL);
+	// Counts and membership come from the indexes, printing no paths
+	status |= bench(&cfg, "filter_count_popular", "filter", "--count",
+					"tag000000", "tag000001", NULL);
+	status |= bench(&cfg, "filter_count_all", "filter", "--count", "-A",
+					"tag000000", "tag000001", NULL);
+	status |= bench(&cfg, "has", "has", "dir0000/file00000000", "tag000000",
+					NULL);
+	// The files of the last hour, against an empty range
+	status |= bench(&cfg, "filter_since_hour", "filter", "--since", "1h", NULL);
+	status |= bench(&cfg, "filter_since_hour_popular", "filter", "--since", "1h",
+					"tag000000", NULL);
+	status |= bench(&cfg, "filter_since_none", "filter", "--since", "0",
+					"--until", "1", NULL);
+	status |= bench(&cfg, "list_recent_hour", "list", "--recent", "1h", NULL);
+	status |= bench(&cfg, "filter_everything_j4", "filter", "-j", "4", NULL);
+	status |= bench(&cfg, "filter_everything_j4_unordered", "filter", "-j", "4",
+					"--unordered", NULL);
+	status |= bench(&cfg, "list_tags", "list", "--counts", NULL);
+	status |= bench(&cfg, "list_file", "list", "dir0000/file00000000", NULL);
+	status |= bench(&cfg, "list_match", "list", "--match", "tag*0", NULL);
+	status |= bench(&cfg, "list_top", "list", "--top", "50", NULL);
+	status |= bench(&cfg, "related_popular", "related", "tag000000", NULL);
+
+	// The same reads again from a snapshot of the finished database
+	status |= bench(&cfg, "snapshot", "snapshot", NULL);
+	status |= bench(&cfg, "snapshot_startup", "-s", SNAPSHOT_FILENAME, "list",
+					"no-such-file", NULL);
+	status |= bench(&cfg, "snapshot_filter_any_popular", "-s", SNAPSHOT_FILENAME,
+					"filter", "tag000000", "tag000001", NULL);
+	status |= bench(&cfg, "snapshot_filter_all_mixed", "-s", SNAPSHOT_FILENAME,
+					"filter", "-A", "tag000000", rare, NULL);
+	status |= bench(&cfg, "snapshot_filter_glob", "-s", SNAPSHOT_FILENAME,
+					"filter", "tag*0", NULL);
+	status |= bench(&cfg, "snapshot_filter_everything", "-s", SNAPSHOT_FILENAME,
+					"filter", NULL);
+	status |= bench(&cfg, "snapshot_list_top", "-s", SNAPSHOT_FILENAME, "list",
+					"--top", "50", NULL);
+	status |= bench(&cfg, "snapshot_list_file", "-s", SNAPSHOT_FILENAME, "list",
+					"dir0000/file00000000", NULL);
+
+	// Moving the whole database out and into an empty one
+	status |= bench(&cfg, "export_jsonl", "export", "--format=jsonl",
+					"export.jsonl", NULL);
+	status |= bench(&cfg, "export_nul", "export", "--format=nul", "export.nul",
+					NULL);
+	status |= bench_import(&cfg, "import_jsonl", "-d", IMPORT_FILENAME, "import",
+						   "--format=jsonl", "export.jsonl", NULL);
+	status |= bench_import(&cfg, "import_nul", "-d", IMPORT_FILENAME, "import",
+						   "--format=nul", "export.nul", NULL);
+	// The same straight from the database, with no text in between
+	status |= bench_import(&cfg, "merge_db", "-d", IMPORT_FILENAME, "merge-db",
+						   DB_FILENAME, NULL);
+	// Syncing costs the changes since, nothing when there are none
+	status |= bench(&cfg, "changes_all", "changes", "changes.tsv", NULL);
+	status |= bench(&cfg, "changes_none", "changes", "--since", "999999999",
+					NULL);
+	// Replaying every change into an empty database, one path and name each
+	status |= bench_import(&cfg, "apply_all", "-d", IMPORT_FILENAME, "apply",
+						   "changes.tsv", NULL);
+	// Into a database holding all of it already, so every id is mapped
+	status |= bench(&cfg, "import_nul_existing", "import", "--format=nul",
+					"export.nul", NULL);
+
+	free(ftag);
+
+	return status;
+}
@@ -0,0 +1,1529 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Export and import -- moving tag databases around as text
+ *
+ * An export is every file, then every tag, then every association, each
+ * table in primary key order, one record at a time. Nothing is buffered
+ * beyond the current record in either direction, so any size of database
+ * can be moved in constant memory.
+ *
+ * Records have a type and two fields, and associations the time they were
+ * made too, unless it is not known:
+ *
+ *   file      id, path
+ *   tag       id, name
+ *   file_tag  file id, tag id, time
+ *
+ * FORMAT_JSONL  one object per line, eg. {"type":"file","id":1,"path":"a"}
+ *               and {"type":"file_tag","file":1,"tag":2,"time":1420070400}
+ * FORMAT_TSV    one line per record, tab separated, with \t, \n and \\
+ *               escaped in paths and names
+ * FORMAT_NUL    type and fields each terminated by a NUL, nothing escaped,
+ *               and the time of an association empty when not known
+ *
+ * Associations without a time, like those of exports made before times
+ * were kept, are imported as made now.
+ *
+ * Importing into an empty database keeps the ids, and because they come
+ * in order every insert appends to the end of its table. Otherwise files
+ * and tags are matched by path and name, and the ids of the export are
+ * mapped to local ones through temporary tables.
+ *
+ * Merging and splitting databases uses the same mapping, but reads the
+ * other database directly instead of a text export. The change log is
+ * moved as text too, to keep copies of a database in step. Its paths and
+ * names are interned as they are replayed, so that each is looked up in
+ * the database only once.
+ */
+
+/***--- Includes ---***/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sqlite3.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Constants ---***/
+
+#define PROGRAM_NAME "ftag"
+
+enum record_type {
+	RECORD_FILE,
+	RECORD_TAG,
+	RECORD_FILE_TAG,
+	RECORD_COUNT
+};
+
+static const char *record_names[RECORD_COUNT] = { "file", "tag", "file_tag" };
+
+// JSON keys of the two fields of each record type
+static const char *json_keys[RECORD_COUNT][2] = {
+	{ "id", "path" }, { "id", "name" }, { "file", "tag" }
+};
+
+struct record {
+	enum record_type type;
+	sqlite3_int64 id;
+	// The second field, either text or for file_tag a tag id
+	char *text;
+	sqlite3_int64 ref;
+	// When a file_tag was made, if timed
+	int timed;
+	sqlite3_int64 time;
+};
+
+/***--- Writing records ---***/
+
+static void write_json_string(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+
+	for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+		switch (*p) {
+			case '"':
+				fputs("\\\"", fp);
+				break;
+			case '\\':
+				fputs("\\\\", fp);
+				break;
+			case '\n':
+				fputs("\\n", fp);
+				break;
+			case '\t':
+				fputs("\\t", fp);
+				break;
+			default:
+				if (*p < 0x20)
+					fprintf(fp, "\\u%04x", *p);
+				else
+					fputc(*p, fp);
+		}
+	}
+
+	fputc('"', fp);
+}
+
+static void write_tsv_string(FILE *fp, const char *str)
+{
+	for (; *str; str++) {
+		switch (*str) {
+			case '\t':
+				fputs("\\t", fp);
+				break;
+			case '\n':
+				fputs("\\n", fp);
+				break;
+			case '\\':
+				fputs("\\\\", fp);
+				break;
+			default:
+				fputc(*str, fp);
+		}
+	}
+}
+
+static void write_record(FILE *fp, int format, const struct record *rec)
+{
+	const char *type = record_names[rec->type];
+
+	switch (format) {
+		case FORMAT_JSONL:
+			fprintf(fp, "{\"type\":\"%s\",\"%s\":%lld,\"%s\":", type,
+					json_keys[rec->type][0], (long long) rec->id,
+					json_keys[rec->type][1]);
+			if (rec->type == RECORD_FILE_TAG)
+				fprintf(fp, "%lld", (long long) rec->ref);
+			else
+				write_json_string(fp, rec->text);
+			if (rec->timed)
+				fprintf(fp, ",\"time\":%lld", (long long) rec->time);
+			fputs("}\n", fp);
+			break;
+		case FORMAT_TSV:
+			fprintf(fp, "%s\t%lld\t", type, (long long) rec->id);
+			if (rec->type == RECORD_FILE_TAG)
+				fprintf(fp, "%lld", (long long) rec->ref);
+			else
+				write_tsv_string(fp, rec->text);
+			if (rec->timed)
+				fprintf(fp, "\t%lld", (long long) rec->time);
+			fputc('\n', fp);
+			break;
+		case FORMAT_NUL:
+			fprintf(fp, "%s%c%lld%c", type, '\0', (long long) rec->id, '\0');
+			if (rec->type != RECORD_FILE_TAG)
+				fprintf(fp, "%s%c", rec->text, '\0');
+			else if (rec->timed)
+				fprintf(fp, "%lld%c%lld%c", (long long) rec->ref, '\0',
+						(long long) rec->time, '\0');
+			else
+				fprintf(fp, "%lld%c%c", (long long) rec->ref, '\0', '\0');
+			break;
+	}
+}
+
+/* Write every file, tag and association of db to fp, as of one moment */
+int ftag_export_db(ftag_db *db, FILE *fp, int format)
+{
+	static const char *queries[RECORD_COUNT] = {
+		"SELECT id, relative_path FROM file ORDER BY id;",
+		"SELECT id, name FROM tag ORDER BY id;",
+		// In the order of file_tag_uq, so without sorting
+		"SELECT file_id, tag_id, tagged_at FROM file_tag "
+		"ORDER BY file_id, tag_id;",
+	};
+	sqlite3 *conn = ftag_db_sqlite(db);
+	int status = SUCCESS;
+
+	if (fp == NULL || format < FORMAT_JSONL || format > FORMAT_NUL)
+		return ERROR;
+
+	if (sqlite3_exec(conn, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	for (int type = 0; type < RECORD_COUNT && status == SUCCESS; type++) {
+		sqlite3_stmt *prep = NULL;
+		struct record rec = { type, 0, NULL, 0, 0, 0 };
+		int step;
+
+		if (sqlite3_prepare_v2(conn, queries[type], -1, &prep, NULL) != SQLITE_OK) {
+			status = ERROR;
+			break;
+		}
+
+		while ((step = sqlite3_step(prep)) == SQLITE_ROW) {
+			rec.id = sqlite3_column_int64(prep, 0);
+			rec.ref = sqlite3_column_int64(prep, 1);
+			rec.text = (char *) sqlite3_column_text(prep, 1);
+			rec.timed = type == RECORD_FILE_TAG &&
+				sqlite3_column_type(prep, 2) != SQLITE_NULL;
+			rec.time = rec.timed ? sqlite3_column_int64(prep, 2) : 0;
+
+			if (rec.text == NULL)
+				continue;
+
+			write_record(fp, format, &rec);
+		}
+
+		if (step != SQLITE_DONE || ferror(fp))
+			status = ERROR;
+
+		sqlite3_finalize(prep);
+	}
+
+	sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+
+	return status;
+}
+
+/***--- Reading records ---***/
+
+static int record_type(const char *name, enum record_type *type)
+{
+	for (int i = 0; i < RECORD_COUNT; i++) {
+		if (strcmp(name, record_names[i]) == 0) {
+			*type = i;
+			return SUCCESS;
+		}
+	}
+
+	return ERROR;
+}
+
+static int parse_id(const char *str, sqlite3_int64 *id)
+{
+	char *end = NULL;
+
+	errno = 0;
+	*id = strtoll(str, &end, 10);
+
+	return *str == '\0' || *end != '\0' || errno != 0 ? ERROR : SUCCESS;
+}
+
+/* Undo write_tsv_string in place */
+static int unescape_tsv(char *str)
+{
+	char *out = str;
+
+	for (; *str; str++) {
+		if (*str != '\\') {
+			*out++ = *str;
+			continue;
+		}
+
+		switch (*++str) {
+			case 't':
+				*out++ = '\t';
+				break;
+			case 'n':
+				*out++ = '\n';
+				break;
+			case '\\':
+				*out++ = '\\';
+				break;
+			default:
+				return ERROR;
+		}
+	}
+
+	*out = '\0';
+
+	return SUCCESS;
+}
+
+/* Fill in rec from the type name, two fields and the time, which may be
+ * NULL or "" when not known and only an association has. Text is kept as
+ * is.
+ */
+static int make_record(struct record *rec, const char *type, const char *id,
+					   char *second, const char *when)
+{
+	if (record_type(type, &rec->type) != SUCCESS ||
+		parse_id(id, &rec->id) != SUCCESS)
+		return ERROR;
+
+	rec->text = second;
+	rec->timed = when != NULL && *when != '\0';
+
+	if (rec->type != RECORD_FILE_TAG)
+		return rec->timed ? ERROR : SUCCESS;
+
+	if (rec->timed && parse_id(when, &rec->time) != SUCCESS)
+		return ERROR;
+
+	return parse_id(second, &rec->ref);
+}
+
+static int parse_tsv(char *line, struct record *rec)
+{
+	char *id = strchr(line, '\t');
+	char *second = id == NULL ? NULL : strchr(id + 1, '\t');
+	char *when = second == NULL ? NULL : strchr(second + 1, '\t');
+
+	if (second == NULL || (when != NULL && strchr(when + 1, '\t') != NULL))
+		return ERROR;
+
+	*id++ = '\0';
+	*second++ = '\0';
+	if (when != NULL)
+		*when++ = '\0';
+
+	if (unescape_tsv(second) != SUCCESS)
+		return ERROR;
+
+	return make_record(rec, line, id, second, when);
+}
+
+/* Append the UTF-8 encoding of code point c at *out */
+static void put_utf8(char **out, unsigned long c)
+{
+	unsigned char *p = (unsigned char *) *out;
+
+	if (c < 0x80) {
+		*p++ = c;
+	} else if (c < 0x800) {
+		*p++ = 0xc0 | c >> 6;
+		*p++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*p++ = 0xe0 | c >> 12;
+		*p++ = 0x80 | (c >> 6 & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	} else {
+		*p++ = 0xf0 | c >> 18;
+		*p++ = 0x80 | (c >> 12 & 0x3f);
+		*p++ = 0x80 | (c >> 6 & 0x3f);
+		*p++ = 0x80 | (c & 0x3f);
+	}
+
+	*out = (char *) p;
+}
+
+static int hex4(const char *p, unsigned long *c)
+{
+	*c = 0;
+
+	for (int i = 0; i < 4; i++) {
+		int d = p[i];
+
+		if (d >= '0' && d <= '9')
+			d -= '0';
+		else if (d >= 'a' && d <= 'f')
+			d -= 'a' - 10;
+		else if (d >= 'A' && d <= 'F')
+			d -= 'A' - 10;
+		else
+			return ERROR;
+
+		*c = *c << 4 | d;
+	}
+
+	return SUCCESS;
+}
+
+/* Decode the JSON string starting after the quote at *p, in place. The
+ * decoded string never is longer than the encoded one. *p is left after
+ * the closing quote. NULL on error.
+ */
+static char *json_string(char **p)
+{
+	char *start = *p;
+	char *in = *p;
+	char *out = *p;
+
+	while (*in != '"') {
+		unsigned long c;
+
+		if (*in == '\0')
+			return NULL;
+
+		if (*in != '\\') {
+			*out++ = *in++;
+			continue;
+		}
+
+		switch (*++in) {
+			case '"': case '\\': case '/':
+				*out++ = *in++;
+				continue;
+			case 'b': *out++ = '\b'; in++; continue;
+			case 'f': *out++ = '\f'; in++; continue;
+			case 'n': *out++ = '\n'; in++; continue;
+			case 'r': *out++ = '\r'; in++; continue;
+			case 't': *out++ = '\t'; in++; continue;
+			case 'u':
+				break;
+			default:
+				return NULL;
+		}
+
+		if (hex4(in + 1, &c) != SUCCESS)
+			return NULL;
+		in += 5;
+
+		// Characters outside the BMP come as a surrogate pair
+		if (c >= 0xd800 && c < 0xdc00) {
+			unsigned long low;
+
+			if (in[0] != '\\' || in[1] != 'u' || hex4(in + 2, &low) != SUCCESS ||
+				low < 0xdc00 || low >= 0xe000)
+				return NULL;
+
+			c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+			in += 6;
+		}
+
+		if (c == 0)
+			return NULL;
+
+		put_utf8(&out, c);
+	}
+
+	*out = '\0';
+	*p = in + 1;
+
+	return start;
+}
+
+static void skip_space(char **p)
+{
+	while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+		(*p)++;
+}
+
+struct json_member {
+	char *key;
+	char *str;
+	sqlite3_int64 num;
+};
+
+/* A flat object of string and integer members, as written by write_record */
+static int parse_json(char *line, struct record *rec)
+{
+	// The type, two fields and a time
+	struct json_member members[4];
+	struct json_member *fields[2] = { NULL, NULL };
+	struct json_member *when = NULL;
+	const char *type = NULL;
+	char *p = line;
+	int n = 0;
+
+	skip_space(&p);
+	if (*p++ != '{')
+		return ERROR;
+
+	skip_space(&p);
+	while (*p != '}') {
+		struct json_member *m = &members[n];
+
+		if (n == 4 || (n > 0 && *p++ != ','))
+			return ERROR;
+
+		skip_space(&p);
+		if (*p++ != '"' || (m->key = json_string(&p)) == NULL)
+			return ERROR;
+
+		skip_space(&p);
+		if (*p++ != ':')
+			return ERROR;
+		skip_space(&p);
+
+		if (*p == '"') {
+			p++;
+			if ((m->str = json_string(&p)) == NULL)
+				return ERROR;
+		} else {
+			char *end = NULL;
+
+			errno = 0;
+			m->str = NULL;
+			m->num = strtoll(p, &end, 10);
+			if (end == p || errno != 0)
+				return ERROR;
+			p = end;
+		}
+
+		n++;
+		skip_space(&p);
+	}
+
+	p++;
+	skip_space(&p);
+	if (*p != '\0')
+		return ERROR;
+
+	for (int i = 0; i < n; i++)
+		if (strcmp(members[i].key, "type") == 0)
+			type = members[i].str;
+
+	if (type == NULL || record_type(type, &rec->type) != SUCCESS)
+		return ERROR;
+
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < 2; k++)
+			if (strcmp(members[i].key, json_keys[rec->type][k]) == 0)
+				fields[k] = &members[i];
+		if (strcmp(members[i].key, "time") == 0)
+			when = &members[i];
+	}
+
+	// The id, then a text or, for associations, another id
+	if (fields[0] == NULL || fields[1] == NULL || fields[0]->str != NULL ||
+		(fields[1]->str == NULL) != (rec->type == RECORD_FILE_TAG))
+		return ERROR;
+
+	// Only associations have a time
+	if (when != NULL && (when->str != NULL || rec->type != RECORD_FILE_TAG))
+		return ERROR;
+
+	rec->id = fields[0]->num;
+	rec->ref = fields[1]->num;
+	rec->text = fields[1]->str;
+	rec->timed = when != NULL;
+	rec->time = when != NULL ? when->num : 0;
+
+	return SUCCESS;
+}
+
+/* Buffers for the fields of the record being read, reused throughout */
+struct reader {
+	FILE *fp;
+	int format;
+	char *buf[4];
+	size_t size[4];
+};
+
+/* The next record into rec, its text valid until the next call.
+ * Returns 0 at the end of input, -1 on error and 1 otherwise.
+ */
+static int read_record(struct reader *r, struct record *rec)
+{
+	ssize_t len;
+
+	if (r->format == FORMAT_NUL) {
+		// Associations have a fourth field, the time
+		int fields = 3;
+
+		for (int i = 0; i < fields; i++) {
+			len = getdelim(&r->buf[i], &r->size[i], '\0', r->fp);
+
+			if (len <= 0 || r->buf[i][len - 1] != '\0')
+				return i == 0 && len == -1 && !ferror(r->fp) ? 0 : -1;
+
+			if (i == 0 && strcmp(r->buf[0], record_names[RECORD_FILE_TAG]) == 0)
+				fields = 4;
+		}
+
+		return make_record(rec, r->buf[0], r->buf[1], r->buf[2],
+						   fields == 4 ? r->buf[3] : NULL) == SUCCESS ? 1 : -1;
+	}
+
+	do {
+		len = getline(&r->buf[0], &r->size[0], r->fp);
+		if (len == -1)
+			return ferror(r->fp) ? -1 : 0;
+
+		if (r->buf[0][len - 1] == '\n')
+			r->buf[0][--len] = '\0';
+	} while (len == 0);
+
+	if (r->format == FORMAT_TSV)
+		return parse_tsv(r->buf[0], rec) == SUCCESS ? 1 : -1;
+	else
+		return parse_json(r->buf[0], rec) == SUCCESS ? 1 : -1;
+}
+
+/***--- Import ---***/
+
+/* Statements per record type, for inserting and for checking the ids an
+ * association refers to when it inserted nothing. A record type may have
+ * two statements to insert, run in order.
+ */
+static const char *fast_sql[RECORD_COUNT][2] = {
+	{ "INSERT INTO file (id, relative_path) VALUES (?1, ?2);", NULL },
+	{ "INSERT INTO tag (id, name) VALUES (?1, ?2);", NULL },
+	{ "INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) SELECT f.id, "
+	  "t.id, ?3 FROM file AS f, tag AS t WHERE f.id = ?1 AND t.id = ?2;", NULL },
+};
+
+static const char *fast_check_sql =
+"SELECT EXISTS (SELECT 1 FROM file WHERE id = ?1) AND "
+"EXISTS (SELECT 1 FROM tag WHERE id = ?2);";
+
+static const char *remap_sql[RECORD_COUNT][2] = {
+	{ "INSERT OR IGNORE INTO file (relative_path) VALUES (?2);",
+	  "INSERT INTO temp.import_file (old_id, new_id) "
+	  "SELECT ?1, id FROM file WHERE relative_path = ?2;" },
+	{ "INSERT OR IGNORE INTO tag (name) VALUES (?2);",
+	  "INSERT INTO temp.import_tag (old_id, new_id) "
+	  "SELECT ?1, id FROM tag WHERE name = ?2;" },
+	{ "INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) "
+	  "SELECT f.new_id, t.new_id, ?3 FROM temp.import_file AS f, "
+	  "temp.import_tag AS t WHERE f.old_id = ?1 AND t.old_id = ?2;", NULL },
+};
+
+static const char *remap_check_sql =
+"SELECT EXISTS (SELECT 1 FROM temp.import_file WHERE old_id = ?1) AND "
+"EXISTS (SELECT 1 FROM temp.import_tag WHERE old_id = ?2);";
+
+static const char *remap_setup_sql =
+"CREATE TEMP TABLE IF NOT EXISTS import_file "
+"(old_id INTEGER PRIMARY KEY, new_id INTEGER);"
+"CREATE TEMP TABLE IF NOT EXISTS import_tag "
+"(old_id INTEGER PRIMARY KEY, new_id INTEGER);"
+"DELETE FROM temp.import_file;"
+"DELETE FROM temp.import_tag;"
+;
+
+static int is_empty(sqlite3 *conn)
+{
+	sqlite3_stmt *prep = NULL;
+	int empty = 0;
+
+	if (sqlite3_prepare_v2(conn, "SELECT NOT EXISTS (SELECT 1 FROM file) AND "
+						   "NOT EXISTS (SELECT 1 FROM tag);", -1, &prep, NULL)
+		== SQLITE_OK && sqlite3_step(prep) == SQLITE_ROW)
+		empty = sqlite3_column_int(prep, 0);
+
+	sqlite3_finalize(prep);
+
+	return empty;
+}
+
+/* Run prep for rec, an association without a time as made at now */
+static int run_record(sqlite3_stmt *prep, const struct record *rec,
+					  sqlite3_int64 now)
+{
+	int status;
+
+	sqlite3_bind_int64(prep, 1, rec->id);
+	if (rec->type == RECORD_FILE_TAG) {
+		sqlite3_bind_int64(prep, 2, rec->ref);
+		sqlite3_bind_int64(prep, 3, rec->timed ? rec->time : now);
+	} else {
+		sqlite3_bind_text(prep, 2, rec->text, -1, SQLITE_STATIC);
+	}
+
+	status = sqlite3_step(prep);
+	sqlite3_reset(prep);
+
+	return status == SQLITE_DONE || status == SQLITE_ROW ? SUCCESS : ERROR;
+}
+
+/* Read records in format from fp into db, all in one transaction */
+int ftag_import_db(ftag_db *db, FILE *fp, int format)
+{
+	sqlite3 *conn = ftag_db_sqlite(db);
+	sqlite3_stmt *insert[RECORD_COUNT][2];
+	sqlite3_stmt *check = NULL;
+	const char *(*sql)[2] = NULL;
+	struct reader reader = { fp, format, { NULL, NULL, NULL, NULL },
+							 { 0, 0, 0, 0 } };
+	struct record rec;
+	sqlite3_int64 now = (sqlite3_int64) time(NULL);
+	long line = 0;
+	int status = ERROR;
+	int got;
+
+	memset(insert, 0, sizeof(insert));
+
+	if (fp == NULL || format < FORMAT_JSONL || format > FORMAT_NUL)
+		return ERROR;
+
+	if (sqlite3_exec(conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	// Into an empty database rows only append, and tag_pair, the change log
+	// and every index are filled at the end
+	if (is_empty(conn)) {
+		sql = fast_sql;
+		if (pause_tag_pairs(db) != SUCCESS || pause_change_log(db) != SUCCESS ||
+			pause_indexes(db) != SUCCESS)
+			goto out;
+	} else {
+		sql = remap_sql;
+		if (sqlite3_exec(conn, remap_setup_sql, NULL, NULL, NULL) != SQLITE_OK)
+			goto out;
+	}
+
+	for (int i = 0; i < RECORD_COUNT; i++)
+		for (int k = 0; k < 2; k++)
+			if (sql[i][k] != NULL && sqlite3_prepare_v2(conn, sql[i][k], -1,
+					&insert[i][k], NULL) != SQLITE_OK)
+				goto out;
+
+	if (sqlite3_prepare_v2(conn, sql == fast_sql ? fast_check_sql : remap_check_sql,
+						   -1, &check, NULL) != SQLITE_OK)
+		goto out;
+
+	while ((got = read_record(&reader, &rec)) > 0) {
+		line++;
+
+		for (int k = 0; k < 2; k++) {
+			if (insert[rec.type][k] != NULL &&
+				run_record(insert[rec.type][k], &rec, now) != SUCCESS) {
+				fprintf(stderr, PROGRAM_NAME ": record %ld: %s\n", line,
+						sqlite3_errmsg(conn));
+				goto out;
+			}
+		}
+
+		// An association may already exist, or refer to something unknown
+		if (rec.type == RECORD_FILE_TAG && sqlite3_changes(conn) == 0) {
+			int known = 0;
+
+			sqlite3_bind_int64(check, 1, rec.id);
+			sqlite3_bind_int64(check, 2, rec.ref);
+			if (sqlite3_step(check) == SQLITE_ROW)
+				known = sqlite3_column_int(check, 0);
+			sqlite3_reset(check);
+
+			if (!known) {
+				fprintf(stderr, PROGRAM_NAME ": record %ld: unknown file or tag\n",
+						line);
+				goto out;
+			}
+		}
+	}
+
+	if (got < 0) {
+		fprintf(stderr, PROGRAM_NAME ": record %ld: malformed\n", line + 1);
+		goto out;
+	}
+
+	if (sql == fast_sql && (rebuild_indexes(db) != SUCCESS ||
+							rebuild_tag_pairs(db) != SUCCESS ||
+							fill_change_log(db) != SUCCESS)) {
+		fprintf(stderr, PROGRAM_NAME ": %s\n", sqlite3_errmsg(conn));
+		goto out;
+	}
+
+	status = SUCCESS;
+
+	out:
+	for (int i = 0; i < RECORD_COUNT; i++)
+		for (int k = 0; k < 2; k++)
+			sqlite3_finalize(insert[i][k]);
+	sqlite3_finalize(check);
+	for (int i = 0; i < 4; i++)
+		free(reader.buf[i]);
+
+	if (status == SUCCESS && sql == remap_sql)
+		sqlite3_exec(conn, "DELETE FROM temp.import_file;"
+					 "DELETE FROM temp.import_tag;", NULL, NULL, NULL);
+
+	if (status == SUCCESS &&
+		sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		status = ERROR;
+
+	if (status != SUCCESS && !sqlite3_get_autocommit(conn))
+		sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+
+	return status;
+}
+
+/***--- Merge and split ---***/
+
+/* Files move between databases with the source ATTACHed to the connection
+ * of the destination, as bulk INSERT ... SELECTs. The ids of the source
+ * are mapped to those of the destination through the same temporary
+ * tables as an import, each filled in one pass joining on path or name.
+ * Tags and associations are found from the files copied, so splitting a
+ * few files off a big database only reads theirs.
+ * ?1 is the prefix taken off the source's paths, ?2 the prefix put on
+ * instead and ?3 the end of the range of paths starting with ?1.
+ */
+static const char *copy_sql[] = {
+	"INSERT OR IGNORE INTO main.file (relative_path) "
+	"SELECT ?2 || substr(o.relative_path, length(?1) + 1) FROM other.file AS o "
+	"WHERE %s AND EXISTS (SELECT 1 FROM other.file_tag AS x "
+	"WHERE x.file_id = o.id);",
+	"INSERT INTO temp.import_file (old_id, new_id) SELECT o.id, f.id "
+	"FROM other.file AS o JOIN main.file AS f ON f.relative_path = "
+	"?2 || substr(o.relative_path, length(?1) + 1) WHERE %s;",
+	"INSERT OR IGNORE INTO main.tag (name) SELECT o.name FROM other.tag AS o "
+	"WHERE o.id IN (SELECT x.tag_id FROM temp.import_file AS m CROSS JOIN "
+	"other.file_tag AS x ON x.file_id = m.old_id);",
+	"INSERT INTO temp.import_tag (old_id, new_id) SELECT o.id, t.id "
+	"FROM other.tag AS o JOIN main.tag AS t ON t.name = o.name;",
+};
+
+/* Then the associations of the files copied, keeping when they were made.
+ * Those the source has no time for, or all if it is from before times were
+ * kept, are made now.
+ */
+#define COPY_FILE_TAGS(when) \
+	"INSERT OR IGNORE INTO main.file_tag (file_id, tag_id, tagged_at) " \
+	"SELECT f.new_id, t.new_id, " when " FROM temp.import_file AS f " \
+	"CROSS JOIN other.file_tag AS x ON x.file_id = f.old_id " \
+	"JOIN temp.import_tag AS t ON t.old_id = x.tag_id;"
+
+static const char *copy_file_tag_sql[2] = {
+	COPY_FILE_TAGS(SQL_NOW),
+	COPY_FILE_TAGS("coalesce(x.tagged_at, " SQL_NOW ")"),
+};
+
+static const char *copy_timed_sql =
+"SELECT EXISTS (SELECT 1 FROM pragma_table_info('file_tag', 'other') "
+"WHERE name = 'tagged_at');";
+
+static const char *copy_range_sql =
+"o.relative_path >= ?1 AND o.relative_path < ?3";
+
+/* More associations coming than there are, so that counting tag_pair once
+ * at the end beats keeping it up to date for each
+ */
+static const char *copy_bulk_sql =
+"SELECT coalesce((SELECT max(rowid) FROM other.file_tag), 0) >= "
+"coalesce((SELECT max(rowid) FROM main.file_tag), 0);";
+
+/* The end of the range of strings starting with prefix, to be freed */
+static char *prefix_end(const char *prefix)
+{
+	char *end = strdup(prefix);
+	size_t len = strlen(prefix);
+
+	// Prefixes end in a /, which has a successor
+	if (end != NULL && len > 0)
+		end[len - 1]++;
+
+	return end;
+}
+
+static int copy_step(sqlite3 *conn, const char *sql, const char *strip,
+					 const char *add, const char *end)
+{
+	sqlite3_stmt *prep = NULL;
+	int status;
+
+	if (sqlite3_prepare_v2(conn, sql, -1, &prep, NULL) != SQLITE_OK) {
+		fprintf(stderr, PROGRAM_NAME ": %s\n", sqlite3_errmsg(conn));
+		return ERROR;
+	}
+
+	sqlite3_bind_text(prep, 1, strip, -1, SQLITE_STATIC);
+	sqlite3_bind_text(prep, 2, add, -1, SQLITE_STATIC);
+	sqlite3_bind_text(prep, 3, end, -1, SQLITE_STATIC);
+
+	status = sqlite3_step(prep);
+	if (status == SQLITE_ROW)
+		status = sqlite3_column_int(prep, 0) ? SQLITE_ROW : SQLITE_DONE;
+	else if (status != SQLITE_DONE)
+		fprintf(stderr, PROGRAM_NAME ": %s\n", sqlite3_errmsg(conn));
+	sqlite3_finalize(prep);
+
+	return status;
+}
+
+/* Copy the tagged files of the database at path whose paths start with
+ * strip, all of them if it is "", into db with add in its place. The
+ * source is attached for the duration. Everything is one transaction.
+ */
+static int copy_files(ftag_db *db, const char *path, const char *strip,
+					  const char *add)
+{
+	sqlite3 *conn = ftag_db_sqlite(db);
+	sqlite3_stmt *attach = NULL;
+	char *end = NULL;
+	char *sql = NULL;
+	int bulk = 0, timed = 0;
+	int status = ERROR;
+
+	if (sqlite3_prepare_v2(conn, "ATTACH ?1 AS other;", -1, &attach, NULL)
+		!= SQLITE_OK)
+		return ERROR;
+
+	sqlite3_bind_text(attach, 1, path, -1, SQLITE_STATIC);
+	status = sqlite3_step(attach) == SQLITE_DONE ? SUCCESS : ERROR;
+	sqlite3_finalize(attach);
+
+	if (status != SUCCESS) {
+		fprintf(stderr, PROGRAM_NAME ": %s\n", sqlite3_errmsg(conn));
+		return ERROR;
+	}
+
+	status = ERROR;
+
+	if ((end = prefix_end(strip)) == NULL ||
+		sqlite3_exec(conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		goto out;
+
+	if (sqlite3_exec(conn, remap_setup_sql, NULL, NULL, NULL) != SQLITE_OK)
+		goto out;
+
+	bulk = copy_step(conn, copy_bulk_sql, strip, add, end) == SQLITE_ROW;
+	if (bulk && (pause_tag_pairs(db) != SUCCESS ||
+				 pause_time_index(db) != SUCCESS))
+		goto out;
+
+	for (size_t i = 0; i < sizeof(copy_sql) / sizeof(*copy_sql); i++) {
+		sql = malloc(strlen(copy_sql[i]) + strlen(copy_range_sql) + 1);
+		if (sql == NULL)
+			goto out;
+
+		sprintf(sql, copy_sql[i], *strip != '\0' ? copy_range_sql : "1");
+		if (copy_step(conn, sql, strip, add, end) != SQLITE_DONE)
+			goto out;
+
+		free(sql);
+		sql = NULL;
+	}
+
+	timed = copy_step(conn, copy_timed_sql, strip, add, end) == SQLITE_ROW;
+	if (copy_step(conn, copy_file_tag_sql[timed], strip, add, end) != SQLITE_DONE)
+		goto out;
+
+	if (bulk && (rebuild_tag_pairs(db) != SUCCESS ||
+				 rebuild_time_index(db) != SUCCESS))
+		goto out;
+
+	if (sqlite3_exec(conn, "DELETE FROM temp.import_file;"
+					 "DELETE FROM temp.import_tag;"
+					 "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)
+		status = SUCCESS;
+
+	out:
+	if (status != SUCCESS && !sqlite3_get_autocommit(conn))
+		sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+
+	sqlite3_exec(conn, "DETACH other;", NULL, NULL, NULL);
+	free(sql);
+	free(end);
+
+	return status;
+}
+
+/* Bring every file and tag of the database at path into db, with prefix,
+ * "" or a path ending in a /, put before each of its paths. Files and tags
+ * already in db are matched by path and name.
+ */
+int ftag_merge_db(ftag_db *db, const char *path, const char *prefix)
+{
+	if (db == NULL || path == NULL || prefix == NULL)
+		return ERROR;
+
+	return copy_files(db, path, "", prefix);
+}
+
+/* Move the files of db whose paths start with prefix, a path ending in a
+ * /, to dst without it. They are copied to dst before they are removed
+ * from db, so a failure at worst leaves them in both.
+ */
+int ftag_split_db(ftag_db *db, const char *prefix, ftag_db *dst)
+{
+	static const char *remove_sql[] = {
+		"DELETE FROM file_tag WHERE file_id IN (SELECT id FROM file "
+		"WHERE relative_path >= ?1 AND relative_path < ?3);",
+		"DELETE FROM file WHERE relative_path >= ?1 AND relative_path < ?3;",
+		"DELETE FROM tag WHERE file_count = 0;",
+	};
+	sqlite3 *conn = NULL;
+	char *end = NULL;
+	int status = ERROR;
+
+	if (db == NULL || prefix == NULL || dst == NULL || ftag_db_path(db) == NULL ||
+		*prefix == '\0' || prefix[strlen(prefix) - 1] != '/')
+		return ERROR;
+
+	conn = ftag_db_sqlite(db);
+
+	if (copy_files(dst, ftag_db_path(db), prefix, "") != SUCCESS)
+		return ERROR;
+
+	if ((end = prefix_end(prefix)) == NULL ||
+		sqlite3_exec(conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		goto out;
+
+	for (size_t i = 0; i < sizeof(remove_sql) / sizeof(*remove_sql); i++)
+		if (copy_step(conn, remove_sql[i], prefix, "", end) != SQLITE_DONE)
+			goto out;
+
+	if (sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK)
+		status = SUCCESS;
+
+	out:
+	if (status != SUCCESS && !sqlite3_get_autocommit(conn))
+		sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+	free(end);
+
+	return status;
+}
+
+/***--- Interning ---***/
+
+/* Strings seen over and over in a bulk load, each mapped to its id once.
+ * The strings are copied into blocks of an arena that goes with the table,
+ * so adding one is no malloc of its own. The id is 0 until looked up, and
+ * set back to 0 when the row may have gone.
+ */
+
+#define ARENA_BLOCK (64 * 1024)
+// Past this many entries the table starts over, to bound its memory
+#define INTERN_MAX (1 << 20)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+struct intern_entry {
+	const char *str;
+	unsigned long long hash;
+	sqlite3_int64 id;
+};
+
+struct intern {
+	struct intern_entry *slots;
+	size_t mask;
+	size_t count;
+	// Entries kept before starting over, INTERN_MAX but in tests
+	size_t max;
+	struct arena_block *arena;
+};
+
+static char *arena_strdup(struct arena_block **arena, const char *str,
+						  size_t len)
+{
+	struct arena_block *block = *arena;
+	char *copy;
+
+	if (block == NULL || block->size - block->used <= len) {
+		size_t size = len < ARENA_BLOCK ? ARENA_BLOCK : len + 1;
+
+		block = malloc(sizeof(*block) + size);
+		if (block == NULL)
+			return NULL;
+
+		block->next = *arena;
+		block->used = 0;
+		block->size = size;
+		*arena = block;
+	}
+
+	copy = block->data + block->used;
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	block->used += len + 1;
+
+	return copy;
+}
+
+static void clear_intern(struct intern *table)
+{
+	size_t max = table->max;
+
+	while (table->arena != NULL) {
+		struct arena_block *next = table->arena->next;
+
+		free(table->arena);
+		table->arena = next;
+	}
+
+	free(table->slots);
+	memset(table, 0, sizeof(*table));
+	table->max = max;
+}
+
+static int grow_intern(struct intern *table)
+{
+	size_t size = table->slots == NULL ? 1024 : (table->mask + 1) * 2;
+	struct intern_entry *slots = calloc(size, sizeof(*slots));
+
+	if (slots == NULL)
+		return ERROR;
+
+	for (size_t i = 0; table->slots != NULL && i <= table->mask; i++) {
+		size_t k = table->slots[i].hash & (size - 1);
+
+		if (table->slots[i].str == NULL)
+			continue;
+
+		while (slots[k].str != NULL)
+			k = (k + 1) & (size - 1);
+		slots[k] = table->slots[i];
+	}
+
+	free(table->slots);
+	table->slots = slots;
+	table->mask = size - 1;
+
+	return SUCCESS;
+}
+
+/* The entry of str, added unless it is there when add, else NULL */
+static struct intern_entry *intern(struct intern *table, const char *str,
+								   int add)
+{
+	size_t len = strlen(str);
+	unsigned long long hash = fnv1a(str, len);
+	struct intern_entry *entry;
+
+	if (add && table->count >= table->max)
+		clear_intern(table);
+
+	// Kept at most three quarters full
+	if (add && (table->count + 1) * 4 > (table->mask + 1) * 3 &&
+		grow_intern(table) != SUCCESS)
+		return NULL;
+
+	if (table->slots == NULL)
+		return NULL;
+
+	for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		entry = &table->slots[i];
+
+		if (entry->str == NULL)
+			break;
+		if (entry->hash == hash && strcmp(entry->str, str) == 0)
+			return entry;
+	}
+
+	if (!add || (entry->str = arena_strdup(&table->arena, str, len)) == NULL)
+		return NULL;
+
+	entry->hash = hash;
+	entry->id = 0;
+	table->count++;
+
+	return entry;
+}
+
+/* Forget the id of str, if it has one */
+static void unintern(struct intern *table, const char *str)
+{
+	struct intern_entry *entry = intern(table, str, 0);
+
+	if (entry != NULL)
+		entry->id = 0;
+}
+
+/***--- Change log ---***/
+
+/* Every change to file_tag and to tag names is logged by the triggers of
+ * change_log, in sequence, by path and name. Replaying the changes after
+ * some point brings a copy of the database made then up to date, in time
+ * proportional to the changes. One change per line, escaped as FORMAT_TSV:
+ *
+ *   SEQ  tag    PATH  TAG  [TIME]
+ *   SEQ  untag  PATH  TAG
+ *   SEQ  retag  OLD   NEW
+ *
+ * TIME is when the association was made, left out when not known, and
+ * then replayed as made now.
+ */
+
+enum change_op {
+	CHANGE_TAG,
+	CHANGE_UNTAG,
+	CHANGE_RETAG,
+	CHANGE_COUNT
+};
+
+static const char *change_names[CHANGE_COUNT] = { "tag", "untag", "retag" };
+
+/* Statements replaying each kind of change, run in order with ?1 and ?2
+ * bound to its two fields, but for tag to the ids of its file and tag, and
+ * ?3 to its time. Files and tags left unused go, as with untag.
+ */
+static const char *change_sql[CHANGE_COUNT][3] = {
+	{ "INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) "
+	  "VALUES (?1, ?2, ?3);", NULL, NULL },
+	{ "DELETE FROM file_tag WHERE file_id = (SELECT id FROM file WHERE "
+	  "relative_path = ?1) AND tag_id = (SELECT id FROM tag WHERE name = ?2);",
+	  "DELETE FROM tag WHERE name = ?2 AND file_count = 0;",
+	  "DELETE FROM file WHERE relative_path = ?1 AND "
+	  "NOT EXISTS (SELECT 1 FROM file_tag WHERE file_id = file.id);" },
+	{ "UPDATE tag SET name = ?2 WHERE name = ?1;", NULL, NULL },
+};
+
+/* Adding and then finding the id of a path or name of a tag change, with
+ * ?1 bound to it, when it is not interned yet
+ */
+static const char *resolve_sql[2][2] = {
+	{ "INSERT OR IGNORE INTO file (relative_path) VALUES (?1);",
+	  "SELECT id FROM file WHERE relative_path = ?1;" },
+	{ "INSERT OR IGNORE INTO tag (name) VALUES (?1);",
+	  "SELECT id FROM tag WHERE name = ?1;" },
+};
+
+/* Sequence number of the latest change, 0 if there are none, -1 on error */
+long long ftag_latest_change(ftag_db *db)
+{
+	sqlite3_stmt *prep = NULL;
+	long long seq = -1;
+
+	// Unlike max(seq) this never goes back, even if the log is emptied
+	if (sqlite3_prepare_v2(ftag_db_sqlite(db), "SELECT coalesce((SELECT seq FROM "
+						   "sqlite_sequence WHERE name = 'change_log'), 0);",
+						   -1, &prep, NULL) == SQLITE_OK &&
+		sqlite3_step(prep) == SQLITE_ROW)
+		seq = sqlite3_column_int64(prep, 0);
+
+	sqlite3_finalize(prep);
+
+	return seq;
+}
+
+/* Forget the changes numbered below before, which the log otherwise keeps
+ * forever. Sequence numbers go on from where they were.
+ */
+int ftag_prune_changes(ftag_db *db, long long before)
+{
+	sqlite3_stmt *prep = NULL;
+	int status = ERROR;
+
+	if (sqlite3_prepare_v2(ftag_db_sqlite(db), "DELETE FROM change_log WHERE "
+						   "seq < ?1;", -1, &prep, NULL) == SQLITE_OK) {
+		sqlite3_bind_int64(prep, 1, before);
+		if (sqlite3_step(prep) == SQLITE_DONE)
+			status = SUCCESS;
+	}
+
+	sqlite3_finalize(prep);
+
+	return status;
+}
+
+/* Write every change after since to fp, as of one moment. ERROR if some of
+ * them were pruned.
+ */
+int ftag_write_changes(ftag_db *db, FILE *fp, long long since)
+{
+	static const char *sql = "SELECT seq, op, "
+	"CASE op WHEN 'retag' THEN tag ELSE file END, "
+	"CASE op WHEN 'retag' THEN new_tag ELSE tag END, "
+	"CASE op WHEN 'tag' THEN tagged_at END "
+	"FROM change_log WHERE seq > ?1 ORDER BY seq;";
+	// Numbers are never skipped, so a gap after since was pruned
+	static const char *pruned_sql = "SELECT coalesce((SELECT min(seq) FROM "
+	"change_log), (SELECT seq + 1 FROM sqlite_sequence WHERE name = "
+	"'change_log'), 1) > ?1 + 1 AND coalesce((SELECT seq FROM sqlite_sequence "
+	"WHERE name = 'change_log'), 0) > ?1;";
+	sqlite3 *conn = ftag_db_sqlite(db);
+	sqlite3_stmt *prep = NULL;
+	int status = ERROR;
+	int step;
+
+	if (fp == NULL)
+		return ERROR;
+
+	if (sqlite3_exec(conn, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	if (sqlite3_prepare_v2(conn, pruned_sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	sqlite3_bind_int64(prep, 1, since);
+	if (sqlite3_step(prep) != SQLITE_ROW || sqlite3_column_int(prep, 0) != 0)
+		goto out;
+
+	sqlite3_finalize(prep);
+	if (sqlite3_prepare_v2(conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	sqlite3_bind_int64(prep, 1, since);
+
+	while ((step = sqlite3_step(prep)) == SQLITE_ROW) {
+		const char *first = (const char *) sqlite3_column_text(prep, 2);
+		const char *second = (const char *) sqlite3_column_text(prep, 3);
+
+		if (first == NULL || second == NULL)
+			continue;
+
+		fprintf(fp, "%lld\t%s\t", (long long) sqlite3_column_int64(prep, 0),
+				(const char *) sqlite3_column_text(prep, 1));
+		write_tsv_string(fp, first);
+		fputc('\t', fp);
+		write_tsv_string(fp, second);
+		if (sqlite3_column_type(prep, 4) != SQLITE_NULL)
+			fprintf(fp, "\t%lld", (long long) sqlite3_column_int64(prep, 4));
+		fputc('\n', fp);
+	}
+
+	if (step == SQLITE_DONE && !ferror(fp))
+		status = SUCCESS;
+
+	out:
+	sqlite3_finalize(prep);
+	sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+
+	return status;
+}
+
+/* Split a line of ftag_write_changes into its fields, unescaped in place.
+ * *at is the time of a tag, or -1 when it has none.
+ */
+static int parse_change(char *line, sqlite3_int64 *seq, enum change_op *op,
+						char **first, char **second, sqlite3_int64 *at)
+{
+	char *field[5] = { line, NULL, NULL, NULL, NULL };
+
+	for (int i = 1; i < 4; i++) {
+		field[i] = strchr(field[i - 1], '\t');
+		if (field[i] == NULL)
+			return ERROR;
+		*field[i]++ = '\0';
+	}
+
+	if ((field[4] = strchr(field[3], '\t')) != NULL)
+		*field[4]++ = '\0';
+
+	if ((field[4] != NULL && (strchr(field[4], '\t') != NULL ||
+							  parse_id(field[4], at) != SUCCESS ||
+							  strcmp(field[1], change_names[CHANGE_TAG]) != 0)) ||
+		parse_id(field[0], seq) != SUCCESS ||
+		unescape_tsv(field[2]) != SUCCESS || unescape_tsv(field[3]) != SUCCESS)
+		return ERROR;
+
+	if (field[4] == NULL)
+		*at = -1;
+
+	for (int i = 0; i < CHANGE_COUNT; i++) {
+		if (strcmp(field[1], change_names[i]) == 0) {
+			*op = i;
+			*first = field[2];
+			*second = field[3];
+			return SUCCESS;
+		}
+	}
+
+	return ERROR;
+}
+
+/* The id of str through table, first adding its row with resolve if it is
+ * not known. 0 on error.
+ */
+static sqlite3_int64 resolve_id(sqlite3 *conn, sqlite3_stmt **resolve,
+								struct intern *table, const char *str)
+{
+	struct intern_entry *entry = intern(table, str, 1);
+	sqlite3_int64 id = 0;
+
+	// Without memory for the entry it is still found, just not kept
+	if (entry != NULL && entry->id != 0)
+		return entry->id;
+
+	sqlite3_bind_text(resolve[0], 1, str, -1, SQLITE_STATIC);
+	if (sqlite3_step(resolve[0]) == SQLITE_DONE) {
+		if (sqlite3_changes(conn) > 0) {
+			id = sqlite3_last_insert_rowid(conn);
+		} else {
+			sqlite3_bind_text(resolve[1], 1, str, -1, SQLITE_STATIC);
+			if (sqlite3_step(resolve[1]) == SQLITE_ROW)
+				id = sqlite3_column_int64(resolve[1], 0);
+			sqlite3_reset(resolve[1]);
+		}
+	}
+	sqlite3_reset(resolve[0]);
+
+	if (entry != NULL)
+		entry->id = id;
+
+	return id;
+}
+
+/* Replay the changes in fp on db, all in one transaction, and set *last to
+ * the sequence number of the last one, or leave it if there were none
+ */
+int ftag_apply_changes(ftag_db *db, FILE *fp, long long *last)
+{
+	return replay_changes(db, fp, last, INTERN_MAX);
+}
+
+/* ftag_apply_changes, interning at most intern_max paths and names at a time */
+int replay_changes(ftag_db *db, FILE *fp, long long *last, size_t intern_max)
+{
+	sqlite3 *conn = ftag_db_sqlite(db);
+	sqlite3_stmt *replay[CHANGE_COUNT][3];
+	sqlite3_stmt *resolve[2][2];
+	struct intern names[2];
+	sqlite3_int64 seq = 0, prev = 0;
+	sqlite3_int64 now = (sqlite3_int64) time(NULL);
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int status = ERROR;
+
+	memset(replay, 0, sizeof(replay));
+	memset(resolve, 0, sizeof(resolve));
+	memset(names, 0, sizeof(names));
+	names[0].max = names[1].max = intern_max > 0 ? intern_max : 1;
+
+	if (fp == NULL || last == NULL)
+		return ERROR;
+
+	if (sqlite3_exec(conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	for (int i = 0; i < CHANGE_COUNT; i++)
+		for (int k = 0; k < 3; k++)
+			if (change_sql[i][k] != NULL && sqlite3_prepare_v2(conn,
+					change_sql[i][k], -1, &replay[i][k], NULL) != SQLITE_OK)
+				goto out;
+
+	for (int i = 0; i < 2; i++)
+		for (int k = 0; k < 2; k++)
+			if (sqlite3_prepare_v2(conn, resolve_sql[i][k], -1, &resolve[i][k],
+								   NULL) != SQLITE_OK)
+				goto out;
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		enum change_op op;
+		char *first = NULL, *second = NULL;
+		sqlite3_int64 at;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (len == 0)
+			continue;
+
+		// Changes only make sense in the order they were made
+		if (parse_change(line, &seq, &op, &first, &second, &at) != SUCCESS ||
+			seq <= prev) {
+			fprintf(stderr, PROGRAM_NAME ": change after %lld: malformed\n",
+					(long long) prev);
+			goto out;
+		}
+
+		for (int k = 0; k < 3 && replay[op][k] != NULL; k++) {
+			sqlite3_stmt *prep = replay[op][k];
+			int step;
+
+			if (op == CHANGE_TAG) {
+				sqlite3_int64 file_id = resolve_id(conn, resolve[0], &names[0],
+												   first);
+				sqlite3_int64 tag_id = resolve_id(conn, resolve[1], &names[1],
+												  second);
+
+				if (file_id == 0 || tag_id == 0) {
+					fprintf(stderr, PROGRAM_NAME ": change %lld: %s\n",
+							(long long) seq, sqlite3_errmsg(conn));
+					goto out;
+				}
+
+				sqlite3_bind_int64(prep, 1, file_id);
+				sqlite3_bind_int64(prep, 2, tag_id);
+				// Changes logged before times were kept are made now
+				sqlite3_bind_int64(prep, 3, at >= 0 ? at : now);
+			} else {
+				sqlite3_bind_text(prep, 1, first, -1, SQLITE_STATIC);
+				sqlite3_bind_text(prep, 2, second, -1, SQLITE_STATIC);
+			}
+
+			step = sqlite3_step(prep);
+			sqlite3_reset(prep);
+
+			if (step != SQLITE_DONE) {
+				fprintf(stderr, PROGRAM_NAME ": change %lld: %s\n",
+						(long long) seq, sqlite3_errmsg(conn));
+				goto out;
+			}
+
+			// Rows deleted or renamed take their interned ids with them
+			if (op == CHANGE_UNTAG && k > 0 && sqlite3_changes(conn) > 0)
+				unintern(&names[k == 1], k == 1 ? second : first);
+		}
+
+		if (op == CHANGE_RETAG) {
+			unintern(&names[1], first);
+			unintern(&names[1], second);
+		}
+
+		prev = seq;
+	}
+
+	if (ferror(fp))
+		goto out;
+
+	if (sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK) {
+		status = SUCCESS;
+		if (prev > 0)
+			*last = prev;
+	}
+
+	out:
+	for (int i = 0; i < CHANGE_COUNT; i++)
+		for (int k = 0; k < 3; k++)
+			sqlite3_finalize(replay[i][k]);
+	for (int i = 0; i < 2; i++) {
+		for (int k = 0; k < 2; k++)
+			sqlite3_finalize(resolve[i][k]);
+		clear_intern(&names[i]);
+	}
+	free(line);
+
+	if (status != SUCCESS && !sqlite3_get_autocommit(conn))
+		sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+
+	return status;
+}
@@ -0,0 +1,130 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ * 
+ */
+
+/*
+ This is a part of ftag.
+ 
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FTAG_INTERNAL_H
+#define FTAG_INTERNAL_H
+
+/* Internals of libftag shared with the ftag unit tests, not part of the
+ * library's interface.
+ */
+
+#include "ftag.h"
+
+#ifdef __GNUC__
+#pragma GCC visibility push(hidden)
+#endif
+
+/* The time now in unix seconds as SQL, for file_tag.tagged_at. Without a %
+ * so that it can go in statements used as format strings too. Each run of a
+ * statement reads the clock, so those run once per record bind it instead.
+ */
+#define SQL_NOW "CAST((julianday('now') - 2440587.5) * 86400 AS INTEGER)"
+
+extern const int schema_version;
+
+extern char *find_db_dir(const char *fn);
+extern char **find_db_dirs(const char *fn, int showhidden);
+extern void free_db_dirs(char **dirs);
+extern int get_schema_version(ftag_db *db);
+extern int pause_tag_pairs(ftag_db *db);
+extern int rebuild_tag_pairs(ftag_db *db);
+extern int pause_change_log(ftag_db *db);
+extern int fill_change_log(ftag_db *db);
+extern int pause_time_index(ftag_db *db);
+extern int rebuild_time_index(ftag_db *db);
+extern int pause_indexes(ftag_db *db);
+extern int rebuild_indexes(ftag_db *db);
+extern int *get_tag_ids(ftag_db *db, int tagc, const char **tagv);
+extern int order_ids_by_count(ftag_db *db, int idc, int *idv);
+extern step_t *filter_ids_any_tag(ftag_db *db, int tagc, int *tagv);
+extern step_t *filter_ids_all_tags(ftag_db *db, int tagc, int *tagv);
+extern step_t *filter_all(ftag_db *db);
+extern int tag_is_pattern(const char *tag);
+extern size_t tag_pattern_prefix(const char *pattern);
+extern int tag_pattern_match(const char *pattern, const char *name, int showhidden);
+extern unsigned long long fnv1a(const char *buf, size_t len);
+extern int replay_changes(ftag_db *db, FILE *fp, long long *last,
+                          size_t intern_max);
+
+/* The tag directories of ftag mount, see mount-index.c */
+
+#define MOUNT_DIR_CACHE 64
+#define MOUNT_MAX_DEPTH 32
+
+struct mount_index {
+	// Relative paths in order, files are known by their place here
+	int nfiles;
+	char **files;
+
+	// Names in order, and the sorted places of the files of each
+	int ntags;
+	char **tags;
+	int **postings;
+	int *counts;
+
+	int data_version;
+	unsigned generation;
+};
+
+/* A directory's files, found so far in order of path */
+struct mount_dir {
+	char *path;
+	unsigned generation;
+	unsigned used;
+
+	int ntags;
+	int tags[MOUNT_MAX_DEPTH];
+
+	int *found;
+	int nfound, size;
+	// Next place in the postings of tags[0] to check, -1 when all are
+	int next;
+};
+
+/* Zeroed to start, loaded by mount_refresh */
+struct mount_tree {
+	int showhidden;
+
+	struct mount_index index;
+	struct mount_dir cache[MOUNT_DIR_CACHE];
+	unsigned tick;
+};
+
+extern int mount_refresh(struct mount_tree *tree, struct sqlite3 *conn);
+extern void mount_free_tree(struct mount_tree *tree);
+extern char *mount_encode(const char *name);
+extern char *mount_decode(const char *entry, size_t len);
+extern int mount_visible(const struct mount_tree *tree, const char *name);
+extern int mount_resolve(struct mount_tree *tree, const char *path, int *tags,
+                         const char **last, size_t *lastlen);
+extern struct mount_dir *mount_get_dir(struct mount_tree *tree, const char *path);
+extern int mount_dir_file(struct mount_tree *tree, struct mount_dir *dir, int i);
+extern int mount_entry_file(struct mount_tree *tree, const int *tags, int ntags,
+                            const char *entry, size_t len);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#endif
@@ -24,40 +24,53 @@
 
 /***--- Includes ---***/
 
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
 #include <getopt.h>
 #include <sqlite3.h>
 #include "CuTest.h"
 #include "ftag.h"
+#include "ftag-internal.h"
 
 /***--- Constants and globals ---***/
 
-#ifndef DB_FILENAME
-#define DB_FILENAME ".ftag.sqlite3"
-#endif
-
 #define PROGRAM_NAME "ftag"
 
-#define FILTER_ANY_TAG  (1<<0)
-#define FILTER_ALL_TAGS (1<<1)
-#define FILTER_ALL      (1<<2)
-
 enum mode {
 	MODE_NONE,
 	MODE_TAG_FILE,
 	MODE_FILTER,
-	MODE_LIST
+	MODE_LIST,
+	MODE_UNTAG,
+	MODE_RETAG,
+	MODE_MERGE,
+	MODE_SNAPSHOT,
+	MODE_EXPORT,
+	MODE_IMPORT,
+	MODE_RELATED,
+	MODE_HAS,
+	MODE_MERGE_DB,
+	MODE_SPLIT_DB,
+	MODE_CHANGES,
+	MODE_APPLY,
+	MODE_XATTR_SYNC,
+	MODE_MOUNT
 };
 
-static sqlite3 *dbconn = NULL;
-
-int showhidden = 0;
+// Set by -s, filter and list then read it instead of the database
+static ftag_snapshot *snapshot = NULL;
 
 /***--- Util ---***/
 
@@ -65,21 +78,106 @@ static void help(void)
 {
 	static const char *str = "Usage: " PROGRAM_NAME " [OPTIONS] MODE ARG...\n"
 	"  " PROGRAM_NAME " [OPTIONS] file FILE TAG...\n"
-	"  " PROGRAM_NAME " [OPTIONS] filter [TAG...]\n"
-	"  " PROGRAM_NAME " [OPTIONS] list [FILE]\n"
-	"\n"
-	"Options:\n"
+	"  " PROGRAM_NAME " [OPTIONS] file -f FILE... -- TAG...\n"
+	"  " PROGRAM_NAME " [OPTIONS] file --files-from=LIST [-0] TAG...\n"
+	"  " PROGRAM_NAME " [OPTIONS] filter [-AC] [-j N [-u]] [TAG...]\n"
+	"  " PROGRAM_NAME " [OPTIONS] filter [-A] [-n N] [-k KEY] [-o ORDER] [TAG...]\n"
+	"  " PROGRAM_NAME " [OPTIONS] filter --count [-A] [TAG...]\n"
+	"  " PROGRAM_NAME " [OPTIONS] filter --recursive [-A] [TAG...]\n"
+	"  " PROGRAM_NAME " [OPTIONS] filter [-A] [-S TIME] [-U TIME] [TAG...]\n"
+	"  " PROGRAM_NAME " [OPTIONS] has FILE TAG\n"
+	"  " PROGRAM_NAME " [OPTIONS] list [-c] [FILE | -m PATTERN | -n N | -M N | -R TIME]\n"
+	"  " PROGRAM_NAME " [OPTIONS] related [-c] [-n N] TAG\n"
+	"  " PROGRAM_NAME " [OPTIONS] untag FILE TAG...\n"
+	"  " PROGRAM_NAME " [OPTIONS] retag OLD NEW\n"
+	"  " PROGRAM_NAME " [OPTIONS] merge TAG INTO\n"
+	"  " PROGRAM_NAME " [OPTIONS] snapshot [FILE]\n"
+	"  " PROGRAM_NAME " [OPTIONS] export [--format=FORMAT] [FILE]\n"
+	"  " PROGRAM_NAME " [OPTIONS] import [--format=FORMAT] [FILE]\n"
+	"  " PROGRAM_NAME " [OPTIONS] merge-db OTHER\n"
+	"  " PROGRAM_NAME " [OPTIONS] split-db SUBDIR NEWDB\n"
+	"  " PROGRAM_NAME " [OPTIONS] changes [--since SEQ | --latest] [FILE]\n"
+	"  " PROGRAM_NAME " [OPTIONS] changes --prune-before SEQ\n"
+	"  " PROGRAM_NAME " [OPTIONS] apply [FILE]\n"
+	"  " PROGRAM_NAME " [OPTIONS] xattr-sync [--push | --pull] [-j N]\n"
+	"  " PROGRAM_NAME " [OPTIONS] mount [-af] MOUNTPOINT\n"
+	"\n";
+	/* Split in two to stay within the string length C99 guarantees */
+	static const char *options = "Options:\n"
 	"  -a, --show-hidden    show all files/tags, even those beginning with a .\n"
 	"  -d, --database-name  specify database name\n"
 	"  -p, --database-dir   force database directory\n"
-	"  -v                   increase output verbosity (can be used multiple times)\n"
+	"  -s, --snapshot       filter and list read the snapshot FILE, not the database\n"
+	"  -v                   increase output verbosity (can be used multiple times),\n"
+	"                       -vv adds timings and SQLite counters, -vvv query plans\n"
+	"  --mem-budget         memory for caching and sorting, eg. 256M, beyond which\n"
+	"                       large results are sorted through temporary files\n"
+	"  -T, --temp-dir       directory for those files, eg. a tmpfs\n"
     "  -t, --test           run unit tests and exit\n"
 	"  --help               show this help\n"
 	"\n"
+	"File options:\n"
+	"  -f, --files          tag every FILE before -- with every TAG after it\n"
+	"  -F, --files-from     read the files to tag from LIST, one per line (- for stdin)\n"
+	"  -0, --null           files in LIST are NUL terminated instead\n"
+	"\n"
+	"Filter options:\n"
+	"  -A, --all-tags       only show files tagged with every TAG\n"
+	"  -j, --jobs           search with N threads, each on its own connection\n"
+	"  -u, --unordered      with -j, print files as they are found, unsorted\n"
+	"  -C, --cache          reuse the result while the database is unchanged\n"
+	"  -n, --limit          print at most N files, then the KEY of the last on\n"
+	"                       standard error if there may be more\n"
+	"  -k, --after          continue after the file with KEY\n"
+	"  -o, --order          path (the default) or id, the order and KEY of pages\n"
+	"  -c, --count          print the number of files instead\n"
+	"  -r, --recursive      search every database above and below the current\n"
+	"                       directory too, printing paths relative to it\n"
+	"  -S, --since          only files tagged at TIME or later\n"
+	"  -U, --until          only files tagged before TIME\n"
+	"\n"
+	"List options:\n"
+	"  -c, --counts         show the number of files tagged with each tag\n"
+	"  -m, --match          only show the tags matching PATTERN\n"
+	"  -n, --top            show the N most used tags, most used first\n"
+	"  -M, --min-count      show the tags tagging at least N files, most used first\n"
+	"  -R, --recent         show the tags used since TIME, most recently used first\n"
+	"\n"
+	"A TAG to filter by may be a pattern like proj-* or 20??, standing for\n"
+	"every tag it matches as in the shell. A TAG also stands for the tags\n"
+	"below it, eg. client/acme/invoices for client/acme.\n"
+	"\n"
+	"A TIME is seconds since 1970, or a number and one of s, m, h, d or w\n"
+	"for that long ago, eg. 90m.\n"
+	"\n"
+	"Related options:\n"
+	"  -c, --counts         show the number of files shared with TAG\n"
+	"  -n, --limit          show at most N tags, 0 for all (default 10)\n"
+	"\n"
+	"Xattr-sync options:\n"
+	"  -P, --push           only write changed tags to user.tags attributes\n"
+	"  -G, --pull           only take tags from user.tags attributes\n"
+	"  -j, --jobs           make the system calls from N threads (default 4)\n"
+	"\n"
+	"Mount options:\n"
+	"  -a, --show-hidden    show files and tags beginning with a . too\n"
+	"  -f, --foreground     stay in the foreground until unmounted\n"
+	"\n"
+	"Changes options:\n"
+	"  -S, --since          only the changes after SEQ\n"
+	"  -l, --latest         print the number of the latest change instead\n"
+	"  --prune-before       delete the changes before SEQ, the log keeps every\n"
+	"                       change until then\n"
+	"\n"
+	"Export and import options:\n"
+	"  -f, --format         jsonl (the default), tsv or nul, FILE defaults to\n"
+	"                       standard output or input\n"
+	"\n"
 	"Report bugs to jacob.wahlgren@gmail.com.\n"
 	"This software is licensed under the GNU General public license.\n"
 	"Copyright 2014, 2015 Jacob Wahlgren.\n";
 	fputs(str, stderr);
+	fputs(options, stderr);
 }
 
 static void usage(void)
@@ -90,423 +188,534 @@ static void usage(void)
 	fputs(str, stderr);
 }
 
-/* Ascend to the first directory containing a file fn, or stay at the current dir */
-static int chdir_to_db(const char *fn)
+/***--- Entry points ---***/
+
+/* Restart getopt to parse a mode's own options, argv[0] being the mode name */
+static void reset_getopt(void)
 {
-	// getcwd returns null if path is too long, the only one char path is /
-	char buf[2];
-    int startdir;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+	extern int optreset;
+	optreset = 1;
+	optind = 1;
+#else
+	optind = 0;
+#endif
+}
 
-    if (fn == NULL)
-        return ERROR;
+/* -a of filter and list, for whichever of db and snapshot is in use */
+static void show_hidden(ftag_db *db)
+{
+	if (snapshot != NULL)
+		ftag_snapshot_show_hidden(snapshot, 1);
+	else
+		ftag_set_show_hidden(db, 1);
+}
 
-    startdir = open(".", O_RDONLY);
+static int main_tag_file(ftag_db *db, int argc, char **argv)
+{
+	char *filesfrom = NULL;
+	int multiple = 0;
+	int delim = '\n';
+	int chr = 0;
+	int status = ERROR;
 
-	int fchdir(int);
+	static struct option longopts[] = {
+		{"files", no_argument, 0, 'f'},
+		{"files-from", required_argument, 0, 'F'},
+		{"null", no_argument, 0, '0'},
+		{0, 0, 0, 0}
+	};
 
-	while (1) {
-		if (access(fn, R_OK) == 0)
-			break;
+	assert(argv != NULL);
 
-		if (getcwd(buf, 2) != NULL) {
-			fchdir(startdir);
-			close(startdir);
-			
-			return ERROR;
+	// Stop at the first file, tags may well begin with a -
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "+fF:0", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'f':
+				multiple = 1;
+				break;
+			case 'F':
+				filesfrom = optarg;
+				break;
+			case '0':
+				delim = '\0';
+				break;
+			default:
+				usage();
+				return ERROR;
 		}
-
-		chdir("..");
 	}
-	close(startdir);
-
-	return SUCCESS;
-}
 
-/***--- SQLite wrappers and helpers ---***/
+	argc -= optind;
+	argv += optind;
 
-int tag_file(const char *file, const char *tag)
-{
-	static const char *sql_str =
-    "BEGIN;"
-    "INSERT OR IGNORE INTO tag (name) VALUES (:tag);"
-    "INSERT OR IGNORE INTO file (relative_path) VALUES (:file);"
-    "INSERT INTO file_tag (file_id, tag_id) SELECT file.id, tag.id FROM "
-    "file, tag WHERE file.relative_path = :file AND tag.name = :tag;"
-    "COMMIT;"
-    ;
+	if (filesfrom != NULL) {
+		FILE *fp = strcmp(filesfrom, "-") == 0 ? stdin : fopen(filesfrom, "r");
 
-	sqlite3_stmt *sql_prep = NULL;
-    const char *sql_unread = sql_str;
+		if (fp == NULL) {
+			fprintf(stderr, PROGRAM_NAME ": failed to open '%s'\n", filesfrom);
+			return ERROR;
+		} else if (argc < 1) {
+			usage();
+			return ERROR;
+		}
 
-    if (file == NULL || tag == NULL)
-        return ERROR;
+		status = ftag_tag_files_from(db, fp, delim, argc, (const char **) argv);
 
-    // Prepare, bind and execute one statement at a time
-    while (sql_unread < sql_str + strlen(sql_str)) {
-        int status = sqlite3_prepare_v2(dbconn, sql_unread, -1, &sql_prep, &sql_unread);
-        if (status != SQLITE_OK)
-            return ERROR;
+		if (fp != stdin)
+			fclose(fp);
+	} else if (multiple) {
+		// FILE... -- TAG...
+		int filec = 0;
 
-        // Is 0 if parameter doesn't exist in this statement
-        int file_index = sqlite3_bind_parameter_index(sql_prep, ":file");
-        int tag_index = sqlite3_bind_parameter_index(sql_prep, ":tag");
+		while (filec < argc && strcmp(argv[filec], "--") != 0)
+			filec++;
 
-        if (file_index > 0)
-            if (sqlite3_bind_text(sql_prep, file_index, file, -1, SQLITE_STATIC)
-                != SQLITE_OK)
-                return ERROR;
+		if (filec == 0 || filec >= argc - 1) {
+			usage();
+			return ERROR;
+		}
 
-        if (tag_index > 0)
-            if (sqlite3_bind_text(sql_prep, tag_index, tag, -1, SQLITE_STATIC)
-                != SQLITE_OK)
-                return ERROR;
+		status = ftag_tag_files(db, filec, (const char **) argv,
+						   argc - filec - 1, (const char **) argv + filec + 1);
+	} else {
+		if (argc < 2) {
+			usage();
+			return ERROR;
+		}
 
-        if (sqlite3_step(sql_prep) != SQLITE_DONE)
-            return ERROR;
+		status = ftag_tag_files(db, 1, (const char **) argv,
+						   argc - 1, (const char **) argv + 1);
+	}
 
-        sqlite3_finalize(sql_prep);
-        sql_prep = NULL;
-    }
+	if (status == ERROR)
+		fprintf(stderr, PROGRAM_NAME ": error tagging file\n");
 
-    return SUCCESS;
+	return status;
 }
 
-const char *step_result(step_t *stmt)
+static int print_row(const char *row, void *arg)
 {
-	int status;
-
-	top:
-	status = sqlite3_step(stmt);
-
-	if (status == SQLITE_ROW) {
-		const char *str = (char *) sqlite3_column_text(stmt, 0);
-
-		if (!showhidden && *str == '.')
-			goto top;
-
-		return str;
-	} else if (status == SQLITE_DONE)
-		return NULL;
-	else {
-		fprintf(stderr, PROGRAM_NAME ": error stepping result\n");
-		exit(ERROR);
-	}
+	(void) arg;
+	return puts(row) == EOF;
 }
 
-void free_step(step_t *stmt)
+/* Free step, saying so if stepping it failed */
+static int free_step(step_t *step)
 {
-#ifndef NDEBUG
-	int status =
-#endif
-	sqlite3_finalize(stmt);
+	if (ftag_free_step(step) == SUCCESS)
+		return SUCCESS;
 
-	assert(status == SQLITE_OK);
+	fprintf(stderr, PROGRAM_NAME ": error stepping result\n");
+	return ERROR;
 }
 
-// Get id of all tags. If tag doesn't exist give value -1 (doesn't return
-// any rows)
-int *get_tag_ids(int tagc, const char **tagv)
+/* Print every row of step, then free it */
+static int print_step(step_t *step)
 {
-	static const char *sql = "SELECT id FROM tag WHERE name=?;";
-	int *buf;
-
-	if (tagv == NULL)
-		return NULL;
+	const char *str = NULL;
 
-	buf = malloc(sizeof(int) * tagc);
-	if (buf == NULL)
-		return NULL;
-
-	for (int i = 0; i < tagc; i++) {
-		sqlite3_stmt *prep;
-
-		sqlite3_prepare_v2(dbconn, sql, -1, &prep, NULL);
-
-		if (prep == NULL)
-			return NULL;
-
-		if (sqlite3_bind_text(prep, 1, tagv[i], -1, SQLITE_STATIC) != SQLITE_OK)
-			goto error;
-
-		switch (sqlite3_step(prep)) {
-			case SQLITE_DONE:
-				buf[i] = -1;
-				continue;
-			case SQLITE_ROW:
-				break;
-			default:
-				goto error;
-		}
-
-		int count = sqlite3_column_count(prep);
-
-		if (count == 0) {
-			goto error;
-		} if (sqlite3_column_count(prep) > 1) {
-			fprintf(stderr, PROGRAM_NAME ": database corrupted\n");
-			goto error;
-		} else {
-			buf[i] = sqlite3_column_int(prep, 0);
-		}
-
-		continue;
+	if (step == NULL)
+		return ERROR;
 
-		error:
-		if (prep != NULL)
-			sqlite3_finalize(prep);
-		if (buf != NULL)
-			free(buf);
-		return NULL;
-	}
+	while ((str = ftag_step_result(step)) != NULL)
+		puts(str);
 
-	return buf;
+	return free_step(step);
 }
 
-step_t *filter_ids_any_tag(int tagc, int *tagv)
+/* Print a page of files, then the key to continue after if it was full */
+static int print_page(ftag_db *db, int tagc, const char **tagv, int flags,
+					  int order, const char *after, int limit)
 {
-	static const char *sql_base =
-	"SELECT DISTINCT f.relative_path FROM file AS f, file_tag AS x "
-	"WHERE f.id = x.file_id AND x.tag_id = ?";
-	char *sql_union = NULL;
-	sqlite3_stmt *prep = NULL;
-
-	sql_union = malloc(strlen(sql_base) * tagc +
-					   strlen(" UNION ") * (tagc - 1) + 1 + 1);
-	if (sql_union == NULL)
-		return NULL;
-
-	strcpy(sql_union, sql_base);
-	for (int i = 1; i < tagc; i++) {
-		strcat(sql_union, " UNION ");
-		strcat(sql_union, sql_base);
-	}
-	strcat(sql_union, ";");
+	step_t *step = ftag_filter_page(db, tagc, tagv, flags, order, after, limit);
+	const char *str = NULL;
+	char *key = NULL;
+	int rows = 0;
 
+	if (step == NULL)
+		return ERROR;
 
-	if (sqlite3_prepare_v2(dbconn, sql_union, -1, &prep, NULL) != SQLITE_OK)
-		prep = NULL;
+	while ((str = ftag_step_result(step)) != NULL) {
+		puts(str);
+		rows++;
 
-	for (int i = 0; i < tagc; i++) {
-		if (sqlite3_bind_int(prep, i+1, tagv[i]) != SQLITE_OK) {
-			sqlite3_finalize(prep);
-			prep = NULL;
-			break;
+		// The row is gone once the query is done
+		if (limit > 0 && rows == limit) {
+			free(key);
+			key = strdup(ftag_step_result_key(step));
 		}
 	}
 
-	free(sql_union);
+	if (key != NULL)
+		fprintf(stderr, "next: %s\n", key);
+
+	free(key);
 
-	return prep;
+	return free_step(step);
 }
 
-step_t *filter_all(void)
+static int add_row(const char *row, void *arg)
 {
-	static const char *sql = "SELECT DISTINCT relative_path FROM file;";
-	sqlite3_stmt *prep = NULL;
-
-	if (sqlite3_prepare_v2(dbconn, sql, -1, &prep, NULL) != SQLITE_OK)
-		return NULL;
-	else
-		return prep;
+	(void) row;
+	++*(long long *) arg;
+	return 0;
 }
 
-step_t *filter_strs(int tagc, const char **tagv, int flags)
+static int print_count(ftag_db *db, int tagc, const char **tagv, int flags)
 {
-	step_t *step = NULL;
-
-	if (flags == 0)
-		return NULL;
-
-	if (flags & FILTER_ALL) {
-		step = filter_all();
-	} else {
-		int *ids = get_tag_ids(tagc, tagv);
-		if (ids == NULL)
-			return NULL;
+	long long count = 0;
+	int status;
 
-		if (flags & FILTER_ANY_TAG)
-			step = filter_ids_any_tag(tagc, ids);
+	// A snapshot has no counts of its own but is quick to walk
+	if (snapshot != NULL)
+		status = ftag_snapshot_filter(snapshot, tagc, tagv, flags, add_row, &count);
+	else
+		status = ftag_filter_count(db, tagc, tagv, flags, &count);
 
-		free(ids);
-	}
+	if (status == SUCCESS)
+		printf("%lld\n", count);
 
-	return step;
+	return status;
 }
 
-step_t *list_by_file(const char *path)
+/* The number in str if it is at least min, otherwise -1 */
+static int parse_number(const char *str, int min)
 {
-	static const char *sql = "SELECT DISTINCT t.name FROM tag AS t, file AS f, "
-	"file_tag AS x WHERE t.id = x.tag_id AND x.file_id = f.id AND "
-	"f.relative_path = ?;";
-	sqlite3_stmt *prep = NULL;
-
-	if (sqlite3_prepare_v2(dbconn, sql, -1, &prep, NULL) != SQLITE_OK)
-		return NULL;
+	char *end = NULL;
+	long value = strtol(str, &end, 10);
 
-	if (sqlite3_bind_text(prep, 1, path, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
-		sqlite3_finalize(prep);
-		prep = NULL;
+	if (*str == '\0' || *end != '\0' || value < min || value > INT_MAX) {
+		fprintf(stderr, PROGRAM_NAME ": invalid number '%s'\n", str);
+		return -1;
 	}
 
-	return prep;
+	return (int) value;
 }
 
-step_t *list_all_tags(void)
+/* The time in str, as unix seconds or as a span before now like 2h, in
+ * *when. ERROR if it is neither.
+ */
+static int parse_time(const char *str, long long *when)
 {
-	static const char *sql = "SELECT DISTINCT name FROM tag;";
-	sqlite3_stmt *prep = NULL;
+	static const char units[] = "smhdw";
+	static const long long seconds[] = { 1, 60, 3600, 86400, 604800 };
+	char *end = NULL;
+	long long value = strtoll(str, &end, 10);
+	const char *unit = NULL;
+	// Plain digits only, no sign or space
+	int digits = *str >= '0' && *str <= '9';
+
+	if (digits && *end == '\0') {
+		*when = value;
+		return SUCCESS;
+	}
 
-	if (sqlite3_prepare_v2(dbconn, sql, -1, &prep, NULL) != SQLITE_OK)
-		return NULL;
+	if (digits && *end != '\0' && end[1] == '\0' &&
+		(unit = strchr(units, *end)) != NULL &&
+		value <= LLONG_MAX / seconds[unit - units]) {
+		*when = (long long) time(NULL) - value * seconds[unit - units];
+		return SUCCESS;
+	}
 
-	return prep;
+	fprintf(stderr, PROGRAM_NAME ": invalid time '%s'\n", str);
+	return ERROR;
 }
 
-static void close_db(void)
+/* The size in str, digits and maybe K, M or G, in bytes in *bytes. ERROR if
+ * it is not one.
+ */
+static int parse_size(const char *str, long long *bytes)
 {
-	if (dbconn != NULL) {
-		sqlite3_close(dbconn);
-		dbconn = NULL;
+	static const char units[] = "KMG";
+	char *end = NULL;
+	long long value = strtoll(str, &end, 10);
+	const char *unit = NULL;
+	int shift = 0;
+
+	if (*str >= '0' && *str <= '9' && *end != '\0' && end[1] == '\0' &&
+		(unit = strchr(units, *end)) != NULL)
+		shift = 10 * (int) (unit - units + 1);
+
+	if (*str < '0' || *str > '9' || (*end != '\0' && unit == NULL) ||
+		value > LLONG_MAX >> shift) {
+		fprintf(stderr, PROGRAM_NAME ": invalid size '%s'\n", str);
+		return ERROR;
 	}
+
+	*bytes = value << shift;
+	return SUCCESS;
 }
 
-static int run_init_db_sql() {
-    static char *init_sql =
-    "BEGIN IMMEDIATE;"
-    "CREATE TABLE file ( id INTEGER PRIMARY KEY, relative_path TEXT );"
-    "CREATE TABLE tag ( id INTEGER PRIMARY KEY, name TEXT );"
-    "CREATE TABLE file_tag ( file_id INTEGER, tag_id INTEGER );"
+static int main_filter(ftag_db *db, int argc, char **argv)
+{
+	int flags = 0;
+	int chr = 0;
+	int alltags = 0;
+	int jobs = 1;
+	int unordered = 0;
+	int cache = 0;
+	int paged = 0;
+	int count = 0;
+	int recursive = 0;
+	int timed = 0;
+	long long since = 0;
+	long long until = LLONG_MAX;
+	int limit = 0;
+	int order = ORDER_PATH;
+	const char *after = NULL;
+	int status = ERROR;
+	char *end = NULL;
 
-    "CREATE UNIQUE INDEX file_path_uq ON file (relative_path);"
-    "CREATE UNIQUE INDEX tag_name_uq ON tag (name);"
-    "CREATE UNIQUE INDEX file_tag_uq ON file_tag (file_id, tag_id);"
-    "COMMIT;"
-    ;
+	static struct option longopts[] = {
+		{"show-hidden", no_argument, 0, 'a'},
+		{"all-tags", no_argument, 0, 'A'},
+		{"jobs", required_argument, 0, 'j'},
+		{"unordered", no_argument, 0, 'u'},
+		{"cache", no_argument, 0, 'C'},
+		{"limit", required_argument, 0, 'n'},
+		{"after", required_argument, 0, 'k'},
+		{"order", required_argument, 0, 'o'},
+		{"count", no_argument, 0, 'c'},
+		{"recursive", no_argument, 0, 'r'},
+		{"since", required_argument, 0, 'S'},
+		{"until", required_argument, 0, 'U'},
+		{0, 0, 0, 0}
+	};
 
-    return sqlite3_exec(dbconn, init_sql, NULL, NULL, NULL);
-}
+	assert(argv != NULL);
 
-/* Open and init database, or search for DB_FILENAME if (fn == NULL) and with chdir_to_db if (dir == NULL)
- * The database is freed atexit
- * If fn is :memory: and dir is NULL it will open an in-memory database
- */
-int init_db(char *fn, char *dir)
-{
-	if (dbconn != NULL)
-		return ERROR;
-
-    if (fn == NULL) {
-		fn = DB_FILENAME;
-    // Do not accidentaly open memory db
-    } else if (strcmp(":memory:", fn) == 0) {
-        fn = "./:memory:";
-    }
-
-    if (dir == NULL) {
-        chdir_to_db(fn);
-    } else {
-        if (chdir(dir) != 0) {
-            fprintf(stderr, PROGRAM_NAME ": failed to change to dir '%s'\n", dir);
-            exit(ERROR);
-        }
-    }
-
-    // Return error if database doesn't already exist
-    int status = sqlite3_open_v2(fn, &dbconn, SQLITE_OPEN_READWRITE, NULL);
-
-    if (status != SQLITE_OK) {
-        status = sqlite3_open_v2(fn, &dbconn, SQLITE_OPEN_READWRITE |
-                                 SQLITE_OPEN_CREATE, NULL);
-        if (status != SQLITE_OK)
-            return ERROR;
-        else {
-            status = run_init_db_sql();
-            if (status != SQLITE_OK)
-                return ERROR;
-        }
-    }
-
-	atexit(close_db);
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "aAj:uCn:k:o:crS:U:", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'a':
+				show_hidden(db);
+				break;
+			case 'A':
+				alltags = 1;
+				break;
+			case 'j':
+				jobs = (int) strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' || jobs < 1) {
+					fprintf(stderr, PROGRAM_NAME ": invalid number of jobs '%s'\n",
+							optarg);
+					return ERROR;
+				}
+				break;
+			case 'u':
+				unordered = 1;
+				break;
+			case 'C':
+				cache = 1;
+				break;
+			case 'n':
+				paged = 1;
+				if ((limit = parse_number(optarg, 0)) < 0)
+					return ERROR;
+				break;
+			case 'k':
+				paged = 1;
+				after = optarg;
+				break;
+			case 'c':
+				count = 1;
+				break;
+			case 'r':
+				recursive = 1;
+				break;
+			case 'S':
+				timed = 1;
+				if (parse_time(optarg, &since) != SUCCESS)
+					return ERROR;
+				break;
+			case 'U':
+				timed = 1;
+				if (parse_time(optarg, &until) != SUCCESS)
+					return ERROR;
+				break;
+			case 'o':
+				paged = 1;
+				if (strcmp(optarg, "path") == 0) {
+					order = ORDER_PATH;
+				} else if (strcmp(optarg, "id") == 0) {
+					order = ORDER_ID;
+				} else {
+					fprintf(stderr, PROGRAM_NAME ": unknown order '%s'\n", optarg);
+					return ERROR;
+				}
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
+	}
 
-    return SUCCESS;
-}
+	argc -= optind;
+	argv += optind;
 
-/* Same as init_db, but use a volatile in-memory database instead of on disk */
-int init_memory_db(void) {
-    if (dbconn != NULL)
-        return ERROR;
+	if (argc == 0) {
+		flags |= FILTER_ALL;
+	} else if (alltags) {
+		flags |= FILTER_ALL_TAGS;
+	} else {
+		flags |= FILTER_ANY_TAG;
+	}
 
-    int status = sqlite3_open_v2(":memory:", &dbconn,
-                                 SQLITE_OPEN_READWRITE, NULL);
-    if (status != SQLITE_OK)
-        return ERROR;
-    else if (run_init_db_sql() != SQLITE_OK)
-        return ERROR;
-    else
-        return SUCCESS;
-}
+	if (paged && (snapshot != NULL || cache || jobs > 1)) {
+		fprintf(stderr, PROGRAM_NAME ": pages can't be combined with -s, -C or -j\n");
+		return ERROR;
+	}
 
-/***--- Entry points ---***/
+	if (count && (paged || cache || jobs > 1)) {
+		fprintf(stderr, PROGRAM_NAME ": --count can't be combined with pages, -C or -j\n");
+		return ERROR;
+	}
 
-static int main_tag_file(int argc, char **argv)
-{
-	assert(argv != NULL);
+	if (recursive && (paged || count || snapshot != NULL || cache || jobs > 1)) {
+		fprintf(stderr, PROGRAM_NAME ": --recursive can't be combined with pages, "
+				"--count, -s, -C or -j\n");
+		return ERROR;
+	}
 
-	if (argc < 2) {
-		usage();
+	if (timed && (paged || count || recursive || snapshot != NULL || cache ||
+				  jobs > 1)) {
+		fprintf(stderr, PROGRAM_NAME ": --since and --until can't be combined with "
+				"pages, --count, -r, -s, -C or -j\n");
 		return ERROR;
 	}
 
-	for (int i = 1; i < argc; i++)
-		if (tag_file(argv[0], argv[i]) == ERROR) {
-			fprintf(stderr, PROGRAM_NAME ": error tagging file\n");
+	if (timed)
+		status = print_step(ftag_filter_time(db, argc, (const char **) argv, flags,
+										since, until));
+	else if (recursive)
+		status = ftag_filter_recursive(db, argc, (const char **) argv, flags,
+								  print_row, NULL);
+	else if (count)
+		status = print_count(db, argc, (const char **) argv, flags);
+	else if (paged)
+		status = print_page(db, argc, (const char **) argv, flags, order, after,
+							limit);
+	else if (snapshot != NULL)
+		status = ftag_snapshot_filter(snapshot, argc, (const char **) argv, flags,
+								 print_row, NULL);
+	else
+		status = (cache ? ftag_filter_cached : ftag_filter_parallel)(db, argc,
+				(const char **) argv, flags, jobs, unordered, print_row, NULL);
 
-			return ERROR;
-		}
+	if (status != SUCCESS) {
+		fprintf(stderr, PROGRAM_NAME ": error while filtering\n");
+		return ERROR;
+	}
 
 	return SUCCESS;
 }
 
-static int main_filter(int argc, char **argv)
+static int print_tag(const char *tag, int count, void *arg)
+{
+	if (*(int *) arg)
+		return printf("%s\t%d\n", tag, count) < 0;
+	else
+		return puts(tag) == EOF;
+}
+
+static int main_list(ftag_db *db, int argc, char **argv)
 {
 	step_t *step = NULL;
-	int flags = 0;
+	int chr = 0;
+	int counts = 0;
+	int ranked = 0;
+	int top = 0;
+	int min_count = 0;
+	int recent = 0;
+	long long since = 0;
+	const char *pattern = NULL;
+
+	static struct option longopts[] = {
+		{"show-hidden", no_argument, 0, 'a'},
+		{"counts", no_argument, 0, 'c'},
+		{"match", required_argument, 0, 'm'},
+		{"top", required_argument, 0, 'n'},
+		{"min-count", required_argument, 0, 'M'},
+		{"recent", required_argument, 0, 'R'},
+		{0, 0, 0, 0}
+	};
 
 	assert(argv != NULL);
 
-	if (argc == 0) {
-		flags |= FILTER_ALL;
-	} else {
-		flags |= FILTER_ANY_TAG;
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "acm:n:M:R:", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'a':
+				show_hidden(db);
+				break;
+			case 'c':
+				counts = 1;
+				break;
+			case 'm':
+				pattern = optarg;
+				break;
+			case 'n':
+				ranked = 1;
+				if ((top = parse_number(optarg, 1)) < 0)
+					return ERROR;
+				break;
+			case 'M':
+				ranked = 1;
+				if ((min_count = parse_number(optarg, 0)) < 0)
+					return ERROR;
+				break;
+			case 'R':
+				recent = 1;
+				if (parse_time(optarg, &since) != SUCCESS)
+					return ERROR;
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
 	}
 
-	step = filter_strs(argc, (const char **) argv, flags);
+	argc -= optind;
+	argv += optind;
 
-	if (step == NULL) {
-		fprintf(stderr, PROGRAM_NAME ": error while filtering\n");
+	// Patterns, ranking and recency are for listing every tag, not those of
+	// a file, and only one at a time
+	if (((pattern != NULL || ranked || recent) && argc > 0) ||
+		(pattern != NULL) + ranked + recent > 1) {
+		usage();
 		return ERROR;
-	} else {
-		const char *str = NULL;
-
-		while ((str = step_result(step)) != NULL)
-			puts(str);
 	}
 
-	free_step(step);
-
-	return SUCCESS;
-}
+	if (recent && snapshot != NULL) {
+		fprintf(stderr, PROGRAM_NAME ": a snapshot has no tagging times\n");
+		return ERROR;
+	}
 
-static int main_list(int argc, char **argv)
-{
-	step_t *step = NULL;
+	if (snapshot != NULL && argc <= 1) {
+		if ((ranked ?
+			 ftag_snapshot_list_top(snapshot, top, min_count, print_tag, &counts) :
+			 pattern != NULL ?
+			 ftag_snapshot_list_matching(snapshot, pattern, print_tag, &counts) :
+			 ftag_snapshot_list(snapshot, argc == 1 ? argv[0] : NULL, print_tag,
+						   &counts)) != SUCCESS) {
+			fprintf(stderr, PROGRAM_NAME ": error while listing tags\n");
+			return ERROR;
+		}
 
-	assert(argv != NULL);
+		return SUCCESS;
+	}
 
-	if (argc == 0)
-		step = list_all_tags();
+	if (recent)
+		step = ftag_list_recent_tags(db, since);
+	else if (ranked)
+		step = ftag_list_top_tags(db, top, min_count);
+	else if (pattern != NULL)
+		step = ftag_list_matching_tags(db, pattern);
+	else if (argc == 0)
+		step = ftag_list_all_tags(db);
 	else if (argc == 1)
-		step = list_by_file(argv[0]);
+		step = ftag_list_by_file(db, argv[0]);
 	else {
 		usage();
 		return ERROR;
@@ -517,403 +726,3086 @@ static int main_list(int argc, char **argv)
 		return ERROR;
 	} else {
 		const char *str = NULL;
-		while((str = step_result(step)) != NULL)
-			puts(str);
+		while((str = ftag_step_result(step)) != NULL)
+			if (counts)
+				printf("%s\t%d\n", str, ftag_step_result_count(step));
+			else
+				puts(str);
 	}
 
-	free_step(step);
+	if (free_step(step) != SUCCESS)
+		return ERROR;
 
 	return SUCCESS;
 }
 
-// Forward declartion to make it run in main
-static int run_tests(void);
-
-int main(int argc, char **argv)
+static int main_related(ftag_db *db, int argc, char **argv)
 {
-	/* Look at git argument parsing for ideas on handling modes etc */
+	step_t *step = NULL;
+	const char *str = NULL;
 	int chr = 0;
-	enum mode mode = MODE_NONE;
-	char *dbfilename = NULL;
-	int verbosity = 0;
-	char *dbpath = NULL;
+	int counts = 0;
+	int limit = 10;
 
 	static struct option longopts[] = {
-		{"show-hidden", no_argument, 0, 'a'},
-		{"database-name", required_argument, 0, 'd'},
-		{"database-dir", required_argument, 0, 'p'},
-		{"verbose", no_argument, 0, 'v'},
-		{"help", no_argument, 0, 'h'},
-        {"test", no_argument, 0, 't'},
+		{"counts", no_argument, 0, 'c'},
+		{"limit", required_argument, 0, 'n'},
 		{0, 0, 0, 0}
 	};
 
-	opterr = 0;
-	while ((chr = getopt_long(argc, argv, "ad:p:vt", longopts, NULL)) != -1) {
+	assert(argv != NULL);
+
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "cn:", longopts, NULL)) != -1) {
 		switch (chr) {
-			case 'a':
-				showhidden = 1;
-				break;
-			case 'd':
-				dbfilename = optarg;
-				break;
-			case 'v':
-				verbosity++;
+			case 'c':
+				counts = 1;
 				break;
-			case 'h':
-				help();
-				return 0;
-			case 'p':
-				dbpath = optarg;
+			case 'n':
+				if ((limit = parse_number(optarg, 0)) < 0)
+					return ERROR;
 				break;
-            case 't':
-               return run_tests();
 			default:
 				usage();
 				return ERROR;
 		}
 	}
 
-	if (argc - optind < 1) {
+	if (argc - optind != 1) {
 		usage();
 		return ERROR;
 	}
 
-	if (strcmp(argv[optind], "file") == 0)
-		mode = MODE_TAG_FILE;
-	else if (strcmp(argv[optind], "filter") == 0)
-		mode = MODE_FILTER;
-	else if (strcmp(argv[optind], "list") == 0)
-		mode = MODE_LIST;
-	else {
-		usage();
+	step = ftag_list_related(db, argv[optind], limit);
+	if (step == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": error while listing related tags\n");
+		return ERROR;
+	}
+
+	while ((str = ftag_step_result(step)) != NULL)
+		if (counts)
+			printf("%s\t%d\n", str, ftag_step_result_count(step));
+		else
+			puts(str);
+
+	if (free_step(step) != SUCCESS)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+/* Exits with 0 if FILE has TAG, 1 if not and 2 on error, like grep */
+static int main_has(ftag_db *db, int argc, char **argv)
+{
+	int found;
+
+	assert(argv != NULL);
+
+	if (argc != 3) {
+		usage();
+		return 2;
+	}
+
+	found = ftag_has_tag(db, argv[1], argv[2]);
+	if (found < 0) {
+		fprintf(stderr, PROGRAM_NAME ": error while looking up tag\n");
+		return 2;
+	}
+
+	return found ? 0 : 1;
+}
+
+static int main_untag(ftag_db *db, int argc, char **argv)
+{
+	assert(argv != NULL);
+
+	argc--;
+	argv++;
+
+	if (argc < 2) {
+		usage();
+		return ERROR;
+	}
+
+	if (ftag_untag_file(db, argv[0], argc - 1, (const char **) argv + 1) == ERROR) {
+		fprintf(stderr, PROGRAM_NAME ": error untagging file\n");
+		return ERROR;
+	}
+
+	return SUCCESS;
+}
+
+static int main_retag(ftag_db *db, int argc, char **argv)
+{
+	assert(argv != NULL);
+
+	if (argc != 3) {
+		usage();
+		return ERROR;
+	}
+
+	if (ftag_rename_tag(db, argv[1], argv[2]) == ERROR) {
+		fprintf(stderr, PROGRAM_NAME ": error renaming tag '%s' (use merge "
+				"if '%s' already exists)\n", argv[1], argv[2]);
+		return ERROR;
+	}
+
+	return SUCCESS;
+}
+
+static int main_merge(ftag_db *db, int argc, char **argv)
+{
+	assert(argv != NULL);
+
+	if (argc != 3) {
+		usage();
+		return ERROR;
+	}
+
+	if (ftag_merge_tags(db, argv[1], argv[2]) == ERROR) {
+		fprintf(stderr, PROGRAM_NAME ": error merging tag '%s'\n", argv[1]);
+		return ERROR;
+	}
+
+	return SUCCESS;
+}
+
+static int main_snapshot(ftag_db *db, int argc, char **argv)
+{
+	char *path = NULL;
+	int status = ERROR;
+
+	assert(argv != NULL);
+
+	if (argc > 2) {
+		usage();
+		return ERROR;
+	}
+
+	if (argc == 2) {
+		path = strdup(argv[1]);
+	} else if ((path = malloc(strlen(ftag_db_dir(db)) + 1 +
+							  strlen(SNAPSHOT_FILENAME) + 1)) != NULL) {
+		sprintf(path, "%s/%s", ftag_db_dir(db), SNAPSHOT_FILENAME);
+	}
+
+	if (path == NULL)
+		return ERROR;
+
+	status = ftag_write_snapshot(db, path);
+	if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": error writing snapshot '%s'\n", path);
+
+	free(path);
+
+	return status;
+}
+
+/* export and import, which share their options */
+/* The path of dir from the database's directory with a / after it, or
+ * "" for that directory itself. NULL if dir is outside it, to be freed.
+ */
+static char *db_prefix(ftag_db *db, const char *dir)
+{
+	char *base = realpath(ftag_db_dir(db), NULL);
+	char *full = realpath(dir, NULL);
+	char *prefix = NULL;
+	size_t len = base != NULL ? strlen(base) : 0;
+
+	// The root directory is the only one already ending in a /
+	if (len > 0 && base[len - 1] == '/')
+		len--;
+
+	if (base == NULL || full == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": can't find '%s'\n", dir);
+	} else if (strcmp(full, base) == 0) {
+		prefix = strdup("");
+	} else if (strncmp(full, base, len) != 0 || full[len] != '/') {
+		fprintf(stderr, PROGRAM_NAME ": '%s' is outside the database's "
+				"directory\n", dir);
+	} else if ((prefix = malloc(strlen(full + len + 1) + 2)) != NULL) {
+		sprintf(prefix, "%s/", full + len + 1);
+	}
+
+	free(base);
+	free(full);
+
+	return prefix;
+}
+
+/* path, or the database file of the same name as db's in it if it is a
+ * directory, to be freed
+ */
+static char *db_file_in(ftag_db *db, const char *path)
+{
+	const char *name = strrchr(ftag_db_path(db), '/') + 1;
+	struct stat st;
+	char *file = NULL;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return strdup(path);
+
+	if ((file = malloc(strlen(path) + 1 + strlen(name) + 1)) != NULL)
+		sprintf(file, "%s/%s", path, name);
+
+	return file;
+}
+
+static int main_merge_db(ftag_db *db, int argc, char **argv)
+{
+	char *path = NULL;
+	char *dir = NULL;
+	char *prefix = NULL;
+	int status = ERROR;
+
+	assert(argv != NULL);
+
+	if (argc != 2) {
+		usage();
+		return ERROR;
+	}
+
+	path = db_file_in(db, argv[1]);
+	if (path == NULL)
+		return ERROR;
+
+	// Attaching a missing database would create an empty one
+	if (access(path, R_OK) != 0) {
+		fprintf(stderr, PROGRAM_NAME ": can't open '%s'\n", path);
+	} else if ((dir = strdup(path)) != NULL &&
+			   (prefix = db_prefix(db, dirname(dir))) != NULL) {
+		status = ftag_merge_db(db, path, prefix);
+		if (status != SUCCESS)
+			fprintf(stderr, PROGRAM_NAME ": error merging '%s'\n", path);
+	}
+
+	free(prefix);
+	free(dir);
+	free(path);
+
+	return status;
+}
+
+static int main_split_db(ftag_db *db, int argc, char **argv)
+{
+	ftag_db *dst = NULL;
+	char *path = NULL;
+	char *dir = NULL;
+	char *name = NULL;
+	char *prefix = NULL;
+	int status = ERROR;
+
+	assert(argv != NULL);
+
+	if (argc != 3) {
+		usage();
+		return ERROR;
+	}
+
+	if ((prefix = db_prefix(db, argv[1])) == NULL)
+		return ERROR;
+
+	if (*prefix == '\0') {
+		fprintf(stderr, PROGRAM_NAME ": '%s' is the database's own directory\n",
+				argv[1]);
+		goto out;
+	}
+
+	if ((path = db_file_in(db, argv[2])) == NULL)
+		goto out;
+
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, PROGRAM_NAME ": '%s' already exists\n", path);
+		goto out;
+	}
+
+	if ((dir = strdup(path)) == NULL || (name = strdup(path)) == NULL)
+		goto out;
+
+	dst = ftag_open_db(basename(name), dirname(dir), 0);
+	if (dst == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": can't create '%s'\n", path);
+		goto out;
+	}
+
+	status = ftag_split_db(db, prefix, dst);
+	if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": error splitting '%s' into '%s'\n",
+				argv[1], path);
+
+	out:
+	ftag_close_db(dst);
+	free(name);
+	free(dir);
+	free(path);
+	free(prefix);
+
+	return status;
+}
+
+/* Parse a sequence number of the changes mode into *seq */
+static int parse_seq(const char *str, long long *seq)
+{
+	char *end = NULL;
+
+	*seq = strtoll(str, &end, 10);
+	if (*str == '\0' || *end != '\0' || *seq < 0) {
+		fprintf(stderr, PROGRAM_NAME ": invalid sequence number '%s'\n", str);
+		return ERROR;
+	}
+
+	return SUCCESS;
+}
+
+static int main_changes(ftag_db *db, int argc, char **argv)
+{
+	long long since = 0;
+	long long before = -1;
+	int latest = 0;
+	int chr = 0;
+	int status = ERROR;
+	FILE *fp = stdout;
+
+	static struct option longopts[] = {
+		{"since", required_argument, 0, 'S'},
+		{"latest", no_argument, 0, 'l'},
+		{"prune-before", required_argument, 0, 'P'},
+		{0, 0, 0, 0}
+	};
+
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "S:l", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'S':
+				if (parse_seq(optarg, &since) != SUCCESS)
+					return ERROR;
+				break;
+			case 'l':
+				latest = 1;
+				break;
+			case 'P':
+				if (parse_seq(optarg, &before) != SUCCESS)
+					return ERROR;
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1 || ((latest || before >= 0) && argc > 0) ||
+		(latest && before >= 0)) {
+		usage();
+		return ERROR;
+	}
+
+	if (before >= 0)
+		return ftag_prune_changes(db, before);
+
+	if (latest) {
+		since = ftag_latest_change(db);
+		if (since < 0)
+			return ERROR;
+
+		printf("%lld\n", since);
+		return SUCCESS;
+	}
+
+	if (argc == 1 && strcmp(argv[0], "-") != 0 && (fp = fopen(argv[0], "wb")) == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": can't open '%s'\n", argv[0]);
+		return ERROR;
+	}
+
+	status = ftag_write_changes(db, fp, since);
+	if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": can't write the changes after %lld, "
+				"some may have been pruned\n", since);
+
+	if (fp != stdout && fclose(fp) != 0)
+		status = ERROR;
+	else if (fp == stdout && fflush(stdout) != 0)
+		status = ERROR;
+
+	return status;
+}
+
+/* Prints the sequence number of the last change applied, to continue from */
+static int main_apply(ftag_db *db, int argc, char **argv)
+{
+	long long last = 0;
+	int status = ERROR;
+	FILE *fp = stdin;
+
+	assert(argv != NULL);
+
+	if (argc > 2) {
+		usage();
+		return ERROR;
+	}
+
+	if (argc == 2 && strcmp(argv[1], "-") != 0 && (fp = fopen(argv[1], "rb")) == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": can't open '%s'\n", argv[1]);
+		return ERROR;
+	}
+
+	status = ftag_apply_changes(db, fp, &last);
+	if (status == SUCCESS && last > 0)
+		printf("%lld\n", last);
+	else if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": error applying changes\n");
+
+	if (fp != stdin)
+		fclose(fp);
+
+	return status;
+}
+
+/* Prints how many attributes were written and files' tags taken from them */
+static int main_xattr_sync(ftag_db *db, int argc, char **argv)
+{
+	int flags = XATTR_PUSH | XATTR_PULL;
+	int jobs = 4;
+	int chr = 0;
+	long long pushed = 0, pulled = 0;
+	int status = ERROR;
+
+	static struct option longopts[] = {
+		{"push", no_argument, 0, 'P'},
+		{"pull", no_argument, 0, 'G'},
+		{"jobs", required_argument, 0, 'j'},
+		{0, 0, 0, 0}
+	};
+
+	assert(argv != NULL);
+
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "PGj:", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'P':
+				flags = XATTR_PUSH;
+				break;
+			case 'G':
+				flags = XATTR_PULL;
+				break;
+			case 'j':
+				if ((jobs = parse_number(optarg, 1)) < 0)
+					return ERROR;
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
+	}
+
+	if (optind != argc) {
+		usage();
+		return ERROR;
+	}
+
+	status = ftag_xattr_sync(db, flags, jobs, &pushed, &pulled);
+	printf("%lld pushed, %lld pulled\n", pushed, pulled);
+
+	if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": error syncing extended attributes\n");
+
+	return status;
+}
+
+static int main_mount(ftag_db *db, int argc, char **argv)
+{
+	int foreground = 0;
+	int chr = 0;
+
+	static struct option longopts[] = {
+		{"show-hidden", no_argument, 0, 'a'},
+		{"foreground", no_argument, 0, 'f'},
+		{0, 0, 0, 0}
+	};
+
+	assert(argv != NULL);
+
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "af", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'a':
+				ftag_set_show_hidden(db, 1);
+				break;
+			case 'f':
+				foreground = 1;
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return ERROR;
+	}
+
+#ifdef FTAG_FUSE
+	if (ftag_mount_db(db, argv[optind], foreground) != SUCCESS) {
+		fprintf(stderr, PROGRAM_NAME ": error mounting '%s'\n", argv[optind]);
 		return ERROR;
 	}
 
-	optind++;
+	return SUCCESS;
+#else
+	(void) foreground;
+	fprintf(stderr, PROGRAM_NAME ": built without FUSE, rebuild with make FUSE=1\n");
+	return ERROR;
+#endif
+}
+
+static int main_transfer(ftag_db *db, int argc, char **argv)
+{
+	int import = strcmp(argv[0], "import") == 0;
+	int format = FORMAT_JSONL;
+	int chr = 0;
+	int status = ERROR;
+	FILE *fp = NULL;
+
+	static struct option longopts[] = {
+		{"format", required_argument, 0, 'f'},
+		{0, 0, 0, 0}
+	};
+
+	reset_getopt();
+	while ((chr = getopt_long(argc, argv, "f:", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'f':
+				if (strcmp(optarg, "jsonl") == 0)
+					format = FORMAT_JSONL;
+				else if (strcmp(optarg, "tsv") == 0)
+					format = FORMAT_TSV;
+				else if (strcmp(optarg, "nul") == 0)
+					format = FORMAT_NUL;
+				else {
+					fprintf(stderr, PROGRAM_NAME ": unknown format '%s'\n", optarg);
+					return ERROR;
+				}
+				break;
+			default:
+				usage();
+				return ERROR;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1) {
+		usage();
+		return ERROR;
+	}
+
+	if (argc == 0 || strcmp(argv[0], "-") == 0)
+		fp = import ? stdin : stdout;
+	else
+		fp = fopen(argv[0], import ? "rb" : "wb");
+
+	if (fp == NULL) {
+		fprintf(stderr, PROGRAM_NAME ": can't open '%s'\n", argv[0]);
+		return ERROR;
+	}
+
+	status = import ? ftag_import_db(db, fp, format) : ftag_export_db(db, fp, format);
+
+	if (fp != stdin && fp != stdout && fclose(fp) != 0)
+		status = ERROR;
+	else if (fp == stdout && fflush(stdout) != 0)
+		status = ERROR;
+
+	if (status != SUCCESS)
+		fprintf(stderr, PROGRAM_NAME ": %s failed\n", import ? "import" : "export");
+
+	return status;
+}
+
+// Forward declartion to make it run in main
+static int run_tests(void);
+
+int main(int argc, char **argv)
+{
+	/* Look at git argument parsing for ideas on handling modes etc */
+	int chr = 0;
+	enum mode mode = MODE_NONE;
+	char *dbfilename = NULL;
+	char *dbpath = NULL;
+	char *snapfile = NULL;
+	char *tempdir = NULL;
+	long long budget = 0;
+	int showhidden = 0;
+	int verbosity = 0;
+	int status = ERROR;
+	ftag_db *db = NULL;
+
+	static struct option longopts[] = {
+		{"show-hidden", no_argument, 0, 'a'},
+		{"database-name", required_argument, 0, 'd'},
+		{"database-dir", required_argument, 0, 'p'},
+		{"snapshot", required_argument, 0, 's'},
+		{"verbose", no_argument, 0, 'v'},
+		// Long only, -M is list's --min-count
+		{"mem-budget", required_argument, 0, 'b'},
+		{"temp-dir", required_argument, 0, 'T'},
+		{"help", no_argument, 0, 'h'},
+        {"test", no_argument, 0, 't'},
+		{0, 0, 0, 0}
+	};
+
+	opterr = 0;
+	// Stop at the mode, it parses its own options
+	while ((chr = getopt_long(argc, argv, "+ad:p:s:vT:t", longopts, NULL)) != -1) {
+		switch (chr) {
+			case 'a':
+				showhidden = 1;
+				break;
+			case 'd':
+				dbfilename = optarg;
+				break;
+			case 'v':
+				verbosity++;
+				break;
+			case 'h':
+				help();
+				return 0;
+			case 'p':
+				dbpath = optarg;
+				break;
+			case 's':
+				snapfile = optarg;
+				break;
+			case 'b':
+				if (parse_size(optarg, &budget) != SUCCESS)
+					return ERROR;
+				break;
+			case 'T':
+				tempdir = optarg;
+				break;
+            case 't':
+               return run_tests();
+			default:
+				usage();
+				return ERROR;
+		}
+	}
+
+	if (argc - optind < 1) {
+		usage();
+		return ERROR;
+	}
+
+	if (strcmp(argv[optind], "file") == 0)
+		mode = MODE_TAG_FILE;
+	else if (strcmp(argv[optind], "filter") == 0)
+		mode = MODE_FILTER;
+	else if (strcmp(argv[optind], "list") == 0)
+		mode = MODE_LIST;
+	else if (strcmp(argv[optind], "untag") == 0)
+		mode = MODE_UNTAG;
+	else if (strcmp(argv[optind], "retag") == 0)
+		mode = MODE_RETAG;
+	else if (strcmp(argv[optind], "merge") == 0)
+		mode = MODE_MERGE;
+	else if (strcmp(argv[optind], "snapshot") == 0)
+		mode = MODE_SNAPSHOT;
+	else if (strcmp(argv[optind], "export") == 0)
+		mode = MODE_EXPORT;
+	else if (strcmp(argv[optind], "import") == 0)
+		mode = MODE_IMPORT;
+	else if (strcmp(argv[optind], "related") == 0)
+		mode = MODE_RELATED;
+	else if (strcmp(argv[optind], "has") == 0)
+		mode = MODE_HAS;
+	else if (strcmp(argv[optind], "merge-db") == 0)
+		mode = MODE_MERGE_DB;
+	else if (strcmp(argv[optind], "split-db") == 0)
+		mode = MODE_SPLIT_DB;
+	else if (strcmp(argv[optind], "changes") == 0)
+		mode = MODE_CHANGES;
+	else if (strcmp(argv[optind], "apply") == 0)
+		mode = MODE_APPLY;
+	else if (strcmp(argv[optind], "xattr-sync") == 0)
+		mode = MODE_XATTR_SYNC;
+	else if (strcmp(argv[optind], "mount") == 0)
+		mode = MODE_MOUNT;
+	else {
+		usage();
+		return ERROR;
+	}
+
+	// SQLite wants it before any database is opened
+	if (tempdir != NULL && ftag_set_temp_dir(tempdir) != SUCCESS) {
+		fprintf(stderr, PROGRAM_NAME ": error: '%s' is not a directory\n", tempdir);
+		return ERROR;
+	}
+
+	if (snapfile != NULL) {
+		if (mode != MODE_FILTER && mode != MODE_LIST) {
+			fprintf(stderr, PROGRAM_NAME ": only filter and list can read a snapshot\n");
+			return ERROR;
+		}
+
+		snapshot = ftag_open_snapshot(snapfile);
+		if (snapshot == NULL) {
+			fprintf(stderr, PROGRAM_NAME ": error: failed to open snapshot '%s'\n",
+					snapfile);
+			return ERROR;
+		}
+
+		ftag_snapshot_show_hidden(snapshot, showhidden);
+
+		if (verbosity > 0)
+			fprintf(stderr, "choosing snapshot '%s'\n", snapfile);
+	} else {
+		db = ftag_open_db(dbfilename, dbpath, verbosity);
+		if (db == NULL) {
+			fprintf(stderr, PROGRAM_NAME ": error: failed to initialize database\n");
+			return ERROR;
+		}
+
+		// One that can't be written is read as it is
+		if (!ftag_db_readonly(db) && ftag_upgrade_db(db) != SUCCESS) {
+			fprintf(stderr, PROGRAM_NAME ": unsupported database schema\n");
+			ftag_close_db(db);
+			return ERROR;
+		}
+
+		ftag_set_show_hidden(db, showhidden);
+
+		if (ftag_set_mem_budget(db, budget) != SUCCESS) {
+			ftag_close_db(db);
+			return ERROR;
+		}
+
+		if (verbosity > 0) {
+			char *path = realpath(ftag_db_path(db), NULL);
+
+			if (path != NULL) {
+				fprintf(stderr, "choosing db '%s'\n", path);
+				free(path);
+			} else {
+				ftag_close_db(db);
+
+				return ERROR;
+			}
+		}
+	}
+
+	if (mode != MODE_NONE) {
+		// Modes get their name as argv[0], just like main
+		int margc = argc - optind;
+		char **margv = argv + optind;
+	
+		switch (mode) {
+			case MODE_TAG_FILE:
+				status = main_tag_file(db, margc, margv);
+				break;
+			case MODE_FILTER:
+				status = main_filter(db, margc, margv);
+				break;
+			case MODE_LIST:
+				status = main_list(db, margc, margv);
+				break;
+			case MODE_UNTAG:
+				status = main_untag(db, margc, margv);
+				break;
+			case MODE_RETAG:
+				status = main_retag(db, margc, margv);
+				break;
+			case MODE_MERGE:
+				status = main_merge(db, margc, margv);
+				break;
+			case MODE_SNAPSHOT:
+				status = main_snapshot(db, margc, margv);
+				break;
+			case MODE_EXPORT:
+			case MODE_IMPORT:
+				status = main_transfer(db, margc, margv);
+				break;
+			case MODE_RELATED:
+				status = main_related(db, margc, margv);
+				break;
+			case MODE_HAS:
+				status = main_has(db, margc, margv);
+				break;
+			case MODE_MERGE_DB:
+				status = main_merge_db(db, margc, margv);
+				break;
+			case MODE_SPLIT_DB:
+				status = main_split_db(db, margc, margv);
+				break;
+			case MODE_CHANGES:
+				status = main_changes(db, margc, margv);
+				break;
+			case MODE_APPLY:
+				status = main_apply(db, margc, margv);
+				break;
+			case MODE_XATTR_SYNC:
+				status = main_xattr_sync(db, margc, margv);
+				break;
+			case MODE_MOUNT:
+				status = main_mount(db, margc, margv);
+				break;
+			default:
+				assert(0);
+				break;
+		}
+	}
+
+	ftag_close_db(db);
+	ftag_close_snapshot(snapshot);
+
+	return status;
+}
+
+/***--- Tests ---***/
+
+// When tests fail, they won't be able to close their database
+static ftag_db *test_db = NULL;
+
+static void close_test_db(void)
+{
+    ftag_close_db(test_db);
+    test_db = NULL;
+}
+
+static ftag_db *setup_test_db(CuTest *tc) {
+    close_test_db();
+    test_db = ftag_open_memory_db();
+    CuAssertPtrNotNull(tc, test_db);
+    return test_db;
+}
+
+static void reset_string(CuString *str)
+{
+	str->length = 0;
+	str->buffer[0] = '\0';
+}
+
+static int append_tag(const char *tag, int count, void *arg)
+{
+	CuStringAppendFormat(arg, "%s:%d\n", tag, count);
+	return 0;
+}
+
+static int query_int(ftag_db *db, const char *sql)
+{
+	sqlite3_stmt *prep = NULL;
+	int value = -1;
+
+	sqlite3_prepare_v2(ftag_db_sqlite(db), sql, -1, &prep, NULL);
+	if (prep != NULL && sqlite3_step(prep) == SQLITE_ROW)
+		value = sqlite3_column_int(prep, 0);
+	sqlite3_finalize(prep);
+
+	return value;
+}
+
+static void test_find_db_dir_null_return(CuTest *tc)
+{
+    CuAssertPtrEquals(tc, NULL, find_db_dir(NULL));
+}
+
+static void test_find_db_dir_cwd(CuTest *tc)
+{
+    char *beforedir = getcwd(NULL, 0);
+    char *afterdir = NULL;
+    char *dbdir = find_db_dir("no-such-ftag-database");
+
+    afterdir = getcwd(NULL, 0);
+    CuAssertStrEquals(tc, beforedir, afterdir);
+    // Not found anywhere, so the current directory is used
+    CuAssertStrEquals(tc, ".", dbdir);
+    free(beforedir);
+    free(afterdir);
+    free(dbdir);
+}
+
+static void test_find_db_dir_parent(CuTest *tc)
+{
+    char dir[5 + 6 + 1];
+    char *dbdir = NULL;
+
+    strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+    if (mkdtemp(dir) == NULL)
+        CuFail(tc, "Failed mkdtemp");
+
+    chdir(dir);
+    mkdir("sub", 0700);
+    close(creat("db", 0600));
+    chdir("sub");
+
+    dbdir = find_db_dir("db");
+
+    chdir("..");
+    rmdir("sub");
+    unlink("db");
+    chdir("..");
+    rmdir(dir);
+
+    CuAssertStrEquals(tc, "..", dbdir);
+    free(dbdir);
+}
+
+static CuSuite *find_db_dir_get_suite()
+{
+    CuSuite *suite = CuSuiteNew();
+
+    SUITE_ADD_TEST(suite, test_find_db_dir_null_return);
+    SUITE_ADD_TEST(suite, test_find_db_dir_cwd);
+    SUITE_ADD_TEST(suite, test_find_db_dir_parent);
+ 
+    return suite;
+}
+
+static void test_tag_file_null_file(CuTest *tc)
+{
+    ftag_db *db = setup_test_db(tc);
+    CuAssertIntEquals(tc, ERROR, ftag_tag_file(db, NULL, "tag"));
+    close_test_db();
+}
+
+static void test_tag_file_null_tag(CuTest *tc)
+{
+    ftag_db *db = setup_test_db(tc);
+    CuAssertIntEquals(tc, ERROR, ftag_tag_file(db, "file", NULL));
+    close_test_db();
+}
+
+static void test_tag_file_tag_exits(CuTest *tc)
+{
+    sqlite3_stmt *prep = NULL;
+
+    ftag_db *db = setup_test_db(tc);
+
+    CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file", "tag"));
+    CuAssertIntEquals(tc, SQLITE_OK,
+                      sqlite3_prepare_v2(ftag_db_sqlite(db), "SELECT name FROM tag;", -1,
+                                         &prep, NULL)
+                      );
+    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+    CuAssertStrEquals(tc, "tag",
+                      (const char *) sqlite3_column_text(prep, 0));
+    sqlite3_finalize(prep);
+    close_test_db();
+
+}
+
+static void test_tag_file_file_exits(CuTest *tc)
+{
+    sqlite3_stmt *prep = NULL;
+
+    ftag_db *db = setup_test_db(tc);
+
+    CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file", "tag"));
+    CuAssertIntEquals(tc, SQLITE_OK,
+                      sqlite3_prepare_v2(ftag_db_sqlite(db),
+                                         "SELECT relative_path FROM file;", -1,
+                                         &prep, NULL)
+                      );
+    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+    CuAssertStrEquals(tc, "file",
+                      (const char *)sqlite3_column_text(prep, 0));
+    // no more rows should be returned!!
+    sqlite3_finalize(prep);
+    close_test_db();
+}
+
+static void test_tag_file_xref_exits(CuTest *tc)
+{
+    sqlite3_stmt *prep = NULL;
+
+    ftag_db *db = setup_test_db(tc);
+
+    CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file", "tag"));
+    sqlite3_prepare_v2(ftag_db_sqlite(db), "SELECT file_id, tag_id FROM file_tag;", -1,
+                       &prep, NULL);
+    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+
+    // Since the in-memory database should be empty, both file and
+    // tag should have been assigned id 1
+    CuAssertIntEquals(tc, 1, sqlite3_column_int(prep, 0));
+    CuAssertIntEquals(tc, 1, sqlite3_column_int(prep, 1));
+
+    sqlite3_finalize(prep);
+
+    close_test_db();
+}
+
+static void test_tag_files(CuTest *tc)
+{
+    ftag_db *db = setup_test_db(tc);
+
+    CuAssertIntEquals(tc, SUCCESS,
+                      ftag_tag_files(db, 3, (const char *[]) {"a", "b", "a"},
+                                     2, (const char *[]) {"x", "y"}));
+    CuAssertIntEquals(tc, 4, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+    CuAssertIntEquals(tc, 2,
+                      query_int(db, "SELECT file_count FROM tag WHERE name='y';"));
+    // Nothing is left staged for the next batch
+    CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM temp.batch_file;"));
+
+    close_test_db();
+}
+
+static void test_tag_files_from(CuTest *tc)
+{
+    char list[] = "a\nb\n\nc";
+    FILE *fp = fmemopen(list, strlen(list), "r");
+
+    ftag_db *db = setup_test_db(tc);
+
+    CuAssertPtrNotNull(tc, fp);
+    CuAssertIntEquals(tc, SUCCESS,
+                      ftag_tag_files_from(db, fp, '\n', 1, (const char *[]) {"x"}));
+    CuAssertIntEquals(tc, 3, query_int(db, "SELECT COUNT(*) FROM file;"));
+    CuAssertIntEquals(tc, 3,
+                      query_int(db, "SELECT file_count FROM tag WHERE name='x';"));
+
+    fclose(fp);
+    close_test_db();
+}
+
+static CuSuite *tag_file_get_suite()
+{
+    CuSuite *suite = CuSuiteNew();
+
+    SUITE_ADD_TEST(suite, test_tag_file_null_file);
+    SUITE_ADD_TEST(suite, test_tag_file_null_tag);
+    SUITE_ADD_TEST(suite, test_tag_file_tag_exits);
+    SUITE_ADD_TEST(suite, test_tag_file_file_exits);
+    SUITE_ADD_TEST(suite, test_tag_file_xref_exits);
+    SUITE_ADD_TEST(suite, test_tag_files);
+    SUITE_ADD_TEST(suite, test_tag_files_from);
+
+    return suite;
+}
+
+static void test_init_db_fn_memory_with_dir(CuTest *tc)
+{
+    char dir[5 + 6 + 1];
+
+    close_test_db();
+
+    strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+    char *status = mkdtemp(dir);
+    if (status == NULL)
+        CuFail(tc, "Failed mkdtemp");
+
+    test_db = ftag_open_db(":memory:", dir, 0);
+    CuAssertPtrNotNull(tc, test_db);
+    chdir(dir);
+
+    int exists = access(":memory:", F_OK);
+
+	close_test_db();
+    unlink(":memory:");
+    chdir("..");
+    rmdir(dir);
+
+    CuAssertIntEquals(tc, 0, exists);
+}
+
+static void test_init_db_fn_memory_null_dir(CuTest *tc)
+{
+    char dir[5 + 6 + 1];
+
+    close_test_db();
+
+    strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+    char *status = mkdtemp(dir);
+    if (status == NULL)
+        CuFail(tc, "Failed mkdtemp");
+
+    chdir(dir);
+    test_db = ftag_open_db(":memory:", NULL, 0);
+    CuAssertPtrNotNull(tc, test_db);
+
+    int exists = access(":memory:", F_OK);
+
+	close_test_db();
+    unlink(":memory:");
+    chdir("..");
+    rmdir(dir);
+
+    CuAssertIntEquals(tc, 0, exists);
+}
+
+/* What a handle opened with verbosity prints on standard error while it
+ * tags, filters and is closed
+ */
+static void verbose_output(CuTest *tc, int verbosity, CuString *out)
+{
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	char buf[256];
+	FILE *tmp = tmpfile();
+	int saved = dup(2);
+	ftag_db *db = NULL;
+	step_t *step = NULL;
+	size_t len;
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (tmp == NULL || saved < 0 || mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed setup");
+
+	fflush(stderr);
+	dup2(fileno(tmp), 2);
+
+	db = ftag_open_db(DB_FILENAME, dir, verbosity);
+	if (db != NULL) {
+		ftag_tag_file(db, "file", "tag");
+		step = ftag_filter_strs(db, 1, (const char *[]) { "tag" }, FILTER_ANY_TAG);
+		if (step != NULL) {
+			while (ftag_step_result(step) != NULL)
+				;
+			ftag_free_step(step);
+		}
+		ftag_close_db(db);
+	}
+
+	fflush(stderr);
+	dup2(saved, 2);
+	close(saved);
+
+	rewind(tmp);
+	while ((len = fread(buf, 1, sizeof(buf) - 1, tmp)) > 0) {
+		buf[len] = '\0';
+		CuStringAppend(out, buf);
+	}
+	fclose(tmp);
+
+	sprintf(path, "%s/%s", dir, DB_FILENAME);
+	unlink(path);
+	rmdir(dir);
+
+	CuAssertPtrNotNull(tc, db);
+}
+
+static void test_verbose_stats(CuTest *tc)
+{
+	CuString *out = CuStringNew();
+
+	// Quiet below -vv
+	verbose_output(tc, 1, out);
+	CuAssertStrEquals(tc, "", out->buffer);
+
+	// Phase times, SQLite's counters for the connection and the filter
+	verbose_output(tc, 2, out);
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "phase"));
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "\nstep "));
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "page cache hits"));
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "vm steps"));
+	CuAssertTrue(tc, strstr(out->buffer, "query: ") == NULL);
+
+	// And the plan of the filter
+	reset_string(out);
+	verbose_output(tc, 3, out);
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "vm steps"));
+	CuAssertPtrNotNull(tc, strstr(out->buffer, "query: SELECT"));
+	CuAssertTrue(tc, strstr(out->buffer, "  SCAN") != NULL ||
+				 strstr(out->buffer, "  SEARCH") != NULL);
+
+	CuStringDelete(out);
+}
+
+static CuSuite *init_db_get_suite()
+{
+    CuSuite *suite = CuSuiteNew();
+
+    SUITE_ADD_TEST(suite, test_init_db_fn_memory_with_dir);
+    SUITE_ADD_TEST(suite, test_init_db_fn_memory_null_dir);
+    SUITE_ADD_TEST(suite, test_verbose_stats);
+
+    return suite;
+}
+
+static void test_get_tag_ids(CuTest *tc)
+{
+	static const char *insert_sql =
+	"BEGIN;"
+	"INSERT INTO tag (name) VALUES ('tag1');"
+	"INSERT INTO tag (name) VALUES ('tag2');"
+	"INSERT INTO tag (name) VALUES ('tag3');"
+	"COMMIT;"
+	;
+
+	ftag_db *db = setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SQLITE_OK,
+					  sqlite3_exec(ftag_db_sqlite(db), insert_sql, NULL, NULL, NULL));
+
+	int *idv = get_tag_ids(db, 3, (const char *[]) {"tag1", "tag2", "tag3"} );
+	CuAssertPtrNotNull(tc, idv);
+
+	for (int i = 0; i < 3; i++)
+		CuAssertIntEquals(tc, i+1, idv[i]);
+
+	close_test_db();
+}
+
+static CuSuite *get_tag_ids_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_get_tag_ids);
+
+	return suite;
+}
+
+static ftag_db *filter_setup_test_db(CuTest *tc)
+{
+	static char *insert_sql =
+	"BEGIN;"
+	"INSERT INTO tag (id, name) VALUES ('1', 'tag1');"
+	"INSERT INTO tag (id, name) VALUES ('2', 'tag2');"
+	"INSERT INTO file (id, relative_path) VALUES ('1', 'file1');"
+	"INSERT INTO file (id, relative_path) VALUES ('2', 'file2');"
+	"INSERT INTO file_tag (file_id, tag_id) VALUES ('1', '1');"
+	"INSERT INTO file_tag (file_id, tag_id) VALUES ('2', '1');"
+	"INSERT INTO file_tag (file_id, tag_id) VALUES ('2', '2');"
+	"COMMIT;"
+	;
+
+	ftag_db *db = setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SQLITE_OK,
+					  sqlite3_exec(ftag_db_sqlite(db), insert_sql, NULL, NULL, NULL));
+
+	return db;
+}
+
+static void test_filter_ids_any_tag_one(CuTest *tc)
+{
+	int id2 = 2;
+	step_t *step = NULL;
+
+	ftag_db *db = filter_setup_test_db(tc);
+
+	step = filter_ids_any_tag(db, 1, &id2);
+	CuAssertPtrNotNull(tc, step);
+	CuAssertStrEquals(tc, "file2", ftag_step_result(step));
+	CuAssertPtrEquals(tc, NULL, (void *) ftag_step_result(step));
+
+	ftag_free_step(step);
+	close_test_db();
+}
+
+static void test_filter_ids_any_tag_two(CuTest *tc)
+{
+	int ids[2] = { 1, 2 };
+	step_t *step = NULL;
+
+	ftag_db *db = filter_setup_test_db(tc);
+
+	step = filter_ids_any_tag(db, 2, ids);
+	CuAssertPtrNotNull(tc, step);
+	// Counts on results being ordered
+	CuAssertStrEquals(tc, "file1", ftag_step_result(step));
+	CuAssertStrEquals(tc, "file2", ftag_step_result(step));
+	CuAssertPtrEquals(tc, NULL, (void *) ftag_step_result(step));
+
+	ftag_free_step(step);
+	close_test_db();
+}
+
+/* Rows of step, which must be in order with no repeats, or -1 */
+static int count_ordered(step_t *step)
+{
+	char prev[32] = "";
+	const char *row = NULL;
+	int count = 0;
+
+	while ((row = ftag_step_result(step)) != NULL) {
+		if (strcmp(prev, row) >= 0)
+			return -1;
+		snprintf(prev, sizeof(prev), "%s", row);
+		count++;
+	}
+
+	return count;
+}
+
+static void test_filter_ids_any_tag_many(CuTest *tc)
+{
+	static const char *insert_sql =
+	"WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n "
+	"WHERE i < 700) INSERT INTO file (id, relative_path) "
+	"SELECT i, printf('f%04d', 701 - i) FROM n;"
+	"INSERT INTO tag (id, name) SELECT id, printf('t%d', id) FROM file "
+	"WHERE id <= 600;"
+	"INSERT INTO file_tag (file_id, tag_id) SELECT id, id FROM tag;";
+	ftag_db *db = setup_test_db(tc);
+	int ids[600];
+	step_t *step = NULL;
+
+	for (int i = 0; i < 600; i++)
+		ids[i] = i + 1;
+
+	CuAssertIntEquals(tc, SQLITE_OK,
+					  sqlite3_exec(ftag_db_sqlite(db), insert_sql, NULL, NULL, NULL));
+	CuAssertIntEquals(tc, SUCCESS, ftag_set_mem_budget(db, 1 << 20));
+	CuAssertIntEquals(tc, -1024, query_int(db, "PRAGMA cache_size;"));
+
+	// Fewer associations than files, so they are collected and sorted
+	step = filter_ids_any_tag(db, 600, ids);
+	CuAssertPtrNotNull(tc, step);
+	CuAssertIntEquals(tc, 600, count_ordered(step));
+	ftag_free_step(step);
+
+	// More, so the files are walked in order instead
+	CuAssertIntEquals(tc, SQLITE_OK, sqlite3_exec(ftag_db_sqlite(db),
+		"INSERT INTO file_tag (file_id, tag_id) SELECT id + 1, id FROM tag;",
+		NULL, NULL, NULL));
+	step = filter_ids_any_tag(db, 600, ids);
+	CuAssertPtrNotNull(tc, step);
+	CuAssertIntEquals(tc, 601, count_ordered(step));
+	ftag_free_step(step);
+
+	close_test_db();
+}
+
+static CuSuite *filter_ids_any_tag_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_filter_ids_any_tag_one);
+	SUITE_ADD_TEST(suite, test_filter_ids_any_tag_two);
+	SUITE_ADD_TEST(suite, test_filter_ids_any_tag_many);
+
+	return suite;
+}
+
+static void test_file_count_tag_file(CuTest *tc)
+{
+	ftag_db *db = setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file1", "tag"));
+	CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file2", "tag"));
+	// Tagging twice is not an error and is only counted once
+	CuAssertIntEquals(tc, SUCCESS, ftag_tag_file(db, "file2", "tag"));
+	CuAssertIntEquals(tc, 2,
+					  query_int(db, "SELECT file_count FROM tag WHERE name='tag';"));
+
+	CuAssertIntEquals(tc, SQLITE_OK,
+					  sqlite3_exec(ftag_db_sqlite(db), "DELETE FROM file_tag WHERE file_id=1;",
+								   NULL, NULL, NULL));
+	CuAssertIntEquals(tc, 1,
+					  query_int(db, "SELECT file_count FROM tag WHERE name='tag';"));
+
+	close_test_db();
+}
+
+static void test_file_count_upgrade(CuTest *tc)
+{
+	// A database as created before schema versioning
+	static const char *old_sql =
+	"CREATE TABLE file ( id INTEGER PRIMARY KEY, relative_path TEXT );"
+	"CREATE TABLE tag ( id INTEGER PRIMARY KEY, name TEXT );"
+	"CREATE TABLE file_tag ( file_id INTEGER, tag_id INTEGER );"
+	"CREATE UNIQUE INDEX file_path_uq ON file (relative_path);"
+	"CREATE UNIQUE INDEX tag_name_uq ON tag (name);"
+	"CREATE UNIQUE INDEX file_tag_uq ON file_tag (file_id, tag_id);"
+	"INSERT INTO tag (id, name) VALUES (1, 'dir/tag1');"
+	"INSERT INTO file (id, relative_path) VALUES (1, 'file1');"
+	"INSERT INTO file (id, relative_path) VALUES (2, 'file2');"
+	"INSERT INTO file_tag (file_id, tag_id) VALUES (1, 1);"
+	"INSERT INTO file_tag (file_id, tag_id) VALUES (2, 1);"
+	;
+	char dir[5 + 6 + 1];
+	sqlite3 *conn = NULL;
+	int status;
+
+	close_test_db();
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	chdir(dir);
+	status = sqlite3_open("old.sqlite3", &conn);
+	if (status == SQLITE_OK)
+		status = sqlite3_exec(conn, old_sql, NULL, NULL, NULL);
+	sqlite3_close(conn);
+	chdir("..");
+
+	// Opening alone leaves it be, and a reader can't upgrade it
+	ftag_db *db = test_db = ftag_open_db("old.sqlite3", dir, 0);
+	ftag_db *reader = db != NULL ? ftag_open_reader(db) : NULL;
+	int opened = db != NULL ? get_schema_version(db) : -1;
+	int readonly = reader != NULL ? ftag_db_readonly(reader) : -1;
+	int upgraded = reader != NULL ? ftag_upgrade_db(reader) : -1;
+	ftag_close_db(reader);
+
+	upgraded = upgraded == ERROR && db != NULL ? ftag_upgrade_db(db) : -1;
+	int version = db != NULL ? get_schema_version(db) : -1;
+	int count = db != NULL ? query_int(db, "SELECT file_count FROM tag;") : -1;
+	int ancestors = db != NULL ?
+		query_int(db, "SELECT COUNT(*) FROM tag_ancestor;") : -1;
+
+	close_test_db();
+	chdir(dir);
+	unlink("old.sqlite3");
+	chdir("..");
+	rmdir(dir);
+
+	CuAssertIntEquals(tc, SQLITE_OK, status);
+	CuAssertIntEquals(tc, 0, opened);
+	CuAssertIntEquals(tc, 1, readonly);
+	CuAssertIntEquals(tc, SUCCESS, upgraded);
+	CuAssertIntEquals(tc, schema_version, version);
+	CuAssertIntEquals(tc, 2, count);
+	CuAssertIntEquals(tc, 2, ancestors);
+}
+
+static void test_step_result_count(CuTest *tc)
+{
+	step_t *step = NULL;
+
+	ftag_db *db = filter_setup_test_db(tc);
+
+	step = ftag_list_by_file(db, "file2");
+	CuAssertPtrNotNull(tc, step);
+	CuAssertStrEquals(tc, "tag1", ftag_step_result(step));
+	CuAssertIntEquals(tc, 2, ftag_step_result_count(step));
+	CuAssertStrEquals(tc, "tag2", ftag_step_result(step));
+	CuAssertIntEquals(tc, 1, ftag_step_result_count(step));
+
+	ftag_free_step(step);
+	close_test_db();
+}
+
+static void test_related(CuTest *tc)
+{
+	// Pairs the maintained table doesn't agree with a full recount on
+	static const char *diff_sql = "SELECT COUNT(*) FROM (SELECT a.tag_id, "
+	"b.tag_id AS other_id, COUNT(*) AS count FROM file_tag AS a JOIN file_tag "
+	"AS b ON b.file_id = a.file_id AND b.tag_id != a.tag_id GROUP BY 1, 2 "
+	"EXCEPT SELECT tag_id, other_id, count FROM tag_pair UNION ALL "
+	"SELECT tag_id, other_id, count FROM tag_pair EXCEPT SELECT a.tag_id, "
+	"b.tag_id, COUNT(*) FROM file_tag AS a JOIN file_tag AS b ON b.file_id = "
+	"a.file_id AND b.tag_id != a.tag_id GROUP BY 1, 2);";
+	ftag_db *db = setup_test_db(tc);
+	CuString *str = CuStringNew();
+	step_t *step = NULL;
+	const char *row = NULL;
+
+	ftag_tag_files(db, 3, (const char *[]) { "a", "b", "c" }, 2,
+			  (const char *[]) { "photo", "2015" });
+	ftag_tag_file(db, "a", "beach");
+	ftag_tag_file(db, "b", "beach");
+	ftag_tag_file(db, "c", "city");
+	ftag_tag_file(db, "d", "beach");
+	CuAssertIntEquals(tc, 0, query_int(db, diff_sql));
+
+	step = ftag_list_related(db, "photo", 0);
+	CuAssertPtrNotNull(tc, step);
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s:%d\n", row, ftag_step_result_count(step));
+	ftag_free_step(step);
+	CuAssertStrEquals(tc, "2015:3\nbeach:2\ncity:1\n", str->buffer);
+
+	reset_string(str);
+	step = ftag_list_related(db, "beach", 1);
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s\n", row);
+	ftag_free_step(step);
+	CuAssertStrEquals(tc, "2015\n", str->buffer);
+
+	// Merging moves pairs over, untagging and removed tags drop them
+	ftag_merge_tags(db, "city", "beach");
+	ftag_untag_file(db, "a", 1, (const char *[]) { "2015" });
+	ftag_rename_tag(db, "photo", "photos");
+	CuAssertIntEquals(tc, 0, query_int(db, diff_sql));
+	CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM tag_pair "
+									   "WHERE count <= 0;"));
+
+	reset_string(str);
+	step = ftag_list_related(db, "photos", 0);
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s:%d\n", row, ftag_step_result_count(step));
+	ftag_free_step(step);
+	CuAssertStrEquals(tc, "beach:3\n2015:2\n", str->buffer);
+
+	close_test_db();
+	CuStringDelete(str);
+}
+
+/* The rows of step as "name:count" lines */
+static void append_step(CuString *str, step_t *step)
+{
+	const char *row = NULL;
+
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s:%d\n", row, ftag_step_result_count(step));
 
-	if (dbfilename == NULL) {
-		static char *filename_static = DB_FILENAME;
-		dbfilename = filename_static;
-	}
+	ftag_free_step(step);
+}
 
-	if (init_db(dbfilename, dbpath) != 0) {
-		fprintf(stderr, PROGRAM_NAME ": error: failed to initialize database\n");
-		return ERROR;
-	}
+static void test_top_tags(CuTest *tc)
+{
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	ftag_db *db = setup_test_db(tc);
+	ftag_snapshot *snap = NULL;
+	CuString *str = CuStringNew();
+	CuString *expected = CuStringNew();
+
+	// Tag k is on k files, and b and c tie
+	ftag_tag_files(db, 4, (const char *[]) { "1", "2", "3", "4" }, 1,
+			  (const char *[]) { "d" });
+	ftag_tag_files(db, 2, (const char *[]) { "1", "2" }, 2,
+			  (const char *[]) { "c", "b" });
+	ftag_tag_files(db, 3, (const char *[]) { "1", "2", "3" }, 1,
+			  (const char *[]) { ".hidden" });
+	ftag_tag_file(db, "1", "a");
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+	sprintf(path, "%s/snapshot", dir);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_snapshot(db, path));
+	snap = ftag_open_snapshot(path);
+	unlink(path);
+	rmdir(dir);
+	CuAssertPtrNotNull(tc, snap);
+
+	append_step(str, ftag_list_top_tags(db, 2, 0));
+	CuAssertStrEquals(tc, "d:4\nb:2\n", str->buffer);
+	ftag_snapshot_list_top(snap, 2, 0, append_tag, expected);
+	CuAssertStrEquals(tc, str->buffer, expected->buffer);
+
+	reset_string(str);
+	reset_string(expected);
+	append_step(str, ftag_list_top_tags(db, 0, 2));
+	CuAssertStrEquals(tc, "d:4\nb:2\nc:2\n", str->buffer);
+	ftag_snapshot_list_top(snap, 0, 2, append_tag, expected);
+	CuAssertStrEquals(tc, str->buffer, expected->buffer);
+
+	reset_string(str);
+	reset_string(expected);
+	ftag_set_show_hidden(db, 1);
+	ftag_snapshot_show_hidden(snap, 1);
+	append_step(str, ftag_list_top_tags(db, 10, 0));
+	CuAssertStrEquals(tc, "d:4\n.hidden:3\nb:2\nc:2\na:1\n", str->buffer);
+	ftag_snapshot_list_top(snap, 10, 0, append_tag, expected);
+	CuAssertStrEquals(tc, str->buffer, expected->buffer);
+
+	ftag_close_snapshot(snap);
+	close_test_db();
+	CuStringDelete(str);
+	CuStringDelete(expected);
+}
 
-	if (verbosity > 0) {
-		char *cdir = getcwd(NULL, 0);
-		
-		if (cdir != NULL) {
-			fprintf(stderr, "choosing db '%s/%s'\n", cdir, dbfilename);
-			free(cdir);
-		} else {
-			close_db();
+static CuSuite *file_count_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
 
-			return ERROR;
-		}
-	}
+	SUITE_ADD_TEST(suite, test_file_count_tag_file);
+	SUITE_ADD_TEST(suite, test_file_count_upgrade);
+	SUITE_ADD_TEST(suite, test_step_result_count);
+	SUITE_ADD_TEST(suite, test_related);
+	SUITE_ADD_TEST(suite, test_top_tags);
 
-	if (mode != MODE_NONE) {
-		int margc = argc - optind;
-		char **margv = argv + optind;
-	
-		switch (mode) {
-			case MODE_TAG_FILE:
-				return main_tag_file(margc, margv);
-			case MODE_FILTER:
-				return main_filter(margc, margv);
-			case MODE_LIST:
-				return main_list(margc, margv);
-			default:
-				assert(0);
-				return ERROR;
-		}
-	} else
-		return ERROR;
+	return suite;
 }
 
-/***--- Tests ---***/
+static void test_filter_ids_all_tags(CuTest *tc)
+{
+	int ids[2] = { 1, 2 };
+	step_t *step = NULL;
+
+	ftag_db *db = filter_setup_test_db(tc);
+
+	step = filter_ids_all_tags(db, 2, ids);
+	CuAssertPtrNotNull(tc, step);
+	CuAssertStrEquals(tc, "file2", ftag_step_result(step));
+	CuAssertPtrEquals(tc, NULL, (void *) ftag_step_result(step));
 
-static void setup_test_db(CuTest *tc) {
-    // When tests fail, they won't be able to close_db
-    if (dbconn != NULL)
-        close_db();
-    CuAssertIntEquals(tc, SUCCESS, init_memory_db());
+	ftag_free_step(step);
+	close_test_db();
 }
 
-static void test_chdir_to_db_null_return(CuTest *tc)
+static void test_order_ids_by_count(CuTest *tc)
 {
-    CuAssertIntEquals(tc, ERROR, chdir_to_db(NULL));
+	int ids[3] = { 1, -1, 2 };
+
+	ftag_db *db = filter_setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SUCCESS, order_ids_by_count(db, 3, ids));
+	CuAssertIntEquals(tc, -1, ids[0]);
+	CuAssertIntEquals(tc, 2, ids[1]);
+	CuAssertIntEquals(tc, 1, ids[2]);
+
+	close_test_db();
 }
 
-static void test_chdir_to_db_null_cwd(CuTest *tc)
+static CuSuite *filter_ids_all_tags_get_suite()
 {
-    char *beforedir = getcwd(NULL, 0);
-    char *afterdir = NULL;
+	CuSuite *suite = CuSuiteNew();
 
-    chdir_to_db(NULL);
-    afterdir = getcwd(NULL, 0);
-    CuAssertStrEquals(tc, beforedir, afterdir);
-    free(beforedir);
-    free(afterdir);
+	SUITE_ADD_TEST(suite, test_filter_ids_all_tags);
+	SUITE_ADD_TEST(suite, test_order_ids_by_count);
+
+	return suite;
 }
 
-static CuSuite *chdir_to_db_get_suite()
+static void test_untag_file(CuTest *tc)
 {
-    CuSuite *suite = CuSuiteNew();
+	ftag_db *db = filter_setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SUCCESS,
+					  ftag_untag_file(db, "file2", 2, (const char *[]) {"tag1", "tag2"}));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 1,
+					  query_int(db, "SELECT file_count FROM tag WHERE name='tag1';"));
+	// tag2 and file2 are no longer used by anything
+	CuAssertIntEquals(tc, 0,
+					  query_int(db, "SELECT COUNT(*) FROM tag WHERE name='tag2';"));
+	CuAssertIntEquals(tc, 0,
+					  query_int(db, "SELECT COUNT(*) FROM file "
+								"WHERE relative_path='file2';"));
+
+	close_test_db();
+}
 
-    SUITE_ADD_TEST(suite, test_chdir_to_db_null_return);
-    SUITE_ADD_TEST(suite, test_chdir_to_db_null_cwd);
- 
-    return suite;
+static void test_rename_tag(CuTest *tc)
+{
+	ftag_db *db = filter_setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_rename_tag(db, "tag2", "new"));
+	CuAssertIntEquals(tc, 2,
+					  query_int(db, "SELECT id FROM tag WHERE name='new';"));
+	CuAssertIntEquals(tc, ERROR, ftag_rename_tag(db, "tag1", "new"));
+	CuAssertIntEquals(tc, ERROR, ftag_rename_tag(db, "missing", "other"));
+
+	close_test_db();
 }
 
-static void test_tag_file_null_file(CuTest *tc)
+static void test_merge_tags(CuTest *tc)
 {
-    setup_test_db(tc);
-    CuAssertIntEquals(tc, ERROR, tag_file(NULL, "tag"));
-    close_db();
+	ftag_db *db = filter_setup_test_db(tc);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_merge_tags(db, "tag1", "tag2"));
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 2,
+					  query_int(db, "SELECT file_count FROM tag WHERE name='tag2';"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM tag;"));
+	CuAssertIntEquals(tc, ERROR, ftag_merge_tags(db, "tag1", "tag2"));
+
+	close_test_db();
 }
 
-static void test_tag_file_null_tag(CuTest *tc)
+static CuSuite *untag_get_suite()
 {
-    setup_test_db(tc);
-    CuAssertIntEquals(tc, ERROR, tag_file("file", NULL));
-    close_db();
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_untag_file);
+	SUITE_ADD_TEST(suite, test_rename_tag);
+	SUITE_ADD_TEST(suite, test_merge_tags);
+
+	return suite;
 }
 
-static void test_tag_file_tag_exits(CuTest *tc)
+static int append_row(const char *row, void *arg)
 {
-    sqlite3_stmt *prep = NULL;
+	CuStringAppend(arg, row);
+	CuStringAppendChar(arg, '\n');
+	return 0;
+}
+
+static int count_row(const char *row, void *arg)
+{
+	(void) row;
+	++*(int *) arg;
+	return 0;
+}
 
-    setup_test_db(tc);
+static void assert_parallel_same(CuTest *tc, ftag_db *db, int tagc,
+								 const char **tagv, int flags, int expected)
+{
+	CuString *serial = CuStringNew();
+	CuString *parallel = CuStringNew();
+	int count = 0;
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_parallel(db, tagc, tagv, flags, 1, 0,
+												   append_row, serial));
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_parallel(db, tagc, tagv, flags, 4, 0,
+												   append_row, parallel));
+	CuAssertStrEquals(tc, serial->buffer, parallel->buffer);
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_parallel(db, tagc, tagv, flags, 3, 1,
+												   count_row, &count));
+	CuAssertIntEquals(tc, expected, count);
+
+	CuStringDelete(serial);
+	CuStringDelete(parallel);
+}
 
-    CuAssertIntEquals(tc, SUCCESS, tag_file("file", "tag"));
-    CuAssertIntEquals(tc, SQLITE_OK,
-                      sqlite3_prepare_v2(dbconn, "SELECT name FROM tag;", -1,
-                                         &prep, NULL)
-                      );
-    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
-    CuAssertStrEquals(tc, "tag",
-                      (const char *) sqlite3_column_text(prep, 0));
-    sqlite3_finalize(prep);
-    close_db();
+static void test_filter_parallel(CuTest *tc)
+{
+	char dir[5 + 6 + 1];
+	char *path = NULL;
+	ftag_db *db = NULL;
+
+	close_test_db();
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	db = test_db = ftag_open_db(DB_FILENAME, dir, 0);
+	CuAssertPtrNotNull(tc, db);
+
+	// Inserted out of path order, so that id ranges and paths disagree
+	for (int i = 0; i < 100; i++) {
+		char file[16];
 
+		sprintf(file, "file%02d", (i * 37) % 100);
+		ftag_tag_file(db, file, "all");
+		if (i % 2 == 0)
+			ftag_tag_file(db, file, "even");
+		if (i % 3 == 0)
+			ftag_tag_file(db, file, "third");
+	}
+
+	assert_parallel_same(tc, db, 0, NULL, FILTER_ALL, 100);
+	assert_parallel_same(tc, db, 2, (const char *[]) { "even", "third" },
+						 FILTER_ANY_TAG, 67);
+	assert_parallel_same(tc, db, 2, (const char *[]) { "all", "third" },
+						 FILTER_ALL_TAGS, 34);
+	assert_parallel_same(tc, db, 1, (const char *[]) { "missing" },
+						 FILTER_ANY_TAG, 0);
+
+	path = strdup(ftag_db_path(db));
+	close_test_db();
+	unlink(path);
+	rmdir(dir);
+	free(path);
 }
 
-static void test_tag_file_file_exits(CuTest *tc)
+/* Remove the cache directory of db and return how many files were in it */
+static int remove_cache_dir(ftag_db *db)
 {
-    sqlite3_stmt *prep = NULL;
+	char dir[256];
+	char path[512];
+	struct dirent *ent = NULL;
+	DIR *dp = NULL;
+	int count = 0;
+
+	snprintf(dir, sizeof(dir), "%s.cache", ftag_db_path(db));
+	dp = opendir(dir);
+	if (dp == NULL)
+		return 0;
+
+	while ((ent = readdir(dp)) != NULL) {
+		if (*ent->d_name == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		unlink(path);
+		count++;
+	}
 
-    setup_test_db(tc);
+	closedir(dp);
+	rmdir(dir);
 
-    CuAssertIntEquals(tc, SUCCESS, tag_file("file", "tag"));
-    CuAssertIntEquals(tc, SQLITE_OK,
-                      sqlite3_prepare_v2(dbconn,
-                                         "SELECT relative_path FROM file;", -1,
-                                         &prep, NULL)
-                      );
-    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
-    CuAssertStrEquals(tc, "file",
-                      (const char *)sqlite3_column_text(prep, 0));
-    // no more rows should be returned!!
-    sqlite3_finalize(prep);
-    close_db();
+	return count;
 }
 
-static void test_tag_file_xref_exits(CuTest *tc)
+static void test_filter_cached(CuTest *tc)
 {
-    sqlite3_stmt *prep = NULL;
+	char dir[5 + 6 + 1];
+	char *path = NULL;
+	ftag_db *db = NULL;
+	CuString *first = CuStringNew();
+	CuString *second = CuStringNew();
+	CuString *third = CuStringNew();
+
+	close_test_db();
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	db = test_db = ftag_open_db(DB_FILENAME, dir, 0);
+	CuAssertPtrNotNull(tc, db);
+
+	ftag_tag_file(db, "file1", "tag1");
+	ftag_tag_file(db, "file2", "tag2");
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_cached(db, 2,
+		(const char *[]) { "tag1", "tag2" }, FILTER_ANY_TAG, 1, 0,
+		append_row, first));
+	// Served from the cache, tag order doesn't matter
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_cached(db, 3,
+		(const char *[]) { "tag2", "tag1", "tag2" }, FILTER_ANY_TAG, 1, 0,
+		append_row, second));
+	CuAssertStrEquals(tc, "file1\nfile2\n", first->buffer);
+	CuAssertStrEquals(tc, first->buffer, second->buffer);
+
+	// Any write invalidates the result
+	ftag_tag_file(db, "file3", "tag1");
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_cached(db, 2,
+		(const char *[]) { "tag1", "tag2" }, FILTER_ANY_TAG, 1, 0,
+		append_row, third));
+	CuAssertStrEquals(tc, "file1\nfile2\nfile3\n", third->buffer);
+
+	path = strdup(ftag_db_path(db));
+	CuAssertIntEquals(tc, 1, remove_cache_dir(db));
+	close_test_db();
+	unlink(path);
+	rmdir(dir);
+	free(path);
+
+	CuStringDelete(first);
+	CuStringDelete(second);
+	CuStringDelete(third);
+}
 
-    setup_test_db(tc);
+static int str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
 
-    CuAssertIntEquals(tc, SUCCESS, tag_file("file", "tag"));
-    sqlite3_prepare_v2(dbconn, "SELECT file_id, tag_id FROM file_tag;", -1,
-                       &prep, NULL);
-    CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+/* Sort the lines of str, to compare with results in path order */
+static void sort_lines(CuString *str)
+{
+	char **lines = malloc(sizeof(*lines) * (str->length + 1));
+	char *copy = strdup(str->buffer);
+	int n = 0;
 
-    // Since the in-memory database should be empty, both file and
-    // tag should have been assigned id 1
-    CuAssertIntEquals(tc, 1, sqlite3_column_int(prep, 0));
-    CuAssertIntEquals(tc, 1, sqlite3_column_int(prep, 1));
+	for (char *line = strtok(copy, "\n"); line != NULL; line = strtok(NULL, "\n"))
+		lines[n++] = line;
 
-    sqlite3_finalize(prep);
+	qsort(lines, n, sizeof(*lines), str_cmp);
+
+	reset_string(str);
+	for (int i = 0; i < n; i++)
+		CuStringAppendFormat(str, "%s\n", lines[i]);
 
-    close_db();
+	free(lines);
+	free(copy);
 }
 
-static CuSuite *tag_file_get_suite()
+/* All of a filter, a page of limit at a time, into str */
+static void append_pages(CuTest *tc, ftag_db *db, int tagc, const char **tagv,
+						 int flags, int order, int limit, CuString *str)
 {
-    CuSuite *suite = CuSuiteNew();
+	char *after = NULL;
+	int pages = 0;
+
+	for (;;) {
+		step_t *step = ftag_filter_page(db, tagc, tagv, flags, order, after, limit);
+		const char *row = NULL;
+		int rows = 0;
+
+		CuAssertPtrNotNull(tc, step);
+		while ((row = ftag_step_result(step)) != NULL) {
+			CuStringAppendFormat(str, "%s\n", row);
+			if (++rows == limit) {
+				free(after);
+				after = strdup(ftag_step_result_key(step));
+			}
+		}
+		CuAssertIntEquals(tc, SUCCESS, ftag_free_step(step));
 
-    SUITE_ADD_TEST(suite, test_tag_file_null_file);
-    SUITE_ADD_TEST(suite, test_tag_file_null_tag);
-    SUITE_ADD_TEST(suite, test_tag_file_tag_exits);
-    SUITE_ADD_TEST(suite, test_tag_file_file_exits);
-    SUITE_ADD_TEST(suite, test_tag_file_xref_exits);
+		if (rows < limit || ++pages > 100)
+			break;
+	}
 
-    return suite;
+	free(after);
 }
 
-static void test_init_db_fn_memory_with_dir(CuTest *tc)
+static void test_filter_page(CuTest *tc)
 {
-    char dir[5 + 6 + 1];
+	static const char *filters[][2] = {
+		{ "common", NULL }, { "rare", NULL }, { "half", "rare" },
+		{ "rare", "half" }, { "c*", "rare" },
+	};
+	ftag_db *db = setup_test_db(tc);
+	CuString *expected = CuStringNew();
+	CuString *str = CuStringNew();
+	step_t *step = NULL;
 
-    if (dbconn != NULL) {
-        close_db();
-        dbconn = NULL;
-    }
+	// Files are created in reverse path order, so ids and paths disagree
+	for (int i = 59; i >= 0; i--) {
+		char file[16];
 
-    strncpy(dir, "ftag-XXXXXX", sizeof(dir));
-    char *status = mkdtemp(dir);
-    if (status == NULL)
-        CuFail(tc, "Failed mkdtemp");
+		sprintf(file, "file%02d", i);
+		ftag_tag_file(db, file, "common");
+		if (i % 2 == 0)
+			ftag_tag_file(db, file, "half");
+		if (i % 20 == 0)
+			ftag_tag_file(db, file, "rare");
+	}
+	ftag_tag_file(db, ".hidden", "common");
+
+	// Pages of common tags walk the files, of rare ones the tags
+	for (size_t i = 0; i < sizeof(filters) / sizeof(*filters); i++) {
+		int tagc = filters[i][1] == NULL ? 1 : 2;
+
+		for (int flags = FILTER_ANY_TAG; flags <= FILTER_ALL_TAGS; flags <<= 1) {
+			reset_string(expected);
+			reset_string(str);
+			ftag_filter_parallel(db, tagc, filters[i], flags, 1, 0, append_row,
+							expected);
+			sort_lines(expected);
+			append_pages(tc, db, tagc, filters[i], flags, ORDER_PATH, 7, str);
+			CuAssertStrEquals(tc, expected->buffer, str->buffer);
+		}
+	}
 
-    CuAssertIntEquals(tc, SUCCESS, init_db(":memory:", dir));
-    chdir(dir);
+	reset_string(expected);
+	reset_string(str);
+	ftag_filter_parallel(db, 0, NULL, FILTER_ALL, 1, 0, append_row, expected);
+	sort_lines(expected);
+	append_pages(tc, db, 0, NULL, FILTER_ALL, ORDER_PATH, 7, str);
+	CuAssertStrEquals(tc, expected->buffer, str->buffer);
+
+	// In id order the files come in the order they were added
+	reset_string(str);
+	append_pages(tc, db, 1, (const char *[]) { "rare" }, FILTER_ANY_TAG,
+				 ORDER_ID, 2, str);
+	CuAssertStrEquals(tc, "file40\nfile20\nfile00\n", str->buffer);
+
+	reset_string(str);
+	step = ftag_filter_page(db, 1, (const char *[]) { "half" }, FILTER_ANY_TAG,
+					   ORDER_ID, "3", 2);
+	append_step(str, step);
+	CuAssertStrEquals(tc, "file56:4\nfile54:6\n", str->buffer);
+
+	CuAssertPtrEquals(tc, NULL, ftag_filter_page(db, 0, NULL, FILTER_ALL, ORDER_ID,
+											"x", 1));
+
+	close_test_db();
+	CuStringDelete(expected);
+	CuStringDelete(str);
+}
 
-    int exists = access(":memory:", F_OK);
+static void test_filter_recursive(CuTest *tc)
+{
+	char dir[5 + 6 + 1];
+	CuString *str = CuStringNew();
+	ftag_db *top = NULL;
+	ftag_db *inner = NULL;
+	ftag_db *db = NULL;
+	char **dirs = NULL;
+	int status = ERROR;
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	chdir(dir);
+	mkdir("sub", 0700);
+	mkdir("sub/inner", 0700);
+
+	// The enclosing database knows one of the nested database's files too
+	top = ftag_open_db("db", ".", 0);
+	inner = ftag_open_db("db", "sub/inner", 0);
+	ftag_tag_file(top, "sub/inner/a", "x");
+	ftag_tag_file(top, "other/b", "x");
+	ftag_tag_file(top, "sub/c", "x");
+	ftag_tag_file(top, "sub/d", "y");
+	ftag_tag_file(inner, "a", "x");
+	ftag_tag_file(inner, "e", "x");
+	ftag_tag_file(inner, ".f", "x");
+	ftag_close_db(top);
+	ftag_close_db(inner);
+
+	chdir("sub");
+	dirs = find_db_dirs("db", 0);
+	db = ftag_open_db("db", NULL, 0);
+	if (db != NULL)
+		status = ftag_filter_recursive(db, 1, (const char *[]) { "x" },
+								  FILTER_ANY_TAG, append_row, str);
+	ftag_close_db(db);
+
+	unlink("inner/db");
+	rmdir("inner");
+	chdir("..");
+	unlink("db");
+	rmdir("sub");
+	chdir("..");
+	rmdir(dir);
+
+	CuAssertPtrNotNull(tc, dirs);
+	CuAssertStrEquals(tc, "..", dirs[0]);
+	CuAssertStrEquals(tc, "inner", dirs[1]);
+	CuAssertPtrEquals(tc, NULL, dirs[2]);
+	CuAssertIntEquals(tc, SUCCESS, status);
+	CuAssertStrEquals(tc, "../other/b\nc\ninner/a\ninner/e\n", str->buffer);
+
+	free_db_dirs(dirs);
+	CuStringDelete(str);
+}
 
-	close_db();
-    unlink(":memory:");
-    chdir("..");
-    rmdir(dir);
+static CuSuite *filter_parallel_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
 
-    CuAssertIntEquals(tc, 0, exists);
+	SUITE_ADD_TEST(suite, test_filter_parallel);
+	SUITE_ADD_TEST(suite, test_filter_cached);
+	SUITE_ADD_TEST(suite, test_filter_page);
+	SUITE_ADD_TEST(suite, test_filter_recursive);
+
+	return suite;
 }
 
-static void test_init_db_fn_memory_null_dir(CuTest *tc)
+static void test_snapshot(CuTest *tc)
 {
-    char dir[5 + 6 + 1];
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	ftag_db *db = setup_test_db(tc);
+	ftag_snapshot *snap = NULL;
+	CuString *expected = CuStringNew();
+	CuString *str = CuStringNew();
+	int count = 0;
+
+	// More files than fit in one block of front coded paths
+	for (int i = 0; i < 40; i++) {
+		char file[16];
+
+		sprintf(file, "file%02d", i);
+		ftag_tag_file(db, file, "all");
+		if (i % 2 == 0)
+			ftag_tag_file(db, file, "even");
+		if (i % 5 == 0)
+			ftag_tag_file(db, file, "five");
+	}
+	ftag_tag_file(db, ".dot", "all");
+	ftag_tag_file(db, "file00", ".hidden");
+	// Rows left dangling by a foreign key that was never enforced
+	CuAssertIntEquals(tc, SQLITE_OK, sqlite3_exec(ftag_db_sqlite(db),
+		"INSERT INTO file_tag (file_id, tag_id) VALUES (1, 999), (999, 1);",
+		NULL, NULL, NULL));
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+	sprintf(path, "%s/snapshot", dir);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_snapshot(db, path));
+	snap = ftag_open_snapshot(path);
+	unlink(path);
+	rmdir(dir);
+	CuAssertPtrNotNull(tc, snap);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_snapshot_filter(snap, 0, NULL, FILTER_ALL,
+												   count_row, &count));
+	CuAssertIntEquals(tc, 40, count);
+
+	ftag_filter_parallel(db, 2, (const char *[]) { "even", "five" }, FILTER_ANY_TAG,
+					1, 0, append_row, expected);
+	ftag_snapshot_filter(snap, 2, (const char *[]) { "five", "even" }, FILTER_ANY_TAG,
+					append_row, str);
+	CuAssertStrEquals(tc, expected->buffer, str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_filter(snap, 3, (const char *[]) { "five", "all", "even" },
+					FILTER_ALL_TAGS, append_row, str);
+	CuAssertStrEquals(tc, "file00\nfile10\nfile20\nfile30\n", str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_filter(snap, 2, (const char *[]) { "even", "missing" },
+					FILTER_ALL_TAGS, append_row, str);
+	CuAssertStrEquals(tc, "", str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_list(snap, "file10", append_tag, str);
+	CuAssertStrEquals(tc, "all:41\neven:20\nfive:8\n", str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_list(snap, "file100", append_tag, str);
+	CuAssertStrEquals(tc, "", str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_show_hidden(snap, 1);
+	ftag_snapshot_list(snap, NULL, append_tag, str);
+	CuAssertStrEquals(tc, ".hidden:1\nall:41\neven:20\nfive:8\n", str->buffer);
+
+	ftag_close_snapshot(snap);
+	close_test_db();
+	CuStringDelete(expected);
+	CuStringDelete(str);
+}
 
-    if (dbconn != NULL) {
-        close_db();
-        dbconn = NULL;
-    }
+static CuSuite *snapshot_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
 
-    strncpy(dir, "ftag-XXXXXX", sizeof(dir));
-    char *status = mkdtemp(dir);
-    if (status == NULL)
-        CuFail(tc, "Failed mkdtemp");
+	SUITE_ADD_TEST(suite, test_snapshot);
 
-    chdir(dir);
-    CuAssertIntEquals(tc, SUCCESS, init_db(":memory:", NULL));
+	return suite;
+}
 
-    int exists = access(":memory:", F_OK);
+static void test_export_import(CuTest *tc)
+{
+	const char *weird = "a\tb\\c\nd\"e";
+
+	for (int format = FORMAT_JSONL; format <= FORMAT_NUL; format++) {
+		ftag_db *src = filter_setup_test_db(tc);
+		ftag_db *dst = ftag_open_memory_db();
+		FILE *fp = tmpfile();
+		CuString *str = CuStringNew();
+		char *before = NULL, *after = NULL;
+		size_t before_len = 0, after_len = 0;
+		FILE *mem = NULL;
+
+		CuAssertPtrNotNull(tc, dst);
+		CuAssertPtrNotNull(tc, fp);
+		ftag_tag_file(src, weird, "tag1");
+		// Times are kept, so the same rows can come back out
+		sqlite3_exec(ftag_db_sqlite(src), "UPDATE file_tag SET tagged_at = "
+					 "1420070400 + rowid;", NULL, NULL, NULL);
+
+		CuAssertIntEquals(tc, SUCCESS, ftag_export_db(src, fp, format));
+		rewind(fp);
+		CuAssertIntEquals(tc, SUCCESS, ftag_import_db(dst, fp, format));
+
+		// The same ids and rows come back out
+		mem = open_memstream(&before, &before_len);
+		ftag_export_db(src, mem, format);
+		fclose(mem);
+		mem = open_memstream(&after, &after_len);
+		ftag_export_db(dst, mem, format);
+		fclose(mem);
+		CuAssertIntEquals(tc, (int) before_len, (int) after_len);
+		CuAssertIntEquals(tc, 0, memcmp(before, after, before_len));
+		CuAssertIntEquals(tc, 1420070402, query_int(dst, "SELECT tagged_at "
+										   "FROM file_tag WHERE rowid = 2;"));
+		CuAssertIntEquals(tc, 0, query_int(dst, "SELECT COUNT(*) FROM change_log "
+										   "WHERE op = 'tag' AND tagged_at IS "
+										   "NOT (SELECT x.tagged_at FROM "
+										   "file_tag AS x JOIN file AS f ON "
+										   "f.id = x.file_id JOIN tag AS t ON "
+										   "t.id = x.tag_id WHERE f.relative_path "
+										   "= file AND t.name = tag);"));
+
+		ftag_filter_parallel(dst, 1, (const char *[]) { "tag1" }, FILTER_ANY_TAG, 1, 0,
+						append_row, str);
+		CuAssertIntEquals(tc, 1, strstr(str->buffer, weird) != NULL);
+		CuAssertIntEquals(tc, 3,
+						  query_int(dst, "SELECT file_count FROM tag WHERE id = 1;"));
+		CuAssertIntEquals(tc, query_int(src, "SELECT total(count) FROM tag_pair;"),
+						  query_int(dst, "SELECT total(count) FROM tag_pair;"));
+		CuAssertIntEquals(tc, 3, query_int(dst, "SELECT COUNT(*) FROM "
+										   "sqlite_master WHERE type = 'trigger' "
+										   "AND name LIKE 'tag_pair_%';"));
+		CuAssertIntEquals(tc, 4, query_int(dst, "SELECT COUNT(*) FROM change_log;"));
+		CuAssertIntEquals(tc, 4, query_int(dst, "SELECT COUNT(*) FROM "
+										   "sqlite_master WHERE type = 'trigger' "
+										   "AND name LIKE 'change_log_%';"));
+
+		// Importing again maps everything onto the existing rows
+		rewind(fp);
+		CuAssertIntEquals(tc, SUCCESS, ftag_import_db(dst, fp, format));
+		CuAssertIntEquals(tc, 3, query_int(dst, "SELECT COUNT(*) FROM file;"));
+		CuAssertIntEquals(tc, 4, query_int(dst, "SELECT COUNT(*) FROM file_tag;"));
+
+		fclose(fp);
+		free(before);
+		free(after);
+		ftag_close_db(dst);
+		close_test_db();
+		CuStringDelete(str);
+	}
+}
 
-	close_db();
-    unlink(":memory:");
-    chdir("..");
-    rmdir(dir);
+static void test_import_into_existing(CuTest *tc)
+{
+	static const char *records =
+	"{\"type\":\"file\",\"id\":7,\"path\":\"file2\"}\n"
+	"{ \"type\" : \"tag\", \"name\" : \"t\\u00e4g\", \"id\" : 9 }\n"
+	"{\"type\":\"file_tag\",\"file\":7,\"tag\":9}\n"
+	"{\"type\":\"tag\",\"id\":10,\"name\":\"old\"}\n"
+	"{\"type\":\"file_tag\",\"file\":7,\"tag\":10,\"time\":100}\n";
+	ftag_db *db = filter_setup_test_db(tc);
+	FILE *fp = fmemopen((void *) records, strlen(records), "r");
+	long long now = (long long) time(NULL);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_import_db(db, fp, FORMAT_JSONL));
+	fclose(fp);
+
+	// An association without a time is made now
+	CuAssertTrue(tc, query_int(db, "SELECT x.tagged_at FROM file_tag AS x "
+							   "JOIN tag AS t ON t.id = x.tag_id WHERE "
+							   "t.name = 't\xc3\xa4g';") >= now - 60);
+	CuAssertIntEquals(tc, 100, query_int(db, "SELECT x.tagged_at FROM "
+										 "file_tag AS x JOIN tag AS t ON "
+										 "t.id = x.tag_id WHERE t.name = 'old';"));
+
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT COUNT(*) FROM file;"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM file_tag AS x, "
+		"file AS f, tag AS t WHERE x.file_id = f.id AND x.tag_id = t.id AND "
+		"f.relative_path = 'file2' AND t.name = 't\xc3\xa4g';"));
+
+	fp = fmemopen("file_tag\t1\t99\n", 15, "r");
+	CuAssertIntEquals(tc, ERROR, ftag_import_db(db, fp, FORMAT_TSV));
+	fclose(fp);
+	// Only associations have a time
+	fp = fmemopen("file\t8\tf\t100\n", 14, "r");
+	CuAssertIntEquals(tc, ERROR, ftag_import_db(db, fp, FORMAT_TSV));
+	fclose(fp);
+
+	close_test_db();
+}
 
-    CuAssertIntEquals(tc, 0, exists);
+static void test_import_bulk(CuTest *tc)
+{
+	static const char *schema_sql = "SELECT group_concat(name) FROM (SELECT "
+	"name FROM sqlite_master WHERE type IN ('index', 'trigger') ORDER BY name);";
+	static const char *records =
+	"file\t1\tb\nfile\t2\t.a\ntag\t1\tx\ntag\t2\ty\n"
+	"file_tag\t1\t1\nfile_tag\t1\t2\nfile_tag\t2\t1\nfile_tag\t1\t1\n";
+	static const char *twice = "file\t1\ta\nfile\t2\ta\n";
+	ftag_db *fresh = ftag_open_memory_db();
+	ftag_db *db = ftag_open_memory_db();
+	CuString *expected = CuStringNew();
+	CuString *got = CuStringNew();
+	sqlite3_stmt *prep = NULL;
+	FILE *fp = NULL;
+
+	CuAssertPtrNotNull(tc, fresh);
+	CuAssertPtrNotNull(tc, db);
+
+	// Loaded without indexes, which are all there again afterwards
+	fp = fmemopen((void *) records, strlen(records), "r");
+	CuAssertIntEquals(tc, SUCCESS, ftag_import_db(db, fp, FORMAT_TSV));
+	fclose(fp);
+	sqlite3_prepare_v2(ftag_db_sqlite(fresh), schema_sql, -1, &prep, NULL);
+	CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+	CuStringAppend(expected, (const char *) sqlite3_column_text(prep, 0));
+	sqlite3_finalize(prep);
+	sqlite3_prepare_v2(ftag_db_sqlite(db), schema_sql, -1, &prep, NULL);
+	CuAssertIntEquals(tc, SQLITE_ROW, sqlite3_step(prep));
+	CuStringAppend(got, (const char *) sqlite3_column_text(prep, 0));
+	sqlite3_finalize(prep);
+	CuAssertStrEquals(tc, expected->buffer, got->buffer);
+
+	// The association given twice is kept once and counted once
+	CuAssertIntEquals(tc, 3, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT file_count FROM tag "
+									   "WHERE name = 'x';"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM file "
+									   "INDEXED BY file_hidden_ix "
+									   "WHERE relative_path GLOB '.*';"));
+	ftag_tag_file(db, "b", "z");
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT file_count FROM tag "
+									   "WHERE name = 'z';"));
+
+	// A path given twice is refused, leaving the database as it was
+	ftag_close_db(db);
+	db = ftag_open_memory_db();
+	CuAssertPtrNotNull(tc, db);
+	fp = fmemopen((void *) twice, strlen(twice), "r");
+	CuAssertIntEquals(tc, ERROR, ftag_import_db(db, fp, FORMAT_TSV));
+	fclose(fp);
+	CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM file;"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM sqlite_master "
+									   "WHERE name = 'file_path_uq';"));
+
+	CuStringDelete(expected);
+	CuStringDelete(got);
+	ftag_close_db(db);
+	ftag_close_db(fresh);
 }
 
-static CuSuite *init_db_get_suite()
+static void test_merge_split_db(CuTest *tc)
 {
-    CuSuite *suite = CuSuiteNew();
+	static const char *pairs_sql = "SELECT total(count) = (SELECT COUNT(*) "
+	"FROM file_tag AS a JOIN file_tag AS b ON b.file_id = a.file_id AND "
+	"b.tag_id != a.tag_id) FROM tag_pair;";
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 8];
+	ftag_db *db = NULL;
+	ftag_db *other = NULL;
+	ftag_db *split = NULL;
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	db = ftag_open_db("db", dir, 0);
+	other = ftag_open_db("other", dir, 0);
+	CuAssertPtrNotNull(tc, db);
+	CuAssertPtrNotNull(tc, other);
+
+	ftag_tag_file(other, "o1", "x");
+	ftag_tag_file(other, "o1", "y");
+	ftag_tag_file(other, "o2", "y");
+	ftag_tag_file(db, "keep", "x");
+	ftag_tag_file(db, "sub/o1", "x");
+	sqlite3_exec(ftag_db_sqlite(other), "UPDATE file_tag SET tagged_at = 100;",
+				 NULL, NULL, NULL);
+	sprintf(path, "%s/other", dir);
+	ftag_close_db(other);
+
+	// More is coming than there is, so tag_pair is counted afresh
+	CuAssertIntEquals(tc, SUCCESS, ftag_merge_db(db, path, "sub/"));
+	CuAssertIntEquals(tc, 3, query_int(db, "SELECT COUNT(*) FROM file;"));
+	CuAssertIntEquals(tc, 4, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT file_count FROM tag "
+									   "WHERE name = 'y';"));
+	CuAssertIntEquals(tc, 1, query_int(db, pairs_sql));
+	CuAssertIntEquals(tc, 3, query_int(db, "SELECT COUNT(*) FROM sqlite_master "
+									   "WHERE type = 'trigger' AND "
+									   "name LIKE 'tag_pair_%';"));
+	// Associations keep when they were made, the one already here its own
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE tagged_at = 100;"));
+
+	// And again, kept up to date by the triggers, which changes nothing
+	CuAssertIntEquals(tc, SUCCESS, ftag_merge_db(db, path, "sub/"));
+	CuAssertIntEquals(tc, 4, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 1, query_int(db, pairs_sql));
+
+	split = ftag_open_db("split", dir, 0);
+	CuAssertPtrNotNull(tc, split);
+	CuAssertIntEquals(tc, SUCCESS, ftag_split_db(db, "sub/", split));
+	CuAssertIntEquals(tc, 2, query_int(split, "SELECT COUNT(*) FROM file "
+									   "WHERE relative_path IN ('o1', 'o2');"));
+	CuAssertIntEquals(tc, 3, query_int(split, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 2, query_int(split, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE tagged_at = 100;"));
+	CuAssertIntEquals(tc, 1, query_int(split, pairs_sql));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM file;"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM tag;"));
+	CuAssertIntEquals(tc, 1, query_int(db, pairs_sql));
+
+	ftag_close_db(split);
+	ftag_close_db(db);
+	unlink(path);
+	sprintf(path, "%s/db", dir);
+	unlink(path);
+	sprintf(path, "%s/split", dir);
+	unlink(path);
+	rmdir(dir);
+}
 
-    SUITE_ADD_TEST(suite, test_init_db_fn_memory_with_dir);
-    SUITE_ADD_TEST(suite, test_init_db_fn_memory_null_dir);
+static void test_change_log(CuTest *tc)
+{
+	ftag_db *src = setup_test_db(tc);
+	ftag_db *dst = ftag_open_memory_db();
+	FILE *fp = tmpfile();
+	long long seeded = -1, last = -1;
+
+	CuAssertPtrNotNull(tc, dst);
+	CuAssertPtrNotNull(tc, fp);
+
+	ftag_tag_files(src, 2, (const char *[]) { "a", "b\tc" }, 2,
+			  (const char *[]) { "x", "y" });
+	sqlite3_exec(ftag_db_sqlite(src), "UPDATE change_log SET tagged_at = 100;",
+				 NULL, NULL, NULL);
+	CuAssertIntEquals(tc, 4, (int) ftag_latest_change(src));
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_changes(src, fp, 0));
+	rewind(fp);
+	CuAssertIntEquals(tc, SUCCESS, ftag_apply_changes(dst, fp, &seeded));
+	CuAssertIntEquals(tc, 4, (int) seeded);
+	// Replayed associations keep when they were made
+	CuAssertIntEquals(tc, 4, query_int(dst, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE tagged_at = 100;"));
+
+	// Only what changed since is replayed
+	ftag_untag_file(src, "a", 1, (const char *[]) { "x" });
+	ftag_rename_tag(src, "y", "z");
+	ftag_merge_tags(src, "x", "z");
+	ftag_tag_file(src, "d", "w");
+	fclose(fp);
+	fp = tmpfile();
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_changes(src, fp, seeded));
+	rewind(fp);
+	CuAssertIntEquals(tc, SUCCESS, ftag_apply_changes(dst, fp, &last));
+	CuAssertIntEquals(tc, (int) ftag_latest_change(src), (int) last);
+
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "a", "z"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "b\tc", "z"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "d", "w"));
+	CuAssertIntEquals(tc, 0, query_int(dst, "SELECT COUNT(*) FROM tag "
+									   "WHERE name IN ('x', 'y');"));
+	CuAssertIntEquals(tc, query_int(src, "SELECT COUNT(*) FROM file_tag;"),
+					  query_int(dst, "SELECT COUNT(*) FROM file_tag;"));
+
+	// Ids looked up earlier in the same replay are not reused once gone
+	fclose(fp);
+	fp = tmpfile();
+	fputs("20\ttag\tg\tu\n21\tuntag\tg\tu\n22\ttag\tg\tu\n"
+		  "23\tretag\tu\tt\n24\ttag\th\tu\n", fp);
+	rewind(fp);
+	CuAssertIntEquals(tc, SUCCESS, ftag_apply_changes(dst, fp, &last));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "g", "t"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "h", "u"));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(dst, "h", "t"));
+	CuAssertIntEquals(tc, 0, query_int(dst, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE file_id NOT IN (SELECT id FROM "
+									   "file) OR tag_id NOT IN (SELECT id "
+									   "FROM tag);"));
+	// Those logged without a time are made now
+	CuAssertIntEquals(tc, 0, query_int(dst, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE tagged_at IS NULL;"));
+
+	// A time only goes with tag
+	fclose(fp);
+	fp = tmpfile();
+	fputs("30\tuntag\tg\tt\t100\n", fp);
+	rewind(fp);
+	CuAssertIntEquals(tc, ERROR, ftag_apply_changes(dst, fp, &last));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(dst, "g", "t"));
+
+	// Out of order changes are refused and nothing is applied
+	fclose(fp);
+	fp = tmpfile();
+	fputs("9\ttag\te\tv\n8\ttag\tf\tv\n", fp);
+	rewind(fp);
+	CuAssertIntEquals(tc, ERROR, ftag_apply_changes(dst, fp, &last));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(dst, "e", "v"));
+
+	// Pruned changes can't be asked for any more, later ones still can
+	last = ftag_latest_change(src);
+	CuAssertIntEquals(tc, SUCCESS, ftag_prune_changes(src, seeded + 1));
+	CuAssertIntEquals(tc, (int) (last - seeded), query_int(src, "SELECT "
+									   "COUNT(*) FROM change_log;"));
+	fclose(fp);
+	fp = tmpfile();
+	CuAssertIntEquals(tc, ERROR, ftag_write_changes(src, fp, seeded - 1));
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_changes(src, fp, seeded));
+	CuAssertIntEquals(tc, SUCCESS, ftag_prune_changes(src, last + 1));
+	CuAssertIntEquals(tc, (int) last, (int) ftag_latest_change(src));
+	CuAssertIntEquals(tc, ERROR, ftag_write_changes(src, fp, last - 1));
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_changes(src, fp, last));
+	ftag_tag_file(src, "e", "v");
+	CuAssertIntEquals(tc, (int) last + 1, (int) ftag_latest_change(src));
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_changes(src, fp, last));
+
+	fclose(fp);
+	ftag_close_db(dst);
+	close_test_db();
+}
 
-    return suite;
+/* No association of db refers to a missing file or tag, and the counts of
+ * the tags agree with them
+ */
+static int replay_consistent(ftag_db *db)
+{
+	return query_int(db, "SELECT COUNT(*) FROM file_tag WHERE file_id NOT IN "
+					 "(SELECT id FROM file) OR tag_id NOT IN (SELECT id FROM "
+					 "tag) OR tagged_at IS NULL;") == 0 &&
+		query_int(db, "SELECT COUNT(*) FROM tag WHERE file_count <> (SELECT "
+				  "COUNT(*) FROM file_tag WHERE tag_id = tag.id);") == 0;
 }
 
-static void test_get_tag_ids(CuTest *tc)
+static void test_apply_interning(CuTest *tc)
 {
-	static const char *insert_sql =
-	"BEGIN;"
-	"INSERT INTO tag (name) VALUES ('tag1');"
-	"INSERT INTO tag (name) VALUES ('tag2');"
-	"INSERT INTO tag (name) VALUES ('tag3');"
-	"COMMIT;"
-	;
+	static const char *reset =
+	"1\ttag\ta\tx\n2\tuntag\ta\tx\n3\ttag\tb\ty\n4\ttag\tc\tz\n"
+	"5\ttag\ta\tx\n6\tuntag\tc\tz\n7\ttag\td\ty\n8\ttag\tc\tz\n"
+	"9\tretag\ty\tw\n10\ttag\ta\ty\n";
+	ftag_db *db = ftag_open_memory_db();
+	FILE *fp = tmpfile();
+	long long last = -1;
+
+	CuAssertPtrNotNull(tc, db);
+	CuAssertPtrNotNull(tc, fp);
+
+	// Enough paths to grow the table several times, each seen twice
+	for (int i = 0; i < 6000; i++)
+		fprintf(fp, "%d\ttag\tp%04d\tt%d\n", i + 1, i % 3000, i / 3000);
+	rewind(fp);
+	CuAssertIntEquals(tc, SUCCESS, ftag_apply_changes(db, fp, &last));
+	CuAssertIntEquals(tc, 6000, (int) last);
+	CuAssertIntEquals(tc, 3000, query_int(db, "SELECT COUNT(*) FROM file;"));
+	CuAssertIntEquals(tc, 6000, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "p2999", "t1"));
+	CuAssertIntEquals(tc, 1, replay_consistent(db));
+	fclose(fp);
+	ftag_close_db(db);
+
+	// Ids forgotten by untag and retag stay forgotten when the table starts
+	// over every two entries
+	db = ftag_open_memory_db();
+	CuAssertPtrNotNull(tc, db);
+	fp = fmemopen((void *) reset, strlen(reset), "r");
+	CuAssertIntEquals(tc, SUCCESS, replay_changes(db, fp, &last, 2));
+	fclose(fp);
+	CuAssertIntEquals(tc, 10, (int) last);
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "a", "x"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "a", "y"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "b", "w"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "d", "w"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "c", "z"));
+	CuAssertIntEquals(tc, 5, query_int(db, "SELECT COUNT(*) FROM file_tag;"));
+	CuAssertIntEquals(tc, 1, replay_consistent(db));
+	ftag_close_db(db);
+}
 
-	setup_test_db(tc);
+/* The user.tags attribute of name in dir, "-" if it has none */
+static const char *test_attr(const char *dir, const char *name)
+{
+	static char value[64];
+	char path[5 + 6 + 1 + 8];
+	ssize_t len;
 
-	CuAssertIntEquals(tc, SQLITE_OK,
-					  sqlite3_exec(dbconn, insert_sql, NULL, NULL, NULL));
+	sprintf(path, "%s/%s", dir, name);
+	len = getxattr(path, "user.tags", value, sizeof(value) - 1);
+	if (len < 0)
+		return "-";
 
-	int *idv = get_tag_ids(3, (const char *[]) {"tag1", "tag2", "tag3"} );
-	CuAssertPtrNotNull(tc, idv);
+	value[len] = '\0';
+	return value;
+}
 
-	for (int i = 0; i < 3; i++)
-		CuAssertIntEquals(tc, i+1, idv[i]);
+static void test_xattr_sync(CuTest *tc)
+{
+	static const char *files[] = { "a", "b", "c" };
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	ftag_db *db = NULL;
+	long long pushed = 0, pulled = 0;
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	for (int i = 0; i < 3; i++) {
+		sprintf(path, "%s/%s", dir, files[i]);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
 
-	close_db();
+	db = ftag_open_db(DB_FILENAME, dir, 0);
+	CuAssertPtrNotNull(tc, db);
+
+	ftag_tag_file(db, "a", "y");
+	ftag_tag_file(db, "a", "x");
+	ftag_tag_file(db, "a", "x,y");
+	ftag_tag_file(db, "b", "z");
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_xattr_sync(db, XATTR_PUSH, 2, &pushed, &pulled));
+	CuAssertIntEquals(tc, 2, (int) pushed);
+	CuAssertStrEquals(tc, "x,y", test_attr(dir, "a"));
+	CuAssertStrEquals(tc, "z", test_attr(dir, "b"));
+	CuAssertStrEquals(tc, "-", test_attr(dir, "c"));
+
+	// Nothing changed since, so nothing is visited
+	CuAssertIntEquals(tc, SUCCESS, ftag_xattr_sync(db, XATTR_PUSH, 2, &pushed, &pulled));
+	CuAssertIntEquals(tc, 0, (int) pushed);
+
+	// The database wins for a file changed in it, the attribute otherwise
+	sprintf(path, "%s/a", dir);
+	setxattr(path, "user.tags", "w", 1, 0);
+	sprintf(path, "%s/b", dir);
+	setxattr(path, "user.tags", "v,z,,v", 6, 0);
+	ftag_tag_file(db, "a", "u");
+	CuAssertIntEquals(tc, SUCCESS, ftag_xattr_sync(db, XATTR_PUSH | XATTR_PULL, 2,
+											  &pushed, &pulled));
+	CuAssertIntEquals(tc, 1, (int) pushed);
+	CuAssertIntEquals(tc, 1, (int) pulled);
+	CuAssertStrEquals(tc, "u,x,y", test_attr(dir, "a"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "b", "v"));
+	CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM file WHERE "
+									   "tag_version <> synced_version;"));
+
+	// Emptied in the database, then cleared on disk; unmirrored tags stay
+	ftag_untag_file(db, "b", 2, (const char *[]) { "v", "z" });
+	CuAssertIntEquals(tc, SUCCESS, ftag_xattr_sync(db, XATTR_PUSH, 2, &pushed, &pulled));
+	CuAssertStrEquals(tc, "-", test_attr(dir, "b"));
+	sprintf(path, "%s/a", dir);
+	setxattr(path, "user.tags", "", 0, 0);
+	CuAssertIntEquals(tc, SUCCESS, ftag_xattr_sync(db, XATTR_PULL, 2, &pushed, &pulled));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "a", "x,y"));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(db, "a", "x"));
+
+	// A file gone from the disk is done with, one that failed is kept
+	sqlite3_exec(ftag_db_sqlite(db), "INSERT INTO xattr_cleared VALUES "
+				 "('a/x'), ('gone');", NULL, NULL, NULL);
+	CuAssertIntEquals(tc, ERROR, ftag_xattr_sync(db, XATTR_PUSH, 2, &pushed, &pulled));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM xattr_cleared "
+									   "WHERE relative_path = 'a/x';"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM xattr_cleared;"));
+
+	ftag_close_db(db);
+	for (int i = 0; i < 3; i++) {
+		sprintf(path, "%s/%s", dir, files[i]);
+		unlink(path);
+	}
+	sprintf(path, "%s/%s", dir, DB_FILENAME);
+	unlink(path);
+	rmdir(dir);
 }
 
-static CuSuite *get_tag_ids_get_suite()
+static CuSuite *export_get_suite()
 {
 	CuSuite *suite = CuSuiteNew();
 
-	SUITE_ADD_TEST(suite, test_get_tag_ids);
+	SUITE_ADD_TEST(suite, test_export_import);
+	SUITE_ADD_TEST(suite, test_import_into_existing);
+	SUITE_ADD_TEST(suite, test_import_bulk);
+	SUITE_ADD_TEST(suite, test_merge_split_db);
+	SUITE_ADD_TEST(suite, test_change_log);
+	SUITE_ADD_TEST(suite, test_apply_interning);
+	SUITE_ADD_TEST(suite, test_xattr_sync);
 
 	return suite;
 }
 
-static void filter_setup_test_db(CuTest *tc)
+/* Check that db and snap both give expected for a filter */
+static void assert_filter(CuTest *tc, ftag_db *db, ftag_snapshot *snap,
+						  int tagc, const char **tagv, int flags,
+						  const char *expected)
 {
-	static char *insert_sql =
-	"BEGIN;"
-	"INSERT INTO tag (id, name) VALUES ('1', 'tag1');"
-	"INSERT INTO tag (id, name) VALUES ('2', 'tag2');"
-	"INSERT INTO file (id, relative_path) VALUES ('1', 'file1');"
-	"INSERT INTO file (id, relative_path) VALUES ('2', 'file2');"
-	"INSERT INTO file_tag (file_id, tag_id) VALUES ('1', '1');"
-	"INSERT INTO file_tag (file_id, tag_id) VALUES ('2', '1');"
-	"INSERT INTO file_tag (file_id, tag_id) VALUES ('2', '2');"
-	"COMMIT;"
-	;
+	CuString *str = CuStringNew();
 
-	setup_test_db(tc);
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_parallel(db, tagc, tagv, flags, 2, 0,
+												   append_row, str));
+	CuAssertStrEquals(tc, expected, str->buffer);
 
-	CuAssertIntEquals(tc, SQLITE_OK,
-					  sqlite3_exec(dbconn, insert_sql, NULL, NULL, NULL));
+	reset_string(str);
+	CuAssertIntEquals(tc, SUCCESS, ftag_snapshot_filter(snap, tagc, tagv, flags,
+												   append_row, str));
+	CuAssertStrEquals(tc, expected, str->buffer);
+
+	CuStringDelete(str);
 }
 
-static void test_filter_ids_any_tag_one(CuTest *tc)
+static void test_tag_patterns(CuTest *tc)
 {
-	int id2 = 2;
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	ftag_db *db = setup_test_db(tc);
+	ftag_snapshot *snap = NULL;
+	CuString *str = CuStringNew();
 	step_t *step = NULL;
+	const char *row = NULL;
+
+	ftag_tag_file(db, "a", "proj-x");
+	ftag_tag_file(db, "b", "proj-y");
+	ftag_tag_file(db, "b", "2014");
+	ftag_tag_file(db, "c", "project");
+	ftag_tag_file(db, "c", "2015");
+	ftag_tag_file(db, "d", "prof");
+	ftag_tag_file(db, "d", "2014");
+	ftag_tag_file(db, "e", ".proj-hidden");
+
+	CuAssertIntEquals(tc, 1, tag_is_pattern("proj-*"));
+	CuAssertIntEquals(tc, 0, tag_is_pattern("proj-x"));
+	CuAssertIntEquals(tc, 4, (int) tag_pattern_prefix("proj*"));
+	CuAssertIntEquals(tc, 0, tag_pattern_match("*", ".proj-hidden", 0));
+	CuAssertIntEquals(tc, 1, tag_pattern_match("*", ".proj-hidden", 1));
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+	sprintf(path, "%s/snapshot", dir);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_snapshot(db, path));
+	snap = ftag_open_snapshot(path);
+	unlink(path);
+	rmdir(dir);
+	CuAssertPtrNotNull(tc, snap);
+
+	// Prefix patterns are index range scans, the others globs
+	assert_filter(tc, db, snap, 1, (const char *[]) { "proj*" }, FILTER_ANY_TAG,
+				  "a\nb\nc\n");
+	assert_filter(tc, db, snap, 1, (const char *[]) { "proj-?" }, FILTER_ANY_TAG,
+				  "a\nb\n");
+	assert_filter(tc, db, snap, 1, (const char *[]) { "*[45]" }, FILTER_ANY_TAG,
+				  "b\nc\nd\n");
+	assert_filter(tc, db, snap, 2, (const char *[]) { "pro[fx]", "proj-x" },
+				  FILTER_ANY_TAG, "a\nd\n");
+	assert_filter(tc, db, snap, 1, (const char *[]) { "none*" }, FILTER_ANY_TAG,
+				  "");
+
+	// With -A a file needs a tag matching each pattern
+	assert_filter(tc, db, snap, 2, (const char *[]) { "pro*", "201?" },
+				  FILTER_ALL_TAGS, "b\nc\nd\n");
+	assert_filter(tc, db, snap, 2, (const char *[]) { "proj*", "2014" },
+				  FILTER_ALL_TAGS, "b\n");
+	assert_filter(tc, db, snap, 2, (const char *[]) { "proj*", "none*" },
+				  FILTER_ALL_TAGS, "");
+
+	// Hidden tags only match patterns beginning with a . unless shown
+	assert_filter(tc, db, snap, 1, (const char *[]) { "*hidden" },
+				  FILTER_ANY_TAG, "");
+	ftag_set_show_hidden(db, 1);
+	ftag_snapshot_show_hidden(snap, 1);
+	assert_filter(tc, db, snap, 1, (const char *[]) { "*hidden" },
+				  FILTER_ANY_TAG, "e\n");
+
+	// The name cache sees new tags
+	ftag_tag_file(db, "f", "proj-z");
+	step = ftag_list_matching_tags(db, "proj-*");
+	CuAssertPtrNotNull(tc, step);
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s:%d\n", row, ftag_step_result_count(step));
+	ftag_free_step(step);
+	CuAssertStrEquals(tc, "proj-x:1\nproj-y:1\nproj-z:1\n", str->buffer);
+
+	reset_string(str);
+	step = ftag_list_matching_tags(db, "p*[!t]");
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s\n", row);
+	ftag_free_step(step);
+	CuAssertStrEquals(tc, "prof\nproj-x\nproj-y\nproj-z\n", str->buffer);
+
+	reset_string(str);
+	ftag_snapshot_list_matching(snap, "201*", append_tag, str);
+	ftag_snapshot_list_matching(snap, "prof", append_tag, str);
+	ftag_snapshot_list_matching(snap, "pro", append_tag, str);
+	CuAssertStrEquals(tc, "2014:2\n2015:1\nprof:1\n", str->buffer);
+
+	ftag_close_snapshot(snap);
+	close_test_db();
+	CuStringDelete(str);
+}
+
+static void test_tag_hierarchy(CuTest *tc)
+{
+	char dir[5 + 6 + 1];
+	char path[5 + 6 + 1 + 16];
+	ftag_db *db = setup_test_db(tc);
+	ftag_snapshot *snap = NULL;
+	CuString *str = CuStringNew();
+
+	ftag_tag_file(db, "a", "client/acme/invoices");
+	ftag_tag_file(db, "b", "client/acme");
+	ftag_tag_file(db, "c", "client/other");
+	ftag_tag_file(db, "c", "2015");
+	ftag_tag_file(db, "d", "clientele");
+	ftag_tag_file(db, "e", "client/acme/invoices");
+	ftag_tag_file(db, "e", "2015");
+
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT depth FROM tag_ancestor "
+									   "JOIN tag ON tag.id = tag_id WHERE ancestor "
+									   "= 'client' AND name = 'client/acme/invoices';"));
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+	sprintf(path, "%s/snapshot", dir);
+
+	CuAssertIntEquals(tc, SUCCESS, ftag_write_snapshot(db, path));
+	snap = ftag_open_snapshot(path);
+	unlink(path);
+	rmdir(dir);
+	CuAssertPtrNotNull(tc, snap);
+
+	// A tag stands for itself and every tag below it
+	assert_filter(tc, db, snap, 1, (const char *[]) { "client/acme" },
+				  FILTER_ANY_TAG, "a\nb\ne\n");
+	assert_filter(tc, db, snap, 1, (const char *[]) { "client" },
+				  FILTER_ANY_TAG, "a\nb\nc\ne\n");
+	assert_filter(tc, db, snap, 1, (const char *[]) { "clientele" },
+				  FILTER_ANY_TAG, "d\n");
+	assert_filter(tc, db, snap, 2, (const char *[]) { "client", "2015" },
+				  FILTER_ALL_TAGS, "c\ne\n");
+	assert_filter(tc, db, snap, 2, (const char *[]) { "2015", "client/acme" },
+				  FILTER_ALL_TAGS, "e\n");
+	ftag_close_snapshot(snap);
+
+	// The closure follows renames and removed tags
+	CuAssertIntEquals(tc, SUCCESS, ftag_rename_tag(db, "client/acme/invoices",
+											  "archive/invoices"));
+	CuAssertIntEquals(tc, SUCCESS, ftag_filter_parallel(db, 1,
+		(const char *[]) { "client/acme" }, FILTER_ANY_TAG, 1, 0, append_row, str));
+	CuAssertStrEquals(tc, "b\n", str->buffer);
+	CuAssertIntEquals(tc, 2, query_int(db, "SELECT COUNT(*) FROM tag_ancestor "
+									   "WHERE ancestor = 'archive' OR "
+									   "ancestor = 'archive/invoices';"));
+	CuAssertIntEquals(tc, 1, query_int(db, "SELECT COUNT(*) FROM tag_ancestor "
+									   "WHERE ancestor = 'client/acme';"));
+
+	ftag_untag_file(db, "b", 1, (const char *[]) { "client/acme" });
+	CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM tag_ancestor "
+									   "WHERE ancestor = 'client/acme';"));
+
+	close_test_db();
+	CuStringDelete(str);
+}
 
-	filter_setup_test_db(tc);
+static long long count_of(ftag_db *db, int tagc, const char **tagv, int flags)
+{
+	long long count = -1;
 
-	step = filter_ids_any_tag(1, &id2);
-	CuAssertPtrNotNull(tc, step);
-	CuAssertStrEquals(tc, "file2", step_result(step));
-	CuAssertPtrEquals(tc, NULL, (void *) step_result(step));
+	if (ftag_filter_count(db, tagc, tagv, flags, &count) != SUCCESS)
+		return -1;
 
-	free_step(step);
-	close_db();
+	return count;
 }
 
-static void test_filter_ids_any_tag_two(CuTest *tc)
+static void test_filter_count(CuTest *tc)
 {
-	int ids[2] = { 1, 2 };
-	step_t *step = NULL;
+	ftag_db *db = setup_test_db(tc);
+
+	ftag_tag_files(db, 3, (const char *[]) { "a", "b", ".h" }, 2,
+			  (const char *[]) { "photo", "2015" });
+	ftag_tag_file(db, "c", "photo/raw");
+	ftag_tag_file(db, ".i", "2016");
+	ftag_tag_file(db, "d", "2016");
+
+	CuAssertIntEquals(tc, 3, count_of(db, 1, (const char *[]) { "photo" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 1, count_of(db, 1, (const char *[]) { "photo/raw" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 4, count_of(db, 2, (const char *[]) { "photo", "2016" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 2, count_of(db, 2, (const char *[]) { "photo", "2015" },
+									 FILTER_ALL_TAGS));
+	CuAssertIntEquals(tc, 3, count_of(db, 1, (const char *[]) { "20*" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 0, count_of(db, 1, (const char *[]) { "none" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 4, count_of(db, 0, NULL, FILTER_ALL));
+
+	// Hidden files matching several ids are only counted once
+	ftag_set_show_hidden(db, 1);
+	CuAssertIntEquals(tc, 6, count_of(db, 2, (const char *[]) { "photo", "2016" },
+									 FILTER_ANY_TAG));
+	CuAssertIntEquals(tc, 3, count_of(db, 2, (const char *[]) { "photo", "2015" },
+									 FILTER_ALL_TAGS));
+	CuAssertIntEquals(tc, 6, count_of(db, 0, NULL, FILTER_ALL));
+	ftag_set_show_hidden(db, 0);
+	CuAssertIntEquals(tc, 3, count_of(db, 2, (const char *[]) { "photo", "2015" },
+									 FILTER_ANY_TAG));
+
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "a", "2015"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "c", "photo"));
+	CuAssertIntEquals(tc, 1, ftag_has_tag(db, "d", "201?"));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(db, "c", "2015"));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(db, "e", "2015"));
+	CuAssertIntEquals(tc, 0, ftag_has_tag(db, "a", "none"));
+
+	close_test_db();
+}
 
-	filter_setup_test_db(tc);
+/* The rows of step as lines, freeing it. NULL if there was no step. */
+static char *step_lines(CuString *str, step_t *step)
+{
+	const char *row = NULL;
 
-	step = filter_ids_any_tag(2, ids);
-	CuAssertPtrNotNull(tc, step);
-	// Counts on results being ordered
-	CuAssertStrEquals(tc, "file1", step_result(step));
-	CuAssertStrEquals(tc, "file2", step_result(step));
-	CuAssertPtrEquals(tc, NULL, (void *) step_result(step));
+	reset_string(str);
+	if (step == NULL)
+		return NULL;
 
-	free_step(step);
-	close_db();
+	while ((row = ftag_step_result(step)) != NULL)
+		CuStringAppendFormat(str, "%s\n", row);
+
+	ftag_free_step(step);
+
+	return str->buffer;
 }
 
-static CuSuite *filter_ids_any_tag_get_suite()
+static void test_filter_time(CuTest *tc)
+{
+	ftag_db *db = setup_test_db(tc);
+	CuString *str = CuStringNew();
+	long long now = (long long) time(NULL);
+
+	ftag_tag_file(db, "a", "photo");
+	ftag_tag_files(db, 2, (const char *[]) { "b", ".h" }, 1,
+			  (const char *[]) { "photo/raw" });
+	ftag_tag_file(db, "b", "2015");
+	ftag_tag_file(db, "c", "2015");
+
+	// Each association is stamped as it is made
+	CuAssertIntEquals(tc, 0, query_int(db, "SELECT COUNT(*) FROM file_tag "
+									   "WHERE tagged_at IS NULL;"));
+	CuAssertTrue(tc, query_int(db, "SELECT MIN(tagged_at) FROM file_tag;") >=
+				 now - 60);
+
+	sqlite3_exec(ftag_db_sqlite(db),
+				 "UPDATE file_tag SET tagged_at = 100 WHERE file_id = 1;"
+				 "UPDATE file_tag SET tagged_at = 200 WHERE file_id = 2 AND "
+				 "tag_id = 2;"
+				 "UPDATE file_tag SET tagged_at = 250 WHERE file_id = 3;"
+				 "UPDATE file_tag SET tagged_at = 300 WHERE file_id = 2 AND "
+				 "tag_id = 3;"
+				 // Made before times were kept
+				 "UPDATE file_tag SET tagged_at = NULL WHERE file_id = 4;",
+				 NULL, NULL, NULL);
+
+	CuAssertStrEquals(tc, "a\nb\n", step_lines(str, ftag_filter_time(db, 0, NULL,
+		FILTER_ALL, 0, LLONG_MAX)));
+	CuAssertStrEquals(tc, "b\n", step_lines(str, ftag_filter_time(db, 0, NULL,
+		FILTER_ALL, 150, 300)));
+	CuAssertStrEquals(tc, "b\n", step_lines(str, ftag_filter_time(db, 1,
+		(const char *[]) { "photo" }, FILTER_ANY_TAG, 150, LLONG_MAX)));
+	CuAssertStrEquals(tc, "", step_lines(str, ftag_filter_time(db, 1,
+		(const char *[]) { "2015" }, FILTER_ANY_TAG, 0, 300)));
+	// Either association may be the one in the range
+	CuAssertStrEquals(tc, "b\n", step_lines(str, ftag_filter_time(db, 2,
+		(const char *[]) { "2015", "photo" }, FILTER_ALL_TAGS, 150, 250)));
+	CuAssertStrEquals(tc, "", step_lines(str, ftag_filter_time(db, 2,
+		(const char *[]) { "2015", "photo" }, FILTER_ALL_TAGS, 0, 150)));
+	CuAssertPtrEquals(tc, NULL, step_lines(str, ftag_filter_time(db, 0, NULL,
+		FILTER_ALL, 300, 200)));
+
+	ftag_set_show_hidden(db, 1);
+	CuAssertStrEquals(tc, ".h\nb\n", step_lines(str, ftag_filter_time(db, 1,
+		(const char *[]) { "photo/raw" }, FILTER_ANY_TAG, 150, LLONG_MAX)));
+
+	reset_string(str);
+	append_step(str, ftag_list_recent_tags(db, 150));
+	CuAssertStrEquals(tc, "2015:2\nphoto/raw:2\n", str->buffer);
+
+	CuStringDelete(str);
+	close_test_db();
+}
+
+static CuSuite *patterns_get_suite()
 {
 	CuSuite *suite = CuSuiteNew();
 
-	SUITE_ADD_TEST(suite, test_filter_ids_any_tag_one);
-	SUITE_ADD_TEST(suite, test_filter_ids_any_tag_two);
+	SUITE_ADD_TEST(suite, test_tag_patterns);
+	SUITE_ADD_TEST(suite, test_tag_hierarchy);
+	SUITE_ADD_TEST(suite, test_filter_count);
+	SUITE_ADD_TEST(suite, test_filter_time);
+
+	return suite;
+}
+
+static void test_mount_names(CuTest *tc)
+{
+	char *entry = mount_encode("a/b%c");
+	char *name = NULL;
+
+	CuAssertStrEquals(tc, "a%2Fb%25c", entry);
+	name = mount_decode(entry, strlen(entry));
+	CuAssertStrEquals(tc, "a/b%c", name);
+	free(entry);
+	free(name);
+
+	// Only the given bytes, and a broken escape is taken as it is
+	name = mount_decode("tag/rest", 3);
+	CuAssertStrEquals(tc, "tag", name);
+	free(name);
+	name = mount_decode("%zz%2", 5);
+	CuAssertStrEquals(tc, "%zz%2", name);
+	free(name);
+}
+
+/* The files of dir from the i-th on, one per line */
+static const char *mount_listing(CuString *str, struct mount_tree *tree,
+								 struct mount_dir *dir, int i)
+{
+	int file;
+
+	reset_string(str);
+	while ((file = mount_dir_file(tree, dir, i++)) >= 0) {
+		CuStringAppend(str, tree->index.files[file]);
+		CuStringAppend(str, "\n");
+	}
+
+	return str->buffer;
+}
+
+static void test_mount_dirs(CuTest *tc)
+{
+	char dir[5 + 6 + 1];
+	char *path = NULL;
+	ftag_db *db = NULL;
+	ftag_db *reader = NULL;
+	struct mount_tree tree;
+	struct mount_dir *found = NULL;
+	const char *last = NULL;
+	size_t len = 0;
+	int tags[MOUNT_MAX_DEPTH];
+	unsigned generation;
+	CuString *str = CuStringNew();
+
+	close_test_db();
+	memset(&tree, 0, sizeof(tree));
+
+	strncpy(dir, "ftag-XXXXXX", sizeof(dir));
+	if (mkdtemp(dir) == NULL)
+		CuFail(tc, "Failed mkdtemp");
+
+	db = test_db = ftag_open_db(DB_FILENAME, dir, 0);
+	CuAssertPtrNotNull(tc, db);
+
+	// Inserted out of path order, so that ids and places disagree
+	for (int i = 0; i < 20; i++) {
+		char file[16];
+
+		sprintf(file, "f%02d", (i * 7) % 20);
+		ftag_tag_file(db, file, "all");
+		if ((i * 7) % 20 % 2 == 0)
+			ftag_tag_file(db, file, "even");
+		if ((i * 7) % 20 % 3 == 0)
+			ftag_tag_file(db, file, "third");
+	}
+	ftag_tag_file(db, "f01", "a/b");
+	ftag_tag_file(db, ".dot", "even");
+
+	reader = ftag_open_reader(db);
+	CuAssertPtrNotNull(tc, reader);
+	CuAssertIntEquals(tc, SUCCESS, mount_refresh(&tree, ftag_db_sqlite(reader)));
+	generation = tree.index.generation;
+	CuAssertIntEquals(tc, SUCCESS, mount_refresh(&tree, ftag_db_sqlite(reader)));
+	CuAssertIntEquals(tc, generation, tree.index.generation);
+
+	CuAssertIntEquals(tc, 0, mount_resolve(&tree, "/", tags, NULL, NULL));
+	CuAssertIntEquals(tc, 2, mount_resolve(&tree, "/third//even/", tags, NULL,
+										   NULL));
+	CuAssertIntEquals(tc, -1, mount_resolve(&tree, "/even/missing", tags, NULL,
+											NULL));
+	CuAssertIntEquals(tc, 1, mount_resolve(&tree, "/a%2Fb", tags, NULL, NULL));
+	CuAssertStrEquals(tc, "a/b", tree.index.tags[tags[0]]);
+	CuAssertIntEquals(tc, 1, mount_resolve(&tree, "/even/f04", tags, &last,
+										   &len));
+	CuAssertStrEquals(tc, "f04", last);
+	CuAssertIntEquals(tc, 3, (int) len);
+
+	// The rarest tag drives, the rest are checked, in path order
+	found = mount_get_dir(&tree, "/even/third");
+	CuAssertPtrNotNull(tc, found);
+	CuAssertStrEquals(tc, "third", tree.index.tags[found->tags[0]]);
+	CuAssertStrEquals(tc, "f12\nf18\n", mount_listing(str, &tree, found, 2));
+	CuAssertStrEquals(tc, "f00\nf06\nf12\nf18\n",
+					  mount_listing(str, &tree, found, 0));
+	CuAssertPtrEquals(tc, found, mount_get_dir(&tree, "/even/third"));
+	CuAssertPtrEquals(tc, NULL, mount_get_dir(&tree, "/missing"));
+
+	CuAssertIntEquals(tc, 1, mount_resolve(&tree, "/even", tags, NULL, NULL));
+	CuAssertIntEquals(tc, -1, mount_entry_file(&tree, tags, 1, "f03", 3));
+	CuAssertStrEquals(tc, "f04",
+		tree.index.files[mount_entry_file(&tree, tags, 1, "f04", 3)]);
+	CuAssertIntEquals(tc, -1, mount_entry_file(&tree, tags, 1, ".dot", 4));
+	tree.showhidden = 1;
+	CuAssertTrue(tc, mount_entry_file(&tree, tags, 1, ".dot", 4) >= 0);
+	tree.showhidden = 0;
+
+	// A change through another handle is seen on the next refresh
+	ftag_tag_file(db, "f03", "even");
+	CuAssertIntEquals(tc, SUCCESS, mount_refresh(&tree, ftag_db_sqlite(reader)));
+	CuAssertTrue(tc, tree.index.generation != generation);
+	found = mount_get_dir(&tree, "/even/third");
+	CuAssertPtrNotNull(tc, found);
+	CuAssertStrEquals(tc, "f00\nf03\nf06\nf12\nf18\n",
+					  mount_listing(str, &tree, found, 0));
+
+	mount_free_tree(&tree);
+	ftag_close_db(reader);
+	CuStringDelete(str);
+
+	path = strdup(ftag_db_path(db));
+	close_test_db();
+	unlink(path);
+	rmdir(dir);
+	free(path);
+}
+
+static CuSuite *mount_get_suite()
+{
+	CuSuite *suite = CuSuiteNew();
+
+	SUITE_ADD_TEST(suite, test_mount_names);
+	SUITE_ADD_TEST(suite, test_mount_dirs);
 
 	return suite;
 }
@@ -923,11 +3815,19 @@ static int run_tests(void)
     CuString *output = CuStringNew();
     CuSuite *suite = CuSuiteNew();
 
-    CuSuiteConsume(suite, chdir_to_db_get_suite());
+    CuSuiteConsume(suite, find_db_dir_get_suite());
     CuSuiteConsume(suite, tag_file_get_suite());
     CuSuiteConsume(suite, init_db_get_suite());
 	CuSuiteConsume(suite, get_tag_ids_get_suite());
 	CuSuiteConsume(suite, filter_ids_any_tag_get_suite());
+	CuSuiteConsume(suite, file_count_get_suite());
+	CuSuiteConsume(suite, filter_ids_all_tags_get_suite());
+	CuSuiteConsume(suite, untag_get_suite());
+	CuSuiteConsume(suite, filter_parallel_get_suite());
+	CuSuiteConsume(suite, snapshot_get_suite());
+	CuSuiteConsume(suite, export_get_suite());
+	CuSuiteConsume(suite, patterns_get_suite());
+	CuSuiteConsume(suite, mount_get_suite());
    
     CuSuiteRun(suite);
     CuSuiteSummary(suite, output);
@@ -937,7 +3837,7 @@ static int run_tests(void)
     CuStringDelete(output);
     CuSuiteDelete(suite);
 	// In case the last test failed
-	close_db();
+	close_test_db();
     
     return SUCCESS;
 }
@@ -22,15 +22,142 @@
  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef FTAG_H
+#define FTAG_H
+
+/* libftag -- the tag database behind ftag
+ *
+ * Every function takes an explicit ftag_db handle and there is no other
+ * state, so the library is re-entrant. A handle must only be used by one
+ * thread at a time: give each thread its own, eg. with ftag_open_reader.
+ * Requires an SQLite built thread-safe (the default).
+ *
+ * The one exception is ftag_set_temp_dir, which sets SQLite's temporary
+ * directory for the whole process: call it at most once, before any
+ * handle is opened, and never while another thread uses the library.
+ */
+
+#include <stdio.h>
+
 #define SUCCESS 0
 #define ERROR 1
 
-typedef struct sqlite3_stmt step_t;
+#ifndef DB_FILENAME
+#define DB_FILENAME ".ftag.sqlite3"
+#endif
+
+#ifndef SNAPSHOT_FILENAME
+#define SNAPSHOT_FILENAME ".ftag.snapshot"
+#endif
+
+#define FILTER_ANY_TAG  (1<<0)
+#define FILTER_ALL_TAGS (1<<1)
+#define FILTER_ALL      (1<<2)
+
+#define ORDER_PATH 0
+#define ORDER_ID   1
+
+#define FORMAT_JSONL 0
+#define FORMAT_TSV   1
+#define FORMAT_NUL   2
+
+#define XATTR_PUSH (1<<0)
+#define XATTR_PULL (1<<1)
+
+typedef struct ftag_db ftag_db;
+typedef struct step step_t;
+
+/* Called with each row of ftag_filter_parallel, return non-zero to stop */
+typedef int (*row_fn_t)(const char *row, void *arg);
+/* Called with each tag and its file count of ftag_snapshot_list, same for stopping */
+typedef int (*tag_fn_t)(const char *tag, int count, void *arg);
+
+typedef struct ftag_snapshot ftag_snapshot;
+
+/* libftag.so is built with -fvisibility=hidden, only these are exported */
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
+extern ftag_db *ftag_open_db(const char *fn, const char *dir, int verbosity);
+extern ftag_db *ftag_open_memory_db(void);
+extern ftag_db *ftag_open_reader(ftag_db *db);
+extern void ftag_close_db(ftag_db *db);
+extern const char *ftag_db_path(ftag_db *db);
+extern const char *ftag_db_dir(ftag_db *db);
+extern int ftag_db_readonly(ftag_db *db);
+extern int ftag_upgrade_db(ftag_db *db);
+extern int ftag_set_mem_budget(ftag_db *db, long long bytes);
+// Process-wide, see above
+extern int ftag_set_temp_dir(const char *dir);
+extern void ftag_set_show_hidden(ftag_db *db, int showhidden);
+extern int ftag_get_show_hidden(ftag_db *db);
+extern struct sqlite3 *ftag_db_sqlite(ftag_db *db);
+
+extern int ftag_tag_file(ftag_db *db, const char *file, const char *tag);
+extern int ftag_tag_files(ftag_db *db, int filec, const char **filev,
+                          int tagc, const char **tagv);
+extern int ftag_tag_files_from(ftag_db *db, FILE *fp, int delim,
+                               int tagc, const char **tagv);
+extern int ftag_untag_file(ftag_db *db, const char *file, int tagc, const char **tagv);
+extern int ftag_rename_tag(ftag_db *db, const char *from, const char *to);
+extern int ftag_merge_tags(ftag_db *db, const char *from, const char *into);
+
+extern step_t *ftag_filter_strs(ftag_db *db, int tagc, const char **tagv, int flags);
+extern int ftag_filter_parallel(ftag_db *db, int tagc, const char **tagv, int flags,
+                                int jobs, int unordered, row_fn_t fn, void *arg);
+extern int ftag_filter_cached(ftag_db *db, int tagc, const char **tagv, int flags,
+                              int jobs, int unordered, row_fn_t fn, void *arg);
+extern int ftag_filter_recursive(ftag_db *db, int tagc, const char **tagv, int flags,
+                                 row_fn_t fn, void *arg);
+extern step_t *ftag_filter_page(ftag_db *db, int tagc, const char **tagv, int flags,
+                                int order, const char *after, int limit);
+extern int ftag_filter_count(ftag_db *db, int tagc, const char **tagv, int flags,
+                             long long *count);
+extern step_t *ftag_filter_time(ftag_db *db, int tagc, const char **tagv, int flags,
+                                long long since, long long until);
+extern int ftag_has_tag(ftag_db *db, const char *file, const char *tag);
+extern step_t *ftag_list_by_file(ftag_db *db, const char *file);
+extern step_t *ftag_list_all_tags(ftag_db *db);
+extern step_t *ftag_list_top_tags(ftag_db *db, int top, int min_count);
+extern step_t *ftag_list_recent_tags(ftag_db *db, long long since);
+extern step_t *ftag_list_matching_tags(ftag_db *db, const char *pattern);
+extern step_t *ftag_list_related(ftag_db *db, const char *tag, int limit);
+extern const char *ftag_step_result(step_t *step);
+extern int ftag_step_result_count(step_t *step);
+extern const char *ftag_step_result_key(step_t *step);
+extern int ftag_free_step(step_t *step);
+
+extern int ftag_export_db(ftag_db *db, FILE *fp, int format);
+extern int ftag_import_db(ftag_db *db, FILE *fp, int format);
+extern int ftag_merge_db(ftag_db *db, const char *path, const char *prefix);
+extern int ftag_split_db(ftag_db *db, const char *prefix, ftag_db *dst);
+extern long long ftag_latest_change(ftag_db *db);
+extern int ftag_write_changes(ftag_db *db, FILE *fp, long long since);
+extern int ftag_prune_changes(ftag_db *db, long long before);
+extern int ftag_apply_changes(ftag_db *db, FILE *fp, long long *last);
+
+extern int ftag_xattr_sync(ftag_db *db, int flags, int jobs, long long *pushed,
+                           long long *pulled);
+
+/* Only in builds with FUSE=1 */
+extern int ftag_mount_db(ftag_db *db, const char *mountpoint, int foreground);
+
+extern int ftag_write_snapshot(ftag_db *db, const char *path);
+extern ftag_snapshot *ftag_open_snapshot(const char *path);
+extern void ftag_close_snapshot(ftag_snapshot *snap);
+extern void ftag_snapshot_show_hidden(ftag_snapshot *snap, int showhidden);
+extern int ftag_snapshot_filter(ftag_snapshot *snap, int tagc, const char **tagv,
+                                int flags, row_fn_t fn, void *arg);
+extern int ftag_snapshot_list(ftag_snapshot *snap, const char *file,
+                              tag_fn_t fn, void *arg);
+extern int ftag_snapshot_list_matching(ftag_snapshot *snap, const char *pattern,
+                                       tag_fn_t fn, void *arg);
+extern int ftag_snapshot_list_top(ftag_snapshot *snap, int top, int min_count,
+                                  tag_fn_t fn, void *arg);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
 
-extern int tag_file(const char *file, const char *tag);
-extern const char *step_result(step_t *stmt);
-extern void free_step(step_t *stmt);
-extern step_t *filter_by_tag(const char *tag);
-extern step_t *filter_by_tags(int tagc, char **tagv);
-extern step_t *list_by_file(const char *file);
-extern int init_db(char *fn, char *dir);
+#endif
@@ -0,0 +1,3748 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ * 
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* libftag -- the tag database behind ftag
+ *
+ * Nothing here is global: every function works on an explicit ftag_db
+ * handle, so the library can be used from a multi-threaded host as long
+ * as each thread has its own handle (see ftag_open_reader).
+ */
+
+/***--- Includes ---***/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Constants and globals ---***/
+
+#define PROGRAM_NAME "ftag"
+
+enum phase {
+	PHASE_NONE,
+	PHASE_DISCOVERY,
+	PHASE_OPEN,
+	PHASE_RESOLVE,
+	PHASE_PREPARE,
+	PHASE_STEP,
+	PHASE_OUTPUT,
+	PHASE_COUNT
+};
+
+struct ftag_db {
+	sqlite3 *conn;
+	// Database file and the directory it is in, as given or discovered
+	char *path;
+	char *dir;
+	int showhidden;
+	/* -v reports the database, -vv timings and SQLite counters, -vvv query plans */
+	int verbosity;
+	// Bytes of page cache and sort memory, 0 for SQLite's default
+	long long mem_budget;
+	struct tag_names *tag_names;
+
+	struct {
+		double wall;
+		double cpu;
+	} phase_time[PHASE_COUNT];
+	enum phase phase_current;
+	double phase_wall_start, phase_cpu_start;
+};
+
+/* Every tag name in order, for matching patterns without going to SQLite.
+ * Valid while data_version and total_changes stay the same.
+ */
+struct tag_names {
+	int n;
+	int *ids;
+	char **names;
+	int data_version;
+	int total_changes;
+};
+
+/* A growable list of tag ids */
+struct id_list {
+	int n;
+	int cap;
+	int *ids;
+};
+
+struct step {
+	sqlite3_stmt *stmt;
+	ftag_db *db;
+	int status;
+};
+
+/***--- Util ---***/
+
+/* dir and fn joined by a /, to be freed */
+static char *join_path(const char *dir, const char *fn)
+{
+	char *path = malloc(strlen(dir) + 1 + strlen(fn) + 1);
+
+	if (path != NULL)
+		sprintf(path, "%s/%s", dir, fn);
+
+	return path;
+}
+
+/* The first directory containing a file fn, ascending from the current
+ * directory, as a relative path such as "../..". If there is none the
+ * current directory "." is returned. The working directory is never
+ * changed. Returns NULL on error, otherwise the path should be freed.
+ */
+char *find_db_dir(const char *fn)
+{
+	char *dir = NULL;
+
+	if (fn == NULL)
+		return NULL;
+
+	dir = strdup(".");
+
+	while (dir != NULL) {
+		struct stat cur, up;
+		char *path = join_path(dir, fn);
+		char *parent = NULL;
+		int found;
+
+		if (path == NULL)
+			break;
+
+		found = access(path, R_OK) == 0;
+		free(path);
+
+		if (found)
+			return dir;
+
+		parent = strcmp(dir, ".") == 0 ? strdup("..") : join_path(dir, "..");
+		if (parent == NULL)
+			break;
+
+		// The root directory is its own parent
+		if (stat(dir, &cur) != 0 || stat(parent, &up) != 0 ||
+			(cur.st_dev == up.st_dev && cur.st_ino == up.st_ino)) {
+			free(parent);
+			free(dir);
+			return strdup(".");
+		}
+
+		free(dir);
+		dir = parent;
+	}
+
+	free(dir);
+
+	return NULL;
+}
+
+/***--- Profiling ---***/
+
+static const char *phase_names[PHASE_COUNT] = {
+	NULL, "discovery", "open", "tag ids", "prepare", "step", "output"
+};
+
+static double clock_seconds(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Charge the time since the last switch to the current phase and start
+ * timing the next one. Does nothing below -vv, where nothing is reported.
+ * CPU time is per thread, like handles are.
+ */
+static void phase_switch(ftag_db *db, enum phase next)
+{
+	double wall, cpu;
+
+	if (db->verbosity < 2 || next == db->phase_current)
+		return;
+
+	wall = clock_seconds(CLOCK_MONOTONIC);
+	cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+
+	if (db->phase_current != PHASE_NONE) {
+		db->phase_time[db->phase_current].wall += wall - db->phase_wall_start;
+		db->phase_time[db->phase_current].cpu += cpu - db->phase_cpu_start;
+	}
+
+	db->phase_current = next;
+	db->phase_wall_start = wall;
+	db->phase_cpu_start = cpu;
+}
+
+static void print_phase_times(ftag_db *db)
+{
+	phase_switch(db, PHASE_NONE);
+
+	fprintf(stderr, "%-12s %10s %10s\n", "phase", "wall ms", "cpu ms");
+	for (int i = PHASE_NONE + 1; i < PHASE_COUNT; i++)
+		fprintf(stderr, "%-12s %10.3f %10.3f\n", phase_names[i],
+				db->phase_time[i].wall * 1e3, db->phase_time[i].cpu * 1e3);
+}
+
+static void print_db_status(sqlite3 *db)
+{
+	static const struct {
+		int op;
+		const char *name;
+	} counters[] = {
+		{ SQLITE_DBSTATUS_CACHE_HIT, "page cache hits" },
+		{ SQLITE_DBSTATUS_CACHE_MISS, "page cache misses" },
+		{ SQLITE_DBSTATUS_CACHE_WRITE, "page cache writes" },
+		{ SQLITE_DBSTATUS_CACHE_USED, "page cache bytes" },
+		{ SQLITE_DBSTATUS_SCHEMA_USED, "schema bytes" },
+		{ SQLITE_DBSTATUS_STMT_USED, "statement bytes" },
+	};
+
+	for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++) {
+		int cur = 0, hiwtr = 0;
+
+		if (sqlite3_db_status(db, counters[i].op, &cur, &hiwtr, 0) == SQLITE_OK)
+			fprintf(stderr, "%-20s %d\n", counters[i].name, cur);
+	}
+}
+
+static void print_query_plan(sqlite3_stmt *stmt)
+{
+	static const char *prefix = "EXPLAIN QUERY PLAN ";
+	const char *sql = sqlite3_sql(stmt);
+	sqlite3_stmt *prep = NULL;
+	char *eqp = NULL;
+
+	if (sql == NULL)
+		return;
+
+	eqp = malloc(strlen(prefix) + strlen(sql) + 1);
+	if (eqp == NULL)
+		return;
+
+	strcpy(eqp, prefix);
+	strcat(eqp, sql);
+
+	fprintf(stderr, "query: %s\n", sql);
+
+	if (sqlite3_prepare_v2(sqlite3_db_handle(stmt), eqp, -1, &prep, NULL)
+		== SQLITE_OK) {
+		// Rows are (id, parent, notused, detail), children follow parents
+		int depth[64] = { 0 };
+		int ids[64] = { 0 };
+		int n = 0;
+
+		while (sqlite3_step(prep) == SQLITE_ROW) {
+			int id = sqlite3_column_int(prep, 0);
+			int parent = sqlite3_column_int(prep, 1);
+			int level = 0;
+
+			for (int i = n - 1; i >= 0; i--)
+				if (ids[i] == parent) {
+					level = depth[i] + 1;
+					break;
+				}
+
+			if (n < 64) {
+				ids[n] = id;
+				depth[n++] = level;
+			}
+
+			fprintf(stderr, "  %*s%s\n", 2 * level, "",
+					(const char *) sqlite3_column_text(prep, 3));
+		}
+	}
+
+	sqlite3_finalize(prep);
+	free(eqp);
+}
+
+static void print_stmt_status(ftag_db *db, sqlite3_stmt *stmt)
+{
+	static const struct {
+		int op;
+		const char *name;
+	} counters[] = {
+		{ SQLITE_STMTSTATUS_FULLSCAN_STEP, "full scan steps" },
+		{ SQLITE_STMTSTATUS_SORT, "sorts" },
+		{ SQLITE_STMTSTATUS_AUTOINDEX, "automatic indexes" },
+		{ SQLITE_STMTSTATUS_VM_STEP, "vm steps" },
+		{ SQLITE_STMTSTATUS_REPREPARE, "reprepares" },
+		{ SQLITE_STMTSTATUS_MEMUSED, "memory bytes" },
+	};
+
+	if (db->verbosity >= 3)
+		print_query_plan(stmt);
+
+	for (size_t i = 0; i < sizeof(counters) / sizeof(*counters); i++)
+		fprintf(stderr, "%-20s %d\n", counters[i].name,
+				sqlite3_stmt_status(stmt, counters[i].op, 0));
+}
+
+/***--- SQLite wrappers and helpers ---***/
+
+/* Run the statements in sql_str one at a time, binding paramv[i] to ?i+1
+ * wherever a statement uses it. If anything fails an open transaction is
+ * rolled back, so sql_str should hold a complete BEGIN ... COMMIT.
+ */
+static int exec_params(ftag_db *db, const char *sql_str, int paramc, const char **paramv)
+{
+	sqlite3_stmt *sql_prep = NULL;
+    const char *sql_unread = sql_str;
+
+    // Prepare, bind and execute one statement at a time
+    while (sql_unread < sql_str + strlen(sql_str)) {
+        int status = sqlite3_prepare_v2(db->conn, sql_unread, -1, &sql_prep, &sql_unread);
+        if (status != SQLITE_OK)
+            goto error;
+
+        // Trailing whitespace prepares to no statement at all
+        if (sql_prep == NULL)
+            break;
+
+        // Only the parameters up to the highest one used may be bound
+        int count = sqlite3_bind_parameter_count(sql_prep);
+
+        for (int i = 0; i < paramc && i < count; i++)
+            if (sqlite3_bind_text(sql_prep, i + 1, paramv[i], -1, SQLITE_STATIC)
+                != SQLITE_OK)
+                goto error;
+
+        if (sqlite3_step(sql_prep) != SQLITE_DONE)
+            goto error;
+
+        sqlite3_finalize(sql_prep);
+        sql_prep = NULL;
+    }
+
+    return SUCCESS;
+
+    error:
+    // Don't leave a half applied change (and its counter updates) behind
+    sqlite3_finalize(sql_prep);
+    if (!sqlite3_get_autocommit(db->conn))
+        sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+    return ERROR;
+}
+
+/* Comma separated numbered parameters ?first, ..., ?first+n-1 for IN lists */
+static char *numbered_params(int first, int n)
+{
+	// "?" + at most 10 digits + ","
+	char *buf = malloc(12 * n + 1);
+	char *end = buf;
+
+	if (buf == NULL)
+		return NULL;
+
+	*end = '\0';
+	for (int i = 0; i < n; i++)
+		end += sprintf(end, i == 0 ? "?%d" : ",?%d", first + i);
+
+	return buf;
+}
+
+int ftag_tag_file(ftag_db *db, const char *file, const char *tag)
+{
+	static const char *sql_str =
+    "BEGIN;"
+    "INSERT OR IGNORE INTO tag (name) VALUES (?2);"
+    "INSERT OR IGNORE INTO file (relative_path) VALUES (?1);"
+    "INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) SELECT file.id, "
+    "tag.id, " SQL_NOW " FROM file, tag WHERE file.relative_path = ?1 AND "
+    "tag.name = ?2;"
+    "COMMIT;"
+    ;
+
+    if (file == NULL || tag == NULL)
+        return ERROR;
+
+    return exec_params(db, sql_str, 2, (const char *[]) { file, tag });
+}
+
+/* Multi-file tagging stages the paths in a temporary table, so that every
+ * file_tag row can be written by one statement however many files there are.
+ * batch_begin opens the transaction and returns the statement to stage a
+ * path with, batch_commit tags everything staged and commits.
+ */
+static sqlite3_stmt *batch_begin(ftag_db *db)
+{
+	static const char *sql_str =
+	"BEGIN;"
+	"CREATE TEMP TABLE IF NOT EXISTS batch_file (path TEXT);"
+	"CREATE TEMP TABLE IF NOT EXISTS batch_tag (name TEXT, id INTEGER);"
+	"DELETE FROM temp.batch_file;"
+	"DELETE FROM temp.batch_tag;"
+	;
+	sqlite3_stmt *prep = NULL;
+
+	if (exec_params(db, sql_str, 0, NULL) != SUCCESS)
+		return NULL;
+
+	if (sqlite3_prepare_v2(db->conn, "INSERT INTO temp.batch_file VALUES (?);",
+						   -1, &prep, NULL) != SQLITE_OK) {
+		sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+		return NULL;
+	}
+
+	return prep;
+}
+
+static int batch_add(sqlite3_stmt *prep, const char *file)
+{
+	int status;
+
+	if (sqlite3_bind_text(prep, 1, file, -1, SQLITE_STATIC) != SQLITE_OK)
+		return ERROR;
+
+	status = sqlite3_step(prep);
+	sqlite3_reset(prep);
+
+	return status == SQLITE_DONE ? SUCCESS : ERROR;
+}
+
+static int batch_commit(ftag_db *db, sqlite3_stmt *prep, int tagc, const char **tagv)
+{
+	static const char *sql_str =
+	"INSERT OR IGNORE INTO tag (name) SELECT name FROM temp.batch_tag;"
+	// Resolve each tag id once instead of once per file
+	"UPDATE temp.batch_tag SET id = (SELECT id FROM tag WHERE name = batch_tag.name);"
+	"INSERT OR IGNORE INTO file (relative_path) SELECT path FROM temp.batch_file;"
+	"INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) SELECT f.id, "
+	"b.id, " SQL_NOW " FROM temp.batch_file AS p CROSS JOIN file AS f CROSS JOIN temp.batch_tag AS b "
+	"WHERE f.relative_path = p.path;"
+	"DELETE FROM temp.batch_file;"
+	"DELETE FROM temp.batch_tag;"
+	"COMMIT;"
+	;
+	sqlite3_stmt *tag_prep = NULL;
+
+	sqlite3_finalize(prep);
+
+	if (sqlite3_prepare_v2(db->conn, "INSERT INTO temp.batch_tag (name) VALUES (?);",
+						   -1, &tag_prep, NULL) != SQLITE_OK)
+		goto error;
+
+	for (int i = 0; i < tagc; i++)
+		if (batch_add(tag_prep, tagv[i]) != SUCCESS)
+			goto error;
+
+	sqlite3_finalize(tag_prep);
+
+	return exec_params(db, sql_str, 0, NULL);
+
+	error:
+	sqlite3_finalize(tag_prep);
+	sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+	return ERROR;
+}
+
+static void batch_abort(ftag_db *db, sqlite3_stmt *prep)
+{
+	sqlite3_finalize(prep);
+	sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+}
+
+/* Tag every file in filev with every tag in tagv in one transaction */
+int ftag_tag_files(ftag_db *db, int filec, const char **filev, int tagc, const char **tagv)
+{
+	sqlite3_stmt *prep = NULL;
+
+	if (filev == NULL || tagv == NULL || tagc < 1)
+		return ERROR;
+
+	prep = batch_begin(db);
+	if (prep == NULL)
+		return ERROR;
+
+	for (int i = 0; i < filec; i++) {
+		if (filev[i] == NULL || batch_add(prep, filev[i]) != SUCCESS) {
+			batch_abort(db, prep);
+			return ERROR;
+		}
+	}
+
+	return batch_commit(db, prep, tagc, tagv);
+}
+
+/* Same as ftag_tag_files, but read the files from fp, one per delim terminated
+ * record. Paths are streamed into the database and never held in memory.
+ */
+int ftag_tag_files_from(ftag_db *db, FILE *fp, int delim, int tagc, const char **tagv)
+{
+	sqlite3_stmt *prep = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	if (fp == NULL || tagv == NULL || tagc < 1)
+		return ERROR;
+
+	prep = batch_begin(db);
+	if (prep == NULL)
+		return ERROR;
+
+	while ((len = getdelim(&line, &size, delim, fp)) != -1) {
+		if (len > 0 && line[len - 1] == delim)
+			line[--len] = '\0';
+
+		if (len == 0)
+			continue;
+
+		if (batch_add(prep, line) != SUCCESS) {
+			free(line);
+			batch_abort(db, prep);
+			return ERROR;
+		}
+	}
+
+	free(line);
+
+	if (ferror(fp)) {
+		batch_abort(db, prep);
+		return ERROR;
+	}
+
+	return batch_commit(db, prep, tagc, tagv);
+}
+
+/* Remove any number of tags from a file. Tags and the file are deleted when
+ * nothing refers to them anymore.
+ */
+int ftag_untag_file(ftag_db *db, const char *file, int tagc, const char **tagv)
+{
+	static const char *sql_fmt =
+	"BEGIN;"
+	"DELETE FROM file_tag WHERE "
+	"file_id = (SELECT id FROM file WHERE relative_path = ?1) AND "
+	"tag_id IN (SELECT id FROM tag WHERE name IN (%s));"
+	"DELETE FROM tag WHERE file_count = 0 AND name IN (%s);"
+	"DELETE FROM file WHERE relative_path = ?1 AND "
+	"NOT EXISTS (SELECT 1 FROM file_tag WHERE file_id = file.id);"
+	"COMMIT;"
+	;
+	const char **paramv = NULL;
+	char *params = NULL;
+	char *sql = NULL;
+	int status = ERROR;
+
+	if (file == NULL || tagv == NULL || tagc < 1)
+		return ERROR;
+
+	paramv = malloc(sizeof(*paramv) * (tagc + 1));
+	params = numbered_params(2, tagc);
+	if (paramv == NULL || params == NULL)
+		goto out;
+
+	sql = malloc(strlen(sql_fmt) + 2 * strlen(params) + 1);
+	if (sql == NULL)
+		goto out;
+
+	sprintf(sql, sql_fmt, params, params);
+
+	paramv[0] = file;
+	for (int i = 0; i < tagc; i++)
+		paramv[i + 1] = tagv[i];
+
+	status = exec_params(db, sql, tagc + 1, paramv);
+
+	out:
+	free(paramv);
+	free(params);
+	free(sql);
+
+	return status;
+}
+
+/* Give a tag a new name, the new name must not be in use */
+int ftag_rename_tag(ftag_db *db, const char *from, const char *to)
+{
+	static const char *sql = "UPDATE tag SET name = ?2 WHERE name = ?1;";
+
+	if (from == NULL || to == NULL)
+		return ERROR;
+
+	if (exec_params(db, sql, 2, (const char *[]) { from, to }) != SUCCESS ||
+		sqlite3_changes(db->conn) != 1)
+		return ERROR;
+
+	return SUCCESS;
+}
+
+/* Move every file tagged from over to the tag into, then delete from */
+int ftag_merge_tags(ftag_db *db, const char *from, const char *into)
+{
+	static const char *sql_str =
+	"BEGIN;"
+	"INSERT OR IGNORE INTO tag (name) VALUES (?2);"
+	// Files already tagged into are left behind and deleted below
+	"UPDATE OR IGNORE file_tag SET tag_id = (SELECT id FROM tag WHERE name = ?2) "
+	"WHERE tag_id = (SELECT id FROM tag WHERE name = ?1);"
+	"DELETE FROM file_tag WHERE tag_id = (SELECT id FROM tag WHERE name = ?1);"
+	"DELETE FROM tag WHERE name = ?1;"
+	"COMMIT;"
+	;
+	int *id = NULL;
+	int exists = 0;
+
+	if (from == NULL || into == NULL)
+		return ERROR;
+
+	id = get_tag_ids(db, 1, &from);
+	if (id == NULL)
+		return ERROR;
+
+	exists = *id != -1;
+	free(id);
+
+	if (!exists)
+		return ERROR;
+	else if (strcmp(from, into) == 0)
+		return SUCCESS;
+
+	return exec_params(db, sql_str, 2, (const char *[]) { from, into });
+}
+
+/* Wrap a prepared query for ftag_step_result, prep is finalized on failure */
+static step_t *new_step(ftag_db *db, sqlite3_stmt *prep)
+{
+	step_t *step = NULL;
+
+	if (prep == NULL)
+		return NULL;
+
+	step = malloc(sizeof(*step));
+	if (step == NULL) {
+		sqlite3_finalize(prep);
+		return NULL;
+	}
+
+	step->stmt = prep;
+	step->db = db;
+	step->status = SUCCESS;
+
+	return step;
+}
+
+/* Next row of a query, or NULL when done or on error (see ftag_free_step) */
+const char *ftag_step_result(step_t *step)
+{
+	int status;
+
+	phase_switch(step->db, PHASE_STEP);
+
+	top:
+	status = sqlite3_step(step->stmt);
+
+	if (status == SQLITE_ROW) {
+		const char *str = (char *) sqlite3_column_text(step->stmt, 0);
+
+		if (!step->db->showhidden && *str == '.')
+			goto top;
+
+		// Until the next call the caller is busy with the row
+		phase_switch(step->db, PHASE_OUTPUT);
+		return str;
+	} else if (status == SQLITE_DONE) {
+		phase_switch(step->db, PHASE_NONE);
+		return NULL;
+	} else {
+		step->status = ERROR;
+		phase_switch(step->db, PHASE_NONE);
+		return NULL;
+	}
+}
+
+/* Returns ERROR if stepping the query failed */
+int ftag_free_step(step_t *step)
+{
+	int status = step->status;
+
+	if (step->db->verbosity >= 2)
+		print_stmt_status(step->db, step->stmt);
+
+	if (sqlite3_finalize(step->stmt) != SQLITE_OK)
+		status = ERROR;
+
+	free(step);
+
+	return status;
+}
+
+// Get id of all tags. If tag doesn't exist give value -1 (doesn't return
+// any rows)
+int *get_tag_ids(ftag_db *db, int tagc, const char **tagv)
+{
+	static const char *sql = "SELECT id FROM tag WHERE name=?;";
+	int *buf;
+
+	if (tagv == NULL)
+		return NULL;
+
+	phase_switch(db, PHASE_RESOLVE);
+
+	buf = malloc(sizeof(int) * tagc);
+	if (buf == NULL)
+		return NULL;
+
+	for (int i = 0; i < tagc; i++) {
+		sqlite3_stmt *prep;
+
+		sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL);
+
+		if (prep == NULL)
+			return NULL;
+
+		if (sqlite3_bind_text(prep, 1, tagv[i], -1, SQLITE_STATIC) != SQLITE_OK)
+			goto error;
+
+		switch (sqlite3_step(prep)) {
+			case SQLITE_DONE:
+				buf[i] = -1;
+				sqlite3_finalize(prep);
+				continue;
+			case SQLITE_ROW:
+				break;
+			default:
+				goto error;
+		}
+
+		int count = sqlite3_column_count(prep);
+
+		if (count == 0) {
+			goto error;
+		} if (sqlite3_column_count(prep) > 1) {
+			goto error;
+		} else {
+			buf[i] = sqlite3_column_int(prep, 0);
+		}
+
+		sqlite3_finalize(prep);
+		continue;
+
+		error:
+		if (prep != NULL)
+			sqlite3_finalize(prep);
+		if (buf != NULL)
+			free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/* Upper bound on the number of files, without counting them */
+static sqlite3_int64 file_total(ftag_db *db)
+{
+	sqlite3_stmt *prep = NULL;
+	sqlite3_int64 total = 0;
+
+	if (sqlite3_prepare_v2(db->conn, "SELECT max(id) FROM file;", -1, &prep, NULL)
+		== SQLITE_OK && sqlite3_step(prep) == SQLITE_ROW)
+		total = sqlite3_column_int64(prep, 0);
+
+	sqlite3_finalize(prep);
+
+	return total;
+}
+
+/* Whether to list the files of tags with count associations between them,
+ * each file once and in path order, by walking file_path_uq and checking
+ * the few tags of every file, instead of collecting them by tag and
+ * sorting them. Walking costs a step per file whatever the tags and needs
+ * no temporary storage. Sorting costs a step per association and, past
+ * the memory budget, temporary files, so it only wins for fewer of them.
+ */
+static int walk_files(ftag_db *db, double count)
+{
+	int walk = count > (double) file_total(db);
+
+	if (db->verbosity >= 2)
+		fprintf(stderr, "filter driven by %s\n", walk ? "files" : "tags");
+
+	return walk;
+}
+
+/* Files with any of the tags, each once, in path order */
+step_t *filter_ids_any_tag(ftag_db *db, int tagc, int *tagv)
+{
+	static const char *sql_count = "SELECT total(file_count) FROM tag "
+	"WHERE id IN (%s);";
+	// The + keeps file_tag_uq to the file, whose tags are then looked up
+	static const char *sql_walk = "SELECT f.relative_path FROM file AS f "
+	"INDEXED BY file_path_uq WHERE EXISTS (SELECT 1 FROM file_tag AS y "
+	"WHERE y.file_id = f.id AND +y.tag_id IN (%s)) ORDER BY f.relative_path;";
+	static const char *sql_sort = "SELECT f.relative_path FROM file_tag AS x "
+	"CROSS JOIN file AS f WHERE x.tag_id IN (%s) AND f.id = x.file_id "
+	"GROUP BY f.relative_path ORDER BY f.relative_path;";
+	sqlite3_stmt *prep = NULL;
+	char *params = NULL;
+	char *sql = NULL;
+	double count = 0;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (tagc < 1 || (params = malloc(2 * tagc)) == NULL)
+		return NULL;
+
+	for (int i = 0; i < tagc; i++) {
+		params[2 * i] = '?';
+		params[2 * i + 1] = ',';
+	}
+	params[2 * tagc - 1] = '\0';
+
+	sql = malloc(strlen(sql_walk) + strlen(sql_sort) + strlen(params) + 1);
+	if (sql == NULL)
+		goto out;
+
+	sprintf(sql, sql_count, params);
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+	for (int i = 0; i < tagc; i++)
+		sqlite3_bind_int(prep, i + 1, tagv[i]);
+	if (sqlite3_step(prep) == SQLITE_ROW)
+		count = sqlite3_column_double(prep, 0);
+	sqlite3_finalize(prep);
+	prep = NULL;
+
+	sprintf(sql, walk_files(db, count) ? sql_walk : sql_sort, params);
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		prep = NULL;
+
+	for (int i = 0; prep != NULL && i < tagc; i++) {
+		if (sqlite3_bind_int(prep, i + 1, tagv[i]) != SQLITE_OK) {
+			sqlite3_finalize(prep);
+			prep = NULL;
+		}
+	}
+
+	out:
+	free(params);
+	free(sql);
+
+	return new_step(db, prep);
+}
+
+struct tag_count {
+	int id;
+	int count;
+};
+
+static int tag_count_cmp(const void *a, const void *b)
+{
+	const struct tag_count *x = a, *y = b;
+
+	return (x->count > y->count) - (x->count < y->count);
+}
+
+// Reorder tag ids by ascending tag.file_count so that an intersection is
+// driven by its most selective tag. Unknown tags (-1) count as empty.
+int order_ids_by_count(ftag_db *db, int idc, int *idv)
+{
+	static const char *sql = "SELECT file_count FROM tag WHERE id = ?;";
+	struct tag_count *counts = NULL;
+	sqlite3_stmt *prep = NULL;
+
+	phase_switch(db, PHASE_RESOLVE);
+
+	counts = malloc(sizeof(*counts) * idc);
+	if (counts == NULL)
+		return ERROR;
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK) {
+		free(counts);
+		return ERROR;
+	}
+
+	for (int i = 0; i < idc; i++) {
+		counts[i].id = idv[i];
+		counts[i].count = 0;
+
+		sqlite3_bind_int(prep, 1, idv[i]);
+		if (sqlite3_step(prep) == SQLITE_ROW)
+			counts[i].count = sqlite3_column_int(prep, 0);
+		sqlite3_reset(prep);
+	}
+
+	sqlite3_finalize(prep);
+
+	qsort(counts, idc, sizeof(*counts), tag_count_cmp);
+	for (int i = 0; i < idc; i++)
+		idv[i] = counts[i].id;
+
+	free(counts);
+
+	return SUCCESS;
+}
+
+// Files tagged with every one of the tags. The join order is forced with
+// CROSS JOIN, so callers should pass the rarest tag first.
+step_t *filter_ids_all_tags(ftag_db *db, int tagc, int *tagv)
+{
+	static const char *sql_first =
+	"SELECT f.relative_path FROM file_tag AS x0";
+	static const char *sql_join = " CROSS JOIN file_tag AS x%d";
+	static const char *sql_file = " CROSS JOIN file AS f WHERE x0.tag_id = ?";
+	static const char *sql_cond = " AND x%d.file_id = x0.file_id AND x%d.tag_id = ?";
+	static const char *sql_end = " AND f.id = x0.file_id ORDER BY f.relative_path;";
+	sqlite3_stmt *prep = NULL;
+	char *sql = NULL;
+	char *end = NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (tagc < 1)
+		return NULL;
+
+	// Generous bound on the formatted length, %d expands to at most 10 digits
+	sql = malloc(strlen(sql_first) + strlen(sql_file) + strlen(sql_end) +
+				 (strlen(sql_join) + strlen(sql_cond) + 3 * 10) * tagc + 1);
+	if (sql == NULL)
+		return NULL;
+
+	end = sql + sprintf(sql, "%s", sql_first);
+	for (int i = 1; i < tagc; i++)
+		end += sprintf(end, sql_join, i);
+	end += sprintf(end, "%s", sql_file);
+	for (int i = 1; i < tagc; i++)
+		end += sprintf(end, sql_cond, i, i);
+	sprintf(end, "%s", sql_end);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		prep = NULL;
+
+	for (int i = 0; prep != NULL && i < tagc; i++) {
+		if (sqlite3_bind_int(prep, i+1, tagv[i]) != SQLITE_OK) {
+			sqlite3_finalize(prep);
+			prep = NULL;
+		}
+	}
+
+	free(sql);
+
+	return new_step(db, prep);
+}
+
+step_t *filter_all(ftag_db *db)
+{
+	static const char *sql = "SELECT DISTINCT relative_path FROM file;";
+	sqlite3_stmt *prep = NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+	else
+		return new_step(db, prep);
+}
+
+/***--- Tag patterns ---***/
+
+/* Tag arguments containing any of *?[ are shell style patterns, matching
+ * every tag they would match as a file name, eg. proj-* or 20??. A pattern
+ * that is only a literal prefix and a trailing * is looked up as a range of
+ * the tag_name_uq index. Other patterns are matched against all tag names,
+ * kept sorted in memory by the handle, starting from their literal prefix.
+ */
+
+int tag_is_pattern(const char *tag)
+{
+	return strpbrk(tag, "*?[") != NULL;
+}
+
+/* Length of the literal text a pattern begins with */
+size_t tag_pattern_prefix(const char *pattern)
+{
+	return strcspn(pattern, "*?[\\");
+}
+
+/* Like in the shell, tags beginning with a . only match patterns that do
+ * too, unless hidden tags are shown.
+ */
+int tag_pattern_match(const char *pattern, const char *name, int showhidden)
+{
+	return fnmatch(pattern, name, showhidden ? 0 : FNM_PERIOD) == 0;
+}
+
+static int has_pattern(int tagc, const char **tagv)
+{
+	for (int i = 0; i < tagc; i++)
+		if (tagv[i] != NULL && tag_is_pattern(tagv[i]))
+			return 1;
+
+	return 0;
+}
+
+static int id_list_add(struct id_list *list, int id)
+{
+	if (list->n == list->cap) {
+		int cap = list->cap ? 2 * list->cap : 16;
+		int *ids = realloc(list->ids, sizeof(*ids) * cap);
+
+		if (ids == NULL)
+			return ERROR;
+
+		list->ids = ids;
+		list->cap = cap;
+	}
+
+	list->ids[list->n++] = id;
+
+	return SUCCESS;
+}
+
+/* The ids of list as SQL, eg. "1,2,3", to be freed. The ids are our own
+ * integers so they are safe to inline, and inlining them avoids the limit
+ * on the number of parameters.
+ */
+static char *id_list_sql(const struct id_list *list)
+{
+	char *sql = malloc(12 * list->n + 1);
+	char *end = sql;
+
+	if (sql == NULL)
+		return NULL;
+
+	*end = '\0';
+	for (int i = 0; i < list->n; i++)
+		end += sprintf(end, i == 0 ? "%d" : ",%d", list->ids[i]);
+
+	return sql;
+}
+
+static void free_tag_names(struct tag_names *names)
+{
+	if (names == NULL)
+		return;
+
+	for (int i = 0; i < names->n; i++)
+		free(names->names[i]);
+
+	free(names->names);
+	free(names->ids);
+	free(names);
+}
+
+static int data_version(ftag_db *db)
+{
+	sqlite3_stmt *prep = NULL;
+	int version = -1;
+
+	if (sqlite3_prepare_v2(db->conn, "PRAGMA data_version;", -1, &prep, NULL)
+		== SQLITE_OK && sqlite3_step(prep) == SQLITE_ROW)
+		version = sqlite3_column_int(prep, 0);
+
+	sqlite3_finalize(prep);
+
+	return version;
+}
+
+/* The sorted tag names of db, loaded again only when the tags may have
+ * changed, through this handle or another connection. NULL on error.
+ */
+static struct tag_names *get_tag_names(ftag_db *db)
+{
+	static const char *sql = "SELECT id, name FROM tag ORDER BY name;";
+	struct tag_names *names = db->tag_names;
+	sqlite3_stmt *prep = NULL;
+	int version = data_version(db);
+	int cap = 0;
+
+	if (names != NULL && names->data_version == version &&
+		names->total_changes == sqlite3_total_changes(db->conn))
+		return names;
+
+	free_tag_names(names);
+	db->tag_names = names = calloc(1, sizeof(*names));
+	if (names == NULL)
+		return NULL;
+
+	names->data_version = version;
+	names->total_changes = sqlite3_total_changes(db->conn);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		goto error;
+
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		const char *name = (const char *) sqlite3_column_text(prep, 1);
+
+		if (names->n == cap) {
+			int *ids = NULL;
+			char **strs = NULL;
+
+			cap = cap ? 2 * cap : 64;
+			ids = realloc(names->ids, sizeof(*ids) * cap);
+			if (ids != NULL)
+				names->ids = ids;
+			strs = realloc(names->names, sizeof(*strs) * cap);
+			if (strs != NULL)
+				names->names = strs;
+			if (ids == NULL || strs == NULL)
+				goto error;
+		}
+
+		names->ids[names->n] = sqlite3_column_int(prep, 0);
+		names->names[names->n] = strdup(name == NULL ? "" : name);
+		if (names->names[names->n++] == NULL)
+			goto error;
+	}
+
+	sqlite3_finalize(prep);
+
+	return names;
+
+	error:
+	sqlite3_finalize(prep);
+	free_tag_names(names);
+	db->tag_names = NULL;
+	return NULL;
+}
+
+/* The smallest string greater than everything beginning with prefix, or
+ * NULL if there is none. To be freed, *none is set if there is no bound.
+ */
+static char *prefix_bound(const char *prefix, size_t len, int *none)
+{
+	char *bound = malloc(len + 1);
+
+	*none = 0;
+	if (bound == NULL)
+		return NULL;
+
+	memcpy(bound, prefix, len);
+
+	// Drop trailing bytes that can't be incremented, then increment one
+	while (len > 0 && (unsigned char) bound[len - 1] == 0xff)
+		len--;
+
+	if (len == 0) {
+		*none = 1;
+		free(bound);
+		return NULL;
+	}
+
+	bound[len - 1]++;
+	bound[len] = '\0';
+
+	return bound;
+}
+
+/* Add the ids of every tag matching pattern to list */
+static int match_tag_ids(ftag_db *db, const char *pattern, struct id_list *list)
+{
+	size_t len = tag_pattern_prefix(pattern);
+	struct tag_names *names = NULL;
+	int lo = 0, hi;
+
+	// name* is a range scan of tag_name_uq
+	if (len > 0 && pattern[len] == '*' && pattern[len + 1] == '\0') {
+		sqlite3_stmt *prep = NULL;
+		int none = 0;
+		char *bound = prefix_bound(pattern, len, &none);
+		int status = SUCCESS;
+
+		if (bound == NULL && !none)
+			return ERROR;
+
+		if (sqlite3_prepare_v2(db->conn, none ?
+				"SELECT id FROM tag WHERE name >= ?1;" :
+				"SELECT id FROM tag WHERE name >= ?1 AND name < ?2;",
+				-1, &prep, NULL) != SQLITE_OK) {
+			free(bound);
+			return ERROR;
+		}
+
+		sqlite3_bind_text(prep, 1, pattern, len, SQLITE_STATIC);
+		if (!none)
+			sqlite3_bind_text(prep, 2, bound, -1, SQLITE_STATIC);
+
+		while (status == SUCCESS && sqlite3_step(prep) == SQLITE_ROW)
+			status = id_list_add(list, sqlite3_column_int(prep, 0));
+
+		sqlite3_finalize(prep);
+		free(bound);
+
+		return status;
+	}
+
+	names = get_tag_names(db);
+	if (names == NULL)
+		return ERROR;
+
+	// Only names beginning with the literal prefix can match
+	hi = names->n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (strncmp(names->names[mid], pattern, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int i = lo; i < names->n && strncmp(names->names[i], pattern, len) == 0;
+		 i++)
+		if (tag_pattern_match(pattern, names->names[i], db->showhidden) &&
+			id_list_add(list, names->ids[i]) != SUCCESS)
+			return ERROR;
+
+	return SUCCESS;
+}
+
+/* Add the ids of the tag called name and every tag below it, eg.
+ * client/acme/invoices for client/acme, to list
+ */
+static int subtree_tag_ids(ftag_db *db, const char *name, struct id_list *list)
+{
+	static const char *sql = "SELECT tag_id FROM tag_ancestor WHERE ancestor = ?;";
+	sqlite3_stmt *prep = NULL;
+	int status = SUCCESS;
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return ERROR;
+
+	sqlite3_bind_text(prep, 1, name, -1, SQLITE_STATIC);
+
+	while (status == SUCCESS && sqlite3_step(prep) == SQLITE_ROW)
+		status = id_list_add(list, sqlite3_column_int(prep, 0));
+
+	sqlite3_finalize(prep);
+
+	return status;
+}
+
+/* Whether any of the tag names in tagv has tags below it */
+static int has_subtree(ftag_db *db, int tagc, const char **tagv)
+{
+	static const char *sql = "SELECT 1 FROM tag_ancestor "
+	"WHERE ancestor = ? AND depth > 0 LIMIT 1;";
+	sqlite3_stmt *prep = NULL;
+	int found = 0;
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return 0;
+
+	for (int i = 0; i < tagc && !found; i++) {
+		if (tagv[i] == NULL || tag_is_pattern(tagv[i]))
+			continue;
+
+		sqlite3_bind_text(prep, 1, tagv[i], -1, SQLITE_STATIC);
+		found = sqlite3_step(prep) == SQLITE_ROW;
+		sqlite3_reset(prep);
+	}
+
+	sqlite3_finalize(prep);
+
+	return found;
+}
+
+/* The ids each of tagv stands for, the tag and those below it for a tag
+ * name. NULL on error, otherwise tagc lists to be freed with free_id_lists.
+ */
+static struct id_list *resolve_tags(ftag_db *db, int tagc, const char **tagv)
+{
+	struct id_list *lists = calloc(tagc, sizeof(*lists));
+
+	if (lists == NULL)
+		return NULL;
+
+	phase_switch(db, PHASE_RESOLVE);
+
+	for (int i = 0; i < tagc; i++) {
+		int status = SUCCESS;
+
+		if (tag_is_pattern(tagv[i]))
+			status = match_tag_ids(db, tagv[i], &lists[i]);
+		else
+			status = subtree_tag_ids(db, tagv[i], &lists[i]);
+
+		if (status != SUCCESS) {
+			for (int k = 0; k <= i; k++)
+				free(lists[k].ids);
+			free(lists);
+			return NULL;
+		}
+	}
+
+	return lists;
+}
+
+static void free_id_lists(struct id_list *lists, int n)
+{
+	for (int i = 0; lists != NULL && i < n; i++)
+		free(lists[i].ids);
+
+	free(lists);
+}
+
+/* Total file count of the tags in list, to order groups by */
+static sqlite3_int64 id_list_count(ftag_db *db, const struct id_list *list)
+{
+	static const char *sql_fmt = "SELECT total(file_count) FROM tag WHERE id IN (%s);";
+	sqlite3_stmt *prep = NULL;
+	sqlite3_int64 count = 0;
+	char *ids = id_list_sql(list);
+	char *sql = NULL;
+
+	if (ids != NULL && (sql = malloc(strlen(sql_fmt) + strlen(ids) + 1)) != NULL) {
+		sprintf(sql, sql_fmt, ids);
+
+		if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) == SQLITE_OK &&
+			sqlite3_step(prep) == SQLITE_ROW)
+			count = sqlite3_column_int64(prep, 0);
+
+		sqlite3_finalize(prep);
+	}
+
+	free(sql);
+	free(ids);
+
+	return count;
+}
+
+struct group_count {
+	struct id_list *list;
+	sqlite3_int64 count;
+};
+
+static int group_count_cmp(const void *a, const void *b)
+{
+	const struct group_count *x = a, *y = b;
+
+	return (x->count > y->count) - (x->count < y->count);
+}
+
+/* The tag ids a filter looks for, in groups a file needs a tag from each
+ * of. With FILTER_ANY_TAG that is one group of every id, with
+ * FILTER_ALL_TAGS one per argument, rarest first.
+ */
+struct tag_groups {
+	int tagc;
+	struct id_list *lists;
+	struct id_list all;
+	struct group_count *groups;
+	char **ids;
+	int n;
+};
+
+static void free_tag_groups(struct tag_groups *g)
+{
+	for (int i = 0; g->ids != NULL && i < g->n; i++)
+		free(g->ids[i]);
+	free(g->ids);
+	free(g->groups);
+	free(g->all.ids);
+	free_id_lists(g->lists, g->tagc);
+}
+
+/* Resolve tagv into g, with the ids of each group as SQL in g->ids */
+static int tag_groups(ftag_db *db, int tagc, const char **tagv, int flags,
+					  struct tag_groups *g)
+{
+	memset(g, 0, sizeof(*g));
+	g->tagc = tagc;
+
+	if (tagc < 1 || (g->lists = resolve_tags(db, tagc, tagv)) == NULL)
+		return ERROR;
+
+	g->groups = malloc(sizeof(*g->groups) * tagc);
+	g->ids = calloc(tagc, sizeof(*g->ids));
+	if (g->groups == NULL || g->ids == NULL)
+		goto error;
+
+	if (flags & FILTER_ANY_TAG) {
+		for (int i = 0; i < tagc; i++)
+			for (int k = 0; k < g->lists[i].n; k++)
+				if (id_list_add(&g->all, g->lists[i].ids[k]) != SUCCESS)
+					goto error;
+
+		g->groups[0].list = &g->all;
+		g->groups[0].count = id_list_count(db, &g->all);
+		g->n = 1;
+	} else {
+		for (int i = 0; i < tagc; i++) {
+			g->groups[i].list = &g->lists[i];
+			g->groups[i].count = id_list_count(db, &g->lists[i]);
+		}
+
+		g->n = tagc;
+		qsort(g->groups, g->n, sizeof(*g->groups), group_count_cmp);
+	}
+
+	for (int i = 0; i < g->n; i++)
+		if ((g->ids[i] = id_list_sql(g->groups[i].list)) == NULL)
+			goto error;
+
+	return SUCCESS;
+
+	error:
+	free_tag_groups(g);
+	memset(g, 0, sizeof(*g));
+	return ERROR;
+}
+
+/* Length of the SQL the groups of g add when formatted with fmt each */
+static size_t tag_groups_len(const struct tag_groups *g, const char *fmt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < g->n; i++)
+		len += strlen(fmt) + strlen(g->ids[i]);
+
+	return len;
+}
+
+/* A filter where each of tagv may be a pattern or a tag with others below
+ * it. With FILTER_ANY_TAG files with any matching tag are found, with
+ * FILTER_ALL_TAGS files with a tag matching each of tagv. The rarest group
+ * drives the search, the others are checked with file_tag_uq, unless even
+ * it is so common that walking every file is quicker (see walk_files).
+ */
+static step_t *filter_patterns(ftag_db *db, int tagc, const char **tagv, int flags)
+{
+	static const char *sql_first = "SELECT f.relative_path FROM "
+	"file_tag AS x CROSS JOIN file AS f WHERE x.tag_id IN (%s) AND f.id = x.file_id";
+	static const char *sql_exists = " AND EXISTS (SELECT 1 FROM file_tag AS y "
+	"WHERE y.file_id = x.file_id AND y.tag_id IN (%s))";
+	static const char *sql_end = " GROUP BY f.relative_path ORDER BY f.relative_path;";
+	static const char *sql_walk = "SELECT f.relative_path FROM file AS f "
+	"INDEXED BY file_path_uq WHERE 1";
+	static const char *sql_walk_exists = " AND EXISTS (SELECT 1 FROM file_tag "
+	"AS y WHERE y.file_id = f.id AND +y.tag_id IN (%s))";
+	static const char *sql_walk_end = " ORDER BY f.relative_path;";
+	struct tag_groups g;
+	sqlite3_stmt *prep = NULL;
+	char *sql = NULL;
+	int walk;
+
+	if (tag_groups(db, tagc, tagv, flags, &g) != SUCCESS)
+		return NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	walk = walk_files(db, g.groups[0].count);
+
+	if (walk)
+		sql = malloc(strlen(sql_walk) + tag_groups_len(&g, sql_walk_exists) +
+					 strlen(sql_walk_end) + 1);
+	else
+		sql = malloc(strlen(sql_first) + tag_groups_len(&g, sql_exists) +
+					 strlen(sql_end) + 1);
+	if (sql != NULL && walk) {
+		char *end = sql + sprintf(sql, "%s", sql_walk);
+
+		for (int i = 0; i < g.n; i++)
+			end += sprintf(end, sql_walk_exists, g.ids[i]);
+
+		strcpy(end, sql_walk_end);
+	} else if (sql != NULL) {
+		char *end = sql + sprintf(sql, sql_first, g.ids[0]);
+
+		for (int i = 1; i < g.n; i++)
+			end += sprintf(end, sql_exists, g.ids[i]);
+
+		strcpy(end, sql_end);
+	}
+
+	if (sql != NULL) {
+		if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+			prep = NULL;
+	}
+
+	free(sql);
+	free_tag_groups(&g);
+
+	return new_step(db, prep);
+}
+
+/***--- Pages ---***/
+
+/* A page of a filter is found by seeking past the key of the last row of
+ * the page before, the path or the file id, never by counting rows from
+ * the start. Each page costs the same however far in it is.
+ *
+ * There are two ways to find a page. Walking the files in key order from
+ * the cursor and checking their tags with file_tag_uq stops as soon as the
+ * page is full, which is quick when the tags are common. Collecting the
+ * files of the rarest group through file_tag_tag_ix and sorting them is
+ * quick when they are few. A page takes about limit * files / count steps
+ * the first way and count the second, the cheaper one is chosen.
+ */
+
+/* Files of a filter in order, path or id, the first limit of them after
+ * the key after if it isn't NULL, or all of them if limit is 0. The key of
+ * each row, to continue from, is given by ftag_step_result_key.
+ */
+step_t *ftag_filter_page(ftag_db *db, int tagc, const char **tagv, int flags,
+					int order, const char *after, int limit)
+{
+	static const char *sql_files = "SELECT f.relative_path, f.%s FROM file AS f "
+	"WHERE (?3 OR f.relative_path NOT LIKE '.%%')";
+	static const char *sql_tags = "SELECT DISTINCT f.relative_path, f.%s FROM "
+	"file_tag AS x CROSS JOIN file AS f WHERE x.tag_id IN (%s) AND "
+	"f.id = x.file_id AND (?3 OR f.relative_path NOT LIKE '.%%')";
+	static const char *sql_after = " AND f.%s > ?1";
+	static const char *sql_exists = " AND EXISTS (SELECT 1 FROM file_tag AS y "
+	"WHERE y.file_id = f.id AND y.tag_id IN (%s))";
+	static const char *sql_end = " ORDER BY f.%s LIMIT ?2;";
+	const char *key = order == ORDER_ID ? "id" : "relative_path";
+	struct tag_groups g;
+	sqlite3_stmt *prep = NULL;
+	char *sql = NULL;
+	char *end = NULL;
+	int by_tags = 0;
+	int first = 0;
+
+	if (flags == 0 || limit < 0 || (order != ORDER_PATH && order != ORDER_ID))
+		return NULL;
+
+	if (flags & FILTER_ALL) {
+		memset(&g, 0, sizeof(g));
+	} else if (tag_groups(db, tagc, tagv, flags, &g) != SUCCESS) {
+		return NULL;
+	} else {
+		double count = g.groups[0].count;
+
+		by_tags = limit == 0 || (double) limit * file_total(db) > count * count;
+		first = by_tags;
+	}
+
+	phase_switch(db, PHASE_PREPARE);
+
+	sql = malloc(strlen(sql_tags) + strlen(g.ids ? g.ids[0] : "") +
+				 strlen(sql_after) + tag_groups_len(&g, sql_exists) +
+				 strlen(sql_end) + 3 * strlen(key) + 1);
+	if (sql == NULL)
+		goto out;
+
+	if (by_tags)
+		end = sql + sprintf(sql, sql_tags, key, g.ids[0]);
+	else
+		end = sql + sprintf(sql, sql_files, key);
+
+	if (after != NULL)
+		end += sprintf(end, sql_after, key);
+
+	for (int i = first; i < g.n; i++)
+		end += sprintf(end, sql_exists, g.ids[i]);
+
+	sprintf(end, sql_end, key);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	if (after != NULL && order == ORDER_ID) {
+		char *last = NULL;
+		long long id = strtoll(after, &last, 10);
+
+		if (*after == '\0' || *last != '\0') {
+			sqlite3_finalize(prep);
+			prep = NULL;
+			goto out;
+		}
+
+		sqlite3_bind_int64(prep, 1, id);
+	} else if (after != NULL) {
+		sqlite3_bind_text(prep, 1, after, -1, SQLITE_TRANSIENT);
+	}
+
+	sqlite3_bind_int(prep, 2, limit == 0 ? -1 : limit);
+	sqlite3_bind_int(prep, 3, db->showhidden);
+
+	if (db->verbosity >= 2)
+		fprintf(stderr, "page driven by %s\n", by_tags ? "tags" : "files");
+
+	out:
+	free(sql);
+	free_tag_groups(&g);
+
+	return new_step(db, prep);
+}
+
+/***--- Counts ---***/
+
+/* Counts and yes/no answers only need ids, so they are found in file_tag
+ * and its indexes without reading paths. Hidden files are the exception,
+ * which file_hidden_ix lists by id for the few of them there usually are.
+ */
+
+static long long count_sql(ftag_db *db, const char *sql, int id)
+{
+	sqlite3_stmt *prep = NULL;
+	long long count = -1;
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) == SQLITE_OK) {
+		sqlite3_bind_int(prep, 1, id);
+
+		phase_switch(db, PHASE_STEP);
+		if (sqlite3_step(prep) == SQLITE_ROW)
+			count = sqlite3_column_int64(prep, 0);
+
+		if (db->verbosity >= 2)
+			print_stmt_status(db, prep);
+	}
+
+	sqlite3_finalize(prep);
+	phase_switch(db, PHASE_NONE);
+
+	return count;
+}
+
+/* first formatted with the ids of the first group of g, and a check for
+ * each other group, as SQL to be freed. NULL on error.
+ */
+static char *groups_sql(const struct tag_groups *g, const char *first,
+						const char *last)
+{
+	static const char *sql_exists = " AND EXISTS (SELECT 1 FROM file_tag AS y "
+	"WHERE y.file_id = x.file_id AND y.tag_id IN (%s))";
+	char *sql = malloc(strlen(first) + strlen(g->ids[0]) +
+					   tag_groups_len(g, sql_exists) + strlen(last) + 1);
+	char *end = sql;
+
+	if (sql == NULL)
+		return NULL;
+
+	end += sprintf(end, first, g->ids[0]);
+	for (int i = 1; i < g->n; i++)
+		end += sprintf(end, sql_exists, g->ids[i]);
+	strcpy(end, last);
+
+	return sql;
+}
+
+/* Number of files a filter finds, without listing them, in *count. With
+ * one tag it is the tag's file count, otherwise the ids are counted with
+ * file_tag_tag_ix. Hidden files found are counted apart and taken away.
+ */
+int ftag_filter_count(ftag_db *db, int tagc, const char **tagv, int flags,
+				 long long *count)
+{
+	static const char *sql_file = "SELECT COUNT(*) FROM file;";
+	static const char *sql_hidden_file = "SELECT COUNT(*) FROM file INDEXED BY "
+	"file_hidden_ix WHERE relative_path GLOB '.*';";
+	static const char *sql_one = "SELECT file_count FROM tag WHERE id = ?1;";
+	static const char *sql_ids = "SELECT COUNT(DISTINCT x.file_id) FROM file_tag "
+	"AS x WHERE x.tag_id IN (%s)";
+	static const char *sql_hidden = "SELECT COUNT(*) FROM file AS f "
+	"INDEXED BY file_hidden_ix WHERE f.relative_path GLOB '.*' AND EXISTS "
+	"(SELECT 1 FROM file_tag AS x WHERE x.file_id = f.id AND x.tag_id IN (%s)";
+	struct tag_groups g;
+	long long all = -1, hidden = 0;
+	char *sql = NULL;
+
+	if (flags == 0 || count == NULL)
+		return ERROR;
+
+	if (flags & FILTER_ALL) {
+		all = count_sql(db, sql_file, 0);
+		if (!db->showhidden)
+			hidden = count_sql(db, sql_hidden_file, 0);
+	} else if (tag_groups(db, tagc, tagv, flags, &g) != SUCCESS) {
+		return ERROR;
+	} else {
+		phase_switch(db, PHASE_PREPARE);
+
+		if (g.n == 1 && g.groups[0].list->n == 1)
+			all = count_sql(db, sql_one, g.groups[0].list->ids[0]);
+		else if ((sql = groups_sql(&g, sql_ids, ";")) != NULL)
+			all = count_sql(db, sql, 0);
+		free(sql);
+
+		if (!db->showhidden) {
+			sql = groups_sql(&g, sql_hidden, ");");
+			hidden = sql != NULL ? count_sql(db, sql, 0) : -1;
+			free(sql);
+		}
+
+		free_tag_groups(&g);
+	}
+
+	if (all < 0 || hidden < 0)
+		return ERROR;
+
+	*count = all - hidden;
+
+	return SUCCESS;
+}
+
+/* Whether file has tag, or a tag below it or matching it if it is a
+ * pattern, 1 if so, 0 if not and -1 on error
+ */
+int ftag_has_tag(ftag_db *db, const char *file, const char *tag)
+{
+	static const char *sql_fmt = "SELECT EXISTS (SELECT 1 FROM file_tag WHERE "
+	"file_id = (SELECT id FROM file WHERE relative_path = ?1) AND "
+	"tag_id IN (%s));";
+	struct id_list *list = NULL;
+	sqlite3_stmt *prep = NULL;
+	char *ids = NULL;
+	char *sql = NULL;
+	int found = -1;
+
+	if (file == NULL || tag == NULL ||
+		(list = resolve_tags(db, 1, &tag)) == NULL)
+		return -1;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	ids = id_list_sql(list);
+	if (ids != NULL && (sql = malloc(strlen(sql_fmt) + strlen(ids) + 1)) != NULL) {
+		sprintf(sql, sql_fmt, ids);
+
+		if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) == SQLITE_OK) {
+			sqlite3_bind_text(prep, 1, file, -1, SQLITE_STATIC);
+
+			phase_switch(db, PHASE_STEP);
+			if (sqlite3_step(prep) == SQLITE_ROW)
+				found = sqlite3_column_int(prep, 0);
+		}
+	}
+
+	sqlite3_finalize(prep);
+	phase_switch(db, PHASE_NONE);
+	free(sql);
+	free(ids);
+	free_id_lists(list, 1);
+
+	return found;
+}
+
+/* Files a filter finds through an association made in [since, until), by
+ * file_tag_time_ix, so the work follows the number of associations in the
+ * range rather than the size of the tags. With FILTER_ALL_TAGS the one
+ * association may be with any of the groups, the others are checked as
+ * usual. Associations from before their time was kept are never found.
+ */
+step_t *ftag_filter_time(ftag_db *db, int tagc, const char **tagv, int flags,
+					long long since, long long until)
+{
+	static const char *sql_first = "SELECT DISTINCT f.relative_path FROM "
+	"file_tag AS x INDEXED BY file_tag_time_ix CROSS JOIN file AS f WHERE "
+	"x.tagged_at >= ?1 AND x.tagged_at < ?2";
+	static const char *sql_in = " AND x.tag_id IN (";
+	static const char *sql_file = " AND f.id = x.file_id AND "
+	"(?3 OR f.relative_path NOT LIKE '.%')";
+	static const char *sql_exists = " AND EXISTS (SELECT 1 FROM file_tag AS y "
+	"WHERE y.file_id = f.id AND y.tag_id IN (%s))";
+	static const char *sql_end = " ORDER BY f.relative_path;";
+	struct tag_groups g;
+	sqlite3_stmt *prep = NULL;
+	char *sql = NULL;
+	char *end = NULL;
+
+	if (flags == 0 || since > until)
+		return NULL;
+
+	if (flags & FILTER_ALL)
+		memset(&g, 0, sizeof(g));
+	else if (tag_groups(db, tagc, tagv, flags, &g) != SUCCESS)
+		return NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	sql = malloc(strlen(sql_first) + strlen(sql_in) + tag_groups_len(&g, ",") +
+				 strlen(sql_file) + tag_groups_len(&g, sql_exists) +
+				 strlen(sql_end) + 1);
+	if (sql == NULL)
+		goto out;
+
+	end = sql + sprintf(sql, "%s", sql_first);
+
+	// The association found must be with one of the tags of some group
+	if (g.n > 0) {
+		end += sprintf(end, "%s", sql_in);
+		for (int i = 0; i < g.n; i++)
+			end += sprintf(end, i == 0 ? "%s" : ",%s", g.ids[i]);
+		*end++ = ')';
+	}
+
+	end += sprintf(end, "%s", sql_file);
+
+	for (int i = 0; g.n > 1 && i < g.n; i++)
+		end += sprintf(end, sql_exists, g.ids[i]);
+
+	strcpy(end, sql_end);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	sqlite3_bind_int64(prep, 1, since);
+	sqlite3_bind_int64(prep, 2, until);
+	sqlite3_bind_int(prep, 3, db->showhidden);
+
+	out:
+	free(sql);
+	free_tag_groups(&g);
+
+	return new_step(db, prep);
+}
+
+step_t *ftag_filter_strs(ftag_db *db, int tagc, const char **tagv, int flags)
+{
+	step_t *step = NULL;
+
+	if (flags == 0)
+		return NULL;
+
+	if (flags & FILTER_ALL) {
+		step = filter_all(db);
+	} else if (has_pattern(tagc, tagv) || has_subtree(db, tagc, tagv)) {
+		step = filter_patterns(db, tagc, tagv, flags);
+	} else {
+		int *ids = get_tag_ids(db, tagc, tagv);
+		if (ids == NULL)
+			return NULL;
+
+		if (flags & FILTER_ANY_TAG)
+			step = filter_ids_any_tag(db, tagc, ids);
+		else if ((flags & FILTER_ALL_TAGS) &&
+				 order_ids_by_count(db, tagc, ids) == SUCCESS)
+			step = filter_ids_all_tags(db, tagc, ids);
+
+		free(ids);
+	}
+
+	return step;
+}
+
+/***--- Nested databases ---***/
+
+/* A recursive filter reads every database of the same name in scope: those
+ * above the current directory, the nearest of which find_db_dir finds, and
+ * those below it. Each is read in path order with its paths prefixed by its
+ * directory, so they are relative to the current directory and stay
+ * sorted, and the streams are merged with a heap on their current paths.
+ * A file in both an enclosing and a nested database is printed once.
+ */
+
+struct dir_list {
+	char **dirs;
+	int n, cap;
+};
+
+/* Add dir to the NULL terminated list, which takes it over */
+static int dir_list_add(struct dir_list *list, char *dir)
+{
+	if (dir == NULL)
+		return ERROR;
+
+	if (list->n + 1 >= list->cap) {
+		int cap = list->cap == 0 ? 8 : 2 * list->cap;
+		char **dirs = realloc(list->dirs, cap * sizeof(*dirs));
+
+		if (dirs == NULL) {
+			free(dir);
+			return ERROR;
+		}
+
+		list->dirs = dirs;
+		list->cap = cap;
+	}
+
+	list->dirs[list->n++] = dir;
+	list->dirs[list->n] = NULL;
+
+	return SUCCESS;
+}
+
+/* Whether dir holds a readable file fn */
+static int has_db_file(const char *dir, const char *fn)
+{
+	char *path = join_path(dir, fn);
+	int found = path != NULL && access(path, R_OK) == 0;
+
+	free(path);
+
+	return found;
+}
+
+/* Add the directories below dir holding a file fn to list. Symbolic links
+ * aren't followed and directories beginning with a . are only searched if
+ * showhidden. Unreadable directories are skipped, not an error.
+ */
+static int find_db_dirs_below(struct dir_list *list, const char *dir,
+							  const char *fn, int showhidden)
+{
+	DIR *dp = opendir(dir);
+	struct dirent *ent = NULL;
+	int status = SUCCESS;
+
+	if (dp == NULL)
+		return SUCCESS;
+
+	while (status == SUCCESS && (ent = readdir(dp)) != NULL) {
+		struct stat st;
+		char *path = NULL;
+
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 ||
+			(ent->d_name[0] == '.' && !showhidden))
+			continue;
+
+		path = strcmp(dir, ".") == 0 ? strdup(ent->d_name) :
+			join_path(dir, ent->d_name);
+		if (path == NULL) {
+			status = ERROR;
+			break;
+		}
+
+		if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (has_db_file(path, fn))
+				status = dir_list_add(list, strdup(path));
+			if (status == SUCCESS)
+				status = find_db_dirs_below(list, path, fn, showhidden);
+		}
+
+		free(path);
+	}
+
+	closedir(dp);
+
+	return status;
+}
+
+/* Every directory holding a file fn in scope of the current directory:
+ * those above it nearest first, as relative paths like find_db_dir gives,
+ * then those below it. NULL terminated and to be freed with free_db_dirs,
+ * NULL on error.
+ */
+char **find_db_dirs(const char *fn, int showhidden)
+{
+	struct dir_list list = { NULL, 0, 0 };
+	char *dir = NULL;
+	int status = SUCCESS;
+
+	if (fn == NULL || (dir = strdup(".")) == NULL)
+		return NULL;
+
+	while (status == SUCCESS) {
+		struct stat cur, up;
+		char *parent = NULL;
+
+		if (has_db_file(dir, fn))
+			status = dir_list_add(&list, strdup(dir));
+
+		parent = strcmp(dir, ".") == 0 ? strdup("..") : join_path(dir, "..");
+		if (status != SUCCESS || parent == NULL) {
+			free(parent);
+			status = ERROR;
+			break;
+		}
+
+		// The root directory is its own parent
+		if (stat(dir, &cur) != 0 || stat(parent, &up) != 0 ||
+			(cur.st_dev == up.st_dev && cur.st_ino == up.st_ino)) {
+			free(parent);
+			break;
+		}
+
+		free(dir);
+		dir = parent;
+	}
+
+	free(dir);
+
+	if (status == SUCCESS)
+		status = find_db_dirs_below(&list, ".", fn, showhidden);
+
+	// Nothing found is an empty list, not an error
+	if (status == SUCCESS && list.dirs == NULL &&
+		(list.dirs = calloc(1, sizeof(*list.dirs))) == NULL)
+		status = ERROR;
+
+	if (status != SUCCESS) {
+		free_db_dirs(list.dirs);
+		return NULL;
+	}
+
+	return list.dirs;
+}
+
+void free_db_dirs(char **dirs)
+{
+	if (dirs == NULL)
+		return;
+
+	for (char **dir = dirs; *dir != NULL; dir++)
+		free(*dir);
+
+	free(dirs);
+}
+
+/* Number of levels dir is above the current directory if it is ".", ".."
+ * or "../.." and so on, otherwise -1
+ */
+static int up_levels(const char *dir)
+{
+	int n = 0;
+
+	if (strcmp(dir, ".") == 0)
+		return 0;
+
+	for (;;) {
+		if (strncmp(dir, "..", 2) != 0 || (dir[2] != '\0' && dir[2] != '/'))
+			return -1;
+
+		n++;
+		if (dir[2] == '\0')
+			return n;
+		dir += 3;
+	}
+}
+
+/* path without its last n components, to be freed */
+static char *drop_components(const char *path, int n)
+{
+	size_t len = strlen(path);
+
+	while (n-- > 0) {
+		while (len > 0 && path[len - 1] != '/')
+			len--;
+		if (len > 0)
+			len--;
+	}
+
+	return strndup(path, len);
+}
+
+/* The path to to from from, both relative to the same directory and ""
+ * for that directory, written to *buf which is grown as needed
+ */
+static char *path_from(const char *from, const char *to, char **buf,
+					   size_t *size)
+{
+	size_t common = 0, i = 0, len;
+	int ups = 0;
+
+	// Skip the leading directories the two have in common
+	while (from[i] != '\0' && from[i] == to[i]) {
+		if (from[i] == '/')
+			common = i + 1;
+		i++;
+	}
+
+	if (from[i] == '\0' && (i == 0 || to[i] == '/'))
+		common = i == 0 ? 0 : i + 1;
+	else
+		for (ups = 1, i = common; from[i] != '\0'; i++)
+			ups += from[i] == '/';
+
+	len = 3 * ups + strlen(to + common) + 1;
+	if (len > *size) {
+		char *grown = realloc(*buf, 2 * len);
+
+		if (grown == NULL)
+			return NULL;
+
+		*buf = grown;
+		*size = 2 * len;
+	}
+
+	for (i = 0; i < (size_t) ups; i++)
+		memcpy(*buf + 3 * i, "../", 3);
+	strcpy(*buf + 3 * ups, to + common);
+
+	return *buf;
+}
+
+/* The files of one database, the current one in key relative to the top
+ * database's directory
+ */
+struct db_stream {
+	ftag_db *db;
+	step_t *step;
+	char *prefix;
+	char *key;
+	size_t size;
+};
+
+/* Step stream to its next file, 0 when there are no more */
+static int db_stream_next(struct db_stream *s)
+{
+	const char *row = ftag_step_result(s->step);
+	size_t len;
+
+	if (row == NULL)
+		return 0;
+
+	len = strlen(s->prefix) + 1 + strlen(row) + 1;
+	if (len > s->size) {
+		char *key = realloc(s->key, 2 * len);
+
+		if (key == NULL) {
+			s->step->status = ERROR;
+			return 0;
+		}
+
+		s->key = key;
+		s->size = 2 * len;
+	}
+
+	if (*s->prefix == '\0')
+		strcpy(s->key, row);
+	else
+		sprintf(s->key, "%s/%s", s->prefix, row);
+
+	return 1;
+}
+
+/* Restore the heap of stream indexes at i, smallest key first */
+static void stream_sift_down(struct db_stream *streams, int *heap, int n, int i)
+{
+	for (;;) {
+		int least = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+		int tmp;
+
+		if (l < n && strcmp(streams[heap[l]].key, streams[heap[least]].key) < 0)
+			least = l;
+		if (r < n && strcmp(streams[heap[r]].key, streams[heap[least]].key) < 0)
+			least = r;
+		if (least == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[least];
+		heap[least] = tmp;
+		i = least;
+	}
+}
+
+/* Filter every database named like that of db in scope of the current
+ * directory, calling fn with each file in path order from the topmost
+ * database's directory, as a path relative to the current directory. db,
+ * with its settings, is used for its own directory and the others are
+ * opened as needed.
+ */
+int ftag_filter_recursive(ftag_db *db, int tagc, const char **tagv, int flags,
+					 row_fn_t fn, void *arg)
+{
+	struct db_stream *streams = NULL;
+	char **dirs = NULL;
+	int *heap = NULL;
+	char *cwd = NULL;
+	char *here = NULL;
+	char *last = NULL;
+	char *out = NULL;
+	size_t size = 0;
+	const char *name = NULL;
+	int dirc = 0;
+	int top = 0;
+	int n = 0;
+	int status = SUCCESS;
+
+	if (db == NULL || db->path == NULL || fn == NULL)
+		return ERROR;
+
+	name = db->path + strlen(db->dir) + 1;
+	dirs = find_db_dirs(name, db->showhidden);
+	if (dirs == NULL)
+		return ERROR;
+
+	// The database furthest above is the top
+	for (dirc = 0; dirs[dirc] != NULL; dirc++)
+		if (up_levels(dirs[dirc]) > top)
+			top = up_levels(dirs[dirc]);
+
+	// The current directory as seen from the top
+	cwd = getcwd(NULL, 0);
+	if (cwd != NULL) {
+		char *above = drop_components(cwd, top);
+
+		if (above != NULL)
+			here = strdup(cwd + strlen(above) + (strlen(above) < strlen(cwd)));
+		free(above);
+	}
+
+	streams = calloc(dirc + 1, sizeof(*streams));
+	heap = malloc((dirc + 1) * sizeof(*heap));
+	if (here == NULL || streams == NULL || heap == NULL)
+		status = ERROR;
+
+	for (int i = 0; i < dirc && status == SUCCESS; i++) {
+		struct db_stream *s = &streams[i];
+		int up = up_levels(dirs[i]);
+
+		if (up >= 0)
+			s->prefix = drop_components(here, up);
+		else if (*here == '\0')
+			s->prefix = strdup(dirs[i]);
+		else if ((s->prefix = malloc(strlen(here) + 1 + strlen(dirs[i]) + 1)) != NULL)
+			sprintf(s->prefix, "%s/%s", here, dirs[i]);
+
+		if (s->prefix == NULL) {
+			status = ERROR;
+			break;
+		}
+
+		if (strcmp(dirs[i], db->dir) == 0) {
+			s->db = db;
+		} else if ((s->db = ftag_open_db(name, dirs[i], db->verbosity)) != NULL) {
+			ftag_set_show_hidden(s->db, db->showhidden);
+		} else {
+			fprintf(stderr, PROGRAM_NAME ": error: failed to open '%s/%s'\n",
+					dirs[i], name);
+			status = ERROR;
+			break;
+		}
+
+		if (db->verbosity > 0)
+			fprintf(stderr, "merging db '%s/%s'\n", dirs[i], name);
+
+		s->step = ftag_filter_page(s->db, tagc, tagv, flags, ORDER_PATH, NULL, 0);
+		if (s->step == NULL)
+			status = ERROR;
+		else if (db_stream_next(s))
+			heap[n++] = i;
+		else if (s->step->status != SUCCESS)
+			status = ERROR;
+	}
+
+	for (int i = n / 2 - 1; i >= 0 && status == SUCCESS; i--)
+		stream_sift_down(streams, heap, n, i);
+
+	while (n > 0 && status == SUCCESS) {
+		struct db_stream *s = &streams[heap[0]];
+
+		// A file in more than one database is listed once
+		if (last == NULL || strcmp(last, s->key) != 0) {
+			free(last);
+			if ((last = strdup(s->key)) == NULL ||
+				path_from(here, s->key, &out, &size) == NULL) {
+				status = ERROR;
+				break;
+			}
+
+			if (fn(out, arg) != 0)
+				break;
+		}
+
+		if (!db_stream_next(s)) {
+			if (s->step->status != SUCCESS)
+				status = ERROR;
+			heap[0] = heap[--n];
+		}
+
+		stream_sift_down(streams, heap, n, 0);
+	}
+
+	for (int i = 0; streams != NULL && i < dirc; i++) {
+		if (streams[i].step != NULL && ftag_free_step(streams[i].step) != SUCCESS)
+			status = ERROR;
+		if (streams[i].db != NULL && streams[i].db != db)
+			ftag_close_db(streams[i].db);
+		free(streams[i].prefix);
+		free(streams[i].key);
+	}
+
+	free(out);
+	free(last);
+	free(heap);
+	free(streams);
+	free(here);
+	free(cwd);
+	free_db_dirs(dirs);
+
+	return status;
+}
+
+/***--- Parallel queries ---***/
+
+/* A big filter is split into ranges of file.id, each run by a worker thread
+ * on its own read-only connection. Ordered, there is one range per worker,
+ * sorted by SQLite in the worker, and the calling thread merges the sorted
+ * streams so the output is in path order. Unordered, there are a
+ * few ranges per worker so that a dense range doesn't hold up the rest, and
+ * rows go to the callback as soon as they are found.
+ */
+
+#define MAX_JOBS 64
+#define CHUNKS_PER_JOB 4
+#define QUEUE_SIZE 256
+
+/* Rows found by one ordered worker, waiting to be merged */
+struct row_queue {
+	char *rows[QUEUE_SIZE];
+	int head;
+	int count;
+	int done;
+};
+
+struct pquery {
+	ftag_db *db;
+	const char *sql;
+	int idc;
+	const int *idv;
+	int unordered;
+	row_fn_t fn;
+	void *arg;
+
+	// Range k is [lo + k * span, lo + (k + 1) * span)
+	sqlite3_int64 lo, span;
+	int chunks;
+
+	// Everything below is guarded by lock
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int next_chunk;
+	int stop;
+	int status;
+	struct row_queue *queues;
+};
+
+struct worker {
+	struct pquery *q;
+	int index;
+	pthread_t thread;
+};
+
+/* The query run on every range, ?1 and ?2 bound to the range and the tag
+ * ids from ?3 on. To be freed.
+ */
+static char *chunk_sql(int flags, int tagc, int ordered)
+{
+	static const char *sql_everything =
+	"SELECT relative_path FROM file WHERE id >= ?1 AND id < ?2";
+	static const char *sql_any =
+	"SELECT f.relative_path FROM file AS f WHERE f.id IN "
+	"(SELECT file_id FROM file_tag WHERE tag_id IN (%s) AND "
+	"file_id >= ?1 AND file_id < ?2)";
+	static const char *sql_first =
+	"SELECT f.relative_path FROM file_tag AS x0";
+	static const char *sql_join = " CROSS JOIN file_tag AS x%d";
+	static const char *sql_file = " CROSS JOIN file AS f WHERE x0.tag_id = ?3 "
+	"AND x0.file_id >= ?1 AND x0.file_id < ?2";
+	static const char *sql_cond = " AND x%d.file_id = x0.file_id AND x%d.tag_id = ?%d";
+	static const char *sql_end = " AND f.id = x0.file_id";
+	static const char *sql_order = " ORDER BY 1";
+	char *params = NULL;
+	char *sql = NULL;
+	char *end = NULL;
+
+	// Generous bound on the formatted length, %d expands to at most 10 digits
+	sql = malloc(strlen(sql_any) + strlen(sql_first) + strlen(sql_file) +
+				 strlen(sql_end) + strlen(sql_order) +
+				 (12 + strlen(sql_join) + strlen(sql_cond) + 3 * 10) * tagc + 2);
+	if (sql == NULL)
+		return NULL;
+
+	if (flags & FILTER_ALL) {
+		end = sql + sprintf(sql, "%s", sql_everything);
+	} else if (flags & FILTER_ANY_TAG) {
+		params = numbered_params(3, tagc);
+		if (params == NULL) {
+			free(sql);
+			return NULL;
+		}
+
+		end = sql + sprintf(sql, sql_any, params);
+		free(params);
+	} else {
+		end = sql + sprintf(sql, "%s", sql_first);
+		for (int i = 1; i < tagc; i++)
+			end += sprintf(end, sql_join, i);
+		end += sprintf(end, "%s", sql_file);
+		for (int i = 1; i < tagc; i++)
+			end += sprintf(end, sql_cond, i, i, i + 3);
+		end += sprintf(end, "%s", sql_end);
+	}
+
+	if (ordered)
+		end += sprintf(end, "%s", sql_order);
+	strcpy(end, ";");
+
+	return sql;
+}
+
+/* Hand a row over from a worker. Returns ERROR when the query should stop. */
+static int pquery_emit(struct pquery *q, int index, const char *row)
+{
+	int status = SUCCESS;
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->unordered) {
+		if (!q->stop && q->fn(row, q->arg) != 0)
+			q->stop = 1;
+	} else {
+		struct row_queue *queue = &q->queues[index];
+		char *copy = NULL;
+
+		while (queue->count == QUEUE_SIZE && !q->stop)
+			pthread_cond_wait(&q->changed, &q->lock);
+
+		if (!q->stop && (copy = strdup(row)) == NULL) {
+			q->status = ERROR;
+			q->stop = 1;
+		}
+
+		if (!q->stop) {
+			queue->rows[(queue->head + queue->count++) % QUEUE_SIZE] = copy;
+			pthread_cond_broadcast(&q->changed);
+		}
+	}
+
+	if (q->stop)
+		status = ERROR;
+
+	pthread_mutex_unlock(&q->lock);
+
+	return status;
+}
+
+static void *pquery_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct pquery *q = w->q;
+	ftag_db *reader = ftag_open_reader(q->db);
+	sqlite3_stmt *prep = NULL;
+	int status = ERROR;
+
+	if (reader == NULL ||
+		sqlite3_prepare_v2(reader->conn, q->sql, -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	// Reports from several threads would interleave, the caller's handle
+	// times the query as a whole
+	reader->verbosity = 0;
+
+	for (int i = 0; i < q->idc; i++)
+		if (sqlite3_bind_int(prep, i + 3, q->idv[i]) != SQLITE_OK)
+			goto out;
+
+	for (;;) {
+		int chunk, step;
+
+		// Ordered workers each own exactly one range
+		pthread_mutex_lock(&q->lock);
+		chunk = q->stop ? q->chunks : q->unordered ? q->next_chunk++ : w->index;
+		pthread_mutex_unlock(&q->lock);
+
+		if (chunk >= q->chunks)
+			break;
+
+		sqlite3_bind_int64(prep, 1, q->lo + chunk * q->span);
+		sqlite3_bind_int64(prep, 2, q->lo + (chunk + 1) * q->span);
+
+		while ((step = sqlite3_step(prep)) == SQLITE_ROW) {
+			const char *str = (const char *) sqlite3_column_text(prep, 0);
+
+			if (!reader->showhidden && *str == '.')
+				continue;
+
+			if (pquery_emit(q, w->index, str) != SUCCESS) {
+				status = SUCCESS;
+				goto out;
+			}
+		}
+
+		if (step != SQLITE_DONE)
+			goto out;
+
+		sqlite3_reset(prep);
+
+		if (!q->unordered)
+			break;
+	}
+
+	status = SUCCESS;
+
+	out:
+	sqlite3_finalize(prep);
+	ftag_close_db(reader);
+
+	pthread_mutex_lock(&q->lock);
+	if (status != SUCCESS) {
+		q->status = ERROR;
+		q->stop = 1;
+	}
+	if (!q->unordered)
+		q->queues[w->index].done = 1;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/* Merge the sorted rows of the ordered workers, in the calling thread */
+static void pquery_merge(struct pquery *q, int queuec)
+{
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->stop) {
+		struct row_queue *best = NULL;
+		char *row = NULL;
+		int ret;
+
+		// The smallest row can only be picked once every stream has one
+		for (int i = 0; i < queuec && !q->stop; i++) {
+			struct row_queue *queue = &q->queues[i];
+
+			while (queue->count == 0 && !queue->done && !q->stop)
+				pthread_cond_wait(&q->changed, &q->lock);
+
+			if (queue->count > 0 && (best == NULL ||
+				strcmp(queue->rows[queue->head], best->rows[best->head]) < 0))
+				best = queue;
+		}
+
+		if (best == NULL || q->stop)
+			break;
+
+		row = best->rows[best->head];
+		best->head = (best->head + 1) % QUEUE_SIZE;
+		best->count--;
+		pthread_cond_broadcast(&q->changed);
+		pthread_mutex_unlock(&q->lock);
+
+		ret = q->fn(row, q->arg);
+		free(row);
+
+		pthread_mutex_lock(&q->lock);
+		if (ret != 0) {
+			q->stop = 1;
+			pthread_cond_broadcast(&q->changed);
+		}
+	}
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Smallest and largest file id, both 0 if there are no files */
+static int file_id_range(ftag_db *db, sqlite3_int64 *lo, sqlite3_int64 *hi)
+{
+	sqlite3_stmt *prep = NULL;
+	int status = ERROR;
+
+	if (sqlite3_prepare_v2(db->conn, "SELECT min(id), max(id) FROM file;",
+						   -1, &prep, NULL) != SQLITE_OK)
+		return ERROR;
+
+	if (sqlite3_step(prep) == SQLITE_ROW) {
+		*lo = sqlite3_column_int64(prep, 0);
+		*hi = sqlite3_column_int64(prep, 1);
+		status = SUCCESS;
+	}
+
+	sqlite3_finalize(prep);
+
+	return status;
+}
+
+/* Run a filter the same way as ftag_filter_strs, calling fn with every row
+ * until it returns non-zero. With jobs > 1 the files are split by id and
+ * searched by that many threads, each with its own reader. Rows then come
+ * in path order, unless unordered is set, in which
+ * case they are passed on as soon as they are found, from the workers'
+ * threads (but never concurrently). Memory databases have no readers and
+ * are searched in the calling thread, as are filters with tag patterns or
+ * tags with others below them.
+ */
+int ftag_filter_parallel(ftag_db *db, int tagc, const char **tagv, int flags,
+					int jobs, int unordered, row_fn_t fn, void *arg)
+{
+	struct pquery q;
+	struct worker *workers = NULL;
+	sqlite3_int64 hi = 0;
+	int *ids = NULL;
+	int started = 0;
+
+	if (flags == 0 || fn == NULL)
+		return ERROR;
+
+	// Patterns and subtrees are expanded in the calling thread and
+	// searched serially
+	if (jobs <= 1 || db->path == NULL || has_pattern(tagc, tagv) ||
+		has_subtree(db, tagc, tagv)) {
+		step_t *step = ftag_filter_strs(db, tagc, tagv, flags);
+		const char *str = NULL;
+
+		if (step == NULL)
+			return ERROR;
+
+		while ((str = ftag_step_result(step)) != NULL)
+			if (fn(str, arg) != 0)
+				break;
+
+		return ftag_free_step(step);
+	}
+
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	memset(&q, 0, sizeof(q));
+	q.db = db;
+	q.unordered = unordered;
+	q.fn = fn;
+	q.arg = arg;
+	q.status = SUCCESS;
+
+	if (!(flags & FILTER_ALL)) {
+		ids = get_tag_ids(db, tagc, tagv);
+		if (ids == NULL)
+			return ERROR;
+
+		if (!(flags & FILTER_ANY_TAG) &&
+			order_ids_by_count(db, tagc, ids) != SUCCESS)
+			goto error;
+
+		q.idc = tagc;
+		q.idv = ids;
+	}
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (file_id_range(db, &q.lo, &hi) != SUCCESS)
+		goto error;
+
+	q.chunks = unordered ? jobs * CHUNKS_PER_JOB : jobs;
+	q.span = (hi - q.lo) / q.chunks + 1;
+
+	q.sql = chunk_sql(flags, q.idc, !unordered);
+	workers = calloc(jobs, sizeof(*workers));
+	if (!unordered)
+		q.queues = calloc(jobs, sizeof(*q.queues));
+	if (q.sql == NULL || workers == NULL || (!unordered && q.queues == NULL))
+		goto error;
+
+	pthread_mutex_init(&q.lock, NULL);
+	pthread_cond_init(&q.changed, NULL);
+
+	phase_switch(db, PHASE_STEP);
+
+	for (; started < jobs; started++) {
+		workers[started].q = &q;
+		workers[started].index = started;
+
+		if (pthread_create(&workers[started].thread, NULL, pquery_worker,
+						   &workers[started]) != 0)
+			break;
+	}
+
+	pthread_mutex_lock(&q.lock);
+	if (started < jobs) {
+		// The ranges of workers that never started would be missing
+		q.status = ERROR;
+		q.stop = 1;
+		pthread_cond_broadcast(&q.changed);
+	}
+	pthread_mutex_unlock(&q.lock);
+
+	if (!unordered)
+		pquery_merge(&q, started);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	phase_switch(db, PHASE_NONE);
+
+	pthread_cond_destroy(&q.changed);
+	pthread_mutex_destroy(&q.lock);
+
+	// Rows left behind when the query was stopped early
+	for (int i = 0; !unordered && i < jobs; i++)
+		while (q.queues[i].count-- > 0)
+			free(q.queues[i].rows[q.queues[i].head++ % QUEUE_SIZE]);
+
+	free(q.queues);
+	free(workers);
+	free((char *) q.sql);
+	free(ids);
+
+	return q.status;
+
+	error:
+	phase_switch(db, PHASE_NONE);
+	free(q.queues);
+	free(workers);
+	free((char *) q.sql);
+	free(ids);
+	return ERROR;
+}
+
+/***--- Query cache ---***/
+
+/* Filter results can be kept in a directory beside the database, one file
+ * per distinct query. A file records the database's change counter when it
+ * was written, which every committed write bumps, so a result is reused
+ * only for as long as the database stays the same. Stale files are simply
+ * overwritten and the directory can be removed at any time.
+ */
+
+#define CACHE_SUFFIX ".cache"
+#define CACHE_MAGIC "ftag-cache 1"
+
+struct cache_writer {
+	row_fn_t fn;
+	void *arg;
+	FILE *out;
+	int stopped;
+};
+
+static int str_ptr_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/* The query in a canonical form, *len bytes long and containing NULs. The
+ * order and repetition of tags don't change a filter's result. To be freed.
+ */
+static char *cache_key(ftag_db *db, int tagc, const char **tagv, int flags,
+					   int unordered, size_t *len)
+{
+	const char **sorted = NULL;
+	size_t size = 3 * 12;
+	char *key = NULL;
+	char *end = NULL;
+
+	if (flags & FILTER_ALL)
+		tagc = 0;
+
+	sorted = malloc(sizeof(*sorted) * (tagc + 1));
+	if (sorted == NULL)
+		return NULL;
+
+	for (int i = 0; i < tagc; i++) {
+		sorted[i] = tagv[i];
+		size += strlen(tagv[i]) + 1;
+	}
+
+	qsort(sorted, tagc, sizeof(*sorted), str_ptr_cmp);
+
+	key = malloc(size);
+	if (key != NULL) {
+		end = key + sprintf(key, "%d %d %d", flags, db->showhidden, unordered) + 1;
+
+		for (int i = 0; i < tagc; i++) {
+			if (i > 0 && strcmp(sorted[i], sorted[i - 1]) == 0)
+				continue;
+
+			strcpy(end, sorted[i]);
+			end += strlen(sorted[i]) + 1;
+		}
+
+		*len = end - key;
+	}
+
+	free(sorted);
+
+	return key;
+}
+
+/* 64 bit FNV-1a, to name cache files after their key */
+unsigned long long fnv1a(const char *buf, size_t len)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) buf[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/* The file change counter in the database header. Must be read in a
+ * transaction, so that it can't change before the query has run. It is
+ * read through SQLite's own file handle, because closing another
+ * descriptor for the file would drop SQLite's locks on it.
+ */
+static int read_change_counter(ftag_db *db, unsigned long *counter)
+{
+	sqlite3_file *file = NULL;
+	unsigned char buf[4];
+
+	if (sqlite3_file_control(db->conn, "main", SQLITE_FCNTL_FILE_POINTER, &file)
+		!= SQLITE_OK || file == NULL || file->pMethods == NULL ||
+		file->pMethods->xRead(file, buf, sizeof(buf), 24) != SQLITE_OK)
+		return ERROR;
+
+	*counter = (unsigned long) buf[0] << 24 | (unsigned long) buf[1] << 16 |
+			   (unsigned long) buf[2] << 8 | buf[3];
+
+	return SUCCESS;
+}
+
+/* Whether fp holds the result of key at counter, leaving fp at its rows */
+static int cache_matches(FILE *fp, unsigned long counter, const char *key,
+						 size_t len)
+{
+	unsigned long file_counter = 0;
+	size_t file_len = 0;
+	char *file_key = NULL;
+	int matches = 0;
+
+	if (fscanf(fp, CACHE_MAGIC " %lu %zu", &file_counter, &file_len) != 2 ||
+		fgetc(fp) != '\n' || file_counter != counter || file_len != len)
+		return 0;
+
+	file_key = malloc(len);
+	if (file_key != NULL)
+		matches = fread(file_key, 1, len, fp) == len &&
+				  memcmp(file_key, key, len) == 0;
+
+	free(file_key);
+
+	return matches;
+}
+
+static int cache_replay(FILE *fp, row_fn_t fn, void *arg)
+{
+	char *row = NULL;
+	size_t size = 0;
+
+	while (getdelim(&row, &size, '\0', fp) != -1)
+		if (fn(row, arg) != 0)
+			break;
+
+	free(row);
+
+	return ferror(fp) ? ERROR : SUCCESS;
+}
+
+/* A new temporary file in dir for a result, with the header written.
+ * *tmp is set to its path, to be freed. NULL if it can't be created.
+ */
+static FILE *cache_create(const char *dir, unsigned long counter,
+						  const char *key, size_t len, char **tmp)
+{
+	FILE *fp = NULL;
+	int fd;
+
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+		return NULL;
+
+	*tmp = join_path(dir, "tmp-XXXXXX");
+	if (*tmp == NULL)
+		return NULL;
+
+	fd = mkstemp(*tmp);
+	if (fd == -1 || (fp = fdopen(fd, "wb")) == NULL) {
+		if (fd != -1) {
+			close(fd);
+			unlink(*tmp);
+		}
+
+		free(*tmp);
+		*tmp = NULL;
+		return NULL;
+	}
+
+	fprintf(fp, CACHE_MAGIC " %lu %zu\n", counter, len);
+	fwrite(key, 1, len, fp);
+
+	return fp;
+}
+
+static int cache_write_row(const char *row, void *arg)
+{
+	struct cache_writer *w = arg;
+
+	fputs(row, w->out);
+	fputc('\0', w->out);
+
+	if (w->fn(row, w->arg) != 0)
+		w->stopped = 1;
+
+	return w->stopped;
+}
+
+/* Same as ftag_filter_parallel, but reuse the result of the same query from the
+ * cache while the database hasn't changed, and store it otherwise. The
+ * cache is only an optimisation: if it can't be used the query just runs.
+ */
+int ftag_filter_cached(ftag_db *db, int tagc, const char **tagv, int flags,
+				  int jobs, int unordered, row_fn_t fn, void *arg)
+{
+	struct cache_writer w = { fn, arg, NULL, 0 };
+	unsigned long counter = 0;
+	char name[16 + 1];
+	char *dir = NULL;
+	char *path = NULL;
+	char *tmp = NULL;
+	char *key = NULL;
+	size_t len = 0;
+	FILE *fp = NULL;
+	int status = ERROR;
+
+	if (db->path == NULL || flags == 0 || fn == NULL)
+		return ftag_filter_parallel(db, tagc, tagv, flags, jobs, unordered, fn, arg);
+
+	key = cache_key(db, tagc, tagv, flags, unordered, &len);
+	dir = malloc(strlen(db->path) + strlen(CACHE_SUFFIX) + 1);
+	if (key == NULL || dir == NULL)
+		goto out;
+
+	sprintf(dir, "%s" CACHE_SUFFIX, db->path);
+	sprintf(name, "%016llx", fnv1a(key, len));
+	path = join_path(dir, name);
+	if (path == NULL)
+		goto out;
+
+	// Hold a read lock from reading the counter until the query is done
+	if (sqlite3_exec(db->conn, "BEGIN; SELECT 1 FROM sqlite_master LIMIT 1;",
+					 NULL, NULL, NULL) != SQLITE_OK ||
+		read_change_counter(db, &counter) != SUCCESS) {
+		if (!sqlite3_get_autocommit(db->conn))
+			sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+		status = ftag_filter_parallel(db, tagc, tagv, flags, jobs, unordered, fn, arg);
+		goto out;
+	}
+
+	fp = fopen(path, "rb");
+
+	if (fp != NULL && cache_matches(fp, counter, key, len)) {
+		if (db->verbosity >= 2)
+			fprintf(stderr, "query cache hit\n");
+
+		phase_switch(db, PHASE_STEP);
+		status = cache_replay(fp, fn, arg);
+		phase_switch(db, PHASE_NONE);
+	} else {
+		if (db->verbosity >= 2)
+			fprintf(stderr, "query cache miss\n");
+
+		w.out = cache_create(dir, counter, key, len, &tmp);
+		if (w.out != NULL)
+			status = ftag_filter_parallel(db, tagc, tagv, flags, jobs, unordered,
+									 cache_write_row, &w);
+		else
+			status = ftag_filter_parallel(db, tagc, tagv, flags, jobs, unordered,
+									 fn, arg);
+	}
+
+	sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL);
+
+	// Only complete results are kept, renamed into place in one step
+	if (w.out != NULL) {
+		int written = !ferror(w.out);
+
+		if (fclose(w.out) == 0 && written && status == SUCCESS && !w.stopped)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+
+	out:
+	if (fp != NULL)
+		fclose(fp);
+	free(tmp);
+	free(path);
+	free(dir);
+	free(key);
+
+	return status;
+}
+
+int ftag_step_result_count(step_t *step)
+{
+	return sqlite3_column_int(step->stmt, 1);
+}
+
+/* Key of the current row of ftag_filter_page, to pass as after for the next */
+const char *ftag_step_result_key(step_t *step)
+{
+	return (const char *) sqlite3_column_text(step->stmt, 1);
+}
+
+step_t *ftag_list_by_file(ftag_db *db, const char *path)
+{
+	static const char *sql = "SELECT DISTINCT t.name, t.file_count FROM tag AS t, file AS f, "
+	"file_tag AS x WHERE t.id = x.tag_id AND x.file_id = f.id AND "
+	"f.relative_path = ?;";
+	sqlite3_stmt *prep = NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+
+	if (sqlite3_bind_text(prep, 1, path, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+		sqlite3_finalize(prep);
+		prep = NULL;
+	}
+
+	return new_step(db, prep);
+}
+
+step_t *ftag_list_all_tags(ftag_db *db)
+{
+	static const char *sql = "SELECT DISTINCT name, file_count FROM tag;";
+	sqlite3_stmt *prep = NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+
+	return new_step(db, prep);
+}
+
+/* The top most used tags tagging at least min_count files, most used
+ * first, all of them if top is 0. A walk down tag_count_ix that stops
+ * after top rows, however many tags there are.
+ */
+step_t *ftag_list_top_tags(ftag_db *db, int top, int min_count)
+{
+	static const char *sql = "SELECT name, file_count FROM tag "
+	"WHERE file_count >= ?2 AND (?3 OR name NOT LIKE '.%') "
+	"ORDER BY file_count DESC, name LIMIT ?1;";
+	sqlite3_stmt *prep = NULL;
+
+	if (top < 0)
+		return NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+
+	sqlite3_bind_int(prep, 1, top == 0 ? -1 : top);
+	sqlite3_bind_int(prep, 2, min_count);
+	sqlite3_bind_int(prep, 3, db->showhidden);
+
+	return new_step(db, prep);
+}
+
+/* Tags put on a file since the time given, the most recently used first.
+ * Walks file_tag_time_ix from since on, so older associations cost nothing.
+ */
+step_t *ftag_list_recent_tags(ftag_db *db, long long since)
+{
+	static const char *sql = "SELECT t.name, t.file_count FROM file_tag AS x "
+	"INDEXED BY file_tag_time_ix CROSS JOIN tag AS t WHERE x.tagged_at >= ?1 "
+	"AND t.id = x.tag_id AND (?2 OR t.name NOT LIKE '.%') "
+	"GROUP BY x.tag_id ORDER BY max(x.tagged_at) DESC, t.name;";
+	sqlite3_stmt *prep = NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+
+	sqlite3_bind_int64(prep, 1, since);
+	sqlite3_bind_int(prep, 2, db->showhidden);
+
+	return new_step(db, prep);
+}
+
+/* Tags matching pattern, or the tag named pattern if it isn't one */
+step_t *ftag_list_matching_tags(ftag_db *db, const char *pattern)
+{
+	static const char *sql_fmt = "SELECT name, file_count FROM tag "
+	"WHERE id IN (%s) ORDER BY name;";
+	struct id_list list = { 0, 0, NULL };
+	sqlite3_stmt *prep = NULL;
+	char *ids = NULL;
+	char *sql = NULL;
+
+	if (pattern == NULL)
+		return NULL;
+
+	phase_switch(db, PHASE_RESOLVE);
+
+	if (!tag_is_pattern(pattern)) {
+		int *id = get_tag_ids(db, 1, &pattern);
+
+		if (id == NULL || (*id != -1 && id_list_add(&list, *id) != SUCCESS)) {
+			free(id);
+			return NULL;
+		}
+
+		free(id);
+	} else if (match_tag_ids(db, pattern, &list) != SUCCESS) {
+		free(list.ids);
+		return NULL;
+	}
+
+	phase_switch(db, PHASE_PREPARE);
+
+	ids = id_list_sql(&list);
+	if (ids != NULL && (sql = malloc(strlen(sql_fmt) + strlen(ids) + 1)) != NULL) {
+		sprintf(sql, sql_fmt, ids);
+
+		if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+			prep = NULL;
+	}
+
+	free(list.ids);
+	free(ids);
+	free(sql);
+
+	return new_step(db, prep);
+}
+
+/* The tags most often on the same files as tag, with the number of files
+ * they share, at most limit of them unless it is 0
+ */
+step_t *ftag_list_related(ftag_db *db, const char *tag, int limit)
+{
+	static const char *sql = "SELECT t.name, p.count FROM tag AS r "
+	"JOIN tag_pair AS p ON p.tag_id = r.id JOIN tag AS t ON t.id = p.other_id "
+	"WHERE r.name = ?1 AND (?3 OR t.name NOT LIKE '.%') "
+	"ORDER BY p.count DESC, t.name LIMIT ?2;";
+	sqlite3_stmt *prep = NULL;
+
+	if (tag == NULL || limit < 0)
+		return NULL;
+
+	phase_switch(db, PHASE_PREPARE);
+
+	if (sqlite3_prepare_v2(db->conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return NULL;
+
+	sqlite3_bind_text(prep, 1, tag, -1, SQLITE_STATIC);
+	sqlite3_bind_int(prep, 2, limit == 0 ? -1 : limit);
+	sqlite3_bind_int(prep, 3, db->showhidden);
+
+	return new_step(db, prep);
+}
+
+static int run_init_db_sql(ftag_db *db)
+{
+    static char *init_sql =
+    "BEGIN IMMEDIATE;"
+    "CREATE TABLE file ( id INTEGER PRIMARY KEY, relative_path TEXT );"
+    "CREATE TABLE tag ( id INTEGER PRIMARY KEY, name TEXT );"
+    "CREATE TABLE file_tag ( file_id INTEGER, tag_id INTEGER );"
+
+    "CREATE UNIQUE INDEX file_path_uq ON file (relative_path);"
+    "CREATE UNIQUE INDEX tag_name_uq ON tag (name);"
+    "CREATE UNIQUE INDEX file_tag_uq ON file_tag (file_id, tag_id);"
+    "COMMIT;"
+    ;
+
+    return sqlite3_exec(db->conn, init_sql, NULL, NULL, NULL);
+}
+
+/* The /-separated parts of the tag name n as a JSON array, and the
+ * tag_ancestor rows of a tag (the tags in from, if any) for each part p of
+ * its name: the name up to and including p, at depth the number of parts
+ * after it. So a tag is below every name it begins with followed by a /.
+ */
+#define NAME_PARTS(n) "('[' || replace(json_quote(" n "), '/', '\",\"') || ']')"
+#define ANCESTOR_ROWS(id, n, from) \
+    "SELECT substr(" n ", 1, (SELECT sum(length(s.value)) + count(*) - 1 " \
+    "FROM json_each(" NAME_PARTS(n) ") AS s WHERE s.key <= p.key)), " id ", " \
+    "json_array_length(" NAME_PARTS(n) ") - 1 - p.key " \
+    "FROM " from "json_each(" NAME_PARTS(n) ") AS p"
+
+/* Count the file_tag row r, as OLD or NEW in a trigger, in tag_pair against
+ * the other tags of its file, or stop counting it
+ */
+#define PAIR_OTHERS(r) "(SELECT tag_id FROM file_tag WHERE file_id = " r ".file_id " \
+    "AND rowid != " r ".rowid)"
+#define PAIR_ADD(r) \
+    "INSERT INTO tag_pair (tag_id, other_id, count) SELECT " r ".tag_id, tag_id, 1 " \
+    "FROM file_tag WHERE file_id = " r ".file_id AND rowid != " r ".rowid " \
+    "ON CONFLICT (tag_id, other_id) DO UPDATE SET count = count + 1;" \
+    "INSERT INTO tag_pair (tag_id, other_id, count) SELECT tag_id, " r ".tag_id, 1 " \
+    "FROM file_tag WHERE file_id = " r ".file_id AND rowid != " r ".rowid " \
+    "ON CONFLICT (tag_id, other_id) DO UPDATE SET count = count + 1;"
+#define PAIR_REMOVE(r) \
+    "UPDATE tag_pair SET count = count - 1 WHERE tag_id = " r ".tag_id " \
+    "AND other_id IN " PAIR_OTHERS(r) ";" \
+    "UPDATE tag_pair SET count = count - 1 WHERE other_id = " r ".tag_id " \
+    "AND tag_id IN " PAIR_OTHERS(r) ";" \
+    "DELETE FROM tag_pair WHERE tag_id = " r ".tag_id AND count = 0;" \
+    "DELETE FROM tag_pair WHERE other_id = " r ".tag_id AND count = 0 " \
+    "AND tag_id IN " PAIR_OTHERS(r) ";"
+#define PAIR_TRIGGERS \
+    "CREATE TRIGGER tag_pair_insert AFTER INSERT ON file_tag BEGIN " \
+    PAIR_ADD("NEW") "END;" \
+    "CREATE TRIGGER tag_pair_delete AFTER DELETE ON file_tag BEGIN " \
+    PAIR_REMOVE("OLD") "END;" \
+    "CREATE TRIGGER tag_pair_update AFTER UPDATE OF tag_id ON file_tag BEGIN " \
+    PAIR_REMOVE("OLD") PAIR_ADD("NEW") "END;"
+
+/* All of tag_pair at once, in one grouped pass over file_tag */
+#define PAIR_FILL \
+    "INSERT INTO tag_pair (tag_id, other_id, count) " \
+    "SELECT a.tag_id, b.tag_id, COUNT(*) FROM file_tag AS a JOIN file_tag AS b " \
+    "ON b.file_id = a.file_id AND b.tag_id != a.tag_id " \
+    "GROUP BY a.tag_id, b.tag_id;"
+
+/* A change_log row for op on file_tag row r, by the path and name it
+ * refers to, as ids differ between databases, and when it was made
+ */
+#define LOG_FILE_TAG(op, r, when) \
+    "INSERT INTO change_log (op, file, tag, tagged_at) VALUES ('" op "', " \
+    "(SELECT relative_path FROM file WHERE id = " r ".file_id), " \
+    "(SELECT name FROM tag WHERE id = " r ".tag_id), " when ");"
+
+#define LOG_TRIGGERS \
+    "CREATE TRIGGER change_log_insert AFTER INSERT ON file_tag BEGIN " \
+    LOG_FILE_TAG("tag", "NEW", "NEW.tagged_at") "END;" \
+    "CREATE TRIGGER change_log_delete AFTER DELETE ON file_tag BEGIN " \
+    LOG_FILE_TAG("untag", "OLD", "NULL") "END;" \
+    "CREATE TRIGGER change_log_update AFTER UPDATE OF tag_id ON file_tag BEGIN " \
+    LOG_FILE_TAG("untag", "OLD", "NULL") \
+    LOG_FILE_TAG("tag", "NEW", "NEW.tagged_at") "END;"
+
+/* A new version of a file's tag set, only if the last one was mirrored:
+ * being unmirrored is all ftag_xattr_sync needs to know, and files already so,
+ * like every one being loaded, are then left alone.
+ */
+#define VERSION_BUMP(cond) \
+    "UPDATE file SET tag_version = tag_version + 1 WHERE " cond \
+    " AND tag_version = synced_version;"
+
+#define VERSION_TRIGGERS \
+    "CREATE TRIGGER file_version_insert AFTER INSERT ON file_tag BEGIN " \
+    VERSION_BUMP("id = NEW.file_id") "END;" \
+    "CREATE TRIGGER file_version_delete AFTER DELETE ON file_tag BEGIN " \
+    VERSION_BUMP("id = OLD.file_id") "END;" \
+    "CREATE TRIGGER file_version_update AFTER UPDATE OF file_id, tag_id ON " \
+    "file_tag BEGIN " VERSION_BUMP("id = OLD.file_id") \
+    VERSION_BUMP("id = NEW.file_id") "END;" \
+    "CREATE TRIGGER file_version_rename AFTER UPDATE OF name ON tag BEGIN " \
+    VERSION_BUMP("id IN (SELECT file_id FROM file_tag WHERE tag_id = NEW.id)") \
+    "END;" \
+    "CREATE TRIGGER xattr_cleared_insert AFTER DELETE ON file " \
+    "WHEN OLD.synced_version > 0 BEGIN INSERT OR IGNORE INTO xattr_cleared " \
+    "(relative_path) VALUES (OLD.relative_path); END;"
+
+/* Per-tag file counts, kept up to date or all counted at once */
+#define COUNT_TRIGGERS \
+    "CREATE TRIGGER file_tag_count_insert AFTER INSERT ON file_tag BEGIN " \
+    "UPDATE tag SET file_count = file_count + 1 WHERE id = NEW.tag_id; END;" \
+    "CREATE TRIGGER file_tag_count_delete AFTER DELETE ON file_tag BEGIN " \
+    "UPDATE tag SET file_count = file_count - 1 WHERE id = OLD.tag_id; END;" \
+    "CREATE TRIGGER file_tag_count_update AFTER UPDATE OF tag_id ON file_tag " \
+    "BEGIN " \
+    "UPDATE tag SET file_count = file_count - 1 WHERE id = OLD.tag_id;" \
+    "UPDATE tag SET file_count = file_count + 1 WHERE id = NEW.tag_id;" \
+    "END;"
+
+#define COUNT_FILL \
+    "UPDATE tag SET file_count = " \
+    "(SELECT COUNT(*) FROM file_tag WHERE tag_id = tag.id);"
+
+/* Associations by when they were made */
+#define TIME_INDEX \
+    "CREATE INDEX file_tag_time_ix ON file_tag (tagged_at, tag_id, file_id);"
+
+/* Every association logged as added, in one pass in the order they were */
+#define LOG_FILL \
+    "INSERT INTO change_log (op, file, tag, tagged_at) SELECT 'tag', " \
+    "f.relative_path, t.name, x.tagged_at FROM file_tag AS x " \
+    "JOIN file AS f ON f.id = x.file_id JOIN tag AS t ON t.id = x.tag_id " \
+    "ORDER BY x.rowid;"
+
+/* Schema changes made after the initial layout above. Entry i upgrades a
+ * database from PRAGMA user_version i to i + 1, so new entries must only
+ * ever be appended.
+ */
+static const char *migrations[] = {
+    // 1: maintained per-tag file counts, used to plan intersections
+    "ALTER TABLE tag ADD COLUMN file_count INTEGER NOT NULL DEFAULT 0;"
+    "CREATE INDEX file_tag_tag_ix ON file_tag (tag_id, file_id);"
+    COUNT_FILL COUNT_TRIGGERS
+    ,
+    // 2: closure of the tag hierarchy, every tag under each of its parents
+    "CREATE TABLE tag_ancestor ( ancestor TEXT NOT NULL, tag_id INTEGER NOT NULL,"
+    " depth INTEGER NOT NULL );"
+    "CREATE UNIQUE INDEX tag_ancestor_uq ON tag_ancestor (ancestor, tag_id);"
+    "CREATE INDEX tag_ancestor_tag_ix ON tag_ancestor (tag_id);"
+    "INSERT OR IGNORE INTO tag_ancestor (ancestor, tag_id, depth) "
+    ANCESTOR_ROWS("tag.id", "tag.name", "tag, ") ";"
+    "CREATE TRIGGER tag_ancestor_insert AFTER INSERT ON tag BEGIN "
+    "INSERT OR IGNORE INTO tag_ancestor (ancestor, tag_id, depth) "
+    ANCESTOR_ROWS("NEW.id", "NEW.name", "") "; END;"
+    "CREATE TRIGGER tag_ancestor_delete AFTER DELETE ON tag BEGIN "
+    "DELETE FROM tag_ancestor WHERE tag_id = OLD.id; END;"
+    "CREATE TRIGGER tag_ancestor_update AFTER UPDATE OF name ON tag BEGIN "
+    "DELETE FROM tag_ancestor WHERE tag_id = OLD.id;"
+    "INSERT OR IGNORE INTO tag_ancestor (ancestor, tag_id, depth) "
+    ANCESTOR_ROWS("NEW.id", "NEW.name", "") "; END;"
+    ,
+    // 3: number of files shared by each pair of tags, both ways round
+    "CREATE TABLE tag_pair ( tag_id INTEGER NOT NULL, other_id INTEGER NOT NULL,"
+    " count INTEGER NOT NULL );"
+    "CREATE UNIQUE INDEX tag_pair_uq ON tag_pair (tag_id, other_id);"
+    PAIR_FILL PAIR_TRIGGERS
+    ,
+    // 4: tags by popularity, for listing the top ones without sorting
+    "CREATE INDEX tag_count_ix ON tag (file_count DESC, name);"
+    ,
+    // 5: hidden files only, for counting them without touching the table
+    "CREATE INDEX file_hidden_ix ON file (id, relative_path) "
+    "WHERE relative_path GLOB '.*';"
+    ,
+    // 6: every change to file_tag and tag names, by path and name, to replay
+    "CREATE TABLE change_log ( seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+    " op TEXT NOT NULL, file TEXT, tag TEXT, new_tag TEXT );"
+    // The triggers as they were then, 9 replaces them with LOG_TRIGGERS
+    "CREATE TRIGGER change_log_insert AFTER INSERT ON file_tag BEGIN "
+    "INSERT INTO change_log (op, file, tag) VALUES ('tag', "
+    "(SELECT relative_path FROM file WHERE id = NEW.file_id), "
+    "(SELECT name FROM tag WHERE id = NEW.tag_id)); END;"
+    "CREATE TRIGGER change_log_delete AFTER DELETE ON file_tag BEGIN "
+    "INSERT INTO change_log (op, file, tag) VALUES ('untag', "
+    "(SELECT relative_path FROM file WHERE id = OLD.file_id), "
+    "(SELECT name FROM tag WHERE id = OLD.tag_id)); END;"
+    "CREATE TRIGGER change_log_update AFTER UPDATE OF tag_id ON file_tag BEGIN "
+    "INSERT INTO change_log (op, file, tag) VALUES ('untag', "
+    "(SELECT relative_path FROM file WHERE id = OLD.file_id), "
+    "(SELECT name FROM tag WHERE id = OLD.tag_id));"
+    "INSERT INTO change_log (op, file, tag) VALUES ('tag', "
+    "(SELECT relative_path FROM file WHERE id = NEW.file_id), "
+    "(SELECT name FROM tag WHERE id = NEW.tag_id)); END;"
+    "CREATE TRIGGER change_log_rename AFTER UPDATE OF name ON tag BEGIN "
+    "INSERT INTO change_log (op, tag, new_tag) VALUES ('retag', OLD.name, "
+    "NEW.name); END;"
+    ,
+    // 7: when each association was made, to find the ones in a time range
+    "ALTER TABLE file_tag ADD COLUMN tagged_at INTEGER;"
+    TIME_INDEX
+    ,
+    // 8: versions of each file's tag set, and the last mirrored to xattrs
+    "ALTER TABLE file ADD COLUMN tag_version INTEGER NOT NULL DEFAULT 1;"
+    "ALTER TABLE file ADD COLUMN synced_version INTEGER NOT NULL DEFAULT 0;"
+    "CREATE INDEX file_unsynced_ix ON file (id) "
+    "WHERE tag_version <> synced_version;"
+    "CREATE TABLE xattr_cleared ( relative_path TEXT PRIMARY KEY );"
+    VERSION_TRIGGERS
+    ,
+    // 9: when each logged association was made, so replaying keeps it
+    "ALTER TABLE change_log ADD COLUMN tagged_at INTEGER;"
+    "DROP TRIGGER change_log_insert;"
+    "DROP TRIGGER change_log_delete;"
+    "DROP TRIGGER change_log_update;"
+    LOG_TRIGGERS
+    ,
+};
+
+#define SCHEMA_VERSION ((int) (sizeof(migrations) / sizeof(*migrations)))
+
+const int schema_version = SCHEMA_VERSION;
+
+/* Stop keeping tag_pair up to date for the rest of the transaction, until
+ * rebuild_tag_pairs. For loading many associations at once, where counting
+ * them in one pass at the end is much quicker than row by row.
+ */
+int pause_tag_pairs(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, "DROP TRIGGER tag_pair_insert;"
+                        "DROP TRIGGER tag_pair_delete;"
+                        "DROP TRIGGER tag_pair_update;", NULL, NULL, NULL)
+        == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+int rebuild_tag_pairs(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, "DELETE FROM tag_pair;" PAIR_FILL PAIR_TRIGGERS,
+                        NULL, NULL, NULL) == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+/* Stop logging changes to associations for the rest of the transaction,
+ * until fill_change_log. Only for loading into an empty database, where
+ * every association afterwards is a change to log.
+ */
+int pause_change_log(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, "DROP TRIGGER change_log_insert;"
+                        "DROP TRIGGER change_log_delete;"
+                        "DROP TRIGGER change_log_update;", NULL, NULL, NULL)
+        == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+int fill_change_log(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, LOG_FILL LOG_TRIGGERS, NULL, NULL, NULL)
+        == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+/* Drop file_tag_time_ix for the rest of the transaction, until
+ * rebuild_time_index sorts it back together at once. Loaded associations
+ * arrive by file, so keeping it up to date would mean a random write each.
+ */
+int pause_time_index(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, "DROP INDEX file_tag_time_ix;", NULL, NULL,
+                        NULL) == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+int rebuild_time_index(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, TIME_INDEX, NULL, NULL, NULL) == SQLITE_OK ?
+        SUCCESS : ERROR;
+}
+
+/* Drop every index of file, tag and file_tag and stop counting files per
+ * tag for the rest of the transaction, until rebuild_indexes. Only for
+ * loading into an empty database: rows loaded in id order then only ever
+ * append to their tables, and each index is built at the end by one sort
+ * of all its keys, which SQLite does in bounded memory, spilling sorted
+ * runs to temporary files and merging them. The time index goes too, so
+ * this is instead of pause_time_index.
+ *
+ * Until then nothing stops duplicate paths, names or associations, which
+ * rebuild_indexes finds.
+ */
+int pause_indexes(ftag_db *db)
+{
+    return sqlite3_exec(db->conn, "DROP INDEX file_path_uq;"
+                        "DROP INDEX tag_name_uq;"
+                        "DROP INDEX file_tag_uq;"
+                        "DROP INDEX file_tag_tag_ix;"
+                        "DROP INDEX file_tag_time_ix;"
+                        "DROP INDEX tag_count_ix;"
+                        "DROP INDEX file_hidden_ix;"
+                        "DROP INDEX file_unsynced_ix;"
+                        "DROP TRIGGER file_tag_count_insert;"
+                        "DROP TRIGGER file_tag_count_delete;"
+                        "DROP TRIGGER file_tag_count_update;", NULL, NULL, NULL)
+        == SQLITE_OK ? SUCCESS : ERROR;
+}
+
+/* Build the indexes pause_indexes dropped, as init_sql and the migrations
+ * make them. Associations loaded twice are dropped, as INSERT OR IGNORE
+ * would have, but a path or name loaded twice is an error.
+ */
+int rebuild_indexes(ftag_db *db)
+{
+    static const char *uq_sql =
+    "CREATE UNIQUE INDEX file_tag_uq ON file_tag (file_id, tag_id);";
+    static const char *dedup_sql =
+    "DELETE FROM file_tag WHERE rowid NOT IN "
+    "(SELECT min(rowid) FROM file_tag GROUP BY file_id, tag_id);";
+    static const char *rebuild_sql =
+    "CREATE UNIQUE INDEX file_path_uq ON file (relative_path);"
+    "CREATE UNIQUE INDEX tag_name_uq ON tag (name);"
+    "CREATE INDEX file_tag_tag_ix ON file_tag (tag_id, file_id);"
+    TIME_INDEX
+    COUNT_FILL COUNT_TRIGGERS
+    "CREATE INDEX tag_count_ix ON tag (file_count DESC, name);"
+    "CREATE INDEX file_hidden_ix ON file (id, relative_path) "
+    "WHERE relative_path GLOB '.*';"
+    "CREATE INDEX file_unsynced_ix ON file (id) "
+    "WHERE tag_version <> synced_version;"
+    ;
+    int rc = sqlite3_exec(db->conn, uq_sql, NULL, NULL, NULL);
+
+    // Duplicates are rare, so only then is the table searched for them
+    if (rc == SQLITE_CONSTRAINT &&
+        sqlite3_exec(db->conn, dedup_sql, NULL, NULL, NULL) == SQLITE_OK)
+        rc = sqlite3_exec(db->conn, uq_sql, NULL, NULL, NULL);
+
+    if (rc != SQLITE_OK ||
+        sqlite3_exec(db->conn, rebuild_sql, NULL, NULL, NULL) != SQLITE_OK)
+        return ERROR;
+
+    return SUCCESS;
+}
+
+int get_schema_version(ftag_db *db)
+{
+    sqlite3_stmt *prep = NULL;
+    int version = -1;
+
+    if (sqlite3_prepare_v2(db->conn, "PRAGMA user_version;", -1, &prep, NULL)
+        != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(prep) == SQLITE_ROW)
+        version = sqlite3_column_int(prep, 0);
+
+    sqlite3_finalize(prep);
+
+    return version;
+}
+
+/* Bring the schema of a database made by an older ftag up to
+ * SCHEMA_VERSION, all in one transaction. ERROR if the schema is newer than
+ * this version knows, or older and the handle is read-only.
+ */
+int ftag_upgrade_db(ftag_db *db)
+{
+    char pragma[32];
+    int version = get_schema_version(db);
+
+    if (version < 0 || version > SCHEMA_VERSION)
+        return ERROR;
+    else if (version == SCHEMA_VERSION)
+        return SUCCESS;
+    else if (ftag_db_readonly(db))
+        return ERROR;
+
+    if (sqlite3_exec(db->conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+        return ERROR;
+
+    // Someone else may have upgraded while we waited for the lock
+    version = get_schema_version(db);
+
+    for (; version >= 0 && version < SCHEMA_VERSION; version++)
+        if (sqlite3_exec(db->conn, migrations[version], NULL, NULL, NULL)
+            != SQLITE_OK)
+            goto error;
+
+    sprintf(pragma, "PRAGMA user_version = %d;", SCHEMA_VERSION);
+
+    if (sqlite3_exec(db->conn, pragma, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_exec(db->conn, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+        goto error;
+
+    return SUCCESS;
+
+    error:
+    sqlite3_exec(db->conn, "ROLLBACK;", NULL, NULL, NULL);
+    return ERROR;
+}
+
+/***--- Handles ---***/
+
+static ftag_db *new_db(void)
+{
+	ftag_db *db = calloc(1, sizeof(*db));
+
+	if (db != NULL)
+		db->phase_current = PHASE_NONE;
+
+	return db;
+}
+
+void ftag_close_db(ftag_db *db)
+{
+	if (db == NULL)
+		return;
+
+	if (db->conn != NULL) {
+		if (db->verbosity >= 2) {
+			print_phase_times(db);
+			print_db_status(db->conn);
+		}
+
+		sqlite3_close(db->conn);
+	}
+
+	free_tag_names(db->tag_names);
+	free(db->path);
+	free(db->dir);
+	free(db);
+}
+
+/* Open and init the database fn in dir. If dir is NULL it is searched for
+ * from the current directory upwards and created in the current directory
+ * if not found. fn defaults to DB_FILENAME. The working directory is left
+ * alone. Returns NULL on error.
+ *
+ * A database made by an older ftag is left as it is, see ftag_upgrade_db.
+ * One whose file can't be written is opened read-only.
+ *
+ * Handles are not safe to share between threads, open one per thread.
+ */
+ftag_db *ftag_open_db(const char *fn, const char *dir, int verbosity)
+{
+	ftag_db *db = new_db();
+
+	if (db == NULL)
+		return NULL;
+
+	db->verbosity = verbosity;
+
+    if (fn == NULL)
+		fn = DB_FILENAME;
+
+    phase_switch(db, PHASE_DISCOVERY);
+
+    // Joining with a dir also stops ":memory:" from opening a memory db
+    db->dir = dir == NULL ? find_db_dir(fn) : strdup(dir);
+    if (db->dir == NULL || (db->path = join_path(db->dir, fn)) == NULL)
+        goto error;
+
+    phase_switch(db, PHASE_OPEN);
+
+    // Return error if database doesn't already exist
+    int status = sqlite3_open_v2(db->path, &db->conn, SQLITE_OPEN_READWRITE |
+                                 SQLITE_OPEN_NOMUTEX, NULL);
+
+    if (status != SQLITE_OK) {
+        sqlite3_close(db->conn);
+        db->conn = NULL;
+
+        status = sqlite3_open_v2(db->path, &db->conn, SQLITE_OPEN_READWRITE |
+                                 SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL);
+        if (status != SQLITE_OK)
+            goto error;
+        else {
+            status = run_init_db_sql(db);
+            if (status != SQLITE_OK || ftag_upgrade_db(db) != SUCCESS)
+                goto error;
+        }
+    }
+
+    phase_switch(db, PHASE_NONE);
+
+    return db;
+
+    error:
+    ftag_close_db(db);
+    return NULL;
+}
+
+/* Same as ftag_open_db, but use a volatile in-memory database instead of on disk */
+ftag_db *ftag_open_memory_db(void)
+{
+    ftag_db *db = new_db();
+
+    if (db == NULL)
+        return NULL;
+
+    int status = sqlite3_open_v2(":memory:", &db->conn,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                                 NULL);
+    if (status != SQLITE_OK || run_init_db_sql(db) != SQLITE_OK ||
+        ftag_upgrade_db(db) != SUCCESS) {
+        ftag_close_db(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+/* Another, read-only, connection to the database of db with the same
+ * settings, for use by another thread. Not possible for memory databases.
+ */
+ftag_db *ftag_open_reader(ftag_db *db)
+{
+	ftag_db *reader = NULL;
+
+	if (db == NULL || db->path == NULL)
+		return NULL;
+
+	reader = new_db();
+	if (reader == NULL)
+		return NULL;
+
+	reader->showhidden = db->showhidden;
+	reader->verbosity = db->verbosity;
+	reader->path = strdup(db->path);
+	reader->dir = strdup(db->dir);
+
+	if (reader->path == NULL || reader->dir == NULL ||
+		sqlite3_open_v2(reader->path, &reader->conn, SQLITE_OPEN_READONLY |
+						SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK ||
+		ftag_set_mem_budget(reader, db->mem_budget) != SUCCESS) {
+		ftag_close_db(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/* Path of the database file, NULL for memory databases */
+const char *ftag_db_path(ftag_db *db)
+{
+	return db->path;
+}
+
+/* Directory of the database file, NULL for memory databases */
+const char *ftag_db_dir(ftag_db *db)
+{
+	return db->dir;
+}
+
+/* Whether changes to db fail, eg. as its file can't be written */
+int ftag_db_readonly(ftag_db *db)
+{
+	return sqlite3_db_readonly(db->conn, "main") == 1;
+}
+
+/* Bytes of memory for the page cache and for sorting, 0 to leave SQLite's
+ * default. Sorts of more than that, like those of large filters by tag,
+ * are merged from runs written to temporary files (see ftag_set_temp_dir).
+ * Readers opened from db get the same.
+ */
+int ftag_set_mem_budget(ftag_db *db, long long bytes)
+{
+	char pragma[48];
+
+	if (bytes < 0)
+		return ERROR;
+
+	db->mem_budget = bytes;
+	if (bytes == 0)
+		return SUCCESS;
+
+	// Negative sizes are in KiB instead of pages
+	sprintf(pragma, "PRAGMA cache_size = -%lld;", bytes < 1024 ? 1 : bytes / 1024);
+
+	return sqlite3_exec(db->conn, pragma, NULL, NULL, NULL) == SQLITE_OK ?
+		SUCCESS : ERROR;
+}
+
+/* Directory for the temporary files of large sorts, eg. a tmpfs to keep
+ * them in memory, or NULL for SQLite's choice ($SQLITE_TMPDIR, $TMPDIR,
+ * /var/tmp, ...). It is SQLite's sqlite3_temp_directory, for the whole
+ * process, so unlike everything else here it is not re-entrant: as SQLite
+ * requires, set it once before any database is opened and never while
+ * another thread uses the library.
+ */
+int ftag_set_temp_dir(const char *dir)
+{
+	struct stat st;
+	char *copy = NULL;
+
+	if (dir != NULL && (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)))
+		return ERROR;
+
+	if (dir != NULL && (copy = sqlite3_mprintf("%s", dir)) == NULL)
+		return ERROR;
+
+	sqlite3_free(sqlite3_temp_directory);
+	sqlite3_temp_directory = copy;
+
+	return SUCCESS;
+}
+
+/* Whether queries include files and tags beginning with a . */
+void ftag_set_show_hidden(ftag_db *db, int showhidden)
+{
+	db->showhidden = showhidden;
+}
+
+int ftag_get_show_hidden(ftag_db *db)
+{
+	return db->showhidden;
+}
+
+/* The underlying connection, for running SQL of one's own */
+sqlite3 *ftag_db_sqlite(ftag_db *db)
+{
+	return db->conn;
+}
@@ -0,0 +1,459 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Mount index -- the tag directories behind ftag mount
+ *
+ * Every file path, tag name and the files of each tag are held in memory,
+ * sorted, and loaded again whenever data_version says the database was
+ * changed. A directory's files are its smallest tag's, each checked against
+ * the other tags by binary search. They are found as readdir asks for them
+ * and kept for the next call, so a big directory is never listed in one go
+ * and listing it again costs nothing.
+ *
+ * Nothing here needs FUSE, it is always built so that it can be tested
+ * without it. mount.c serves it.
+ */
+
+/***--- Includes ---***/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sqlite3.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Index ---***/
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void free_index(struct mount_index *index)
+{
+	for (int i = 0; index->files != NULL && i < index->nfiles; i++)
+		free(index->files[i]);
+	for (int i = 0; index->tags != NULL && i < index->ntags; i++)
+		free(index->tags[i]);
+	for (int i = 0; index->postings != NULL && i < index->ntags; i++)
+		free(index->postings[i]);
+
+	free(index->files);
+	free(index->tags);
+	free(index->postings);
+	free(index->counts);
+
+	index->nfiles = index->ntags = 0;
+	index->files = index->tags = NULL;
+	index->postings = NULL;
+	index->counts = NULL;
+}
+
+static sqlite3_int64 max_id(sqlite3 *conn, const char *sql)
+{
+	sqlite3_stmt *prep = NULL;
+	sqlite3_int64 id = -1;
+
+	if (sqlite3_prepare_v2(conn, sql, -1, &prep, NULL) == SQLITE_OK &&
+		sqlite3_step(prep) == SQLITE_ROW)
+		id = sqlite3_column_int64(prep, 0);
+	sqlite3_finalize(prep);
+
+	return id;
+}
+
+/* Rows of sql as the id in the first column and a name in the second, in
+ * order, into names with the place of each id in places
+ */
+static int load_names(sqlite3 *conn, const char *sql, int n, char **names,
+					  int *places, sqlite3_int64 maxid)
+{
+	sqlite3_stmt *prep = NULL;
+	int i = 0;
+
+	if (sqlite3_prepare_v2(conn, sql, -1, &prep, NULL) != SQLITE_OK)
+		return ERROR;
+
+	while (i < n && sqlite3_step(prep) == SQLITE_ROW) {
+		sqlite3_int64 id = sqlite3_column_int64(prep, 0);
+
+		if (id < 0 || id > maxid ||
+			(names[i] = strdup((const char *) sqlite3_column_text(prep, 1)))
+			== NULL)
+			break;
+
+		places[id] = i++;
+	}
+	sqlite3_finalize(prep);
+
+	return i == n ? SUCCESS : ERROR;
+}
+
+/* Load the whole database into index, in one read transaction */
+static int load_index(sqlite3 *conn, struct mount_index *index)
+{
+	sqlite3_stmt *prep = NULL;
+	sqlite3_int64 maxfile, maxtag;
+	int *file_at = NULL, *tag_at = NULL, *filled = NULL;
+	int status = ERROR;
+
+	if (sqlite3_exec(conn, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	maxfile = max_id(conn, "SELECT ifnull(max(id), 0) FROM file;");
+	maxtag = max_id(conn, "SELECT ifnull(max(id), 0) FROM tag;");
+	index->nfiles = (int) max_id(conn, "SELECT COUNT(*) FROM file;");
+	index->ntags = (int) max_id(conn, "SELECT COUNT(*) FROM tag;");
+	if (maxfile < 0 || maxtag < 0 || index->nfiles < 0 || index->ntags < 0) {
+		index->nfiles = index->ntags = 0;
+		goto out;
+	}
+
+	index->files = calloc(index->nfiles + 1, sizeof(*index->files));
+	index->tags = calloc(index->ntags + 1, sizeof(*index->tags));
+	index->postings = calloc(index->ntags + 1, sizeof(*index->postings));
+	index->counts = calloc(index->ntags + 1, sizeof(*index->counts));
+	file_at = malloc(sizeof(*file_at) * (maxfile + 1));
+	tag_at = malloc(sizeof(*tag_at) * (maxtag + 1));
+	filled = calloc(index->ntags + 1, sizeof(*filled));
+	if (index->files == NULL || index->tags == NULL || index->postings == NULL ||
+		index->counts == NULL || file_at == NULL || tag_at == NULL ||
+		filled == NULL)
+		goto out;
+
+	if (load_names(conn, "SELECT id, relative_path FROM file "
+				   "ORDER BY relative_path;", index->nfiles, index->files,
+				   file_at, maxfile) != SUCCESS ||
+		load_names(conn, "SELECT id, name FROM tag ORDER BY name;",
+				   index->ntags, index->tags, tag_at, maxtag) != SUCCESS)
+		goto out;
+
+	// The maintained counts size each tag's files up front
+	if (sqlite3_prepare_v2(conn, "SELECT id, file_count FROM tag;", -1, &prep,
+						   NULL) != SQLITE_OK)
+		goto out;
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		int t = tag_at[sqlite3_column_int64(prep, 0)];
+
+		index->counts[t] = sqlite3_column_int(prep, 1);
+		if ((index->postings[t] = malloc(sizeof(int) * (index->counts[t] + 1)))
+			== NULL)
+			goto out;
+	}
+	sqlite3_finalize(prep);
+
+	if (sqlite3_prepare_v2(conn, "SELECT tag_id, file_id FROM file_tag;", -1,
+						   &prep, NULL) != SQLITE_OK)
+		goto out;
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		int t = tag_at[sqlite3_column_int64(prep, 0)];
+
+		if (filled[t] == index->counts[t])
+			goto out;
+		index->postings[t][filled[t]++] = file_at[sqlite3_column_int64(prep, 1)];
+	}
+
+	for (int t = 0; t < index->ntags; t++) {
+		index->counts[t] = filled[t];
+		qsort(index->postings[t], filled[t], sizeof(int), cmp_int);
+	}
+
+	status = SUCCESS;
+
+	out:
+	sqlite3_finalize(prep);
+	sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+	free(file_at);
+	free(tag_at);
+	free(filled);
+
+	if (status != SUCCESS)
+		free_index(index);
+
+	return status;
+}
+
+static int data_version(sqlite3 *conn)
+{
+	return (int) max_id(conn, "PRAGMA data_version;");
+}
+
+/* Load the index again if the database changed since it last was */
+int mount_refresh(struct mount_tree *tree, sqlite3 *conn)
+{
+	int version = data_version(conn);
+
+	if (version == tree->index.data_version && tree->index.files != NULL)
+		return SUCCESS;
+
+	free_index(&tree->index);
+	if (load_index(conn, &tree->index) != SUCCESS)
+		return ERROR;
+
+	tree->index.data_version = version;
+	tree->index.generation++;
+
+	return SUCCESS;
+}
+
+/***--- Names ---***/
+
+/* name as an entry, / and % escaped. To be freed. */
+char *mount_encode(const char *name)
+{
+	char *out = malloc(3 * strlen(name) + 1);
+	char *end = out;
+
+	if (out == NULL)
+		return NULL;
+
+	for (; *name != '\0'; name++) {
+		if (*name == '/' || *name == '%')
+			end += sprintf(end, "%%%02X", (unsigned char) *name);
+		else
+			*end++ = *name;
+	}
+	*end = '\0';
+
+	return out;
+}
+
+/* The name an entry of len bytes stands for. To be freed. */
+char *mount_decode(const char *entry, size_t len)
+{
+	char *out = malloc(len + 1);
+	char *end = out;
+
+	if (out == NULL)
+		return NULL;
+
+	for (size_t i = 0; i < len; i++) {
+		if (entry[i] == '%' && i + 2 < len && isxdigit((unsigned char) entry[i + 1])
+			&& isxdigit((unsigned char) entry[i + 2])) {
+			char hex[3] = { entry[i + 1], entry[i + 2], '\0' };
+
+			*end++ = (char) strtol(hex, NULL, 16);
+			i += 2;
+		} else {
+			*end++ = entry[i];
+		}
+	}
+	*end = '\0';
+
+	return out;
+}
+
+static int find_name(char **names, int n, const char *name)
+{
+	char **found = bsearch(&name, names, n, sizeof(*names), cmp_str);
+
+	return found != NULL ? (int) (found - names) : -1;
+}
+
+static int has_file(const struct mount_index *index, int tag, int file)
+{
+	return bsearch(&file, index->postings[tag], index->counts[tag], sizeof(int),
+				   cmp_int) != NULL;
+}
+
+/* Whether an entry is shown, the name of a file or tag */
+int mount_visible(const struct mount_tree *tree, const char *name)
+{
+	return tree->showhidden || *name != '.';
+}
+
+/* The tags of the components of path, up to the last one if last is NULL,
+ * otherwise with its component in *last. The number of tags, -1 if one
+ * isn't a tag.
+ */
+int mount_resolve(struct mount_tree *tree, const char *path, int *tags,
+				  const char **last, size_t *lastlen)
+{
+	int n = 0;
+
+	while (*path == '/')
+		path++;
+
+	while (*path != '\0') {
+		size_t len = strcspn(path, "/");
+		char *name = NULL;
+		int tag;
+
+		if (last != NULL && path[len + strspn(path + len, "/")] == '\0') {
+			*last = path;
+			*lastlen = len;
+			return n;
+		}
+
+		if (n == MOUNT_MAX_DEPTH || (name = mount_decode(path, len)) == NULL)
+			return -1;
+		tag = find_name(tree->index.tags, tree->index.ntags, name);
+		free(name);
+
+		if (tag < 0)
+			return -1;
+
+		tags[n++] = tag;
+		path += len;
+		while (*path == '/')
+			path++;
+	}
+
+	if (last != NULL)
+		*last = NULL;
+
+	return n;
+}
+
+/***--- Directories ---***/
+
+static void free_dir(struct mount_dir *dir)
+{
+	free(dir->path);
+	free(dir->found);
+	memset(dir, 0, sizeof(*dir));
+}
+
+/* The files of a directory, cached, with the rarest tag first. NULL if
+ * path is not one.
+ */
+struct mount_dir *mount_get_dir(struct mount_tree *tree, const char *path)
+{
+	struct mount_dir *dir = NULL;
+	struct mount_dir *oldest = &tree->cache[0];
+
+	for (int i = 0; i < MOUNT_DIR_CACHE; i++) {
+		struct mount_dir *d = &tree->cache[i];
+
+		if (d->path != NULL && d->generation == tree->index.generation &&
+			strcmp(d->path, path) == 0) {
+			d->used = ++tree->tick;
+			return d;
+		}
+
+		if (d->used < oldest->used)
+			oldest = d;
+	}
+
+	dir = oldest;
+	free_dir(dir);
+
+	if ((dir->ntags = mount_resolve(tree, path, dir->tags, NULL, NULL)) < 0 ||
+		(dir->path = strdup(path)) == NULL) {
+		free_dir(dir);
+		return NULL;
+	}
+
+	for (int i = 1; i < dir->ntags; i++) {
+		if (tree->index.counts[dir->tags[i]] < tree->index.counts[dir->tags[0]]) {
+			int tmp = dir->tags[0];
+			dir->tags[0] = dir->tags[i];
+			dir->tags[i] = tmp;
+		}
+	}
+
+	dir->generation = tree->index.generation;
+	dir->used = ++tree->tick;
+	dir->next = dir->ntags > 0 ? 0 : -1;
+
+	return dir;
+}
+
+/* The i-th file of dir, found now if it wasn't before. -1 past the end. */
+int mount_dir_file(struct mount_tree *tree, struct mount_dir *dir, int i)
+{
+	const struct mount_index *index = &tree->index;
+
+	while (i >= dir->nfound && dir->next >= 0) {
+		int first = dir->tags[0];
+		int file, k;
+
+		if (dir->next >= index->counts[first]) {
+			dir->next = -1;
+			break;
+		}
+
+		file = index->postings[first][dir->next++];
+		for (k = 1; k < dir->ntags && has_file(index, dir->tags[k], file); k++)
+			;
+		if (k < dir->ntags || !mount_visible(tree, index->files[file]))
+			continue;
+
+		if (dir->nfound == dir->size) {
+			int size = dir->size ? 2 * dir->size : 256;
+			int *found = realloc(dir->found, sizeof(*found) * size);
+
+			if (found == NULL)
+				return -1;
+			dir->found = found;
+			dir->size = size;
+		}
+
+		dir->found[dir->nfound++] = file;
+	}
+
+	return i < dir->nfound ? dir->found[i] : -1;
+}
+
+/* The file an entry of a directory stands for, -1 if none */
+int mount_entry_file(struct mount_tree *tree, const int *tags, int ntags,
+					 const char *entry, size_t len)
+{
+	char *name = NULL;
+	int file, k;
+
+	if (ntags == 0 || (name = mount_decode(entry, len)) == NULL)
+		return -1;
+
+	file = find_name(tree->index.files, tree->index.nfiles, name);
+	free(name);
+
+	for (k = 0; file >= 0 && k < ntags && has_file(&tree->index, tags[k], file);
+		 k++)
+		;
+
+	if (file < 0 || k < ntags || !mount_visible(tree, tree->index.files[file]))
+		return -1;
+
+	return file;
+}
+
+/* Free all of tree but itself, it can be refreshed again after */
+void mount_free_tree(struct mount_tree *tree)
+{
+	for (int i = 0; i < MOUNT_DIR_CACHE; i++)
+		free_dir(&tree->cache[i]);
+	free_index(&tree->index);
+}
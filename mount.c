@@ -0,0 +1,286 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Mount -- tags as directories through FUSE
+ *
+ * The root lists every tag as a directory, and /tag1/tag2/ lists the files
+ * tagged with both as symlinks to the real files. Any tag can be added to
+ * a path, though only the root lists them. A / in a tag name or path is
+ * written %2F in an entry, and a % as %25.
+ *
+ * The directories are kept by mount-index.c, this only serves them.
+ *
+ * Only built with make FUSE=1, against libfuse 3. Requests are served one
+ * at a time.
+ */
+
+/***--- Includes ---***/
+
+#define _XOPEN_SOURCE 700
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <fuse.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Constants ---***/
+
+#define PROGRAM_NAME "ftag"
+
+/***--- Operations ---***/
+
+struct mount {
+	ftag_db *db;
+	ftag_db *reader;
+	char *dir;
+
+	struct mount_tree tree;
+};
+
+static struct mount *get_mount(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+/* Load the index again if the database changed since it last was */
+static int refresh(struct mount *m)
+{
+	if (m->reader == NULL)
+		return ERROR;
+
+	return mount_refresh(&m->tree, ftag_db_sqlite(m->reader));
+}
+
+static int mount_getattr(const char *path, struct stat *st,
+						 struct fuse_file_info *fi)
+{
+	struct mount *m = get_mount();
+	int tags[MOUNT_MAX_DEPTH];
+	const char *last = NULL;
+	size_t len = 0;
+	int n, file;
+
+	(void) fi;
+
+	if (refresh(m) != SUCCESS)
+		return -EIO;
+
+	memset(st, 0, sizeof(*st));
+
+	if ((n = mount_resolve(&m->tree, path, tags, &last, &len)) < 0)
+		return -ENOENT;
+
+	// A file of the directory comes before a tag of the same name
+	if (last != NULL &&
+		(file = mount_entry_file(&m->tree, tags, n, last, len)) >= 0) {
+		st->st_mode = S_IFLNK | 0444;
+		st->st_nlink = 1;
+		st->st_size = strlen(m->dir) + 1 + strlen(m->tree.index.files[file]);
+		return 0;
+	}
+
+	if (last != NULL && mount_resolve(&m->tree, path, tags, NULL, NULL) < 0)
+		return -ENOENT;
+
+	st->st_mode = S_IFDIR | 0555;
+	st->st_nlink = 2;
+
+	return 0;
+}
+
+static int mount_readlink(const char *path, char *buf, size_t size)
+{
+	struct mount *m = get_mount();
+	int tags[MOUNT_MAX_DEPTH];
+	const char *last = NULL;
+	size_t len = 0;
+	int n, file;
+
+	if (refresh(m) != SUCCESS)
+		return -EIO;
+
+	if ((n = mount_resolve(&m->tree, path, tags, &last, &len)) < 0 ||
+		last == NULL ||
+		(file = mount_entry_file(&m->tree, tags, n, last, len)) < 0)
+		return -ENOENT;
+
+	if (size > 0)
+		snprintf(buf, size, "%s/%s", m->dir, m->tree.index.files[file]);
+
+	return 0;
+}
+
+/* The handle is the path, the directory itself is looked up in the cache on
+ * each call and found again if the database changed in between
+ */
+static int mount_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct mount *m = get_mount();
+	char *copy = NULL;
+
+	if (refresh(m) != SUCCESS)
+		return -EIO;
+
+	if (mount_get_dir(&m->tree, path) == NULL)
+		return -ENOENT;
+
+	if ((copy = strdup(path)) == NULL)
+		return -ENOMEM;
+
+	fi->fh = (uint64_t) (uintptr_t) copy;
+
+	return 0;
+}
+
+/* Offsets are 1 after ., 2 after .. and i + 3 after the i-th entry */
+static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+						 off_t offset, struct fuse_file_info *fi,
+						 enum fuse_readdir_flags flags)
+{
+	struct mount *m = get_mount();
+	struct mount_dir *dir = NULL;
+	char *name = NULL;
+	int full = 0;
+
+	(void) flags;
+
+	if (fi != NULL && fi->fh != 0)
+		path = (const char *) (uintptr_t) fi->fh;
+
+	if (refresh(m) != SUCCESS)
+		return -EIO;
+
+	if ((dir = mount_get_dir(&m->tree, path)) == NULL)
+		return -ENOENT;
+
+	if (offset < 1 && filler(buf, ".", NULL, 1, 0))
+		return 0;
+	if (offset < 2 && filler(buf, "..", NULL, 2, 0))
+		return 0;
+
+	for (int i = offset > 2 ? (int) offset - 2 : 0; !full; i++) {
+		const char *entry = NULL;
+
+		if (dir->ntags == 0) {
+			if (i >= m->tree.index.ntags)
+				break;
+			entry = m->tree.index.tags[i];
+			if (!mount_visible(&m->tree, entry))
+				continue;
+		} else {
+			int file = mount_dir_file(&m->tree, dir, i);
+
+			if (file < 0)
+				break;
+			entry = m->tree.index.files[file];
+		}
+
+		if ((name = mount_encode(entry)) == NULL)
+			return -ENOMEM;
+		full = filler(buf, name, NULL, i + 3, 0);
+		free(name);
+	}
+
+	return 0;
+}
+
+static int mount_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	free((char *) (uintptr_t) fi->fh);
+
+	return 0;
+}
+
+static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	struct mount *m = get_mount();
+
+	(void) conn;
+
+	// Entries only change with the database, which is checked each time
+	cfg->kernel_cache = 0;
+
+	// Opened here, after fuse_main went to the background
+	m->reader = ftag_open_reader(m->db);
+
+	return m;
+}
+
+static void mount_destroy(void *private_data)
+{
+	struct mount *m = private_data;
+
+	mount_free_tree(&m->tree);
+
+	if (m->reader != NULL)
+		ftag_close_db(m->reader);
+}
+
+static const struct fuse_operations mount_ops = {
+	.getattr = mount_getattr,
+	.readlink = mount_readlink,
+	.opendir = mount_opendir,
+	.readdir = mount_readdir,
+	.releasedir = mount_releasedir,
+	.init = mount_init,
+	.destroy = mount_destroy,
+};
+
+/* Serve db at mountpoint until it is unmounted, in the background unless
+ * foreground. Files and tags beginning with a . are shown with show hidden.
+ */
+int ftag_mount_db(ftag_db *db, const char *mountpoint, int foreground)
+{
+	struct mount m;
+	char *argv[] = { PROGRAM_NAME, "-s", "-o", "ro,fsname=ftag", NULL, NULL,
+					 NULL };
+	int argc = 4;
+	int status;
+
+	memset(&m, 0, sizeof(m));
+	m.db = db;
+	m.tree.showhidden = ftag_get_show_hidden(db);
+	m.tree.index.data_version = -1;
+
+	if (mountpoint == NULL || (m.dir = realpath(ftag_db_dir(db), NULL)) == NULL)
+		return ERROR;
+
+	if (foreground)
+		argv[argc++] = "-f";
+	argv[argc++] = (char *) mountpoint;
+
+	status = fuse_main(argc, argv, &mount_ops, &m);
+
+	free(m.dir);
+
+	return status == 0 ? SUCCESS : ERROR;
+}
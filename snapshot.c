@@ -0,0 +1,1162 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Snapshots -- an immutable copy of a tag database for fast reading
+ *
+ * A snapshot is queried straight from a read-only mapping of the file,
+ * nothing is loaded or parsed when it is opened beyond checking the header.
+ * Tags and paths are numbered in sorted order, so posting lists of file
+ * numbers come out in path order and can be merged without sorting.
+ *
+ * File layout, integers little endian, offsets in the header absolute and
+ * offsets in the tables relative to the section they point into:
+ *
+ *   header      "FTAGSNAP", u32 version, u32 tag count, u32 file count,
+ *               u32 zero, u64 offsets of the six sections below, u64 size
+ *   tag table   per tag in name order: u64 name, u64 posting list,
+ *               u32 file count, u32 zero
+ *   names       tag names, NUL terminated
+ *   path index  u64 offset of every PATH_BLOCK:th path
+ *   paths       in order, front coded: varint length of the prefix shared
+ *               with the previous path, varint suffix length, suffix. The
+ *               first path of a block shares nothing.
+ *   file table  per file in path order: u64 tag list
+ *   postings    posting lists (file numbers of a tag) and tag lists (tag
+ *               numbers of a file): varint count, then ascending numbers
+ *               as varint differences from the previous, the first from 0
+ */
+
+/***--- Includes ---***/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Constants ---***/
+
+#define SNAPSHOT_MAGIC "FTAGSNAP"
+#define SNAPSHOT_VERSION 1
+#define HEADER_SIZE 80
+#define TAG_ENTRY_SIZE 24
+#define PATH_BLOCK 16
+
+enum section {
+	SECTION_TAG_TABLE,
+	SECTION_NAMES,
+	SECTION_PATH_INDEX,
+	SECTION_PATHS,
+	SECTION_FILE_TABLE,
+	SECTION_POSTINGS,
+	SECTION_COUNT
+};
+
+struct ftag_snapshot {
+	const unsigned char *map;
+	size_t size;
+	uint32_t tagc;
+	uint32_t filec;
+	uint64_t section[SECTION_COUNT];
+	int showhidden;
+};
+
+/***--- Encoding ---***/
+
+struct buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	int failed;
+};
+
+static void put_bytes(struct buf *b, const void *p, size_t n)
+{
+	if (b->failed)
+		return;
+
+	if (b->len + n > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		unsigned char *data = NULL;
+
+		while (cap < b->len + n)
+			cap *= 2;
+
+		data = realloc(b->data, cap);
+		if (data == NULL) {
+			b->failed = 1;
+			return;
+		}
+
+		b->data = data;
+		b->cap = cap;
+	}
+
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+static void put_u32(struct buf *b, uint32_t v)
+{
+	unsigned char bytes[4];
+
+	for (int i = 0; i < 4; i++)
+		bytes[i] = v >> 8 * i;
+
+	put_bytes(b, bytes, sizeof(bytes));
+}
+
+static void put_u64(struct buf *b, uint64_t v)
+{
+	unsigned char bytes[8];
+
+	for (int i = 0; i < 8; i++)
+		bytes[i] = v >> 8 * i;
+
+	put_bytes(b, bytes, sizeof(bytes));
+}
+
+static void put_varint(struct buf *b, uint64_t v)
+{
+	unsigned char bytes[10];
+	size_t n = 0;
+
+	do {
+		bytes[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v != 0);
+
+	put_bytes(b, bytes, n);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+		   (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return (uint64_t) get_u32(p) | (uint64_t) get_u32(p + 4) << 32;
+}
+
+/* Decode a varint at *p, not reading past end. Returns ERROR if cut short. */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+					  uint64_t *v)
+{
+	*v = 0;
+
+	for (int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char byte = *(*p)++;
+
+		*v |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return SUCCESS;
+	}
+
+	return ERROR;
+}
+
+/***--- Writing ---***/
+
+struct id_num {
+	sqlite3_int64 id;
+	uint32_t num;
+};
+
+struct pair {
+	uint32_t a;
+	uint32_t b;
+};
+
+static int id_num_cmp(const void *x, const void *y)
+{
+	const struct id_num *a = x, *b = y;
+
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+static int pair_cmp(const void *x, const void *y)
+{
+	const struct pair *a = x, *b = y;
+
+	if (a->a != b->a)
+		return (a->a > b->a) - (a->a < b->a);
+
+	return (a->b > b->b) - (a->b < b->b);
+}
+
+/* Make room for element n of the array *p, which has room for *cap */
+static int grow(void **p, size_t *cap, size_t n, size_t size)
+{
+	void *grown = NULL;
+
+	if (n < *cap)
+		return SUCCESS;
+
+	grown = realloc(*p, size * (*cap ? 2 * *cap : 1024));
+	if (grown == NULL)
+		return ERROR;
+
+	*p = grown;
+	*cap = *cap ? 2 * *cap : 1024;
+
+	return SUCCESS;
+}
+
+/* Number of the row with id in map, sorted by id, or -1 */
+static int64_t id_to_num(const struct id_num *map, size_t n, sqlite3_int64 id)
+{
+	struct id_num key = { id, 0 };
+	const struct id_num *found = bsearch(&key, map, n, sizeof(*map), id_num_cmp);
+
+	return found == NULL ? -1 : (int64_t) found->num;
+}
+
+/* Append the lists of pairs, sorted by (a, b), to postings and record
+ * where the list of each a starts in offsets. Every a in [0, n) gets a
+ * list, possibly empty.
+ */
+static void put_lists(struct buf *postings, uint64_t *offsets, uint32_t n,
+					  const struct pair *pairs, size_t pairc)
+{
+	size_t i = 0;
+
+	for (uint32_t a = 0; a < n; a++) {
+		size_t end = i;
+		uint32_t prev = 0;
+
+		while (end < pairc && pairs[end].a == a)
+			end++;
+
+		offsets[a] = postings->len;
+		put_varint(postings, end - i);
+
+		for (; i < end; i++) {
+			put_varint(postings, pairs[i].b - prev);
+			prev = pairs[i].b;
+		}
+	}
+}
+
+static size_t shared_prefix(const char *a, const char *b)
+{
+	size_t n = 0;
+
+	while (a[n] != '\0' && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+/* Write a snapshot of db to path. The file is written beside path and
+ * renamed into place, so readers never see a partial snapshot.
+ */
+int ftag_write_snapshot(ftag_db *db, const char *path)
+{
+	sqlite3 *conn = ftag_db_sqlite(db);
+	sqlite3_stmt *prep = NULL;
+	struct buf sections[SECTION_COUNT];
+	struct buf header = { NULL, 0, 0, 0 };
+	struct id_num *tag_ids = NULL, *file_ids = NULL;
+	struct pair *pairs = NULL;
+	uint64_t *offsets = NULL;
+	uint32_t *counts = NULL;
+	uint32_t tagc = 0, filec = 0;
+	size_t tags_cap = 0, files_cap = 0;
+	size_t pairc = 0, pairs_cap = 0;
+	char *prev = NULL;
+	char *tmp = NULL;
+	FILE *fp = NULL;
+	int fd = -1;
+	int created = 0;
+	int status = ERROR;
+
+	memset(sections, 0, sizeof(sections));
+
+	if (path == NULL)
+		return ERROR;
+
+	// One read transaction, so that the tables agree with each other
+	if (sqlite3_exec(conn, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	// Tags in name order, numbered by position
+	if (sqlite3_prepare_v2(conn, "SELECT id, name FROM tag ORDER BY name;",
+						   -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		const char *name = (const char *) sqlite3_column_text(prep, 1);
+
+		if (name == NULL || grow((void **) &tag_ids, &tags_cap, tagc,
+								 sizeof(*tag_ids)) != SUCCESS)
+			goto out;
+
+		tag_ids[tagc].id = sqlite3_column_int64(prep, 0);
+		tag_ids[tagc].num = tagc;
+		put_bytes(&sections[SECTION_NAMES], name, strlen(name) + 1);
+		tagc++;
+	}
+
+	sqlite3_finalize(prep);
+	prep = NULL;
+
+	// Paths in order, front coded in blocks
+	if (sqlite3_prepare_v2(conn, "SELECT id, relative_path FROM file "
+						   "ORDER BY relative_path;", -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		const char *file = (const char *) sqlite3_column_text(prep, 1);
+		size_t shared = 0;
+
+		if (file == NULL || grow((void **) &file_ids, &files_cap, filec,
+								 sizeof(*file_ids)) != SUCCESS)
+			goto out;
+
+		file_ids[filec].id = sqlite3_column_int64(prep, 0);
+		file_ids[filec].num = filec;
+
+		if (filec % PATH_BLOCK == 0)
+			put_u64(&sections[SECTION_PATH_INDEX], sections[SECTION_PATHS].len);
+		else
+			shared = shared_prefix(prev, file);
+
+		put_varint(&sections[SECTION_PATHS], shared);
+		put_varint(&sections[SECTION_PATHS], strlen(file) - shared);
+		put_bytes(&sections[SECTION_PATHS], file + shared, strlen(file) - shared);
+
+		free(prev);
+		prev = strdup(file);
+		if (prev == NULL)
+			goto out;
+
+		filec++;
+	}
+
+	sqlite3_finalize(prep);
+	prep = NULL;
+
+	qsort(tag_ids, tagc, sizeof(*tag_ids), id_num_cmp);
+	qsort(file_ids, filec, sizeof(*file_ids), id_num_cmp);
+
+	// Every file_tag row as (tag number, file number)
+	if (sqlite3_prepare_v2(conn, "SELECT tag_id, file_id FROM file_tag;",
+						   -1, &prep, NULL) != SQLITE_OK)
+		goto out;
+
+	while (sqlite3_step(prep) == SQLITE_ROW) {
+		int64_t tag = id_to_num(tag_ids, tagc, sqlite3_column_int64(prep, 0));
+		int64_t file = id_to_num(file_ids, filec, sqlite3_column_int64(prep, 1));
+
+		if (tag < 0 || file < 0)
+			continue;
+
+		if (grow((void **) &pairs, &pairs_cap, pairc, sizeof(*pairs)) != SUCCESS)
+			goto out;
+
+		pairs[pairc].a = tag;
+		pairs[pairc++].b = file;
+	}
+
+	sqlite3_finalize(prep);
+	prep = NULL;
+
+	offsets = malloc(sizeof(*offsets) * ((tagc > filec ? tagc : filec) + 1));
+	counts = calloc(tagc + 1, sizeof(*counts));
+	if (offsets == NULL || counts == NULL)
+		goto out;
+
+	// Posting lists, then the same pairs turned around as tag lists
+	qsort(pairs, pairc, sizeof(*pairs), pair_cmp);
+	put_lists(&sections[SECTION_POSTINGS], offsets, tagc, pairs, pairc);
+
+	for (size_t i = 0; i < pairc; i++) {
+		uint32_t tag = pairs[i].a;
+
+		counts[tag]++;
+		pairs[i].a = pairs[i].b;
+		pairs[i].b = tag;
+	}
+
+	// Names were stored one after the other in tag order
+	for (uint32_t i = 0, name = 0; i < tagc && !sections[SECTION_NAMES].failed; i++) {
+		put_u64(&sections[SECTION_TAG_TABLE], name);
+		put_u64(&sections[SECTION_TAG_TABLE], offsets[i]);
+		put_u32(&sections[SECTION_TAG_TABLE], counts[i]);
+		put_u32(&sections[SECTION_TAG_TABLE], 0);
+		name += strlen((char *) sections[SECTION_NAMES].data + name) + 1;
+	}
+
+	qsort(pairs, pairc, sizeof(*pairs), pair_cmp);
+	put_lists(&sections[SECTION_POSTINGS], offsets, filec, pairs, pairc);
+
+	for (uint32_t i = 0; i < filec; i++)
+		put_u64(&sections[SECTION_FILE_TABLE], offsets[i]);
+
+	sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+
+	// Header, then the sections in order
+	{
+		uint64_t offset = HEADER_SIZE;
+
+		put_bytes(&header, SNAPSHOT_MAGIC, 8);
+		put_u32(&header, SNAPSHOT_VERSION);
+		put_u32(&header, tagc);
+		put_u32(&header, filec);
+		put_u32(&header, 0);
+
+		for (int i = 0; i < SECTION_COUNT; i++) {
+			put_u64(&header, offset);
+			offset += sections[i].len;
+		}
+
+		put_u64(&header, offset);
+	}
+
+	for (int i = 0; i < SECTION_COUNT; i++)
+		if (sections[i].failed)
+			goto out;
+
+	if (header.failed)
+		goto out;
+
+	tmp = malloc(strlen(path) + strlen(".XXXXXX") + 1);
+	if (tmp == NULL)
+		goto out;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out;
+
+	// Snapshots are meant to be shared, unlike mkstemp's private files
+	created = 1;
+	if (fchmod(fd, 0644) != 0 || (fp = fdopen(fd, "wb")) == NULL)
+		goto out;
+
+	fd = -1;
+	fwrite(header.data, 1, header.len, fp);
+	for (int i = 0; i < SECTION_COUNT; i++)
+		if (sections[i].len > 0)
+			fwrite(sections[i].data, 1, sections[i].len, fp);
+
+	if (!ferror(fp) && fclose(fp) == 0 && rename(tmp, path) == 0)
+		status = SUCCESS;
+
+	fp = NULL;
+
+	out:
+	sqlite3_finalize(prep);
+	if (!sqlite3_get_autocommit(conn))
+		sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+
+	if (fp != NULL)
+		fclose(fp);
+	if (fd != -1)
+		close(fd);
+	if (status != SUCCESS && created)
+		unlink(tmp);
+
+	for (int i = 0; i < SECTION_COUNT; i++)
+		free(sections[i].data);
+
+	free(header.data);
+	free(tag_ids);
+	free(file_ids);
+	free(pairs);
+	free(offsets);
+	free(counts);
+	free(prev);
+	free(tmp);
+
+	return status;
+}
+
+/***--- Reading ---***/
+
+/* Map the snapshot at path. Only the header is read, and checked so that
+ * every section lies within the file. Returns NULL on error.
+ */
+ftag_snapshot *ftag_open_snapshot(const char *path)
+{
+	ftag_snapshot *snap = NULL;
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd = -1;
+
+	if (path == NULL || (fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE)
+		goto error;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto error;
+
+	close(fd);
+	fd = -1;
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		goto error;
+
+	snap->map = map;
+	snap->size = st.st_size;
+	snap->tagc = get_u32(snap->map + 12);
+	snap->filec = get_u32(snap->map + 16);
+
+	if (memcmp(snap->map, SNAPSHOT_MAGIC, 8) != 0 ||
+		get_u32(snap->map + 8) != SNAPSHOT_VERSION ||
+		get_u64(snap->map + 24 + 8 * SECTION_COUNT) != snap->size)
+		goto error;
+
+	for (int i = 0; i < SECTION_COUNT; i++) {
+		snap->section[i] = get_u64(snap->map + 24 + 8 * i);
+
+		if (snap->section[i] < HEADER_SIZE || snap->section[i] > snap->size ||
+			(i > 0 && snap->section[i] < snap->section[i - 1]))
+			goto error;
+	}
+
+	// The fixed size tables must fit in their sections, and the names must
+	// end with a NUL so that none of them runs off the end
+	if ((uint64_t) snap->tagc * TAG_ENTRY_SIZE !=
+		snap->section[SECTION_NAMES] - snap->section[SECTION_TAG_TABLE] ||
+		(uint64_t) (snap->filec + PATH_BLOCK - 1) / PATH_BLOCK * 8 !=
+		snap->section[SECTION_PATHS] - snap->section[SECTION_PATH_INDEX] ||
+		(uint64_t) snap->filec * 8 !=
+		snap->section[SECTION_POSTINGS] - snap->section[SECTION_FILE_TABLE] ||
+		(snap->tagc > 0 && snap->map[snap->section[SECTION_PATH_INDEX] - 1] != '\0'))
+		goto error;
+
+	return snap;
+
+	error:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd != -1)
+		close(fd);
+	free(snap);
+	return NULL;
+}
+
+void ftag_close_snapshot(ftag_snapshot *snap)
+{
+	if (snap == NULL)
+		return;
+
+	munmap((void *) snap->map, snap->size);
+	free(snap);
+}
+
+/* Whether queries include files and tags beginning with a . */
+void ftag_snapshot_show_hidden(ftag_snapshot *snap, int showhidden)
+{
+	snap->showhidden = showhidden;
+}
+
+static const unsigned char *tag_entry(const ftag_snapshot *snap, uint32_t tag)
+{
+	return snap->map + snap->section[SECTION_TAG_TABLE] + TAG_ENTRY_SIZE * tag;
+}
+
+static const char *tag_name(const ftag_snapshot *snap, uint32_t tag)
+{
+	uint64_t off = get_u64(tag_entry(snap, tag));
+	uint64_t size = snap->section[SECTION_PATH_INDEX] - snap->section[SECTION_NAMES];
+
+	return off < size ? (const char *) snap->map + snap->section[SECTION_NAMES] + off
+					  : "";
+}
+
+/* Number of the tag called name, or -1 */
+static int64_t find_tag(const ftag_snapshot *snap, const char *name)
+{
+	uint32_t lo = 0, hi = snap->tagc;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(tag_name(snap, mid), name);
+
+		if (cmp == 0)
+			return mid;
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return -1;
+}
+
+/* Walks a posting or tag list */
+struct cursor {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t left;
+	uint32_t value;
+};
+
+static int cursor_init(const ftag_snapshot *snap, uint64_t off, struct cursor *c)
+{
+	uint64_t base = snap->section[SECTION_POSTINGS];
+
+	c->end = snap->map + snap->size;
+	c->value = 0;
+	c->left = 0;
+
+	if (off >= snap->size - base)
+		return ERROR;
+
+	c->p = snap->map + base + off;
+
+	return get_varint(&c->p, c->end, &c->left);
+}
+
+/* Move to the next number in the list, returns 0 at the end */
+static int cursor_next(struct cursor *c)
+{
+	uint64_t delta;
+
+	if (c->left == 0 || get_varint(&c->p, c->end, &delta) != SUCCESS)
+		return 0;
+
+	c->left--;
+	c->value += delta;
+
+	return 1;
+}
+
+/* Decodes paths, cheaply when they are visited in ascending order */
+struct path_cursor {
+	const ftag_snapshot *snap;
+	const unsigned char *p;
+	uint32_t next;
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+static int path_decode(struct path_cursor *c)
+{
+	const unsigned char *end = c->snap->map + c->snap->section[SECTION_FILE_TABLE];
+	uint64_t shared, suffix;
+
+	if (get_varint(&c->p, end, &shared) != SUCCESS ||
+		get_varint(&c->p, end, &suffix) != SUCCESS ||
+		shared > c->len || suffix > (uint64_t) (end - c->p))
+		return ERROR;
+
+	if (shared + suffix + 1 > c->cap) {
+		size_t cap = 2 * (shared + suffix + 1);
+		char *buf = realloc(c->buf, cap);
+
+		if (buf == NULL)
+			return ERROR;
+
+		c->buf = buf;
+		c->cap = cap;
+	}
+
+	memcpy(c->buf + shared, c->p, suffix);
+	c->buf[shared + suffix] = '\0';
+	c->len = shared + suffix;
+	c->p += suffix;
+	c->next++;
+
+	return SUCCESS;
+}
+
+/* Path number n, valid until the next call. NULL on error. */
+static const char *path_seek(struct path_cursor *c, uint32_t n)
+{
+	const ftag_snapshot *snap = c->snap;
+
+	if (n >= snap->filec)
+		return NULL;
+
+	// Jump to the block unless n is further on in the current one
+	if (c->buf == NULL || n < c->next - 1 ||
+		n / PATH_BLOCK != (c->next - 1) / PATH_BLOCK) {
+		uint64_t block = n / PATH_BLOCK;
+		uint64_t off = get_u64(snap->map + snap->section[SECTION_PATH_INDEX] +
+							   8 * block);
+
+		if (off >= snap->section[SECTION_FILE_TABLE] - snap->section[SECTION_PATHS])
+			return NULL;
+
+		c->p = snap->map + snap->section[SECTION_PATHS] + off;
+		c->next = block * PATH_BLOCK;
+		c->len = 0;
+
+		if (path_decode(c) != SUCCESS)
+			return NULL;
+	}
+
+	while (c->next - 1 < n)
+		if (path_decode(c) != SUCCESS)
+			return NULL;
+
+	return c->buf;
+}
+
+/* Number of the file at path, or -1 */
+static int64_t find_file(const ftag_snapshot *snap, const char *path)
+{
+	struct path_cursor c = { snap, NULL, 0, NULL, 0, 0 };
+	uint32_t blocks = (snap->filec + PATH_BLOCK - 1) / PATH_BLOCK;
+	uint32_t lo = 0, hi = blocks;
+	int64_t found = -1;
+
+	// The last block starting at or before path
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *first = path_seek(&c, mid * PATH_BLOCK);
+
+		if (first == NULL)
+			goto out;
+
+		if (strcmp(first, path) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == 0)
+		goto out;
+
+	for (uint32_t n = (lo - 1) * PATH_BLOCK; n < lo * PATH_BLOCK && n < snap->filec;
+		 n++) {
+		const char *cur = path_seek(&c, n);
+
+		if (cur == NULL || strcmp(cur, path) > 0)
+			break;
+
+		if (strcmp(cur, path) == 0) {
+			found = n;
+			break;
+		}
+	}
+
+	out:
+	free(c.buf);
+	return found;
+}
+
+static int emit_file(struct path_cursor *c, uint32_t n, row_fn_t fn, void *arg,
+					 int *stop)
+{
+	const char *path = path_seek(c, n);
+
+	if (path == NULL)
+		return ERROR;
+
+	if (c->snap->showhidden || *path != '.')
+		*stop = fn(path, arg) != 0;
+
+	return SUCCESS;
+}
+
+/* The union of the posting lists of every tag an argument stands for */
+struct group {
+	struct cursor *cursors;
+	size_t n;
+	size_t cap;
+	uint32_t value;
+};
+
+/* Number of the first tag beginning with the len bytes of prefix */
+static uint32_t find_prefix(const ftag_snapshot *snap, const char *prefix,
+							size_t len)
+{
+	uint32_t lo = 0, hi = snap->tagc;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (strncmp(tag_name(snap, mid), prefix, len) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Add the posting list of tag to g, positioned on its first file */
+static int group_add_tag(const ftag_snapshot *snap, uint32_t tag, struct group *g)
+{
+	if (grow((void **) &g->cursors, &g->cap, g->n, sizeof(*g->cursors)) != SUCCESS ||
+		cursor_init(snap, get_u64(tag_entry(snap, tag) + 8),
+					&g->cursors[g->n]) != SUCCESS)
+		return ERROR;
+
+	if (cursor_next(&g->cursors[g->n]))
+		g->n++;
+
+	return SUCCESS;
+}
+
+/* Add every tag matching pattern to g, or the tag called pattern and the
+ * tags below it if it isn't a pattern. Tags are sorted, so only those
+ * beginning with the literal prefix of the pattern are tried, and the tags
+ * below a/b are those right after a/b/.
+ */
+static int group_add(const ftag_snapshot *snap, const char *pattern,
+					 struct group *g)
+{
+	size_t len;
+
+	if (!tag_is_pattern(pattern)) {
+		int64_t tag = find_tag(snap, pattern);
+		char *parent = NULL;
+		int status = SUCCESS;
+
+		if (tag >= 0 && group_add_tag(snap, tag, g) != SUCCESS)
+			return ERROR;
+
+		len = strlen(pattern) + 1;
+		parent = malloc(len + 1);
+		if (parent == NULL)
+			return ERROR;
+
+		sprintf(parent, "%s/", pattern);
+		for (uint32_t i = find_prefix(snap, parent, len); status == SUCCESS &&
+			 i < snap->tagc && strncmp(tag_name(snap, i), parent, len) == 0; i++)
+			status = group_add_tag(snap, i, g);
+
+		free(parent);
+
+		return status;
+	}
+
+	len = tag_pattern_prefix(pattern);
+	for (uint32_t i = find_prefix(snap, pattern, len);
+		 i < snap->tagc && strncmp(tag_name(snap, i), pattern, len) == 0; i++)
+		if (tag_pattern_match(pattern, tag_name(snap, i), snap->showhidden) &&
+			group_add_tag(snap, i, g) != SUCCESS)
+			return ERROR;
+
+	return SUCCESS;
+}
+
+static void group_min(struct group *g)
+{
+	g->value = g->cursors[0].value;
+
+	for (size_t i = 1; i < g->n; i++)
+		if (g->cursors[i].value < g->value)
+			g->value = g->cursors[i].value;
+}
+
+/* Move past the current file, returns 0 when every list is done */
+static int group_next(struct group *g)
+{
+	for (size_t i = 0; i < g->n; i++)
+		if (g->cursors[i].value == g->value && !cursor_next(&g->cursors[i]))
+			g->cursors[i--] = g->cursors[--g->n];
+
+	if (g->n == 0)
+		return 0;
+
+	group_min(g);
+
+	return 1;
+}
+
+/* Same as ftag_filter_parallel, reading the snapshot. Files come in path order.
+ * Tags may be patterns like in ftag_filter_strs.
+ */
+int ftag_snapshot_filter(ftag_snapshot *snap, int tagc, const char **tagv, int flags,
+					row_fn_t fn, void *arg)
+{
+	struct path_cursor paths = { snap, NULL, 0, NULL, 0, 0 };
+	struct group *groups = NULL;
+	int status = SUCCESS;
+	int stop = 0;
+	int n = 0;
+
+	if (flags == 0 || fn == NULL || (tagc > 0 && tagv == NULL))
+		return ERROR;
+
+	if (flags & FILTER_ALL) {
+		for (uint32_t i = 0; i < snap->filec && !stop && status == SUCCESS; i++)
+			status = emit_file(&paths, i, fn, arg, &stop);
+
+		free(paths.buf);
+		return status;
+	}
+
+	if (tagc == 0)
+		return SUCCESS;
+
+	// With any tag one group takes every list, otherwise one per argument
+	n = flags & FILTER_ANY_TAG ? 1 : tagc;
+	groups = calloc(n, sizeof(*groups));
+	if (groups == NULL)
+		return ERROR;
+
+	for (int i = 0; i < tagc; i++) {
+		struct group *g = &groups[flags & FILTER_ANY_TAG ? 0 : i];
+
+		if (group_add(snap, tagv[i], g) != SUCCESS) {
+			status = ERROR;
+			goto out;
+		}
+	}
+
+	// No file has every tag if one of them has none
+	for (int i = 0; i < n; i++) {
+		if (groups[i].n == 0)
+			goto out;
+
+		group_min(&groups[i]);
+	}
+
+	// Leapfrog to the largest current file number, with one group this is
+	// a union taking the smallest file number until every list is done
+	while (!stop && status == SUCCESS) {
+		uint32_t target = groups[0].value;
+		int match = 1;
+
+		for (int i = 1; i < n && match; i++) {
+			while (groups[i].value < target)
+				if (!group_next(&groups[i]))
+					goto out;
+
+			if (groups[i].value > target) {
+				target = groups[i].value;
+				match = 0;
+			}
+		}
+
+		if (match) {
+			status = emit_file(&paths, target, fn, arg, &stop);
+			if (!group_next(&groups[0]))
+				break;
+		} else {
+			while (groups[0].value < target)
+				if (!group_next(&groups[0]))
+					goto out;
+		}
+	}
+
+	out:
+	for (int i = 0; i < n; i++)
+		free(groups[i].cursors);
+	free(groups);
+	free(paths.buf);
+
+	return status;
+}
+
+/* Call fn with every tag and its file count, or only the tags of file if
+ * it isn't NULL. Tags come in name order.
+ */
+int ftag_snapshot_list(ftag_snapshot *snap, const char *file, tag_fn_t fn, void *arg)
+{
+	struct cursor c;
+	int64_t n;
+
+	if (fn == NULL)
+		return ERROR;
+
+	if (file == NULL) {
+		for (uint32_t i = 0; i < snap->tagc; i++) {
+			const char *name = tag_name(snap, i);
+
+			if ((snap->showhidden || *name != '.') &&
+				fn(name, get_u32(tag_entry(snap, i) + 16), arg) != 0)
+				break;
+		}
+
+		return SUCCESS;
+	}
+
+	n = find_file(snap, file);
+	if (n < 0)
+		return SUCCESS;
+
+	if (cursor_init(snap, get_u64(snap->map + snap->section[SECTION_FILE_TABLE] +
+								  8 * n), &c) != SUCCESS)
+		return ERROR;
+
+	while (cursor_next(&c)) {
+		const char *name = NULL;
+
+		if (c.value >= snap->tagc)
+			return ERROR;
+
+		name = tag_name(snap, c.value);
+		if ((snap->showhidden || *name != '.') &&
+			fn(name, get_u32(tag_entry(snap, c.value) + 16), arg) != 0)
+			break;
+	}
+
+	return SUCCESS;
+}
+
+/* Call fn with every tag matching pattern, or the tag called pattern if
+ * it isn't a pattern, in name order.
+ */
+int ftag_snapshot_list_matching(ftag_snapshot *snap, const char *pattern,
+						   tag_fn_t fn, void *arg)
+{
+	size_t len;
+
+	if (pattern == NULL || fn == NULL)
+		return ERROR;
+
+	len = tag_is_pattern(pattern) ? tag_pattern_prefix(pattern) : strlen(pattern);
+	for (uint32_t i = find_prefix(snap, pattern, len);
+		 i < snap->tagc && strncmp(tag_name(snap, i), pattern, len) == 0; i++) {
+		const char *name = tag_name(snap, i);
+
+		if (tag_is_pattern(pattern) ?
+			!tag_pattern_match(pattern, name, snap->showhidden) :
+			strcmp(name, pattern) != 0)
+			continue;
+
+		if ((snap->showhidden || *name != '.') &&
+			fn(name, get_u32(tag_entry(snap, i) + 16), arg) != 0)
+			break;
+	}
+
+	return SUCCESS;
+}
+
+/* A tag and its file count, ranked by count and then by name */
+struct ranked {
+	uint32_t count;
+	uint32_t tag;
+};
+
+/* Whether a ranks below b: fewer files, or as many and later by name */
+static int ranks_below(const struct ranked *a, const struct ranked *b)
+{
+	return a->count < b->count || (a->count == b->count && a->tag > b->tag);
+}
+
+/* Highest ranked first */
+static int ranked_cmp(const void *x, const void *y)
+{
+	return ranks_below(x, y) - ranks_below(y, x);
+}
+
+/* Restore the heap below i, the lowest ranked tag on top */
+static void sift_down(struct ranked *heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t low = i, l = 2 * i + 1, r = 2 * i + 2;
+		struct ranked tmp;
+
+		if (l < n && ranks_below(&heap[l], &heap[low]))
+			low = l;
+		if (r < n && ranks_below(&heap[r], &heap[low]))
+			low = r;
+		if (low == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[low];
+		heap[low] = tmp;
+		i = low;
+	}
+}
+
+static void sift_up(struct ranked *heap, size_t i)
+{
+	while (i > 0 && ranks_below(&heap[i], &heap[(i - 1) / 2])) {
+		struct ranked tmp = heap[i];
+
+		heap[i] = heap[(i - 1) / 2];
+		heap[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
+	}
+}
+
+/* Call fn with the top most used tags tagging at least min_count files,
+ * most used first, or all of them if top is 0. The tag table is in name
+ * order, so one pass keeps the best top so far in a heap.
+ */
+int ftag_snapshot_list_top(ftag_snapshot *snap, int top, int min_count,
+					  tag_fn_t fn, void *arg)
+{
+	struct ranked *heap = NULL;
+	size_t cap = 0, n = 0;
+
+	if (top < 0 || fn == NULL)
+		return ERROR;
+
+	if (top > 0) {
+		cap = (uint32_t) top < snap->tagc ? (size_t) top : snap->tagc;
+		heap = malloc(sizeof(*heap) * (cap ? cap : 1));
+		if (heap == NULL)
+			return ERROR;
+	}
+
+	for (uint32_t i = 0; i < snap->tagc; i++) {
+		struct ranked cur = { get_u32(tag_entry(snap, i) + 16), i };
+
+		if ((int64_t) cur.count < min_count ||
+			(!snap->showhidden && *tag_name(snap, i) == '.'))
+			continue;
+
+		if (top == 0) {
+			if (grow((void **) &heap, &cap, n, sizeof(*heap)) != SUCCESS) {
+				free(heap);
+				return ERROR;
+			}
+			heap[n++] = cur;
+		} else if (n < cap) {
+			heap[n] = cur;
+			sift_up(heap, n++);
+		} else if (ranks_below(&heap[0], &cur)) {
+			heap[0] = cur;
+			sift_down(heap, n, 0);
+		}
+	}
+
+	if (n > 0)
+		qsort(heap, n, sizeof(*heap), ranked_cmp);
+
+	for (size_t i = 0; i < n; i++)
+		if (fn(tag_name(snap, heap[i].tag), heap[i].count, arg) != 0)
+			break;
+
+	free(heap);
+
+	return SUCCESS;
+}
@@ -0,0 +1,649 @@
+/*
+ * ftag -- tag your files
+ * Copyright 2014, 2015 Jacob Wahlgren
+ * jacob.wahlgren@gmail.com
+ *
+ */
+
+/*
+ This is a part of ftag.
+
+ ftag is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Extended attributes -- mirroring tags to and from user.tags
+ *
+ * Each file's tags are kept in its user.tags attribute too, sorted by name
+ * and joined by commas, for other tools to read. Tags with a comma in their
+ * name can't be told apart there and are left out.
+ *
+ * Every file has a version of its tag set, bumped by triggers, and the
+ * version last mirrored. Pushing only visits files where the two differ,
+ * found through a partial index of just those. Pulling reads the attribute
+ * of every file and takes on its tags where they differ, unless the file's
+ * tags changed in the database since the last sync, which then win. Files
+ * dropped from the database after being mirrored are remembered until
+ * their attribute is removed.
+ *
+ * The system calls go to a pool of worker threads a batch of files at a
+ * time, while the calling thread reads and writes the database, all in one
+ * transaction.
+ */
+
+/***--- Includes ---***/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <sqlite3.h>
+#include "ftag.h"
+#include "ftag-internal.h"
+
+/***--- Constants ---***/
+
+#define PROGRAM_NAME "ftag"
+
+#define XATTR_NAME "user.tags"
+#define XATTR_BATCH 4096
+#define XATTR_MAX_JOBS 64
+
+#ifndef ENODATA
+#define ENODATA ENOATTR
+#endif
+
+/***--- System calls ---***/
+
+/* The attribute of path in *value, to be freed, or NULL if it has none.
+ * ERROR with errno set otherwise.
+ */
+static int read_attr(const char *path, char **value)
+{
+	ssize_t size, got;
+
+	*value = NULL;
+
+	// It may grow between asking its size and reading it
+	for (;;) {
+#ifdef __APPLE__
+		size = getxattr(path, XATTR_NAME, NULL, 0, 0, 0);
+#else
+		size = getxattr(path, XATTR_NAME, NULL, 0);
+#endif
+		if (size < 0)
+			return errno == ENODATA ? SUCCESS : ERROR;
+
+		if ((*value = malloc(size + 1)) == NULL)
+			return ERROR;
+
+#ifdef __APPLE__
+		got = getxattr(path, XATTR_NAME, *value, size, 0, 0);
+#else
+		got = getxattr(path, XATTR_NAME, *value, size);
+#endif
+		if (got >= 0) {
+			(*value)[got] = '\0';
+			return SUCCESS;
+		}
+
+		free(*value);
+		*value = NULL;
+		if (errno != ERANGE)
+			return errno == ENODATA ? SUCCESS : ERROR;
+	}
+}
+
+/* Set the attribute of path to value, or remove it if value is NULL */
+static int write_attr(const char *path, const char *value)
+{
+	int ret;
+
+#ifdef __APPLE__
+	if (value == NULL)
+		ret = removexattr(path, XATTR_NAME, 0);
+	else
+		ret = setxattr(path, XATTR_NAME, value, strlen(value), 0, 0);
+#else
+	if (value == NULL)
+		ret = removexattr(path, XATTR_NAME);
+	else
+		ret = setxattr(path, XATTR_NAME, value, strlen(value), 0);
+#endif
+
+	if (ret != 0 && value == NULL && errno == ENODATA)
+		return SUCCESS;
+
+	return ret == 0 ? SUCCESS : ERROR;
+}
+
+/***--- Workers ---***/
+
+enum attr_op {
+	ATTR_PUSH,
+	ATTR_READ,
+	// Read, and push if there is nothing to read
+	ATTR_READ_OR_PUSH,
+};
+
+struct attr_item {
+	sqlite3_int64 id;
+	char *path;
+	// The tags in the database, NULL for none
+	char *tags;
+	enum attr_op op;
+
+	// Results
+	int pushed;
+	char *read;
+	int err;
+};
+
+struct attr_pool {
+	struct attr_item *items;
+	int n;
+
+	pthread_mutex_t lock;
+	int next;
+};
+
+static void run_item(struct attr_item *item)
+{
+	item->err = 0;
+
+	if (item->op != ATTR_PUSH) {
+		if (read_attr(item->path, &item->read) != SUCCESS) {
+			item->err = errno;
+			return;
+		}
+
+		if (item->read != NULL || item->op == ATTR_READ)
+			return;
+	}
+
+	if (write_attr(item->path, item->tags) != SUCCESS)
+		item->err = errno;
+	else
+		item->pushed = 1;
+}
+
+static void *attr_worker(void *arg)
+{
+	struct attr_pool *pool = arg;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->n)
+			return NULL;
+
+		run_item(&pool->items[i]);
+	}
+}
+
+/* Run every item, on up to jobs threads besides the calling one */
+static void run_items(struct attr_item *items, int n, int jobs)
+{
+	struct attr_pool pool = { items, n, PTHREAD_MUTEX_INITIALIZER, 0 };
+	pthread_t threads[XATTR_MAX_JOBS];
+	int started = 0;
+
+	if (jobs > n)
+		jobs = n;
+
+	while (started < jobs - 1 &&
+		   pthread_create(&threads[started], NULL, attr_worker, &pool) == 0)
+		started++;
+
+	attr_worker(&pool);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void free_items(struct attr_item *items, int n)
+{
+	for (int i = 0; i < n; i++) {
+		free(items[i].path);
+		free(items[i].tags);
+		free(items[i].read);
+	}
+}
+
+/***--- Sync ---***/
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* The tags in an attribute value, sorted and without duplicates or empty
+ * names, joined by commas again as the database would. To be freed.
+ */
+static char *normal_tags(const char *value)
+{
+	char *copy = strdup(value);
+	char **names = NULL;
+	char *out = NULL;
+	char *end = NULL;
+	int n = 0;
+
+	if (copy == NULL || (names = malloc(sizeof(*names) * (strlen(copy) / 2 + 1)))
+		== NULL)
+		goto out;
+
+	for (char *name = copy, *comma; name != NULL; name = comma) {
+		if ((comma = strchr(name, ',')) != NULL)
+			*comma++ = '\0';
+		if (*name != '\0')
+			names[n++] = name;
+	}
+
+	qsort(names, n, sizeof(*names), cmp_str);
+
+	if ((out = end = malloc(strlen(value) + 1)) == NULL)
+		goto out;
+
+	*out = '\0';
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && strcmp(names[i], names[i - 1]) == 0)
+			continue;
+		if (end != out)
+			*end++ = ',';
+		end += sprintf(end, "%s", names[i]);
+	}
+
+	out:
+	free(names);
+	free(copy);
+
+	return out;
+}
+
+/* Statements making a file's tags in the database those of its attribute,
+ * with ?1 its id, ?2 the time now and the tags in temp.xattr_tag. Tags
+ * that can't be mirrored stay. Tags and the file left unused go, as with
+ * untag.
+ */
+static const char *pull_sql[] = {
+	"INSERT OR IGNORE INTO tag (name) SELECT name FROM temp.xattr_tag;",
+	"DELETE FROM file_tag WHERE file_id = ?1 AND tag_id IN (SELECT x.tag_id "
+	"FROM file_tag AS x JOIN tag AS t ON t.id = x.tag_id WHERE x.file_id = ?1 "
+	"AND instr(t.name, ',') = 0 AND t.name NOT IN "
+	"(SELECT name FROM temp.xattr_tag));",
+	"INSERT OR IGNORE INTO file_tag (file_id, tag_id, tagged_at) "
+	"SELECT ?1, t.id, ?2 FROM temp.xattr_tag AS s JOIN tag AS t "
+	"ON t.name = s.name;",
+	"DELETE FROM tag WHERE file_count = 0;",
+	"DELETE FROM file WHERE id = ?1 AND "
+	"NOT EXISTS (SELECT 1 FROM file_tag WHERE file_id = ?1);",
+	"DELETE FROM temp.xattr_tag;",
+};
+
+#define PULL_STEPS ((int) (sizeof(pull_sql) / sizeof(*pull_sql)))
+
+struct sync {
+	sqlite3 *conn;
+	const char *dir;
+	int flags;
+	int jobs;
+	sqlite3_int64 now;
+
+	sqlite3_stmt *next;
+	sqlite3_stmt *synced;
+	sqlite3_stmt *stage;
+	sqlite3_stmt *pull[PULL_STEPS];
+
+	long long pushed, pulled;
+	int failed;
+};
+
+static const char *synced_sql = "UPDATE file SET synced_version = tag_version "
+"WHERE id = ?1 AND synced_version <> tag_version;";
+
+static const char *stage_sql =
+"INSERT OR IGNORE INTO temp.xattr_tag (name) VALUES (?1);";
+
+static const char *cleared_sql = "SELECT c.relative_path FROM xattr_cleared "
+"AS c WHERE NOT EXISTS (SELECT 1 FROM file WHERE relative_path = "
+"c.relative_path) AND c.relative_path > ?1 ORDER BY 1 LIMIT ?2;";
+
+static const char *uncleared_sql =
+"DELETE FROM xattr_cleared WHERE relative_path = ?1;";
+
+// Files added back are mirrored by their own sync instead
+static const char *readded_sql = "DELETE FROM xattr_cleared WHERE "
+"relative_path IN (SELECT relative_path FROM file);";
+
+/* Files after id in id order, with their tags as the attribute would have
+ * them. Pushing alone only needs the files not mirrored yet.
+ */
+static const char *next_all_sql =
+"SELECT f.id, f.relative_path, f.tag_version, f.synced_version, "
+"(SELECT group_concat(name, ',') FROM (SELECT t.name FROM file_tag AS x "
+"JOIN tag AS t ON t.id = x.tag_id WHERE x.file_id = f.id AND "
+"instr(t.name, ',') = 0 ORDER BY t.name)) FROM file AS f WHERE f.id > ?1 "
+"ORDER BY f.id LIMIT ?2;";
+
+static const char *next_unsynced_sql =
+"SELECT f.id, f.relative_path, f.tag_version, f.synced_version, "
+"(SELECT group_concat(name, ',') FROM (SELECT t.name FROM file_tag AS x "
+"JOIN tag AS t ON t.id = x.tag_id WHERE x.file_id = f.id AND "
+"instr(t.name, ',') = 0 ORDER BY t.name)) FROM file AS f "
+"INDEXED BY file_unsynced_ix WHERE f.tag_version <> f.synced_version AND "
+"f.id > ?1 ORDER BY f.id LIMIT ?2;";
+
+static char *join_path(const char *dir, const char *file)
+{
+	char *path = malloc(strlen(dir) + strlen(file) + 2);
+
+	if (path != NULL)
+		sprintf(path, "%s/%s", dir, file);
+
+	return path;
+}
+
+static char *dup_column(sqlite3_stmt *prep, int col)
+{
+	const char *str = (const char *) sqlite3_column_text(prep, col);
+
+	return str != NULL ? strdup(str) : NULL;
+}
+
+static void report(struct sync *s, const struct attr_item *item)
+{
+	// A file gone from the disk is left to be mirrored once it is back
+	if (item->err == ENOENT)
+		return;
+
+	fprintf(stderr, PROGRAM_NAME ": %s: %s\n", item->path, strerror(item->err));
+	s->failed = 1;
+}
+
+static int exec_step(sqlite3_stmt *prep)
+{
+	int step = sqlite3_step(prep);
+
+	sqlite3_reset(prep);
+
+	return step == SQLITE_DONE ? SUCCESS : ERROR;
+}
+
+/* Make the tags of item in the database those in tags */
+static int pull_item(struct sync *s, const struct attr_item *item,
+					 const char *tags)
+{
+	const char *name = tags;
+
+	while (*name != '\0') {
+		size_t len = strcspn(name, ",");
+
+		sqlite3_bind_text(s->stage, 1, name, (int) len, SQLITE_STATIC);
+		if (exec_step(s->stage) != SUCCESS)
+			return ERROR;
+
+		name += len + (name[len] == ',');
+	}
+
+	for (int k = 0; k < PULL_STEPS; k++) {
+		sqlite3_bind_int64(s->pull[k], 1, item->id);
+		sqlite3_bind_int64(s->pull[k], 2, s->now);
+		if (exec_step(s->pull[k]) != SUCCESS)
+			return ERROR;
+	}
+
+	s->pulled++;
+
+	return SUCCESS;
+}
+
+/* Act on what the workers found for a batch */
+static int finish_batch(struct sync *s, struct attr_item *items, int n)
+{
+	for (int i = 0; i < n; i++) {
+		struct attr_item *item = &items[i];
+
+		if (item->err != 0) {
+			report(s, item);
+			continue;
+		}
+
+		if (item->pushed) {
+			s->pushed++;
+		} else if (item->read != NULL) {
+			char *tags = normal_tags(item->read);
+			int status = tags == NULL ? ERROR : SUCCESS;
+
+			if (status == SUCCESS &&
+				strcmp(tags, item->tags != NULL ? item->tags : "") != 0)
+				status = pull_item(s, item, tags);
+			free(tags);
+
+			if (status != SUCCESS)
+				return ERROR;
+		} else {
+			// Nothing to read, nothing mirrored
+			continue;
+		}
+
+		sqlite3_bind_int64(s->synced, 1, item->id);
+		if (exec_step(s->synced) != SUCCESS)
+			return ERROR;
+	}
+
+	return SUCCESS;
+}
+
+/* Mirror every file next finds, a batch at a time */
+static int sync_files(struct sync *s)
+{
+	struct attr_item *items = calloc(XATTR_BATCH, sizeof(*items));
+	sqlite3_int64 last = 0;
+	int status = ERROR;
+	int n = 0;
+
+	if (items == NULL)
+		return ERROR;
+
+	do {
+		free_items(items, n);
+		n = 0;
+
+		sqlite3_bind_int64(s->next, 1, last);
+		sqlite3_bind_int(s->next, 2, XATTR_BATCH);
+
+		while (sqlite3_step(s->next) == SQLITE_ROW) {
+			struct attr_item *item = &items[n++];
+			int changed = sqlite3_column_int64(s->next, 2) !=
+				sqlite3_column_int64(s->next, 3);
+
+			memset(item, 0, sizeof(*item));
+			item->id = last = sqlite3_column_int64(s->next, 0);
+			item->path = join_path(s->dir,
+					(const char *) sqlite3_column_text(s->next, 1));
+			item->tags = dup_column(s->next, 4);
+
+			if (!(s->flags & XATTR_PULL))
+				item->op = ATTR_PUSH;
+			else if (!(s->flags & XATTR_PUSH))
+				item->op = ATTR_READ;
+			else
+				item->op = changed ? ATTR_PUSH : ATTR_READ_OR_PUSH;
+
+			if (item->path == NULL)
+				break;
+		}
+		sqlite3_reset(s->next);
+
+		if (n > 0 && items[n - 1].path == NULL)
+			goto out;
+
+		run_items(items, n, s->jobs);
+
+		if (finish_batch(s, items, n) != SUCCESS)
+			goto out;
+	} while (n == XATTR_BATCH);
+
+	status = SUCCESS;
+
+	out:
+	free_items(items, n);
+	free(items);
+
+	return status;
+}
+
+/* Remove the attribute of files dropped from the database since it was
+ * mirrored, unless they were added back since
+ */
+static int clear_files(struct sync *s)
+{
+	struct attr_item *items = calloc(XATTR_BATCH, sizeof(*items));
+	sqlite3_stmt *prep = NULL, *done = NULL;
+	char *last = strdup("");
+	size_t skip = strlen(s->dir) + 1;
+	int status = ERROR;
+	int n = 0;
+
+	if (items == NULL || last == NULL ||
+		sqlite3_prepare_v2(s->conn, cleared_sql, -1, &prep, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(s->conn, uncleared_sql, -1, &done, NULL) != SQLITE_OK)
+		goto out;
+
+	do {
+		free_items(items, n);
+		n = 0;
+
+		sqlite3_bind_text(prep, 1, last, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(prep, 2, XATTR_BATCH);
+
+		while (sqlite3_step(prep) == SQLITE_ROW) {
+			struct attr_item *item = &items[n++];
+			const char *path = (const char *) sqlite3_column_text(prep, 0);
+
+			memset(item, 0, sizeof(*item));
+			item->op = ATTR_PUSH;
+			item->path = join_path(s->dir, path);
+
+			free(last);
+			last = strdup(path);
+			if (item->path == NULL || last == NULL)
+				break;
+		}
+		sqlite3_reset(prep);
+
+		if (n > 0 && (items[n - 1].path == NULL || last == NULL))
+			goto out;
+
+		run_items(items, n, s->jobs);
+
+		// Those that failed stay to be tried again with the next push
+		for (int i = 0; i < n; i++) {
+			if (items[i].err != 0)
+				report(s, &items[i]);
+			else
+				s->pushed++;
+
+			if (items[i].err != 0 && items[i].err != ENOENT)
+				continue;
+
+			sqlite3_bind_text(done, 1, items[i].path + skip, -1, SQLITE_STATIC);
+			if (exec_step(done) != SUCCESS)
+				goto out;
+		}
+	} while (n == XATTR_BATCH);
+
+	if (sqlite3_exec(s->conn, readded_sql, NULL, NULL, NULL) == SQLITE_OK)
+		status = SUCCESS;
+
+	out:
+	sqlite3_finalize(prep);
+	sqlite3_finalize(done);
+	free_items(items, n);
+	free(items);
+	free(last);
+
+	return status;
+}
+
+/* Mirror tags between the database and the user.tags attribute of each
+ * file, with XATTR_PUSH, XATTR_PULL or both in flags and the system calls
+ * spread over jobs threads. The number of attributes written and of files
+ * whose tags were taken from theirs go in *pushed and *pulled. Files that
+ * could not be synced are reported, and make it ERROR once the rest are.
+ */
+int ftag_xattr_sync(ftag_db *db, int flags, int jobs, long long *pushed,
+			   long long *pulled)
+{
+	struct sync s;
+	int status = ERROR;
+
+	memset(&s, 0, sizeof(s));
+	s.conn = ftag_db_sqlite(db);
+	s.dir = ftag_db_dir(db);
+	s.flags = flags;
+	s.jobs = jobs > XATTR_MAX_JOBS ? XATTR_MAX_JOBS : jobs;
+	s.now = (sqlite3_int64) time(NULL);
+
+	if (s.dir == NULL || jobs < 1 || !(flags & (XATTR_PUSH | XATTR_PULL)) ||
+		pushed == NULL || pulled == NULL)
+		return ERROR;
+
+	if (sqlite3_exec(s.conn, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK)
+		return ERROR;
+
+	if (sqlite3_exec(s.conn, "CREATE TEMP TABLE IF NOT EXISTS xattr_tag "
+					 "( name TEXT PRIMARY KEY );", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(s.conn, flags & XATTR_PULL ? next_all_sql :
+						   next_unsynced_sql, -1, &s.next, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(s.conn, synced_sql, -1, &s.synced, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(s.conn, stage_sql, -1, &s.stage, NULL) != SQLITE_OK)
+		goto out;
+
+	for (int k = 0; k < PULL_STEPS; k++)
+		if (sqlite3_prepare_v2(s.conn, pull_sql[k], -1, &s.pull[k], NULL)
+			!= SQLITE_OK)
+			goto out;
+
+	if (sync_files(&s) != SUCCESS ||
+		((flags & XATTR_PUSH) && clear_files(&s) != SUCCESS))
+		goto out;
+
+	status = SUCCESS;
+
+	out:
+	sqlite3_finalize(s.next);
+	sqlite3_finalize(s.synced);
+	sqlite3_finalize(s.stage);
+	for (int k = 0; k < PULL_STEPS; k++)
+		sqlite3_finalize(s.pull[k]);
+
+	if (sqlite3_exec(s.conn, status == SUCCESS ? "COMMIT;" : "ROLLBACK;",
+					 NULL, NULL, NULL) != SQLITE_OK)
+		status = ERROR;
+
+	*pushed = s.pushed;
+	*pulled = s.pulled;
+
+	return status == SUCCESS && !s.failed ? SUCCESS : ERROR;
+}